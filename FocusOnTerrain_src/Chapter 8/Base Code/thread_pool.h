@@ -0,0 +1,246 @@
+//==============================================================
+//==============================================================
+//= thread_pool.h ==============================================
+//==============================================================
+//= A small pool of worker threads that share out a batch of   =
+//= numbered jobs.											   =
+//==============================================================
+//==============================================================
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+
+//--------------------------------------------------------------
+//--------------------------------------------------------------
+//- HEADERS AND LIBRARIES --------------------------------------
+//--------------------------------------------------------------
+//--------------------------------------------------------------
+#include <windows.h>
+
+
+//--------------------------------------------------------------
+//--------------------------------------------------------------
+//- DEFINITIONS ------------------------------------------------
+//--------------------------------------------------------------
+//--------------------------------------------------------------
+//a job function, called once for each job number in a batch. The demos
+//link the single-threaded C runtime, so jobs mustn't call rand( ) and co.
+typedef void ( *JOB_FUNC )( void* pArg, int iJob );
+
+
+//--------------------------------------------------------------
+//--------------------------------------------------------------
+//- CLASS ------------------------------------------------------
+//--------------------------------------------------------------
+//--------------------------------------------------------------
+class CTHREAD_POOL
+{
+	private:
+		HANDLE* m_phThreads;
+		int m_iNumThreads;
+
+		HANDLE m_hStart;			//semaphore, one count per worker per batch
+		HANDLE m_hDone;				//set when every worker has finished the batch
+
+		//the current batch
+		JOB_FUNC m_pFunc;
+		void* m_pArg;
+		int m_iNumJobs;
+		volatile LONG m_lNextJob;
+		volatile LONG m_lNumActive;
+		bool m_bRunning;
+		bool m_bQuit;
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::DoJobs - private
+	// Description:		Take jobs from the current batch until there are
+	//					none left
+	// Arguments:		None
+	// Return Value:	None
+	//----------------------------------------------------------
+	void DoJobs( void )
+	{
+		LONG lJob;
+
+		while( ( lJob= InterlockedIncrement( &m_lNextJob )-1 )<m_iNumJobs )
+			m_pFunc( m_pArg, lJob );
+	}
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::Worker - private
+	// Description:		A worker thread: wait for a batch, help with it,
+	//					then check in
+	// Arguments:		-pParam: the pool
+	// Return Value:	Zero
+	//----------------------------------------------------------
+	static DWORD WINAPI Worker( LPVOID pParam )
+	{
+		CTHREAD_POOL* pPool= ( CTHREAD_POOL* )pParam;
+
+		while( true )
+		{
+			WaitForSingleObject( pPool->m_hStart, INFINITE );
+			if( pPool->m_bQuit )
+				return 0;
+
+			pPool->DoJobs( );
+
+			//the last one in tells Wait( ) that no worker is still
+			//looking at this batch
+			if( InterlockedDecrement( &pPool->m_lNumActive )==0 )
+				SetEvent( pPool->m_hDone );
+		}
+	}
+
+	public:
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::Init - public
+	// Description:		Start the worker threads
+	// Arguments:		-iNumThreads: number of threads to run jobs on,
+	//					 including the one that calls Wait( ), or 0 for
+	//					 one per processor
+	// Return Value:	None
+	//----------------------------------------------------------
+	void Init( int iNumThreads= 0 )
+	{
+		SYSTEM_INFO sysInfo;
+		DWORD dwID;
+		int i;
+
+		if( iNumThreads<=0 )
+		{
+			GetSystemInfo( &sysInfo );
+			iNumThreads= sysInfo.dwNumberOfProcessors;
+		}
+
+		//the thread that calls Wait( ) does jobs too
+		m_iNumThreads= iNumThreads-1;
+		m_phThreads  = NULL;
+		m_bRunning   = false;
+		m_bQuit      = false;
+		m_iNumJobs   = 0;
+		m_lNextJob   = 0;
+
+		m_hStart= CreateSemaphore( NULL, 0, m_iNumThreads>0 ? m_iNumThreads : 1, NULL );
+		m_hDone = CreateEvent( NULL, TRUE, TRUE, NULL );
+
+		if( m_iNumThreads>0 )
+		{
+			m_phThreads= new HANDLE [m_iNumThreads];
+			for( i=0; i<m_iNumThreads; i++ )
+			{
+				m_phThreads[i]= CreateThread( NULL, 0, Worker, this, 0, &dwID );
+				if( m_phThreads[i]==NULL )
+					break;
+			}
+
+			//make do with the threads we got
+			m_iNumThreads= i;
+		}
+	}
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::Shutdown - public
+	// Description:		Stop the worker threads
+	// Arguments:		None
+	// Return Value:	None
+	//----------------------------------------------------------
+	void Shutdown( void )
+	{
+		int i;
+
+		if( m_hStart==NULL )
+			return;
+
+		Wait( );
+
+		m_bQuit= true;
+		if( m_iNumThreads>0 )
+		{
+			ReleaseSemaphore( m_hStart, m_iNumThreads, NULL );
+			for( i=0; i<m_iNumThreads; i++ )
+			{
+				WaitForSingleObject( m_phThreads[i], INFINITE );
+				CloseHandle( m_phThreads[i] );
+			}
+			delete[] m_phThreads;
+		}
+		m_phThreads  = NULL;
+		m_iNumThreads= 0;
+
+		CloseHandle( m_hStart );
+		CloseHandle( m_hDone );
+		m_hStart= NULL;
+		m_hDone = NULL;
+	}
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::Start - public
+	// Description:		Hand a batch of jobs to the workers, and return
+	//					straight away
+	// Arguments:		-pFunc: the job function
+	//					-pArg: passed to every job
+	//					-iNumJobs: jobs are numbered 0 to iNumJobs-1
+	// Return Value:	None
+	//----------------------------------------------------------
+	void Start( JOB_FUNC pFunc, void* pArg, int iNumJobs )
+	{
+		Wait( );
+
+		m_pFunc     = pFunc;
+		m_pArg      = pArg;
+		m_iNumJobs  = iNumJobs;
+		m_lNextJob  = 0;
+		m_lNumActive= m_iNumThreads;
+		m_bRunning  = true;
+
+		if( m_iNumThreads>0 )
+		{
+			ResetEvent( m_hDone );
+			ReleaseSemaphore( m_hStart, m_iNumThreads, NULL );
+		}
+	}
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::Wait - public
+	// Description:		Help with the current batch, then wait for it
+	//					to finish
+	// Arguments:		None
+	// Return Value:	None
+	//----------------------------------------------------------
+	void Wait( void )
+	{
+		if( !m_bRunning )
+			return;
+
+		DoJobs( );
+		WaitForSingleObject( m_hDone, INFINITE );
+		m_bRunning= false;
+	}
+
+	//----------------------------------------------------------
+	// Name:			CTHREAD_POOL::Run - public
+	// Description:		Run a batch of jobs and wait for them
+	// Arguments:		-pFunc, pArg, iNumJobs: as for Start( )
+	// Return Value:	None
+	//----------------------------------------------------------
+	inline void Run( JOB_FUNC pFunc, void* pArg, int iNumJobs )
+	{
+		Start( pFunc, pArg, iNumJobs );
+		Wait( );
+	}
+
+	//get the number of threads that run jobs, including the caller's
+	inline int GetNumThreads( void )
+	{	return m_iNumThreads+1;	}
+
+	CTHREAD_POOL( void ) : m_phThreads( NULL ), m_iNumThreads( 0 ), m_hStart( NULL ), m_hDone( NULL ),
+						   m_bRunning( false )
+	{	}
+	~CTHREAD_POOL( void )
+	{	}
+};
+
+
+#endif	//__THREAD_POOL_H__
@@ -186,6 +186,10 @@ SOURCE="..\Base Code\math_ops.h"
 # End Source File
 # Begin Source File
 
+SOURCE="..\Base Code\thread_pool.h"
+# End Source File
+# Begin Source File
+
 SOURCE="..\Base Code\timer.h"
 # End Source File
 # End Group
@@ -15,6 +15,7 @@
 //--------------------------------------------------------------
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <windows.h>
 
 #include "../Base Code/gl_app.h"
@@ -198,6 +199,12 @@ void DemoRender( void )
 	//calculate the viewing frustum
 	g_camera.CalculateViewFrustum( );
 
+	//update our particles on the worker threads while the scene is drawn
+	g_particleEngine.CreateRaindrops( g_camera.m_vecEyePos[0]-150.0f, g_camera.m_vecEyePos[1]-150.0f, g_camera.m_vecEyePos[2]-150.0f,
+									  g_camera.m_vecEyePos[0]+150.0f, g_camera.m_vecEyePos[1]+150.0f, g_camera.m_vecEyePos[2]+150.0f,
+									  6, 150 );
+	g_particleEngine.BeginUpdate( );
+
 	//render the skydome
 	glDisable( GL_CULL_FACE );
 	glDisable( GL_DEPTH_TEST );
@@ -239,12 +246,6 @@ void DemoRender( void )
 		glDepthMask( GL_TRUE );
 	glPopMatrix( );
 
-	//update our particles
-	g_particleEngine.CreateRaindrops( g_camera.m_vecEyePos[0]-150.0f, g_camera.m_vecEyePos[1]-150.0f, g_camera.m_vecEyePos[2]-150.0f,
-									  g_camera.m_vecEyePos[0]+150.0f, g_camera.m_vecEyePos[1]+150.0f, g_camera.m_vecEyePos[2]+150.0f,
-									  6, 150 );
-	g_particleEngine.Update( );
-
 	//enable blending
 	glEnable( GL_BLEND );
 	glBlendFunc( GL_SRC_ALPHA, GL_ONE );
@@ -253,8 +254,9 @@ void DemoRender( void )
 	glDisable( GL_DEPTH_TEST );
 	glDisable( GL_TEXTURE_2D );
 
-	//render our particles
+	//render our particles (as of the last update), then finish this one
 	g_particleEngine.Render( );
+	g_particleEngine.EndUpdate( );
 
 	//render some text to the screen
 	glDisable( GL_TEXTURE_2D );
@@ -396,6 +398,74 @@ bool DemoInput( void )
 	return true;
 }
 
+//--------------------------------------------------------------
+// Name:			DemoBenchmark - global
+// Description:		Time the particle engine's two storage types with a
+//					million particles, without opening a window. Run
+//					"demo8_12 -benchmark", the results go in the log.
+// Arguments:		None
+// Return Value:	None
+//--------------------------------------------------------------
+void DemoBenchmark( void )
+{
+	const int iNumParticles= 1000000;
+	const int iNumFrames= 100;
+	static char* szName[3]= {	"SPARTICLE array", "SPARTICLE_BLOCKs, one thread", "SPARTICLE_BLOCKs, all processors"	};
+	static int iNumThreads[3]= {	0, 1, 0	};
+	CPARTICLE_ENGINE engine;
+	CTIMER timer;
+	double dSum[3];
+	float fTime, fCreateTime, fUpdateTime;
+	int i, j;
+
+	g_log.Init( "benchmark log.html" );
+	timer.Init( );
+
+	g_log.Write( LOG_PLAINTEXT, "Particle benchmark: %d particles, %d updates", iNumParticles, iNumFrames );
+
+	for( i=0; i<3; i++ )
+	{
+		if( !engine.Init( iNumParticles, i>0, iNumThreads[i] ) )
+			return;
+
+		engine.SetMaxLife( 150 );
+		engine.SetColor( 1.0f, 1.0f, 1.0f, 0.2f, 0.2f, 1.0f );
+		engine.SetTranslucency( 1.0f, 0.3f );
+		engine.SetSize( 0.1f, 2.0f, 0.1f, 2.0f );
+		engine.SetMass( 1.25f );
+		engine.SetFriction( 0.01f );
+		engine.SetExternalForces( 0.0f, -0.001f, 0.0f );
+		engine.SetEmissionPosition( 128.0f, 64.0f, 128.0f );
+
+		//every run uses the same seed (the block runs explode on the worker
+		//threads with their own random numbers, so they match each other
+		//rather than the array)
+		srand( 1 );
+
+		fTime= timer.GetTime( );
+		engine.Explode( 0.12f, iNumParticles+1 );
+		fCreateTime= timer.GetTime( )-fTime;
+
+		//update, topping the particles up with rain like the demo does
+		fUpdateTime= 0.0f;
+		for( j=0; j<iNumFrames; j++ )
+		{
+			engine.CreateRaindrops( 0.0f, 0.0f, 0.0f, 256.0f, 128.0f, 256.0f, 6, 5000 );
+
+			fTime= timer.GetTime( );
+			engine.Update( );
+			fUpdateTime+= timer.GetTime( )-fTime;
+		}
+
+		engine.GetPositionSum( dSum );
+		g_log.Write( LOG_PLAINTEXT, "%s: explode %.1fms, update %.2fms/frame, %d live, position sum %.1f %.1f %.1f",
+					 szName[i], fCreateTime, fUpdateTime/iNumFrames, engine.GetNumLiveParticles( ),
+					 dSum[0], dSum[1], dSum[2] );
+
+		engine.Shutdown( );
+	}
+}
+
 //--------------------------------------------------------------
 // Name:			WinMain - global
 // Description:		The equivalant to Main( ) in console apps
@@ -407,6 +477,13 @@ int WINAPI WinMain( HINSTANCE hInstance,
 				    LPSTR	 lpCmdLine, 
 				    int		 nCmdShow ) 
 {
+	//time the particle engine, then quit
+	if( lpCmdLine && strstr( lpCmdLine, "-benchmark" ) )
+	{
+		DemoBenchmark( );
+		return false;
+	}
+
 	//Do all of the Initiation stuff
 	if( !DemoInit( ) )
 		return false;
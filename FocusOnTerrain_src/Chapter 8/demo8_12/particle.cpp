@@ -12,10 +12,17 @@
 //- HEADERS AND LIBRARIES --------------------------------------
 //--------------------------------------------------------------
 //--------------------------------------------------------------
+#include <string.h>
+
 #include "../Base Code/gl_app.h"
 
 #include "particle.h"
 
+#if defined( __SSE__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP>=1 )
+#define PARTICLE_SSE
+#include <xmmintrin.h>
+#endif
+
 
 //--------------------------------------------------------------
 //--------------------------------------------------------------
@@ -23,16 +30,84 @@
 //--------------------------------------------------------------
 //--------------------------------------------------------------
 
+//--------------------------------------------------------------
+// Name:		 RandomFloat - global
+// Description:	 A random number generator for the worker threads,
+//				 which can't share rand( )
+// Arguments:	 -uiSeed: the generator's state
+// Return Value: A float value: a random number from 0 to 1
+//--------------------------------------------------------------
+static inline float RandomFloat( unsigned int& uiSeed )
+{
+	uiSeed= uiSeed*1664525U+1013904223U;
+	return ( uiSeed>>8 )*( 1.0f/16777216.0f );
+}
+
 //--------------------------------------------------------------
 // Name:		 CPARTICLE_ENGINE::Init - public
 // Description:	 Initialize the particle engine
 // Arguments:	 -iNumParticles: number of particles in the system
+//				 -bBlocks: store the particles as SPARTICLE_BLOCKs
+//						   (true), or as an array of SPARTICLEs (false)
+//				 -iNumThreads: threads to update blocks with (0 for
+//							   one per processor)
 // Return Value: A boolean variable: -true: successful initiation
 //									 -false: unsuccessful initiation
 //--------------------------------------------------------------
-bool CPARTICLE_ENGINE::Init( int iNumParticles )
+bool CPARTICLE_ENGINE::Init( int iNumParticles, bool bBlocks, int iNumThreads )
 {
+	int iMaxJobs;
+	int i;
+
 	m_iNumParticles= iNumParticles;
+	m_bBlocks= bBlocks;
+	m_pParticles= NULL;
+	m_pBlocks= NULL;
+	m_pucBlockMemory= NULL;
+	m_piDead= NULL;
+	m_piJobDead= NULL;
+	m_pVertices[0]= m_pVertices[1]= NULL;
+	m_piJobVertices[0]= m_piJobVertices[1]= NULL;
+	m_iNumVertexJobs[0]= m_iNumVertexJobs[1]= 0;
+	m_iFront= 0;
+	m_iNumJobs= 0;
+	m_bUpdating= false;
+	m_iFirstFree= 0;
+	m_iNumLive= 0;
+
+	if( m_bBlocks )
+	{
+		//allocate whole blocks, aligned for SSE
+		m_pucBlockMemory= new unsigned char [( ( m_iNumParticles+3 )/4 )*sizeof( SPARTICLE_BLOCK )+15];
+		if( m_pucBlockMemory==NULL )
+		{
+			g_log.Write( LOG_FAILURE, "Could not allocate memory for the particle buffer" );
+			return false;
+		}
+		memset( m_pucBlockMemory, 0, ( ( m_iNumParticles+3 )/4 )*sizeof( SPARTICLE_BLOCK )+15 );
+		m_pBlocks= ( SPARTICLE_BLOCK* )( ( ( size_t )m_pucBlockMemory+15 ) & ~( size_t )15 );
+
+		//each job notes its dead particles, and writes its live ones
+		//to the snapshot, starting at its own first particle
+		iMaxJobs= ( m_iNumParticles+PARTICLE_JOB_SIZE-1 )/PARTICLE_JOB_SIZE;
+		m_piDead= new int [m_iNumParticles];
+		m_piJobDead= new int [iMaxJobs];
+		for( i=0; i<2; i++ )
+		{
+			m_pVertices[i]= new SPARTICLE_VERTEX [m_iNumParticles];
+			m_piJobVertices[i]= new int [iMaxJobs];
+		}
+		if( m_piDead==NULL || m_piJobDead==NULL || m_pVertices[0]==NULL || m_pVertices[1]==NULL ||
+			m_piJobVertices[0]==NULL || m_piJobVertices[1]==NULL )
+		{
+			g_log.Write( LOG_FAILURE, "Could not allocate memory for the particle buffer" );
+			return false;
+		}
+
+		m_threadPool.Init( iNumThreads );
+		return true;
+	}
+
 	m_pParticles= new SPARTICLE [m_iNumParticles];
 	if( m_pParticles==NULL )
 	{
@@ -40,6 +115,10 @@ bool CPARTICLE_ENGINE::Init( int iNumParticles )
 		return false;
 	}
 
+	//all of the particles start out dead
+	for( i=0; i<m_iNumParticles; i++ )
+		m_pParticles[i].m_fLife= 0.0f;
+
 	return true;
 }
 
@@ -51,7 +130,28 @@ bool CPARTICLE_ENGINE::Init( int iNumParticles )
 //--------------------------------------------------------------
 void CPARTICLE_ENGINE::Shutdown( void )
 {
+	int i;
+
+	EndUpdate( );
+	m_threadPool.Shutdown( );
+
 	delete[] m_pParticles;
+	delete[] m_pucBlockMemory;
+	delete[] m_piDead;
+	delete[] m_piJobDead;
+	for( i=0; i<2; i++ )
+	{
+		delete[] m_pVertices[i];
+		delete[] m_piJobVertices[i];
+		m_pVertices[i]= NULL;
+		m_piJobVertices[i]= NULL;
+	}
+
+	m_pParticles= NULL;
+	m_pucBlockMemory= NULL;
+	m_piDead= NULL;
+	m_piJobDead= NULL;
+	m_pBlocks= NULL;
 }
 
 //--------------------------------------------------------------
@@ -65,10 +165,16 @@ void CPARTICLE_ENGINE::CreateParticle( float fVelX, float fVelY, float fVelZ )
 	int iChoice;
 	int i;
 
+	if( m_bBlocks )
+	{
+		CreateBlockParticle( fVelX, fVelY, fVelZ );
+		return;
+	}
+
 	iChoice= -1;
 
-	//find an open particle
-	for( i=0; i<m_iNumParticles; i++ )
+	//find an open particle (all of those before m_iFirstFree are alive)
+	for( i=m_iFirstFree; i<m_iNumParticles; i++ )
 	{
 		if( m_pParticles[i].m_fLife<=0.0f )
 		{
@@ -78,7 +184,11 @@ void CPARTICLE_ENGINE::CreateParticle( float fVelX, float fVelY, float fVelZ )
 	}
 
 	if(iChoice==-1)
+	{
+		m_iFirstFree= m_iNumParticles;
 		return;
+	}
+	m_iFirstFree= iChoice+1;
 
 	//set the particle's lifespan
 	m_pParticles[iChoice].m_fLife= RANDOM_FLOAT*m_fMaxLife;
@@ -108,6 +218,285 @@ void CPARTICLE_ENGINE::CreateParticle( float fVelX, float fVelY, float fVelZ )
 	m_pParticles[iChoice].m_fFriction= m_fFriction;
 }
 
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::CreateBlockParticle - private
+// Description:	 Create a new particle at the end of the live ones
+// Arguments:	 -fVelX, fVelY, fVelZ: the new particle's velocity
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::CreateBlockParticle( float fVelX, float fVelY, float fVelZ )
+{
+	//the particles can't be touched while the threads update them
+	if( m_bUpdating )
+		EndUpdate( );
+
+	if( m_iNumLive>=m_iNumParticles )
+		return;
+
+	SetBlockParticle( m_iNumLive++, fVelX, fVelY, fVelZ, RANDOM_FLOAT*m_fMaxLife );
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::SetBlockParticle - private
+// Description:	 Start a particle off at the emission position
+// Arguments:	 -iParticle: the particle's index
+//				 -fVelX, fVelY, fVelZ: the particle's velocity
+//				 -fLife: the particle's lifespan
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::SetBlockParticle( int iParticle, float fVelX, float fVelY, float fVelZ, float fLife )
+{
+	SPARTICLE_BLOCK* pBlock= &m_pBlocks[iParticle>>2];
+	int i= iParticle&3;
+
+	//set the particle's lifespan
+	pBlock->m_fLife[i]= fLife;
+
+	//set the particle's position and velocity
+	pBlock->m_fPosition[0][i]= m_vecPosition[0];
+	pBlock->m_fPosition[1][i]= m_vecPosition[1];
+	pBlock->m_fPosition[2][i]= m_vecPosition[2];
+	pBlock->m_fVelocity[0][i]= fVelX;
+	pBlock->m_fVelocity[1][i]= fVelY;
+	pBlock->m_fVelocity[2][i]= fVelZ;
+
+	//set the particle's color and transparency
+	pBlock->m_fColor[0][i]= m_vecStartColor[0];
+	pBlock->m_fColor[1][i]= m_vecStartColor[1];
+	pBlock->m_fColor[2][i]= m_vecStartColor[2];
+	pBlock->m_fColorCounter[0][i]= ( m_vecEndColor[0]-m_vecStartColor[0] )/fLife;
+	pBlock->m_fColorCounter[1][i]= ( m_vecEndColor[1]-m_vecStartColor[1] )/fLife;
+	pBlock->m_fColorCounter[2][i]= ( m_vecEndColor[2]-m_vecStartColor[2] )/fLife;
+	pBlock->m_fTranslucency[i]= m_fStartTranslucency;
+	pBlock->m_fTranslucencyCounter[i]= ( m_fEndTranslucency-m_fStartTranslucency )/fLife;
+
+	//set the particle's size (SetSize( ) keeps width in x, height in z)
+	pBlock->m_fSize[0][i]= m_vecStartSize[0];
+	pBlock->m_fSize[1][i]= m_vecStartSize[2];
+	pBlock->m_fSizeCounter[0][i]= ( m_vecEndSize[0]-m_vecStartSize[0] )/fLife;
+	pBlock->m_fSizeCounter[1][i]= ( m_vecEndSize[2]-m_vecStartSize[2] )/fLife;
+
+	//set the particle's mass and air-resistance
+	pBlock->m_fMass[i]= m_fMass;
+	pBlock->m_fFriction[i]= m_fFriction;
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::CopyBlockParticle - private
+// Description:	 Copy one particle over another
+// Arguments:	 -iDst, iSrc: the particles' indices
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::CopyBlockParticle( int iDst, int iSrc )
+{
+	float* pfDst= ( ( float* )&m_pBlocks[iDst>>2] )+( iDst&3 );
+	float* pfSrc= ( ( float* )&m_pBlocks[iSrc>>2] )+( iSrc&3 );
+	int i;
+
+	for( i=0; i<PARTICLE_BLOCK_MEMBERS; i++ )
+		pfDst[i*4]= pfSrc[i*4];
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::UpdateBlocks - private
+// Description:	 Update one job's particles four at a time, noting the
+//				 ones that die, and copy the ones still alive into the
+//				 back snapshot
+// Arguments:	 -iJob: the job number
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::UpdateBlocks( int iJob )
+{
+	SPARTICLE_BLOCK* pBlock;
+	SPARTICLE_VERTEX* pFirstVertex;
+	SPARTICLE_VERTEX* pVertex;
+	int* piDead;
+	int iFirstBlock= iJob*( PARTICLE_JOB_SIZE/4 );
+	int iLastBlock = MIN( iFirstBlock+PARTICLE_JOB_SIZE/4, ( m_iNumLive+3 )/4 );
+	int iNumDead= 0;
+	int i, j, k, iDead, iLive;
+
+	//the job's lists start at its own first particle, so they never overlap
+	piDead= m_piDead+iFirstBlock*4;
+	pFirstVertex= m_pVertices[m_iFront^1]+iFirstBlock*4;
+	pVertex= pFirstVertex;
+
+#ifdef PARTICLE_SSE
+	__m128 one= _mm_set1_ps( 1.0f );
+	__m128 zero= _mm_setzero_ps( );
+	__m128 force[3], life, mass, damp;
+
+	force[0]= _mm_set1_ps( m_vecForces[0] );
+	force[1]= _mm_set1_ps( m_vecForces[1] );
+	force[2]= _mm_set1_ps( m_vecForces[2] );
+
+	for( i=iFirstBlock; i<iLastBlock; i++ )
+	{
+		pBlock= &m_pBlocks[i];
+
+		//age the particles, and note the ones that have died
+		life= _mm_sub_ps( _mm_load_ps( pBlock->m_fLife ), one );
+		_mm_store_ps( pBlock->m_fLife, life );
+		iDead= _mm_movemask_ps( _mm_cmple_ps( life, zero ) );
+		iLive= ~iDead & 15;
+		for( k=0; iDead; k++, iDead>>= 1 )
+		{
+			if( iDead & 1 )
+				piDead[iNumDead++]= i*4+k;
+		}
+
+		//update the particles' positions and members
+		mass= _mm_load_ps( pBlock->m_fMass );
+		damp= _mm_sub_ps( one, _mm_load_ps( pBlock->m_fFriction ) );
+		for( j=0; j<3; j++ )
+		{
+			_mm_store_ps( pBlock->m_fPosition[j], _mm_add_ps( _mm_load_ps( pBlock->m_fPosition[j] ),
+						  _mm_mul_ps( _mm_load_ps( pBlock->m_fVelocity[j] ), mass ) ) );
+			_mm_store_ps( pBlock->m_fColor[j], _mm_add_ps( _mm_load_ps( pBlock->m_fColor[j] ),
+						  _mm_load_ps( pBlock->m_fColorCounter[j] ) ) );
+
+			//now its time for the external forces to take their toll
+			_mm_store_ps( pBlock->m_fVelocity[j], _mm_add_ps( _mm_mul_ps( _mm_load_ps( pBlock->m_fVelocity[j] ),
+						  damp ), force[j] ) );
+		}
+		for( j=0; j<2; j++ )
+			_mm_store_ps( pBlock->m_fSize[j], _mm_add_ps( _mm_load_ps( pBlock->m_fSize[j] ),
+						  _mm_load_ps( pBlock->m_fSizeCounter[j] ) ) );
+		_mm_store_ps( pBlock->m_fTranslucency, _mm_add_ps( _mm_load_ps( pBlock->m_fTranslucency ),
+					  _mm_load_ps( pBlock->m_fTranslucencyCounter ) ) );
+#else
+	float fDamp;
+
+	for( i=iFirstBlock; i<iLastBlock; i++ )
+	{
+		pBlock= &m_pBlocks[i];
+		iLive= 0;
+
+		for( k=0; k<4; k++ )
+		{
+			//age the particle, and note it if it has died
+			pBlock->m_fLife[k]-= 1;
+			if( pBlock->m_fLife[k]<=0.0f )
+				piDead[iNumDead++]= i*4+k;
+			else
+				iLive|= 1<<k;
+
+			//update the particle's position and members
+			fDamp= 1-pBlock->m_fFriction[k];
+			for( j=0; j<3; j++ )
+			{
+				pBlock->m_fPosition[j][k]+= pBlock->m_fVelocity[j][k]*pBlock->m_fMass[k];
+				pBlock->m_fColor[j][k]+= pBlock->m_fColorCounter[j][k];
+
+				//now its time for the external forces to take their toll
+				pBlock->m_fVelocity[j][k]= pBlock->m_fVelocity[j][k]*fDamp+m_vecForces[j];
+			}
+			pBlock->m_fSize[0][k]+= pBlock->m_fSizeCounter[0][k];
+			pBlock->m_fSize[1][k]+= pBlock->m_fSizeCounter[1][k];
+			pBlock->m_fTranslucency[k]+= pBlock->m_fTranslucencyCounter[k];
+		}
+#endif
+
+		//copy the live particles into the snapshot (the padding at the
+		//end of the last block ages too, so leave that out)
+		if( i*4+4>m_iNumLive )
+			iLive&= ( 1<<( m_iNumLive-i*4 ) )-1;
+		for( k=0; iLive; k++, iLive>>= 1 )
+		{
+			if( iLive & 1 )
+			{
+				pVertex->m_fPosition[0]= pBlock->m_fPosition[0][k];
+				pVertex->m_fPosition[1]= pBlock->m_fPosition[1][k];
+				pVertex->m_fPosition[2]= pBlock->m_fPosition[2][k];
+				pVertex->m_fSize[0]	   = pBlock->m_fSize[0][k];
+				pVertex->m_fSize[1]	   = pBlock->m_fSize[1][k];
+				pVertex->m_fColor[0]   = pBlock->m_fColor[0][k];
+				pVertex->m_fColor[1]   = pBlock->m_fColor[1][k];
+				pVertex->m_fColor[2]   = pBlock->m_fColor[2][k];
+				pVertex->m_fColor[3]   = pBlock->m_fTranslucency[k];
+				pVertex++;
+			}
+		}
+	}
+
+	m_piJobDead[iJob]= iNumDead;
+	m_piJobVertices[m_iFront^1][iJob]= pVertex-pFirstVertex;
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::UpdateJob - private
+// Description:	 Thread pool job to update a range of particles
+// Arguments:	 -pArg: the particle engine
+//				 -iJob: the job number
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::UpdateJob( void* pArg, int iJob )
+{
+	( ( CPARTICLE_ENGINE* )pArg )->UpdateBlocks( iJob );
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::BeginUpdate - public
+// Description:	 Start updating the particle engine on the worker
+//				 threads. Render( ) keeps drawing the last update's
+//				 particles until EndUpdate( ) is called.
+// Arguments:	 None
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::BeginUpdate( float fTimeStep )
+{
+	if( !m_bBlocks )
+	{
+		Update( fTimeStep );
+		return;
+	}
+
+	EndUpdate( );
+
+	m_iNumJobs= ( m_iNumLive+PARTICLE_JOB_SIZE-1 )/PARTICLE_JOB_SIZE;
+	m_bUpdating= true;
+	m_threadPool.Start( UpdateJob, this, m_iNumJobs );
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::EndUpdate - public
+// Description:	 Finish the update started by BeginUpdate( ), then
+//				 swap the last live particle into the place of each
+//				 one that died, and show the new snapshot
+// Arguments:	 None
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::EndUpdate( void )
+{
+	int* piDead;
+	int i, iJob;
+
+	if( !m_bUpdating )
+		return;
+
+	m_threadPool.Wait( );
+	m_bUpdating= false;
+
+	//remove the dead particles, last first, so that the particle
+	//swapped into each one's place is always a live one
+	for( iJob=m_iNumJobs-1; iJob>=0; iJob-- )
+	{
+		piDead= m_piDead+iJob*PARTICLE_JOB_SIZE;
+		for( i=m_piJobDead[iJob]-1; i>=0; i-- )
+		{
+			if( piDead[i]>=m_iNumLive )
+				continue;
+
+			m_iNumLive--;
+			if( piDead[i]<m_iNumLive )
+				CopyBlockParticle( piDead[i], m_iNumLive );
+		}
+	}
+
+	m_iFront^= 1;
+	m_iNumVertexJobs[m_iFront]= m_iNumJobs;
+}
+
 //--------------------------------------------------------------
 // Name:		 CPARTICLE_ENGINE::Update - public
 // Description:	 Update the particle engine
@@ -119,6 +508,13 @@ void CPARTICLE_ENGINE::Update( float fTimeStep )
 	CVECTOR	vecMomentum;
 	int		i;
 
+	if( m_bBlocks )
+	{
+		BeginUpdate( fTimeStep );
+		EndUpdate( );
+		return;
+	}
+
 	//loop through the particles
 	for( i=0; i<m_iNumParticles; i++ )
 	{
@@ -142,6 +538,61 @@ void CPARTICLE_ENGINE::Update( float fTimeStep )
 			m_pParticles[i].m_vecVelocity*= 1-m_pParticles[i].m_fFriction;
 			m_pParticles[i].m_vecVelocity+= m_vecForces;
 		}
+
+		//the particle has died, so its slot is free
+		else if( i<m_iFirstFree )
+			m_iFirstFree= i;
+	}
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::GetNumLiveParticles - public
+// Description:	 Count the live particles
+// Arguments:	 None
+// Return Value: An integer variable: the number of live particles
+//--------------------------------------------------------------
+int CPARTICLE_ENGINE::GetNumLiveParticles( void )
+{
+	int iNumLive= 0;
+	int i;
+
+	if( m_bBlocks )
+	{
+		EndUpdate( );
+		return m_iNumLive;
+	}
+
+	for( i=0; i<m_iNumParticles; i++ )
+	{
+		if( m_pParticles[i].m_fLife>0.0f )
+			iNumLive++;
+	}
+	return iNumLive;
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::GetPositionSum - public
+// Description:	 Add up the positions of the live particles
+// Arguments:	 -dpSum: three doubles to hold the sum
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::GetPositionSum( double* dpSum )
+{
+	int i, j;
+
+	dpSum[0]= dpSum[1]= dpSum[2]= 0.0;
+	EndUpdate( );
+
+	for( i=0; i<( m_bBlocks ? m_iNumLive : m_iNumParticles ); i++ )
+	{
+		for( j=0; j<3; j++ )
+		{
+			if( m_bBlocks )
+				dpSum[j]+= m_pBlocks[i>>2].m_fPosition[j][i&3];
+
+			else if( m_pParticles[i].m_fLife>0.0f )
+				dpSum[j]+= m_pParticles[i].m_vecPosition[j];
+		}
 	}
 }
 
@@ -154,9 +605,10 @@ void CPARTICLE_ENGINE::Update( float fTimeStep )
 void CPARTICLE_ENGINE::Render( void )
 {
 	CVECTOR vecMtrxRight, vecMtrxUp;
-	CVECTOR vecPosition, vecSize, vecTemp;
+	CVECTOR vecPosition, vecSize;
+	SPARTICLE_VERTEX* pVertex;
 	float fMatrix[16];
-	int i;
+	int i, iJob;
 
 	//enable blending and texturing
 	glEnable( GL_BLEND );
@@ -176,6 +628,29 @@ void CPARTICLE_ENGINE::Render( void )
 
 	m_iNumParticlesOnScreen= 0;
 
+	//draw the front snapshot, which each update job filled in from
+	//its own first particle on (so an update can run meanwhile)
+	if( m_bBlocks )
+	{
+		for( iJob=0; iJob<m_iNumVertexJobs[m_iFront]; iJob++ )
+		{
+			pVertex= m_pVertices[m_iFront]+iJob*PARTICLE_JOB_SIZE;
+			for( i=0; i<m_piJobVertices[m_iFront][iJob]; i++, pVertex++ )
+			{
+				vecPosition.Set( pVertex->m_fPosition[0], pVertex->m_fPosition[1], pVertex->m_fPosition[2] );
+				vecSize[0]= pVertex->m_fSize[0];
+				vecSize[1]= pVertex->m_fSize[1];
+				vecSize[2]= ( vecSize[0]+vecSize[2] )/2;
+
+				glColor4fv( pVertex->m_fColor );
+				RenderParticle( vecPosition, vecSize, vecMtrxRight, vecMtrxUp );
+			}
+		}
+
+		glEnable( GL_DEPTH_TEST );
+		return;
+	}
+
 	for( i=0; i<m_iNumParticles; i++ )
 	{
 		if( m_pParticles[i].m_fLife>0.0f )
@@ -188,35 +663,49 @@ void CPARTICLE_ENGINE::Render( void )
 			vecSize[1]= m_pParticles[i].m_vecSize[2];
 			vecSize[2]= ( vecSize[0]+vecSize[2] )/2;
 
-			//render our particle (as a triangle strip)
-			glBegin(GL_TRIANGLE_STRIP);
-				glColor4f( m_pParticles[i].m_vecColor[0],
-						   m_pParticles[i].m_vecColor[1],
-						   m_pParticles[i].m_vecColor[2],
-						   m_pParticles[i].m_fTranslucency );
+			glColor4f( m_pParticles[i].m_vecColor[0],
+					   m_pParticles[i].m_vecColor[1],
+					   m_pParticles[i].m_vecColor[2],
+					   m_pParticles[i].m_fTranslucency );
+			RenderParticle( vecPosition, vecSize, vecMtrxRight, vecMtrxUp );
+		}
+	}
 
-				//top right
-				vecTemp= ( ( vecMtrxRight+vecMtrxUp )*vecSize )+vecPosition;
-				glTexCoord2f( 1, 1 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
+	glEnable( GL_DEPTH_TEST );
+}
 
-				//top left
-				vecTemp= ( ( vecMtrxUp-vecMtrxRight )*vecSize )+vecPosition;
-				glTexCoord2f( 0, 1 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::RenderParticle - private
+// Description:	 Render one billboarded particle, in the current color
+// Arguments:	 -vecPosition, vecSize: the particle's position and size
+//				 -vecMtrxRight, vecMtrxUp: the billboard's axes
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::RenderParticle( CVECTOR& vecPosition, CVECTOR& vecSize,
+									   CVECTOR& vecMtrxRight, CVECTOR& vecMtrxUp )
+{
+	CVECTOR vecTemp;
 
-				//bottom right
-				vecTemp= ( ( vecMtrxRight-vecMtrxUp )*vecSize )+vecPosition;
-				glTexCoord2f( 1, 0 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
+	//render our particle (as a triangle strip)
+	glBegin(GL_TRIANGLE_STRIP);
+		//top right
+		vecTemp= ( ( vecMtrxRight+vecMtrxUp )*vecSize )+vecPosition;
+		glTexCoord2f( 1, 1 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
 
-				//bottom left
-				vecTemp= ( ( vecMtrxRight+vecMtrxUp )*-vecSize )+vecPosition;
-				glTexCoord2f( 0, 0 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
-			glEnd( );
+		//top left
+		vecTemp= ( ( vecMtrxUp-vecMtrxRight )*vecSize )+vecPosition;
+		glTexCoord2f( 0, 1 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
 
-			m_iNumParticlesOnScreen++;
-		}
-	}
+		//bottom right
+		vecTemp= ( ( vecMtrxRight-vecMtrxUp )*vecSize )+vecPosition;
+		glTexCoord2f( 1, 0 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
 
-	glEnable( GL_DEPTH_TEST );
+		//bottom left
+		vecTemp= ( ( vecMtrxRight+vecMtrxUp )*-vecSize )+vecPosition;
+		glTexCoord2f( 0, 0 );	glVertex3f( vecTemp[0], vecTemp[1], vecTemp[2] );
+	glEnd( );
+
+	m_iNumParticlesOnScreen++;
 }
 
 //--------------------------------------------------------------
@@ -231,6 +720,27 @@ void CPARTICLE_ENGINE::Explode( float fMagnitude, int iNumParticles )
 	float fYaw;
 	float fPitch;
 
+	//reserve the particles, and have the worker threads fill them in
+	//(one fewer than asked for, like the loop below)
+	if( m_bBlocks )
+	{
+		if( m_bUpdating )
+			EndUpdate( );
+
+		iNumParticles= MIN( iNumParticles-1, m_iNumParticles-m_iNumLive );
+		if( iNumParticles<=0 )
+			return;
+
+		m_iExplodeFirst= m_iNumLive;
+		m_iExplodeCount= iNumParticles;
+		m_fExplodeMagnitude= fMagnitude;
+		m_uiExplodeSeed= ( ( unsigned int )rand( )<<16 ) ^ ( unsigned int )rand( );
+		m_iNumLive+= iNumParticles;
+
+		m_threadPool.Run( ExplodeJob, this, ( iNumParticles+PARTICLE_JOB_SIZE-1 )/PARTICLE_JOB_SIZE );
+		return;
+	}
+
 	//create our particles
 	while( --iNumParticles>0 )
 	{
@@ -245,6 +755,54 @@ void CPARTICLE_ENGINE::Explode( float fMagnitude, int iNumParticles )
 	}
 }
 
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::ExplodeBlocks - private
+// Description:	 Fill in one job's share of an explosion. Each job has
+//				 its own random number stream, seeded from the
+//				 explosion's seed and the job number, so the explosion
+//				 comes out the same however many threads there are.
+// Arguments:	 -iJob: the job number
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::ExplodeBlocks( int iJob )
+{
+	unsigned int uiSeed;
+	float fYaw;
+	float fPitch;
+	float fVelX, fVelY, fVelZ;
+	int iFirst= iJob*PARTICLE_JOB_SIZE;
+	int iLast = MIN( iFirst+PARTICLE_JOB_SIZE, m_iExplodeCount );
+	int i;
+
+	uiSeed= m_uiExplodeSeed+( unsigned int )iJob*2654435761U;
+	RandomFloat( uiSeed );
+
+	for( i=iFirst; i<iLast; i++ )
+	{
+		//set the particle's angle
+		fYaw  = RandomFloat( uiSeed )*PI*2.0f;
+		fPitch= DEG_TO_RAD( RandomFloat( uiSeed )*( int )( RandomFloat( uiSeed )*360 ) );
+
+		//create the particle
+		fVelX= ( cosf( fPitch ) )*( m_fExplodeMagnitude*RandomFloat( uiSeed ) );
+		fVelY= ( sinf( fPitch )*cosf( fYaw ) )*( m_fExplodeMagnitude*RandomFloat( uiSeed ) );
+		fVelZ= ( sinf( fPitch )*sinf( fYaw ) )*( m_fExplodeMagnitude*RandomFloat( uiSeed ) );
+		SetBlockParticle( m_iExplodeFirst+i, fVelX, fVelY, fVelZ, RandomFloat( uiSeed )*m_fMaxLife );
+	}
+}
+
+//--------------------------------------------------------------
+// Name:		 CPARTICLE_ENGINE::ExplodeJob - private
+// Description:	 Thread pool job to fill in part of an explosion
+// Arguments:	 -pArg: the particle engine
+//				 -iJob: the job number
+// Return Value: None
+//--------------------------------------------------------------
+void CPARTICLE_ENGINE::ExplodeJob( void* pArg, int iJob )
+{
+	( ( CPARTICLE_ENGINE* )pArg )->ExplodeBlocks( iJob );
+}
+
 //--------------------------------------------------------------
 // Name:		 CPARTICLE_ENGINE::CreateRaindrops - public
 // Description:	 Make a series of raindrops in the given area
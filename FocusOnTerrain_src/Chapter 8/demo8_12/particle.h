@@ -16,6 +16,7 @@
 //--------------------------------------------------------------
 #include "../Base Code/math_ops.h"
 #include "../Base Code/image.h"
+#include "../Base Code/thread_pool.h"
 
 
 //--------------------------------------------------------------
@@ -43,6 +44,42 @@ typedef struct SPARTICLE_TYP
 	float m_fFriction;
 } SPARTICLE, *SPARTICLE_PTR;
 
+//Four particles stored member by member, so that one SSE register holds
+//the same member of all four (an array of structures of arrays)
+typedef struct SPARTICLE_BLOCK_TYP
+{
+	float m_fLife[4];
+
+	float m_fPosition[3][4];
+	float m_fVelocity[3][4];
+
+	float m_fSize[2][4];				//width and height
+	float m_fSizeCounter[2][4];
+	float m_fMass[4];
+
+	float m_fColor[3][4];
+	float m_fColorCounter[3][4];
+	float m_fTranslucency[4];
+	float m_fTranslucencyCounter[4];
+
+	float m_fFriction[4];
+} SPARTICLE_BLOCK, *SPARTICLE_BLOCK_PTR;
+
+//number of floats per particle in a block
+#define PARTICLE_BLOCK_MEMBERS ( sizeof( SPARTICLE_BLOCK )/( 4*sizeof( float ) ) )
+
+//A particle as Render( ) needs it
+typedef struct SPARTICLE_VERTEX_TYP
+{
+	float m_fPosition[3];
+	float m_fSize[2];
+	float m_fColor[4];				//red, green, blue and translucency
+} SPARTICLE_VERTEX;
+
+//number of particles in each job that the worker threads share out
+//(a multiple of four, so that jobs don't share blocks when updating)
+#define PARTICLE_JOB_SIZE 4096
+
 
 //--------------------------------------------------------------
 //--------------------------------------------------------------
@@ -54,6 +91,35 @@ class CPARTICLE_ENGINE
 	private:
 		SPARTICLE* m_pParticles;
 		int m_iNumParticles;
+		int m_iFirstFree;
+
+		//structure of arrays storage, live particles are packed at the
+		//front so that updating only touches live data
+		bool m_bBlocks;
+		SPARTICLE_BLOCK* m_pBlocks;
+		unsigned char* m_pucBlockMemory;
+		int m_iNumLive;
+		int* m_piDead;				//particles that died this update
+
+		//worker threads for updates and explosions, which are split
+		//into jobs of PARTICLE_JOB_SIZE particles
+		CTHREAD_POOL m_threadPool;
+		int m_iNumJobs;
+		int* m_piJobDead;			//number of particles that died in each job
+		bool m_bUpdating;			//between BeginUpdate( ) and EndUpdate( )
+
+		//double-buffered snapshot of the live particles: Render( )
+		//draws the front one while an update fills the back one
+		SPARTICLE_VERTEX* m_pVertices[2];
+		int* m_piJobVertices[2];	//number of particles each job wrote
+		int m_iNumVertexJobs[2];
+		int m_iFront;
+
+		//the explosion being made
+		int m_iExplodeFirst;
+		int m_iExplodeCount;
+		float m_fExplodeMagnitude;
+		unsigned int m_uiExplodeSeed;
 
 		int m_iNumParticlesOnScreen;
 
@@ -80,6 +146,16 @@ class CPARTICLE_ENGINE
 		unsigned int m_uiTexID;
 
 	void CreateParticle( float fVelX, float fVelY, float fVelZ );
+	void CreateBlockParticle( float fVelX, float fVelY, float fVelZ );
+	void SetBlockParticle( int iParticle, float fVelX, float fVelY, float fVelZ, float fLife );
+	void UpdateBlocks( int iJob );
+	void ExplodeBlocks( int iJob );
+	void CopyBlockParticle( int iDst, int iSrc );
+
+	static void UpdateJob( void* pArg, int iJob );
+	static void ExplodeJob( void* pArg, int iJob );
+	void RenderParticle( CVECTOR& vecPosition, CVECTOR& vecSize,
+						 CVECTOR& vecMtrxRight, CVECTOR& vecMtrxUp );
 
 	//--------------------------------------------------------------
 	// Name:			CPARTICLE_ENGINE::RangedRandom - private
@@ -92,10 +168,12 @@ class CPARTICLE_ENGINE
 
 	public:
 		
-	bool Init( int iNumParticles );
+	bool Init( int iNumParticles, bool bBlocks= true, int iNumThreads= 0 );
 	void Shutdown( void );
 
 	void Update( float fTimeStep= 1.0f );
+	void BeginUpdate( float fTimeStep= 1.0f );
+	void EndUpdate( void );
 	void Render( void );
 
 	void Explode( float fMagnitude, int iNumParticles );
@@ -158,6 +236,12 @@ class CPARTICLE_ENGINE
 	int GetNumParticlesOnScreen( void )
 	{	return m_iNumParticlesOnScreen;	}
 
+	//get the number of live particles (without rendering them)
+	int GetNumLiveParticles( void );
+
+	//add up the live particles' positions (to compare the two storage types)
+	void GetPositionSum( double* dpSum );
+
 	CPARTICLE_ENGINE( void )
 	{	}
 	~CPARTICLE_ENGINE( void )
@@ -24,6 +24,10 @@
 #include "stdafx.h"
 #include <mmsystem.h>
 #include <math.h>
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1) || defined(__SSE__)
+#include <xmmintrin.h>		// SSE FOR THE SKINNING LOOP
+#define SKIN_USE_SSE
+#endif
 #include "Skully.h"
 #include "OGLView.h"
 #include "LoadOBJ.h"
@@ -71,10 +75,17 @@ COGLView::COGLView()
 	m_Camera.trans.z = -50.0f;
 
 	m_Model.vertexData = NULL;
+
+	m_Influence = NULL;
+	m_InfluenceMatrix = NULL;
+	m_InfluenceBoneCnt = 0;
+	m_InfluenceDirty = TRUE;
 }
 
 COGLView::~COGLView()
 {
+	if (m_Influence) free(m_Influence);
+	if (m_InfluenceMatrix) free(m_InfluenceMatrix);
 }
 
 BOOL COGLView::Create(LPCTSTR lpszClassName, LPCTSTR lpszWindowName, DWORD dwStyle, const RECT& rect, CWnd* pParentWnd, UINT nID, CCreateContext* pContext) 
@@ -463,6 +474,255 @@ GLvoid COGLView::DeformVertices(t_Bone *rootBone,t_Visual *visual)
 	}
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// DeformVertices walks every vertex once for every bone, so the cost
+// is bones * vertices even though most vertices only have one or two
+// bones pulling on them.  The influence table turns the weights around
+// so each vertex keeps its own short list of bones.  Then the skin is
+// one straight pass through the vertex array.
+///////////////////////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Function:	ListInfluenceBones
+// Purpose:		Number the bones in the same order as the weight file
+// Arguments:	Bone pointer, list to fill (or NULL to just count), next index
+///////////////////////////////////////////////////////////////////////////////
+int COGLView::ListInfluenceBones(t_Bone *rootBone, t_Bone **list, int index)
+{
+/// Local Variables ///////////////////////////////////////////////////////////
+	int loop;
+	t_Bone *curBone;
+///////////////////////////////////////////////////////////////////////////////
+	curBone = rootBone->children;
+	for (loop = 0; loop < rootBone->childCnt; loop++, curBone++)
+	{
+		if (list != NULL)
+			list[index] = curBone;
+		index++;
+
+		// CHECK IF THIS BONE HAS CHILDREN, IF SO RECURSIVE CALL
+		if (curBone->childCnt > 0)
+			index = ListInfluenceBones(curBone, list, index);
+	}
+	return index;
+}
+//// ListInfluenceBones ///////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Function:	BuildInfluences
+// Purpose:		Build the vertex ordered weight table from the bone weights
+// Arguments:	None
+// Notes:		Each vertex keeps its MAX_VERTEX_INFLUENCE biggest weights.
+//				If more bones than that touch a vertex, the kept weights are
+//				scaled up so the vertex total does not change
+///////////////////////////////////////////////////////////////////////////////
+GLvoid COGLView::BuildInfluences()
+{
+/// Local Variables ///////////////////////////////////////////////////////////
+	int loop,loop2,slot;
+	t_Bone **boneList;
+	t_VInfluence *influence;
+	float *total;
+	float weight,kept;
+	int vertex;
+///////////////////////////////////////////////////////////////////////////////
+	if (m_Influence) free(m_Influence);
+	if (m_InfluenceMatrix) free(m_InfluenceMatrix);
+	m_Influence = NULL;
+	m_InfluenceMatrix = NULL;
+	m_InfluenceBoneCnt = 0;
+	m_InfluenceDirty = FALSE;
+
+	if (m_Model.vertexData == NULL || m_Skeleton.childCnt == 0)
+		return;
+
+	m_InfluenceBoneCnt = ListInfluenceBones(&m_Skeleton, NULL, 0);
+	boneList = (t_Bone **)malloc(sizeof(t_Bone *) * m_InfluenceBoneCnt);
+	ListInfluenceBones(&m_Skeleton, boneList, 0);
+
+	// THE MATRIX POINTERS STAY PUT UNTIL A NEW SKELETON IS LOADED
+	m_InfluenceMatrix = (tMatrix **)malloc(sizeof(tMatrix *) * m_InfluenceBoneCnt);
+	for (loop = 0; loop < m_InfluenceBoneCnt; loop++)
+		m_InfluenceMatrix[loop] = boneList[loop]->curMatrix;
+
+	// UNUSED SLOTS POINT AT BONE 0 WITH NO WEIGHT
+	m_Influence = (t_VInfluence *)malloc(sizeof(t_VInfluence) * m_Model.vertexCnt);
+	memset(m_Influence,0,sizeof(t_VInfluence) * m_Model.vertexCnt);
+	total = (float *)malloc(sizeof(float) * m_Model.vertexCnt);
+	memset(total,0,sizeof(float) * m_Model.vertexCnt);
+
+	for (loop = 0; loop < m_InfluenceBoneCnt; loop++)
+	{
+		for (loop2 = 0; loop2 < m_Model.vertexCnt; loop2++)
+		{
+			weight = boneList[loop]->CV_weight[loop2].weight;
+			if (weight > 0.0f)
+			{
+				vertex = boneList[loop]->CV_weight[loop2].vertex;
+				influence = &m_Influence[vertex];
+				total[vertex] += weight;
+
+				// KEEP THE LIST SORTED, BIGGEST WEIGHT FIRST
+				for (slot = 0; slot < MAX_VERTEX_INFLUENCE; slot++)
+					if (weight > influence->weight[slot]) break;
+				if (slot == MAX_VERTEX_INFLUENCE) continue;	// TOO SMALL TO KEEP
+				memmove(&influence->bone[slot + 1],&influence->bone[slot],
+					sizeof(int) * (MAX_VERTEX_INFLUENCE - 1 - slot));
+				memmove(&influence->weight[slot + 1],&influence->weight[slot],
+					sizeof(float) * (MAX_VERTEX_INFLUENCE - 1 - slot));
+				influence->bone[slot] = loop;
+				influence->weight[slot] = weight;
+			}
+		}
+	}
+
+	// SPREAD ANY WEIGHT THAT GOT DROPPED OVER THE BONES THAT WERE KEPT
+	influence = m_Influence;
+	for (loop2 = 0; loop2 < m_Model.vertexCnt; loop2++, influence++)
+	{
+		kept = 0.0f;
+		for (slot = 0; slot < MAX_VERTEX_INFLUENCE; slot++)
+			kept += influence->weight[slot];
+		if (kept > 0.0f && total[loop2] > kept)
+		{
+			for (slot = 0; slot < MAX_VERTEX_INFLUENCE; slot++)
+				influence->weight[slot] *= total[loop2] / kept;
+		}
+	}
+
+	free(total);
+	free(boneList);
+}
+//// BuildInfluences //////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Function:	SkinVertices
+// Purpose:		Same result as DeformVertices in one pass over the vertices
+// Arguments:	Pointer to the model
+// Notes:		The weighted bone matrices are added into one matrix per
+//				vertex, so each vertex is only transformed once
+///////////////////////////////////////////////////////////////////////////////
+GLvoid COGLView::SkinVertices(t_Visual *visual)
+{
+/// Local Variables ///////////////////////////////////////////////////////////
+	int loop,loop2;
+	t_VInfluence *influence;
+	float *deformData,*vertexData;
+#ifdef SKIN_USE_SSE
+	float *mat;
+	__m128 weight,col0,col1,col2,col3,result;
+#else
+	tVector post;
+#endif
+///////////////////////////////////////////////////////////////////////////////
+	if (m_InfluenceDirty)
+		BuildInfluences();
+	if (m_Influence == NULL || visual->vertexData == NULL)
+		return;
+
+	// COPY THE NORMALS AND TEXTURE COORDS, THE POSITIONS GET WRITTEN BELOW
+	memcpy(visual->deformData,visual->vertexData,sizeof(float) * visual->vSize * visual->vertexCnt);
+
+	influence = m_Influence;
+	vertexData = (float *)(visual->vertexData + (visual->vSize - 3));
+	deformData = (float *)(visual->deformData + (visual->vSize - 3));
+	for (loop = 0; loop < visual->vertexCnt; loop++, influence++,
+		vertexData += visual->vSize, deformData += visual->vSize)
+	{
+#ifdef SKIN_USE_SSE
+		// BLEND THE COLUMNS OF THE BONE MATRICES BY THE WEIGHTS
+		mat = m_InfluenceMatrix[influence->bone[0]]->m;
+		weight = _mm_set1_ps(influence->weight[0]);
+		col0 = _mm_mul_ps(_mm_loadu_ps(&mat[0]),weight);
+		col1 = _mm_mul_ps(_mm_loadu_ps(&mat[4]),weight);
+		col2 = _mm_mul_ps(_mm_loadu_ps(&mat[8]),weight);
+		col3 = _mm_mul_ps(_mm_loadu_ps(&mat[12]),weight);
+		for (loop2 = 1; loop2 < MAX_VERTEX_INFLUENCE; loop2++)
+		{
+			mat = m_InfluenceMatrix[influence->bone[loop2]]->m;
+			weight = _mm_set1_ps(influence->weight[loop2]);
+			col0 = _mm_add_ps(col0,_mm_mul_ps(_mm_loadu_ps(&mat[0]),weight));
+			col1 = _mm_add_ps(col1,_mm_mul_ps(_mm_loadu_ps(&mat[4]),weight));
+			col2 = _mm_add_ps(col2,_mm_mul_ps(_mm_loadu_ps(&mat[8]),weight));
+			col3 = _mm_add_ps(col3,_mm_mul_ps(_mm_loadu_ps(&mat[12]),weight));
+		}
+
+		// THEN RUN THE REST POSITION THROUGH THE BLENDED MATRIX
+		result = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(col0,_mm_set1_ps(vertexData[0])),
+					   _mm_mul_ps(col1,_mm_set1_ps(vertexData[1]))),
+			_mm_add_ps(_mm_mul_ps(col2,_mm_set1_ps(vertexData[2])),col3));
+		_mm_storel_pi((__m64 *)deformData,result);
+		_mm_store_ss(&deformData[2],_mm_movehl_ps(result,result));
+#else
+		deformData[0] = 0.0f;
+		deformData[1] = 0.0f;
+		deformData[2] = 0.0f;
+		// SLOTS ARE SORTED SO THE FIRST EMPTY ONE ENDS THE LIST
+		for (loop2 = 0; loop2 < MAX_VERTEX_INFLUENCE && influence->weight[loop2] > 0.0f; loop2++)
+		{
+			MultVectorByMatrix(m_InfluenceMatrix[influence->bone[loop2]], (tVector *)vertexData, &post);
+			deformData[0] += (post.x * influence->weight[loop2]);
+			deformData[1] += (post.y * influence->weight[loop2]);
+			deformData[2] += (post.z * influence->weight[loop2]);
+		}
+#endif
+	}
+}
+//// SkinVertices /////////////////////////////////////////////////////////////
+
+///////////////////////////////////////////////////////////////////////////////
+// Function:	BenchmarkDeform
+// Purpose:		Time DeformVertices against SkinVertices on the loaded model
+// Arguments:	Number of times to run each one
+// Notes:		Puts the time per pass and the largest difference between
+//				the two results in the status bar
+///////////////////////////////////////////////////////////////////////////////
+void COGLView::BenchmarkDeform(int passes)
+{
+/// Local Variables ///////////////////////////////////////////////////////////
+	int loop;
+	long count;
+	DWORD start,deformTime,skinTime;
+	float *check,diff,maxDiff;
+	char message[80];
+///////////////////////////////////////////////////////////////////////////////
+	if (m_Model.vertexData == NULL || m_Skeleton.childCnt == 0 || passes < 1)
+		return;
+
+	// BUILD THE TABLE NOW SO IT IS NOT PART OF THE TIMING
+	if (m_InfluenceDirty)
+		BuildInfluences();
+
+	start = timeGetTime();
+	for (loop = 0; loop < passes; loop++)
+		DeformVertices(&m_Skeleton,&m_Model);
+	deformTime = timeGetTime() - start;
+
+	count = m_Model.vSize * m_Model.vertexCnt;
+	check = (float *)malloc(sizeof(float) * count);
+	memcpy(check,m_Model.deformData,sizeof(float) * count);
+
+	start = timeGetTime();
+	for (loop = 0; loop < passes; loop++)
+		SkinVertices(&m_Model);
+	skinTime = timeGetTime() - start;
+
+	maxDiff = 0.0f;
+	for (loop = 0; loop < count; loop++)
+	{
+		diff = (float)fabs(check[loop] - m_Model.deformData[loop]);
+		if (diff > maxDiff) maxDiff = diff;
+	}
+	free(check);
+
+	sprintf(message,"Deform %.2fms Skin %.2fms Diff %g",
+		(float)deformTime / passes,(float)skinTime / passes,maxDiff);
+	if (m_StatusBar != NULL)
+		m_StatusBar->SetPaneText(1,message);
+}
+//// BenchmarkDeform //////////////////////////////////////////////////////////
+
 ///////////////////////////////////////////////////////////////////////////////
 // Function:	drawModel
 // Purpose:		Draw the Mesh model either deformed or not
@@ -623,7 +883,7 @@ GLvoid COGLView::drawScene(BOOL drawSelectRect)
 
 	if (m_Skeleton.childCnt > 0)
 	{
-		DeformVertices(&m_Skeleton,&m_Model);
+		SkinVertices(&m_Model);
 	}
 	drawModel(&m_Model);
 
@@ -990,6 +1250,7 @@ void COGLView::HandleKeyUp(UINT nChar)
 		WeightBones();
 		break;
 	case 'B':
+		BenchmarkDeform(100);
 		break;
 	case 'R':
 		m_SelectedBone->rot.x = m_SelectedBone->b_rot.x;
@@ -1060,6 +1321,7 @@ void COGLView::SetSkeletonList(t_Bone *skeleton)
 	long vptr;
 	t_Bone *child;
 ///////////////////////////////////////////////////////////////////////////////
+	m_InfluenceDirty = TRUE;		// BONES OR MODEL CHANGED
 	
 	if (skeleton->childCnt > 0 && m_Model.vertexData != NULL)
 	{
@@ -1112,6 +1374,7 @@ GLvoid COGLView::WeightBones()
 				m_SelectedBone->CV_weight[loop3].weight = m_SelectedBone->animBlend;
 			}
 		}
+		m_InfluenceDirty = TRUE;
 	}
 }
 
@@ -1140,6 +1403,7 @@ void COGLView::ClearBoneWeights(t_Bone *skeleton)
 					child->CV_weight[loop3].weight = 0.0f;
 				}
 			}
+			m_InfluenceDirty = TRUE;
 
 			// Recurse through Hierarchy
 			if (child->childCnt > 0)
@@ -1166,7 +1430,10 @@ void COGLView::IterateBoneWeights(t_Bone *skeleton, BOOL read, FILE *fp)
 		for (loop = 0; loop < skeleton->childCnt; loop++,child++)
 		{
 			if (read)
+			{
 				fread(child->CV_weight,sizeof(t_VWeight),m_Model.vertexCnt, fp);
+				m_InfluenceDirty = TRUE;
+			}
 			else
 				fwrite(child->CV_weight,sizeof(t_VWeight),m_Model.vertexCnt, fp);
 
@@ -55,6 +55,10 @@ public:
 	t_Bone		m_Camera,*m_SelectedBone;	// For the Camera and Pointer to Current Bone
 	t_Bone		m_Skeleton;					// Storage for the Skeletal system
 	t_Visual	m_Model;					// Actual Model to be deformed
+	t_VInfluence *m_Influence;				// Vertex ordered bone weights for the model
+	tMatrix		**m_InfluenceMatrix;		// Current matrix of each influence bone
+	int			m_InfluenceBoneCnt;			// Count of bones in the influence list
+	BOOL		m_InfluenceDirty;			// Weights changed since the table was built
 // Operations
 public:
 	BOOL	SetupPixelFormat(HDC hdc);
@@ -75,6 +79,10 @@ public:
 	GLvoid  GetBaseSkeletonMat(t_Bone *rootBone);
 	GLvoid	WeightBones();
 	GLvoid	DeformVertices(t_Bone *rootBone,t_Visual *visual);
+	int		ListInfluenceBones(t_Bone *rootBone, t_Bone **list, int index);
+	GLvoid	BuildInfluences();
+	GLvoid	SkinVertices(t_Visual *visual);
+	void	BenchmarkDeform(int passes);
 	void	IterateBoneWeights(t_Bone *skeleton, BOOL read, FILE *fp) ;
 	void	ClearBoneWeights(t_Bone *skeleton);
 	BOOL	LoadWeights(CString name);
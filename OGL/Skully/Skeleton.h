@@ -111,6 +111,18 @@ struct t_VWeight
 	float		weight;
 };
 
+/// Influence Definitions /////////////////////////////////////////////////////
+#define MAX_VERTEX_INFLUENCE		4		// BONES THAT CAN MOVE ONE VERTEX
+///////////////////////////////////////////////////////////////////////////////
+
+// SPARSE COPY OF THE BONE WEIGHTS ORDERED BY VERTEX INSTEAD OF BY BONE
+// UNUSED SLOTS HAVE A WEIGHT OF 0 SO THE SKINNING LOOP NEVER BRANCHES
+struct t_VInfluence
+{
+	int			bone[MAX_VERTEX_INFLUENCE];		// INDEX INTO THE INFLUENCE BONE LIST
+	float		weight[MAX_VERTEX_INFLUENCE];	// LARGEST WEIGHT FIRST
+};
+
 /// Structure Definitions ///////////////////////////////////////////////////////
 
 // THIS STRUCTURE DEFINES A BONE IN THE ANIMATION SYSTEM
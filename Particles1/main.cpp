@@ -25,6 +25,9 @@
 
   ESC					: Exit
   w,a,s,d,r,f,x,y,c,v	: move / turn
+  b						: switch batch rendering (one vertex array per system) on / off
+
+  Start it with -benchmark to time UpdateSystem instead
 
 
 
@@ -34,6 +37,8 @@
 #include <GL\glaux.h>		//load the texture
 #include <stdlib.h>			//random function
 #include <math.h>			//sine and cosine functions
+#include <stdio.h>			//printing the benchmark results
+#include <string.h>			//checking the command line
 
 #include "Camera.h"
 #include "particles.h"
@@ -227,6 +232,18 @@ void KeyDown(unsigned char key, int x, int y)
 		g_Camera.Move(F3dVector(0.0,0.3,0.0));
 		Display();
 		break;
+	case 'b':
+		{
+			bool bBatch = !g_ParticleSystem1.m_bBatchRendering;
+			g_ParticleSystem1.m_bBatchRendering = bBatch;
+			g_ParticleSystem2.m_bBatchRendering = bBatch;
+			g_ParticleSystem3.m_bBatchRendering = bBatch;
+			g_ParticleSystem4.m_bBatchRendering = bBatch;
+			g_ParticleSystem5.m_bBatchRendering = bBatch;
+			g_ParticleSystem6.m_bBatchRendering = bBatch;
+			Display();
+			break;
+		}
 
 	}
 }
@@ -386,8 +403,55 @@ void InitParticles()
 
 }
 
+//Times UpdateSystem with the particle array 1%, 10% and 100% full:
+void Benchmark()
+{
+	const int iNumParticles = 100000;
+	const int iNumUpdates = 1000;
+	int iPercentFull[3] = {1, 10, 100};
+	LARGE_INTEGER Frequency, Start, End;
+
+	QueryPerformanceFrequency(&Frequency);
+
+	for (int i = 0; i < 3; i++)
+	{
+		CCCParticleSystem System;
+		System.Initialize(iNumParticles);
+		System.m_bRecreateWhenDied = true;  //keeps the number of particles constant
+		System.m_fMinDieAge = 1.0f;
+		System.m_fMaxDieAge = 2.0f;
+		System.SetAcceleration(F3dVector(0.0f,-1.0f,0.0f),0.5f,1.0f);
+		System.m_fMinEmitSpeed = 0.5f;
+		System.m_fMaxEmitSpeed = 1.0f;
+		System.SetEmissionDirection(0.0f,1.0f,0.0f,
+									0.2f,0.2f,0.2f);
+
+		//Create all the particles in one go:
+		System.m_iParticlesCreatedPerSec = iNumParticles*iPercentFull[i]/100;
+		System.UpdateSystem(1.0f);
+		System.m_iParticlesCreatedPerSec = 0;
+
+		QueryPerformanceCounter(&Start);
+		for (int j = 0; j < iNumUpdates; j++)
+		{
+			System.UpdateSystem(0.01f);
+		}
+		QueryPerformanceCounter(&End);
+
+		printf("%3d%% full (%d particles): %.3f ms per UpdateSystem\n",
+			   iPercentFull[i], System.m_iParticlesInUse,
+			   (double)(End.QuadPart-Start.QuadPart)*1000.0/(double)Frequency.QuadPart/iNumUpdates);
+	}
+}
+
 int main(int argc, char **argv)
 {	
+	if (argc > 1 && strcmp(argv[1],"-benchmark") == 0)
+	{
+		Benchmark();
+		return 0;
+	}
+
 	//Initialize GLUT
 	glutInit(&argc, argv);
 	//Lets use doublebuffering, RGB(A)-mode and a depth buffer
@@ -419,4 +483,4 @@ int main(int argc, char **argv)
 	//Let GLUT get the msgs and tell us the ones we need
 	glutMainLoop();
 	return 0;
-}
\ No newline at end of file
+}
@@ -1,6 +1,12 @@
 #include "particles.h"
 #include "math.h"
 
+//Use SSE to build the billboards if the compiler may:
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define PARTICLES_SSE
+#include <xmmintrin.h>
+#endif
+
 //Generates a random float in the range [0;1]
 #define RANDOM_FLOAT (((float)rand())/RAND_MAX)
 /*************************************
@@ -246,7 +252,17 @@ CCCParticleSystem::CCCParticleSystem()
 	this->m_fCreationVariance = 0.0f;
 	this->m_bParticlesLeaveSystem = false;
 	this->m_pParticles = NULL;
+	this->m_piLiveParticles = NULL;
+	this->m_piFreeParticles = NULL;
+	this->m_iNumFreeParticles = 0;
+	this->m_pBillboardVertices = NULL;
+	this->m_bBatchRendering = true;
+
+}
 
+CCCParticleSystem::~CCCParticleSystem()
+{
+	FreeParticles();
 }
 //*********************************************************
 void CCCParticleSystem::SetEmitter(float x, float y, float z, float EmitterDeviationX,float EmitterDeviationY,float EmitterDeviationZ)
@@ -337,8 +353,25 @@ void CCCParticleSystem::SetSizeValues (float EmitMin, float EmitMax, float DieMi
 }
 //*********************************************************
 
+void CCCParticleSystem::FreeParticles()
+{
+	delete[] this->m_pParticles;
+	delete[] this->m_piLiveParticles;
+	delete[] this->m_piFreeParticles;
+	delete[] this->m_pBillboardVertices;
+	this->m_pParticles = NULL;
+	this->m_piLiveParticles = NULL;
+	this->m_piFreeParticles = NULL;
+	this->m_pBillboardVertices = NULL;
+	this->m_iMaxParticles = 0;
+	this->m_iParticlesInUse = 0;
+	this->m_iNumFreeParticles = 0;
+}
+
 bool CCCParticleSystem::Initialize(int iNumParticles)
 {
+	FreeParticles();
+
 	this->m_pParticles = new CCCParticle[iNumParticles];
 	if (m_pParticles == NULL) 
 	{
@@ -347,13 +380,24 @@ bool CCCParticleSystem::Initialize(int iNumParticles)
 		this->m_iParticlesInUse = 0;
 	}
 
+	this->m_piLiveParticles = new int[iNumParticles];
+	this->m_piFreeParticles = new int[iNumParticles];
+	this->m_pBillboardVertices = new SParticleVertex[4*iNumParticles];
+	if (m_piLiveParticles == NULL || m_piFreeParticles == NULL || m_pBillboardVertices == NULL)
+	{
+		return false;
+	}
+
 	this->m_iMaxParticles = iNumParticles;
 	this->m_iParticlesInUse = 0;
+	this->m_iNumFreeParticles = iNumParticles;
 
 	//Set the status of each particle to DEAD
 	for (int i = 0; i < iNumParticles; i++)
 	{
 		m_pParticles[i].m_bIsAlive = false;
+		//push them in reverse order, so the first particles are used first:
+		m_piFreeParticles[i] = iNumParticles-1-i;
 	}
 
 	return true;
@@ -373,30 +417,52 @@ void CCCParticleSystem::UpdateSystem(float timePassed)
 		                                   *(1.0f+m_fCreationVariance*(RANDOM_FLOAT-0.5f)));
 	
 
-	//loop through the particles and update / create them
-	for (int i = 0; i < m_iMaxParticles; i++)
+	//loop through the live particles and update them
+	int i = 0;
+	while (i < m_iParticlesInUse)
 	{
-		if (m_pParticles[i].m_bIsAlive)
+		int iParticle = m_piLiveParticles[i];
+		m_pParticles[iParticle].Update(timePassed);
+
+		if (m_pParticles[iParticle].m_bIsAlive)
 		{
-			m_pParticles[i].Update(timePassed);
+			i++;
 		}
-
-		//Should we create the particle?
-		if (iParticlesToCreate > 0)
+		else
 		{
-			if (!m_pParticles[i].m_bIsAlive)
-			{
-				m_pParticles[i].Initialize(this);
-				//Update the particle: This has an effect, as if the particle would have
-				//been emitted some milliseconds ago. This is very useful on slow PCs:
-				//Especially if you simulate something like rain, then you could see that 
-				//many particles are emitted at the same time (same "UpdateSystem" call),
-				//if you would not call this function:				
-				m_pParticles[i].Update(RANDOM_FLOAT*timePassed);  
-				iParticlesToCreate--;
-			}
+			//The particle has died (and Update has decreased m_iParticlesInUse):
+			//Move the last live particle into its place and look at that one next.
+			m_piLiveParticles[i] = m_piLiveParticles[m_iParticlesInUse];
+			m_piFreeParticles[m_iNumFreeParticles++] = iParticle;
 		}
+	}
+
+	//create the new particles, as long as there are dead ones left
+	while (iParticlesToCreate > 0 && m_iNumFreeParticles > 0)
+	{
+		int iParticle = m_piFreeParticles[--m_iNumFreeParticles];
+		iParticlesToCreate--;
 
+		m_pParticles[iParticle].Initialize(this);
+		if (!m_pParticles[iParticle].m_bIsAlive)
+		{
+			//a die age of 0 - the particle can't be created
+			m_piFreeParticles[m_iNumFreeParticles++] = iParticle;
+			continue;
+		}
+		m_piLiveParticles[m_iParticlesInUse++] = iParticle;
+
+		//Update the particle: This has an effect, as if the particle would have
+		//been emitted some milliseconds ago. This is very useful on slow PCs:
+		//Especially if you simulate something like rain, then you could see that 
+		//many particles are emitted at the same time (same "UpdateSystem" call),
+		//if you would not call this function:				
+		m_pParticles[iParticle].Update(RANDOM_FLOAT*timePassed);  
+		if (!m_pParticles[iParticle].m_bIsAlive)
+		{
+			//it has already died again (it was the last one in the live list):
+			m_piFreeParticles[m_iNumFreeParticles++] = iParticle;
+		}
 	}
 	
 }
@@ -472,9 +538,128 @@ void CCCParticleSystem::Render()
 	{
 		glGetFloatv(GL_POINT_SIZE,&m_fCurrentPointSize);
 	}
-	for (int i = 0; i < m_iMaxParticles; i++)
+
+	if (m_bUseTexture && m_bBatchRendering)
 	{
-		if (m_pParticles[i].m_bIsAlive)
-			m_pParticles[i].Render();
+		//Render all particles with one call:
+		int iNumVertices = BuildBillboards(m_pBillboardVertices);
+
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+		glEnableClientState(GL_COLOR_ARRAY);
+		glVertexPointer(3,GL_FLOAT,sizeof(SParticleVertex),&m_pBillboardVertices[0].x);
+		glTexCoordPointer(2,GL_FLOAT,sizeof(SParticleVertex),&m_pBillboardVertices[0].s);
+		glColorPointer(4,GL_FLOAT,sizeof(SParticleVertex),&m_pBillboardVertices[0].r);
+
+		glDrawArrays(GL_QUADS,0,iNumVertices);
+
+		glDisableClientState(GL_VERTEX_ARRAY);
+		glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+		glDisableClientState(GL_COLOR_ARRAY);
+		return;
+	}
+
+	for (int i = 0; i < m_iParticlesInUse; i++)
+	{
+		m_pParticles[m_piLiveParticles[i]].Render();
 	}
-}
\ No newline at end of file
+}
+
+int CCCParticleSystem::BuildBillboards(SParticleVertex * pVertices)
+{
+	//The corners are the same ones CCCParticle::Render uses. With the half size h, 
+	//A = (RotatedX+RotatedY)*h and B = (RotatedX-RotatedY)*h they are:
+	//   Position-A (0/0), Position-B (0/1), Position+A (1/1), Position+B (1/0)
+	SParticleVertex * pVertex = pVertices;
+
+#ifdef PARTICLES_SSE
+	//x, y and z of the vectors go into one SSE register each (the 4th value is not used)
+	__m128 X = _mm_setr_ps(m_BillboardedX.x,m_BillboardedX.y,m_BillboardedX.z,0.0f);
+	__m128 Y = _mm_setr_ps(m_BillboardedY.x,m_BillboardedY.y,m_BillboardedY.z,0.0f);
+	__m128 XPlusY = _mm_add_ps(X,Y);
+	__m128 XMinusY = _mm_sub_ps(X,Y);
+
+	for (int i = 0; i < m_iParticlesInUse; i++)
+	{
+		CCCParticle * pParticle = &m_pParticles[m_piLiveParticles[i]];
+		__m128 A = XPlusY;
+		__m128 B = XMinusY;
+
+		//If spinning is switched on, rotate the particle now:
+		if (pParticle->m_fSpinAngle > 0.0f)
+		{
+			__m128 Cos = _mm_set1_ps((float)cos(pParticle->m_fSpinAngle));
+			__m128 Sin = _mm_set1_ps((float)sin(pParticle->m_fSpinAngle));
+			__m128 RotatedX = _mm_add_ps(_mm_mul_ps(X,Cos),_mm_mul_ps(Y,Sin));
+			__m128 RotatedY = _mm_sub_ps(_mm_mul_ps(Y,Cos),_mm_mul_ps(X,Sin));
+			A = _mm_add_ps(RotatedX,RotatedY);
+			B = _mm_sub_ps(RotatedX,RotatedY);
+		}
+
+		__m128 HalfSize = _mm_set1_ps(0.5f*pParticle->m_fSize);
+		A = _mm_mul_ps(A,HalfSize);
+		B = _mm_mul_ps(B,HalfSize);
+
+		//(m_Position is followed by m_Velocity, so reading 4 floats is ok)
+		__m128 Position = _mm_loadu_ps(&pParticle->m_Position.x);
+		__m128 Color = _mm_setr_ps(pParticle->m_Color.x,pParticle->m_Color.y,pParticle->m_Color.z,pParticle->m_fAlpha);
+
+		//Storing a position writes 4 floats, the 4th one is overwritten by s right afterwards:
+		_mm_storeu_ps(&pVertex[0].x,_mm_sub_ps(Position,A));
+		_mm_storeu_ps(&pVertex[1].x,_mm_sub_ps(Position,B));
+		_mm_storeu_ps(&pVertex[2].x,_mm_add_ps(Position,A));
+		_mm_storeu_ps(&pVertex[3].x,_mm_add_ps(Position,B));
+		for (int j = 0; j < 4; j++)
+		{
+			_mm_storeu_ps(&pVertex[j].r,Color);
+		}
+#else
+	SF3dVector XPlusY = m_BillboardedX + m_BillboardedY;
+	SF3dVector XMinusY = m_BillboardedX - m_BillboardedY;
+
+	for (int i = 0; i < m_iParticlesInUse; i++)
+	{
+		CCCParticle * pParticle = &m_pParticles[m_piLiveParticles[i]];
+		SF3dVector A = XPlusY;
+		SF3dVector B = XMinusY;
+
+		//If spinning is switched on, rotate the particle now:
+		if (pParticle->m_fSpinAngle > 0.0f)
+		{
+			SF3dVector RotatedX = m_BillboardedX * cos(pParticle->m_fSpinAngle) 
+							      + m_BillboardedY * sin(pParticle->m_fSpinAngle);
+			SF3dVector RotatedY = m_BillboardedY * cos(pParticle->m_fSpinAngle) 
+							      - m_BillboardedX * sin(pParticle->m_fSpinAngle);
+			A = RotatedX + RotatedY;
+			B = RotatedX - RotatedY;
+		}
+
+		A = A * (0.5f*pParticle->m_fSize);
+		B = B * (0.5f*pParticle->m_fSize);
+
+		SF3dVector Corners[4];
+		Corners[0] = pParticle->m_Position - A;
+		Corners[1] = pParticle->m_Position - B;
+		Corners[2] = pParticle->m_Position + A;
+		Corners[3] = pParticle->m_Position + B;
+		for (int j = 0; j < 4; j++)
+		{
+			pVertex[j].x = Corners[j].x;
+			pVertex[j].y = Corners[j].y;
+			pVertex[j].z = Corners[j].z;
+			pVertex[j].r = pParticle->m_Color.x;
+			pVertex[j].g = pParticle->m_Color.y;
+			pVertex[j].b = pParticle->m_Color.z;
+			pVertex[j].a = pParticle->m_fAlpha;
+		}
+#endif
+
+		pVertex[0].s = 0.0f;  pVertex[0].t = 0.0f;
+		pVertex[1].s = 0.0f;  pVertex[1].t = 1.0f;
+		pVertex[2].s = 1.0f;  pVertex[2].t = 1.0f;
+		pVertex[3].s = 1.0f;  pVertex[3].t = 0.0f;
+		pVertex += 4;
+	}
+
+	return (int)(pVertex-pVertices);
+}
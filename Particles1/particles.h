@@ -27,6 +27,20 @@ CONSTANTS
 #define BILLBOARDING_PERPTOVIEWDIR					1  //align particles perpendicular to view direction
 #define BILLBOARDING_PERPTOVIEWDIR_BUTVERTICAL		2  //like PERPToViewDir, but Particles are vertically aligned
 
+
+/*******************
+SParticleVertex
+*******************/
+
+//One corner of a particle's quadrangle, as CCCParticleSystem::BuildBillboards writes them
+//(all of them go into one vertex array, so the whole system is rendered with one glDrawArrays call)
+struct SParticleVertex
+{
+	GLfloat x,y,z;		//position (must come first: BuildBillboards writes 4 floats at once here)
+	GLfloat s,t;		//texture coordinates
+	GLfloat r,g,b,a;	//color and alpha
+};
+
 /*******************
 CCCParticle
 *******************/
@@ -61,6 +75,9 @@ private:
 	float	   m_fAge;		//Age of the particle (is updated 	
   //Needed to access the system's values:
 	CCCParticleSystem * m_ParentSystem;
+
+	//The system reads the particles directly when it builds the vertex array:
+	friend class CCCParticleSystem;
 	
 public:
 	bool	   m_bIsAlive;  //Is the particle active or not? Must be visible for the System
@@ -152,6 +169,9 @@ public:  //The values how to emit a particle must be public because the particle
 
 	bool			m_bParticlesLeaveSystem;  //Switch it off if the particle's positions 
 											 //shall be relative to the system's position (emitter position)
+
+	bool			m_bBatchRendering;	//Set it false to render each textured particle on its own
+										//(glBegin/glEnd) instead of all of them from one vertex array
 		
 //*************************************
 // STORING THE PARTICLES
@@ -162,6 +182,14 @@ public:  //The values how to emit a particle must be public because the particle
 	int				m_iMaxParticles;
 	//How many particles are currently in use?
 	int				m_iParticlesInUse;
+	//Indices of the particles in use (the first m_iParticlesInUse entries are valid),
+	//so updating and rendering don't have to look at the dead particles:
+	int			   *m_piLiveParticles;
+	//Stack of the indices of the dead particles, so creating one needs no search:
+	int			   *m_piFreeParticles;
+	int				m_iNumFreeParticles;
+	//The vertex array for batch rendering (4 vertices per particle):
+	SParticleVertex *m_pBillboardVertices;
 	//How many particles are created per second?
 	//Note that this is an average value and if you set it too high, there won't be
 	//dead particles that can be created unless the lifetime is very short and/or 
@@ -217,8 +245,11 @@ public:  //The values how to emit a particle must be public because the particle
 //*************************************
 
 	CCCParticleSystem();								//constructor: sets default values
+	~CCCParticleSystem();								//destructor: frees the particles
+
 
 	bool			Initialize(int iNumParticles);		//reserves space for the particles
+	void			FreeParticles();					//frees it again (Initialize does that first, too)
 
 	bool			LoadTextureFromFile(char * Filename);
 
@@ -229,4 +260,9 @@ public:  //The values how to emit a particle must be public because the particle
 	void			UpdateSystem(float timePassed);	//updates all particles alive
 	void			Render();							//renders all particles alive
 
-};
\ No newline at end of file
+	//Fills pVertices with the quadrangles of all particles alive (4 vertices each, billboarded
+	//with m_BillboardedX and m_BillboardedY) and returns the number of vertices.
+	//It doesn't call OpenGL, so it can be used without a window, too.
+	int				BuildBillboards(SParticleVertex * pVertices);
+
+};
@@ -122,10 +122,11 @@ void loadTextures()
 {
 	unsigned char *data;
 
-	texture[0] = txm_addTgaFile("Data/Water.tga", false, true, true);
-	texture[1] = txm_addTgaFile("Data/Ball.tga", false, true, true);
-	texture[2] = txm_addTgaFile("Data/Envmap.tga", false, true, true);
-	texture[3] = txm_addTgaFile("Data/Mountains.tga", false, true, true);
+	/* Decoded in the background, uploaded by txm_update() in appDraw() */
+	texture[0] = txm_addTgaFileAsync("Data/Water.tga", false, true, true);
+	texture[1] = txm_addTgaFileAsync("Data/Ball.tga", false, true, true);
+	texture[2] = txm_addTgaFileAsync("Data/Envmap.tga", false, true, true);
+	texture[3] = txm_addTgaFileAsync("Data/Mountains.tga", false, true, true);
 
 	/* Create an empty texture for reflections */
 	data = (unsigned char *)calloc(3*REFL_TEXW*REFL_TEXH, sizeof(unsigned char));
@@ -555,6 +556,9 @@ void appDraw()
 	countObjects = 0;
 	frameCount++;
 
+	/* Upload any textures that have finished loading */
+	txm_update(1);
+
 	if (win_height == 0)
 		win_height = 1;
 	aspect = (float)win_width / (float)win_height;
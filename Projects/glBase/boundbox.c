@@ -205,3 +205,165 @@ bool bbox_intersectLine(bbox b, vec3 p0, vec3 p1, float *s0, float *s1)
 	}
 	return true;
 }
+
+
+static void bbox_get(bboxsoa b, int i, bbox box)
+{
+	box->minp[0] = b->minx[i];
+	box->minp[1] = b->miny[i];
+	box->minp[2] = b->minz[i];
+	box->maxp[0] = b->maxx[i];
+	box->maxp[1] = b->maxy[i];
+	box->maxp[2] = b->maxz[i];
+}
+
+/*
+  Test n boxes against the sides of a frustum, four at a time. On entry
+  clipFlags[i] holds the parent clip flags for box i, on exit it holds the
+  clip flags bbox_isInsideFrustum() would have returned.
+*/
+void bbox_isInsideFrustumSoA(bboxsoa b, int n, fru f, int *clipFlags)
+{
+	int i, j;
+	float *rx, *ry, *rz, *ax, *ay, *az;
+	plane p;
+	struct bbox_str box;
+#ifdef PLANE_SSE2
+	__m128i flags, bit, active, out, in;
+	__m128i one = _mm_set1_epi32(1);
+	__m128 rv, av, zero = _mm_setzero_ps();
+#else
+	int k, flag, active, in, out;
+#endif
+
+	for (i = 0; i + 4 <= n; i += 4) {
+#ifdef PLANE_SSE2
+		flags = _mm_loadu_si128((__m128i*)(clipFlags + i));
+#endif
+		for (j = 0; j < FRUSTUM_NUMPLANES; j++) {
+			p = &f->planes[j];
+
+			/* Which boxes still need this plane? */
+#ifdef PLANE_SSE2
+			bit = _mm_set1_epi32(2 << j);
+			active = _mm_cmpeq_epi32(_mm_and_si128(flags, bit), bit);
+			if (!_mm_movemask_epi8(active))
+				continue;
+#else
+			flag = 2 << j;
+			active = 0;
+			for (k = 0; k < 4; k++)
+				if ((clipFlags[i + k] & flag) && clipFlags[i + k] != 1)
+					active |= 1 << k;
+			if (!active)
+				continue;
+#endif
+
+			/* Accept / reject points are the same corners for every box */
+			if (p->signbits & 8)	{ rx = b->maxx; ax = b->minx; }
+			else					{ rx = b->minx; ax = b->maxx; }
+			if (p->signbits & 16)	{ ry = b->maxy; ay = b->miny; }
+			else					{ ry = b->miny; ay = b->maxy; }
+			if (p->signbits & 32)	{ rz = b->maxz; az = b->minz; }
+			else					{ rz = b->minz; az = b->maxz; }
+
+#ifdef PLANE_SSE2
+			plane_eval4(p, rx + i, ry + i, rz + i, rv);
+			plane_eval4(p, ax + i, ay + i, az + i, av);
+
+			/* Boxes wholly outside the plane are rejected completely */
+			out = _mm_and_si128(active,
+						_mm_castps_si128(_mm_cmpnlt_ps(rv, zero)));
+			flags = _mm_or_si128(_mm_andnot_si128(out, flags),
+									_mm_and_si128(out, one));
+
+			/* Boxes wholly inside the plane turn off its clip flag */
+			in = _mm_andnot_si128(out, _mm_and_si128(active,
+						_mm_castps_si128(_mm_cmplt_ps(av, zero))));
+			flags = _mm_andnot_si128(_mm_and_si128(in, bit), flags);
+#else
+			out = ~vec3_isInsidePlane4(rx + i, ry + i, rz + i, p);
+			in = vec3_isInsidePlane4(ax + i, ay + i, az + i, p);
+
+			for (k = 0; k < 4; k++) {
+				if (!(active & (1 << k)))
+					continue;
+				if (out & (1 << k))
+					clipFlags[i + k] = 1;
+				else if (in & (1 << k))
+					clipFlags[i + k] &= ~flag;
+			}
+#endif
+		}
+#ifdef PLANE_SSE2
+		_mm_storeu_si128((__m128i*)(clipFlags + i), flags);
+#endif
+	}
+
+	/* Left overs */
+	for (; i < n; i++) {
+		bbox_get(b, i, &box);
+		clipFlags[i] = bbox_isInsideFrustum(&box, f, clipFlags[i]);
+	}
+}
+
+/*
+  Test n boxes against a directed line segment from p0 to p1. Sets hit[i]
+  to the result bbox_intersectLine() gives for box i, and s0[i] and s1[i]
+  to its intersection points if it hits. Returns the number of boxes hit.
+
+  The line is the same for every box, so the parallel tests and the
+  divisors are only worked out once, and the loops over the boxes have no
+  early outs, so the compiler can vectorise them.
+*/
+int bbox_intersectLineSoA(bboxsoa b, int n, vec3 p0, vec3 p1,
+							float *s0, float *s1, unsigned char *hit)
+{
+	int i, j, count = 0;
+	float d, t0, t1, *minp, *maxp, *nearp, *farp;
+
+	for (i = 0; i < n; i++) {
+		s0[i] = -(float)INT_MAX;
+		s1[i] = (float)INT_MAX;
+		hit[i] = true;
+	}
+
+	/* For each dimension */
+	for (j = 0; j < 3; j++) {
+		minp = j == 0 ? b->minx : j == 1 ? b->miny : b->minz;
+		maxp = j == 0 ? b->maxx : j == 1 ? b->maxy : b->maxz;
+		d = p1[j] - p0[j];
+		if (d == 0.0f) {
+			/* Line is parallel to sides, misses boxes it is outside */
+			for (i = 0; i < n; i++)
+				hit[i] &= !(p0[j] < minp[i] || p0[j] > maxp[i]);
+		}
+		else {
+			/* Going backwards the near side is the max side */
+			if (d < 0.0f) {
+				nearp = maxp;
+				farp = minp;
+			}
+			else {
+				nearp = minp;
+				farp = maxp;
+			}
+			for (i = 0; i < n; i++) {
+				t0 = (nearp[i] - p0[j]) / d;
+				t1 = (farp[i] - p0[j]) / d;
+				s0[i] = t0 > s0[i] ? t0 : s0[i];	/* biggest s near */
+				s1[i] = t1 < s1[i] ? t1 : s1[i];	/* smallest s far */
+			}
+		}
+	}
+
+	/*
+	 * s near only grows and s far only shrinks, so testing them at the end
+	 * rejects the same boxes as testing after each dimension.
+	 */
+	for (i = 0; i < n; i++) {
+		hit[i] &= !(s0[i] > s1[i] || s1[i] < 0.0f || s0[i] > 1.0f);
+		count += hit[i];
+	}
+	return count;
+}
@@ -35,9 +35,19 @@ typedef struct bbox_str {
 	vec3 minp, maxp;
 } *bbox;
 
+/* Lots of boxes, each coordinate in an array of its own */
+typedef struct bboxsoa_str {
+	float *minx, *miny, *minz;
+	float *maxx, *maxy, *maxz;
+} *bboxsoa;
+
 int  bbox_isInsidePlane(bbox b, plane p);
 int  bbox_isInsideFrustum(bbox b, fru f, int clipFlags);
 int  bbox_isInsideBox(bbox b, bbox other);
 bool bbox_intersectLine(bbox b, vec3 p0, vec3 p1, float *s0, float *s1);
 
+void bbox_isInsideFrustumSoA(bboxsoa b, int n, fru f, int *clipFlags);
+int  bbox_intersectLineSoA(bboxsoa b, int n, vec3 p0, vec3 p1,
+							float *s0, float *s1, unsigned char *hit);
+
 #endif /* BOUNDBOX_H */
@@ -26,17 +26,34 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 				caching code.
 				If VAR/Fence is supported, fast memory may be requested
 				(from graphics or AGP memory).
+
+				Shared caches: set shared before calling cch_init() and
+				cch_alloc() may be called from several threads at once.
+				Objects are not linked or collected, each thread just
+				bumps frameUsed with an atomic add and writes its object
+				at the old value. Nothing is freed, instead an object
+				stays valid (see cch_valid()) until the cache has moved on
+				by half its size since the start of the frame it was last
+				checked in. As no frame may use more than the other half,
+				an object that is valid at the start of a frame can't be
+				overwritten before the end of it, and cch_thrashed() is set
+				if it does use more. cch_initFrame() must be called by one
+				thread while no others are allocating.
+				Shared caches don't use fast memory, because the fences
+				would have to be set by the allocating thread.
 */
 
 #include "opengl.h"
 #include "cache.h"
 #include "error.h"
+#include "thread.h"
 
 cch cch_create(size_t size, bool fast)
 {
 	cch c = (cch)malloc(sizeof(struct cch_str));
 	if (c) {
 		c->fast = fast;
+		c->shared = false;
 		c->fastBase = NULL;
 		c->base = c->rover = NULL;
 		c->size = 0;
@@ -83,7 +100,11 @@ void cch_init(cch c, size_t size)
 	c->base->owner = NULL;
 	c->base->size = c->size;
 
-	if (c->fast && globalGL.supportsVARFence) {
+	c->frameBase = 0;
+	c->framePos = 0;
+	c->frameUsed = 0;
+
+	if (c->fast && !c->shared && globalGL.supportsVARFence) {
 		c->fastBase = (unsigned char*)globalGL.wglAllocateMemoryNV(
 							size, 0.0f, 0.0f, 1.0f);
 		if (!c->fastBase)
@@ -100,6 +121,14 @@ void cch_flush(cch c)
 	if (!c || !c->base)
 		return;
 
+	if (c->shared) {
+		/* Move on by a whole cache, no object is valid after that */
+		c->frameBase += (unsigned long)(c->frameUsed + c->size);
+		c->framePos = 0;
+		c->frameUsed = 0;
+		return;
+	}
+
 	for (obj = c->base; obj; obj = obj->next) {
 		if (c->fast) {
 			if(!globalGL.glTestFenceNV(obj->fence))
@@ -120,6 +149,44 @@ void cch_initFrame(cch c)
 {
 	c->wrapped = c->thrashed = false;
 	c->initRover = c->rover;
+
+	if (c->shared && c->size) {
+		/* Start a new frame where the last one finished */
+		c->frameBase += (unsigned long)c->frameUsed;
+		c->framePos = (c->framePos + (size_t)c->frameUsed) % c->size;
+		c->frameUsed = 0;
+	}
+}
+
+/*
+ * Allocate from a shared cache. Each try reserves size bytes with an
+ * atomic add, a reservation that runs off the end of the cache is wasted
+ * and the next one starts near the base.
+ */
+static cchobj cch_allocShared(cch c, size_t size, cchobj *owner)
+{
+	cchobj obj;
+	size_t off, pos;
+
+	do {
+		off = (size_t)thr_atomicAdd(&c->frameUsed, (long)size);
+		pos = (c->framePos + off) % c->size;
+	} while (pos + size > c->size);
+
+	/* Has this frame used more than its half? */
+	if (off + size > c->size / 2)
+		c->thrashed = true;
+
+	obj = (cchobj)((unsigned char*)c->base + pos);
+	obj->size = size;
+	obj->next = NULL;
+	obj->fence = 0;
+	obj->stamp = c->frameBase + (unsigned long)off;
+	obj->data = (unsigned char*)(obj + 1);
+	obj->owner = owner;
+	*owner = obj;
+
+	return obj;
 }
 
 cchobj cch_alloc(cch c, size_t size, cchobj *owner)
@@ -133,11 +200,14 @@ cchobj cch_alloc(cch c, size_t size, cchobj *owner)
 	/* 4 byte align */
 	size = (size + 3) & ~3;
 
-	if (size > c->size) {
+	if (size > (c->shared ? c->size / 2 : c->size)) {
 		err_report("cch_alloc: %i > cache size of %i", size, c->size);
 		return NULL;
 	}
 
+	if (c->shared)
+		return cch_allocShared(c, size, owner);
+
 	/* If there is not size bytes after the rover, reset to the cache base */
 	wrapped_this_time = false;
 	if (!c->rover)
@@ -211,10 +281,57 @@ void *cch_malloc(cch c, size_t size, cchobj *owner)
 	return NULL;
 }
 
+/*
+ * Is the object owned by owner still in the cache? For a shared cache
+ * this also means it will still be there at the end of the frame.
+ */
+bool cch_valid(cch c, cchobj *owner)
+{
+	cchobj obj = *owner;
+	long off;
+	size_t pos;
+
+	if (!obj)
+		return false;
+	if (!c->shared)
+		return obj->owner == owner;
+
+	/* Check the pointer before looking at the object, it may be left
+	   over from before the cache was flushed */
+	if ((unsigned char*)obj < (unsigned char*)c->base ||
+		(unsigned char*)obj >= (unsigned char*)c->base + c->size ||
+		obj->owner != owner || obj->size > c->size / 2)
+		return false;
+
+	/* Offset from the start of the frame */
+	off = (long)(obj->stamp - c->frameBase);
+	if (off >= 0) {
+		/* Allocated this frame, has the cache come round to it again? */
+		if (c->frameUsed - off > (long)c->size)
+			return false;
+		pos = (c->framePos + (size_t)off) % c->size;
+	}
+	else {
+		/* Allocated before this frame, is it far enough inside the half
+		   of the cache this frame won't touch? */
+		if ((size_t)-off > c->size / 2 - obj->size)
+			return false;
+		pos = (c->framePos + c->size - (size_t)-off) % c->size;
+	}
+
+	/* Is it where it should be? */
+	return (unsigned char*)obj == (unsigned char*)c->base + pos;
+}
+
 void cch_dump(cch c)
 {
 	cchobj obj;
 	printf("cch_dump cache size %i\n", c->size);
+	if (c->shared) {
+		printf("shared, %i bytes used this frame\n", (int)c->frameUsed);
+		fflush(stdout);
+		return;
+	}
 	for (obj = c->base; obj; obj = obj->next) {
 		if (obj == c->rover)
 			printf("ROVER:\n");
@@ -26,6 +26,8 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 				caching code.
 				If VAR/Fence is supported, fast memory may be requested
 				(from graphics or AGP memory).
+				A shared cache may be allocated from by several threads
+				at once (see cache.c).
 */
 
 #ifndef CACHE_H
@@ -40,6 +42,7 @@ typedef struct cchobj_str {			/* object in cache */
 									   a cchobj pointer */
 	int fence;						/* NV fence */
 	unsigned char *data;			/* pointer a size element array */
+	unsigned long stamp;			/* shared cache: allocation position */
 } *cchobj;
 
 typedef struct cch_str {			/* cache */
@@ -50,6 +53,10 @@ typedef struct cch_str {			/* cache */
 	cchobj	initRover;				/* used to detect cache thrashing */
 	unsigned char *fastBase;		/* fast memory base pointer */
 	bool	wrapped, thrashed;
+	bool	shared;					/* allow allocation from any thread */
+	unsigned long frameBase;		/* shared cache: position at frame start */
+	size_t	framePos;				/* shared cache: offset at frame start */
+	volatile long frameUsed;		/* shared cache: bytes used this frame */
 } *cch;
 
 #define cch_free(c) ((c)->size-((unsigned char*)(c)->rover-(unsigned char*)(c)->base))
@@ -62,6 +69,7 @@ void cch_flush(cch c);
 void cch_initFrame(cch c);
 cchobj cch_alloc(cch c, size_t size, cchobj *owner);
 void *cch_malloc(cch c, size_t size, cchobj *owner);
+bool cch_valid(cch c, cchobj *owner);
 void cch_dump(cch c);
 
 #endif /* CACHE_H */
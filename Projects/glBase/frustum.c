@@ -113,3 +113,38 @@ bool vec3_isInsideFrustum(vec3 v, fru f)
 	}
 	return true;
 }
+
+
+/*
+
+  Test n points, given as separate arrays of x, y and z, against the sides
+  of the frustum, four at a time. Sets inside[i] to true if point i is
+  inside, false if outside, and returns the number inside.
+
+*/
+int vec3_isInsideFrustumSoA(float *x, float *y, float *z, int n, fru f,
+								unsigned char *inside)
+{
+	int i, j, mask, count = 0;
+	vec3 v;
+
+	for (i = 0; i + 4 <= n; i += 4) {
+		mask = 0xF;
+		for (j = 0; j < FRUSTUM_NUMPLANES && mask; j++)
+			mask &= vec3_isInsidePlane4(x + i, y + i, z + i, &f->planes[j]);
+		for (j = 0; j < 4; j++) {
+			inside[i + j] = (mask >> j) & 1;
+			count += inside[i + j];
+		}
+	}
+
+	/* Left overs */
+	for (; i < n; i++) {
+		v[0] = x[i];
+		v[1] = y[i];
+		v[2] = z[i];
+		inside[i] = vec3_isInsideFrustum(v, f);
+		count += inside[i];
+	}
+	return count;
+}
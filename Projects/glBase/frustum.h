@@ -61,5 +61,7 @@ void fru_destroy(fru f);
 void fru_init(fru f, cam c);
 
 bool vec3_isInsideFrustum(vec3 v, fru f);
+int  vec3_isInsideFrustumSoA(float *x, float *y, float *z, int n, fru f,
+								unsigned char *inside);
 
 #endif /* FRUSTUM_H */
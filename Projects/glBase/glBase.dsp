@@ -222,6 +222,14 @@ SOURCE=.\tgafile.h
 # End Source File
 # Begin Source File
 
+SOURCE=.\thread.c
+# End Source File
+# Begin Source File
+
+SOURCE=.\thread.h
+# End Source File
+# Begin Source File
+
 SOURCE=.\vector.c
 # End Source File
 # Begin Source File
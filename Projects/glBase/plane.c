@@ -120,3 +120,29 @@ bool vec3_isInsidePlane(vec3 v, plane p)
 
 	return (planeEqVal < 0);
 }
+
+/*
+ * Test four points, given as arrays of x, y and z, against the plane.
+ * Returns a mask with bit i set if point i is inside. The sums are done in
+ * the same order as vec3_isInsidePlane(), so the answers are the same.
+ */
+int vec3_isInsidePlane4(float *x, float *y, float *z, plane p)
+{
+#ifdef PLANE_SSE2
+	__m128 val;
+	plane_eval4(p, x, y, z, val);
+	return _mm_movemask_ps(_mm_cmplt_ps(val, _mm_setzero_ps()));
+#else
+	int i, mask = 0;
+	vec3 v;
+
+	for (i = 0; i < 4; i++) {
+		v[0] = x[i];
+		v[1] = y[i];
+		v[2] = z[i];
+		if (vec3_isInsidePlane(v, p))
+			mask |= 1 << i;
+	}
+	return mask;
+#endif
+}
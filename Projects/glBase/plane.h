@@ -52,8 +52,33 @@ typedef struct plane_str {
 
 #define plane_translate(p,v)	{p->d -= vec3_dot(p->v,v);}
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PLANE_SSE2
+#include <emmintrin.h>
+
+/*
+ * Plane equation values for the four points in arrays x, y and z, summed
+ * in the same order as vec3_isInsidePlane() so the signs are the same.
+ */
+#define plane_eval4(p,x,y,z,val)	{\
+	val = _mm_set1_ps(p->d);\
+	if (p->signbits & 7) {\
+		float *c_ = (p->signbits & 1) ? (x) : (p->signbits & 2) ? (y) : (z);\
+		if (p->signbits & ((p->signbits & 7) << 3))\
+			val = _mm_sub_ps(val, _mm_loadu_ps(c_));\
+		else\
+			val = _mm_add_ps(val, _mm_loadu_ps(c_));\
+	}\
+	else\
+		val = _mm_add_ps(val, _mm_add_ps(_mm_add_ps(\
+				_mm_mul_ps(_mm_set1_ps(p->v[0]), _mm_loadu_ps(x)),\
+				_mm_mul_ps(_mm_set1_ps(p->v[1]), _mm_loadu_ps(y))),\
+				_mm_mul_ps(_mm_set1_ps(p->v[2]), _mm_loadu_ps(z))));}
+#endif
+
 void plane_setSignbits(plane p);
 
 bool vec3_isInsidePlane(vec3 v, plane p);
+int  vec3_isInsidePlane4(float *x, float *y, float *z, plane p);
 
 #endif /* PLANE_H */
@@ -21,24 +21,81 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 	File:		textureManager.c
 
 	Function:	Manage loading textures into OpenGL texture objects.
+
+				Named textures are kept in a hash table, so looking one up
+				doesn't depend on how many are loaded.
+
+				txm_addTgaFileAsync() and txm_addRawFileAsync() return a
+				texture object at once, holding a one texel grey
+				placeholder. The file is read and decoded on worker threads
+				the next time txm_update() is called, and a later call to
+				txm_update() replaces the placeholder with the real texture.
+				Only txm_update() and txm_finish() touch OpenGL, so they
+				must be called from the thread with the GL context.
 */
 
 #include "textureManager.h"
 #include "tgafile.h"
 #include "opengl.h"
+#include "error.h"
+#include "thread.h"
+
+#define TXM_HASH_SIZE	256			/* Must be a power of two */
+
+#define TXM_TGA			0			/* File types */
+#define TXM_RAW			1
+
+#define TXM_PENDING		0			/* Load states */
+#define TXM_DECODED		1
+#define TXM_DONE		2
+
+typedef struct txmload_str {		/* Texture file being loaded */
+	int type;
+	bool alpha, repeat, mipmap;
+	int w, h, format;				/* Raw: given, tga: found when decoded */
+	unsigned char *data;			/* Decoded texels, NULL if it failed */
+	tga tgaFile;
+	volatile long state;
+	struct txm_str *waiting;		/* Next texture waiting for a batch */
+} *txmload;
 
 typedef struct txm_str {
 	char *name;
 	int texNum;
 	struct txm_str *next;
+	struct txm_str *hashNext;		/* Next texture in hash bucket */
+	txmload load;					/* Async load, NULL when done */
 } *txm;
 
+typedef struct txmbatch_str {		/* Loads decoded together */
+	int numLoads;
+	txm *texs;
+	volatile long nextLoad;			/* Next load for a worker to take */
+	int uploaded;
+	thr job;
+	struct txmbatch_str *next;
+} *txmbatch;
+
 static txm globalTexList;
+static txm globalTexHash[TXM_HASH_SIZE];
+
+static txm txmWaiting;				/* Loads not yet in a batch */
+static int txmNumWaiting;
+static txmbatch txmBatches;			/* Batches being decoded / uploaded */
+
+static unsigned int txm_hash(char *name)
+{
+	unsigned int h = 5381;
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h & (TXM_HASH_SIZE - 1);
+}
 
 static txm txm_create(char *name)
 {
 	int size;
 	txm t;
+	txm *bucket;
 
 	size = strlen(name) + 1 + sizeof(struct txm_str);
 	t = (txm)malloc(size);
@@ -46,8 +103,17 @@ static txm txm_create(char *name)
 		t->name = (char *)(t + 1);
 		strcpy(t->name, name);
 		t->texNum = 0;
+		t->load = NULL;
 		t->next = globalTexList;
 		globalTexList = t;
+
+		/* Raw data textures have no name and are never looked up */
+		t->hashNext = NULL;
+		if (*name) {
+			bucket = &globalTexHash[txm_hash(name)];
+			t->hashNext = *bucket;
+			*bucket = t;
+		}
 	}
 	return t;
 }
@@ -60,21 +126,65 @@ static void txm_destroy(txm t)
 		while (*tp != t)
 			tp = &((*tp)->next);
 		*tp = t->next;
+
+		/* And in its hash bucket */
+		if (*t->name) {
+			tp = &globalTexHash[txm_hash(t->name)];
+			while (*tp != t)
+				tp = &((*tp)->hashNext);
+			*tp = t->hashNext;
+		}
 		free(t);
 	}
 }
 
 static txm txm_find(char *name)
 {
-	txm t = globalTexList;
+	txm t = globalTexHash[txm_hash(name)];
 	while (t) {
 		if (SCMP(name, t->name))
 			return t;
-		t = t->next;
+		t = t->hashNext;
 	}
 	return NULL;
 }
 
+static void txm_setTexObject(unsigned int texNum, unsigned char *texData,
+							 int w, int h, int format, bool repeat, bool mipmap)
+{
+	glBindTexture(GL_TEXTURE_2D, texNum);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	/* Set the tiling mode */
+	if (repeat) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	}
+	else if (globalGL.supportsEdgeClamp) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+	else {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
+	}
+
+	/* Set the filtering */
+	if (mipmap) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+												GL_LINEAR_MIPMAP_LINEAR);
+		gluBuild2DMipmaps(GL_TEXTURE_2D, format, w, h,
+					format, GL_UNSIGNED_BYTE, texData);
+	}
+	else {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0,
+					format, GL_UNSIGNED_BYTE, texData);
+	}
+}
+
 static int txm_genTexObject(unsigned char *texData, int w, int h,
 								int format, bool repeat, bool mipmap)
 {
@@ -82,70 +192,31 @@ static int txm_genTexObject(unsigned char *texData, int w, int h,
 
 	glGenTextures(1, &texNum);
 
-	if (texData) {
-
-		glBindTexture(GL_TEXTURE_2D, texNum);
-		glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-
-		/* Set the tiling mode */
-		if (repeat) {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		}
-		else if (globalGL.supportsEdgeClamp) {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		}
-		else {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-		}
+	if (texData)
+		txm_setTexObject(texNum, texData, w, h, format, repeat, mipmap);
 
-		/* Set the filtering */
-		if (mipmap) {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
-													GL_LINEAR_MIPMAP_LINEAR);
-			gluBuild2DMipmaps(GL_TEXTURE_2D, format, w, h,
-						format, GL_UNSIGNED_BYTE, texData);
-		}
-		else {
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-			glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0,
-						format, GL_UNSIGNED_BYTE, texData);
-		}
-	}
 	return texNum;
 }
 
-int txm_addRawFile(char *filename, int w, int h, int format, bool repeat, bool mipmap)
+static int txm_depth(int format)
 {
-	int texNum = 0;
-	unsigned char *data = NULL;
-	int depth;
-	FILE *f;
-	txm t;
-
-	t = txm_find(filename);
-	if (t)
-		return t->texNum;
-	t = txm_create(filename);
-	if (!t)
-		return 0;
-
 	switch (format) {
 	case GL_RGBA:
-		depth = 4;
-		break;
+		return 4;
 	case GL_RGB:
-		depth = 3;
-		break;
+		return 3;
 	default:
 	case GL_ALPHA:
-		depth = 1;
-		break;
+		return 1;
 	}
+}
+
+static unsigned char *txm_readRawFile(char *filename, int w, int h, int format)
+{
+	unsigned char *data = NULL;
+	int depth = txm_depth(format);
+	FILE *f;
+
 	f = fopen(filename, "rb");
 	if (f) {
 		data = (unsigned char*)malloc(w * h * depth);
@@ -153,7 +224,44 @@ int txm_addRawFile(char *filename, int w, int h, int format, bool repeat, bool m
 			fread(data, sizeof(unsigned char), w * h * depth, f);
 		fclose(f);
 	}
+	return data;
+}
+
+/*
+ * Get the texture format for a tga file, stripping the alpha channel if
+ * it isn't wanted. Returns false if the file can't be used.
+ */
+static bool txm_tgaFormat(tga f, bool alpha, int *format)
+{
+	if (f->depth == 32 && alpha)
+		*format = GL_RGBA;
+	else if (f->depth == 32) {
+		tga_stripAlpha(f);
+		*format = GL_RGB;
+	}
+	else if (f->depth == 24 && !alpha)
+		*format = GL_RGB;
+	else if (f->depth == 8 && alpha)
+		*format = GL_ALPHA;
+	else
+		return false;
+	return true;
+}
+
+int txm_addRawFile(char *filename, int w, int h, int format, bool repeat, bool mipmap)
+{
+	int texNum = 0;
+	unsigned char *data;
+	txm t;
 
+	t = txm_find(filename);
+	if (t)
+		return t->texNum;
+	t = txm_create(filename);
+	if (!t)
+		return 0;
+
+	data = txm_readRawFile(filename, w, h, format);
 	if (data) {
 		texNum = txm_genTexObject(data, w, h, format, repeat, mipmap);
 		free(data);
@@ -168,6 +276,7 @@ int txm_addRawFile(char *filename, int w, int h, int format, bool repeat, bool m
 int txm_addTgaFile(char *filename, bool alpha, bool repeat, bool mipmap)
 {
 	int texNum = 0;
+	int format;
 	tga f;
 	txm t;
 
@@ -179,34 +288,15 @@ int txm_addTgaFile(char *filename, bool alpha, bool repeat, bool mipmap)
 		return 0;
 
 	f = tga_create(filename);
-    if (f) {
-		if (f->depth == 32 && alpha) {
-			texNum = txm_genTexObject(f->data,f->width,f->height,
-											GL_RGBA,repeat,mipmap);
-			t->texNum = texNum;
-		}
-		else if (f->depth == 32) {
-			tga_stripAlpha(f);
-			texNum = txm_genTexObject(f->data,f->width,f->height,
-											GL_RGB,repeat,mipmap);
-			t->texNum = texNum;
-		}
-		else if (f->depth == 24 && !alpha) {
-			texNum = txm_genTexObject(f->data,f->width,f->height,
-											GL_RGB,repeat,mipmap);
-			t->texNum = texNum;
-		}
-		else if (f->depth == 8 && alpha) {
-			texNum = txm_genTexObject(f->data,f->width,f->height,
-											GL_ALPHA,repeat,mipmap);
-			t->texNum = texNum;
-		}
-		else
-			txm_destroy(t);
-		tga_destroy(f);
+	if (f && txm_tgaFormat(f, alpha, &format)) {
+		texNum = txm_genTexObject(f->data,f->width,f->height,
+										format,repeat,mipmap);
+		t->texNum = texNum;
 	}
 	else
 		txm_destroy(t);
+	if (f)
+		tga_destroy(f);
 
 	return texNum;
 }
@@ -230,8 +320,234 @@ int txm_addRawData(unsigned char* data, int w, int h, int format, bool repeat, b
 	return texNum;
 }
 
+/*
+ * Create a texture object holding a placeholder, and queue the file to be
+ * loaded into it.
+ */
+static int txm_addAsync(char *filename, int type, int w, int h, int format,
+						bool alpha, bool repeat, bool mipmap)
+{
+	unsigned char placeholder[4] = {128, 128, 128, 255};
+	txmload load;
+	txm t;
+
+	t = txm_find(filename);
+	if (t)
+		return t->texNum;
+
+	load = (txmload)calloc(1, sizeof(struct txmload_str));
+	t = txm_create(filename);
+	if (!t || !load) {
+		err_report("txm_addAsync: cannot allocate %d bytes",
+											sizeof(struct txmload_str));
+		if (t)
+			txm_destroy(t);
+		if (load)
+			free(load);
+		return 0;
+	}
+	load->type = type;
+	load->w = w;
+	load->h = h;
+	load->format = format;
+	load->alpha = alpha;
+	load->repeat = repeat;
+	load->mipmap = mipmap;
+	load->state = TXM_PENDING;
+	t->load = load;
+
+	/* Raw files may be GL_ALPHA, tga files aren't known yet */
+	t->texNum = txm_genTexObject(placeholder, 1, 1,
+			(type == TXM_RAW && format == GL_ALPHA) ? GL_ALPHA : GL_RGBA,
+			repeat, mipmap);
+
+	/* Wait for txm_update() to start a batch */
+	load->waiting = txmWaiting;
+	txmWaiting = t;
+	txmNumWaiting++;
+
+	return t->texNum;
+}
+
+int txm_addRawFileAsync(char *filename, int w, int h, int format, bool repeat, bool mipmap)
+{
+	return txm_addAsync(filename, TXM_RAW, w, h, format, false, repeat, mipmap);
+}
+
+int txm_addTgaFileAsync(char *filename, bool alpha, bool repeat, bool mipmap)
+{
+	return txm_addAsync(filename, TXM_TGA, 0, 0, 0, alpha, repeat, mipmap);
+}
+
+static void txm_loadWorker(void *arg, int thread)
+{
+	txmbatch b = (txmbatch)arg;
+	txmload load;
+	long i;
+	tga f;
+
+	while ((i = thr_atomicInc(&b->nextLoad) - 1) < b->numLoads) {
+		load = b->texs[i]->load;
+		if (load->type == TXM_TGA) {
+			f = tga_create(b->texs[i]->name);
+			if (f && txm_tgaFormat(f, load->alpha, &load->format)) {
+				load->data = f->data;
+				load->w = f->width;
+				load->h = f->height;
+				load->tgaFile = f;
+			}
+			else if (f)
+				tga_destroy(f);
+		}
+		else
+			load->data = txm_readRawFile(b->texs[i]->name,
+										load->w, load->h, load->format);
+
+		/* Publish the texels to the render thread */
+		thr_atomicInc(&load->state);
+	}
+}
+
+/*
+ * Put all the waiting loads in a batch and start decoding it.
+ */
+static void txm_startBatch()
+{
+	int i, numThreads;
+	txmbatch b, *bp;
+	txm t;
+
+	b = (txmbatch)malloc(sizeof(struct txmbatch_str)
+									+ txmNumWaiting * sizeof(txm));
+	if (!b) {
+		err_report("txm_startBatch: cannot allocate %d bytes",
+				sizeof(struct txmbatch_str) + txmNumWaiting * sizeof(txm));
+		return;
+	}
+	b->texs = (txm *)(b + 1);
+	b->numLoads = txmNumWaiting;
+	b->nextLoad = 0;
+	b->uploaded = 0;
+
+	/* Oldest first */
+	for (i = txmNumWaiting - 1, t = txmWaiting; t; i--, t = t->load->waiting)
+		b->texs[i] = t;
+	txmWaiting = NULL;
+	txmNumWaiting = 0;
+
+	/* Append, so batches are uploaded in the order they were queued */
+	b->next = NULL;
+	for (bp = &txmBatches; *bp; bp = &((*bp)->next))
+		;
+	*bp = b;
+
+	numThreads = thr_numCPUs();
+	if (numThreads > b->numLoads)
+		numThreads = b->numLoads;
+	b->job = thr_spawn(numThreads, txm_loadWorker, b);
+	if (!b->job)
+		txm_loadWorker(b, 0);
+}
+
+static void txm_endLoad(txm t)
+{
+	txmload load = t->load;
+	if (load->tgaFile)
+		tga_destroy(load->tgaFile);
+	else if (load->data)
+		free(load->data);
+	free(load);
+	t->load = NULL;
+}
+
+int txm_update(int maxTextures)
+{
+	int i, numUploads = 0, numPending = 0;
+	txmbatch b, *bp;
+	txmload load;
+	txm t;
+
+	if (txmWaiting)
+		txm_startBatch();
+
+	bp = &txmBatches;
+	while ((b = *bp) != NULL) {
+		for (i = 0; i < b->numLoads; i++) {
+			t = b->texs[i];
+			load = t->load;
+			if (!load)
+				continue;
+			if (load->state != TXM_DECODED
+				|| (maxTextures > 0 && numUploads >= maxTextures)) {
+				numPending++;
+				continue;
+			}
+
+			/* Replace the placeholder, or keep it if the file failed */
+			if (load->data)
+				txm_setTexObject(t->texNum, load->data, load->w, load->h,
+						load->format, load->repeat, load->mipmap);
+			else
+				err_report("txm_update: cannot load %s", t->name);
+			txm_endLoad(t);
+			b->uploaded++;
+			numUploads++;
+		}
+
+		if (b->uploaded == b->numLoads) {
+			thr_join(b->job);
+			*bp = b->next;
+			free(b);
+		}
+		else
+			bp = &b->next;
+	}
+
+	return numPending + txmNumWaiting;
+}
+
+void txm_finish()
+{
+	txmbatch b;
+
+	if (txmWaiting)
+		txm_startBatch();
+	for (b = txmBatches; b; b = b->next) {
+		thr_join(b->job);
+		b->job = NULL;
+	}
+	txm_update(0);
+}
+
+/*
+ * Wait for the workers, then throw away anything not uploaded.
+ */
+static void txm_cancelLoads()
+{
+	int i;
+	txmbatch b;
+	txm t;
+
+	while (txmBatches) {
+		b = txmBatches;
+		txmBatches = b->next;
+		thr_join(b->job);
+		for (i = 0; i < b->numLoads; i++)
+			if (b->texs[i]->load)
+				txm_endLoad(b->texs[i]);
+		free(b);
+	}
+	while (txmWaiting) {
+		t = txmWaiting;
+		txmWaiting = t->load->waiting;
+		txm_endLoad(t);
+	}
+	txmNumWaiting = 0;
+}
+
 void txm_deleteTextures()
 {
+	txm_cancelLoads();
 	while(globalTexList) {
 		glDeleteTextures(1, &globalTexList->texNum);
 		txm_destroy(globalTexList);
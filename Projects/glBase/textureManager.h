@@ -32,6 +32,13 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 int txm_addRawFile(char *filename, int w, int h, int format, bool repeat, bool mipmap);
 int txm_addTgaFile(char *filename, bool alpha, bool repeat, bool mipmap);
 int txm_addRawData(unsigned char* data, int w, int h, int format, bool repeat, bool mipmap);
+
+/* Load in the background, see txm_update() */
+int txm_addRawFileAsync(char *filename, int w, int h, int format, bool repeat, bool mipmap);
+int txm_addTgaFileAsync(char *filename, bool alpha, bool repeat, bool mipmap);
+int txm_update(int maxTextures);
+void txm_finish();
+
 void txm_deleteTextures();
 
 #endif /* TEXTUREMANAGER_H */
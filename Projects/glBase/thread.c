@@ -0,0 +1,272 @@
+/*
+Copyright (C) 2000-2001 Adrian Welbourn
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+/*
+	File:		thread.c
+
+	Function:	simple worker threads - for spreading long precalculation
+				loops across all the CPUs. Uses Win32 threads on Windows
+				and pthreads elsewhere.
+
+				thr_run() starts numThreads copies of a worker function
+				and waits for them all to finish. The calling thread runs
+				worker 0 itself. Workers usually share out their work by
+				taking items from a counter with thr_atomicInc().
+
+				thr_spawn() does the same on a background thread so the
+				caller can carry on, e.g. rendering, and poll for the end
+				of the job with thr_isDone().
+*/
+
+#include "thread.h"
+#include "error.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#endif
+
+typedef struct thrarg_str {
+	thrfunc func;
+	void *arg;
+	int thread;
+} *thrarg;
+
+#ifdef WIN32
+static DWORD WINAPI thr_start(LPVOID p)
+{
+	thrarg a = (thrarg)p;
+	a->func(a->arg, a->thread);
+	return 0;
+}
+#else
+static void *thr_start(void *p)
+{
+	thrarg a = (thrarg)p;
+	a->func(a->arg, a->thread);
+	return NULL;
+}
+#endif
+
+/*
+ * Return the number of CPUs, clamped to THR_MAX_THREADS.
+ */
+int thr_numCPUs(void)
+{
+	int n;
+
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	n = (int)info.dwNumberOfProcessors;
+#else
+	n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+
+	if (n < 1)
+		n = 1;
+	if (n > THR_MAX_THREADS)
+		n = THR_MAX_THREADS;
+	return n;
+}
+
+/*
+ * Run func(arg, 0 .. numThreads - 1) in parallel and wait for them all.
+ * If a thread can't be started its work is done on the calling thread.
+ */
+void thr_run(int numThreads, thrfunc func, void *arg)
+{
+	struct thrarg_str a[THR_MAX_THREADS];
+#ifdef WIN32
+	HANDLE h[THR_MAX_THREADS];
+#else
+	pthread_t h[THR_MAX_THREADS];
+#endif
+	bool started[THR_MAX_THREADS];
+	int i;
+
+	if (numThreads > THR_MAX_THREADS)
+		numThreads = THR_MAX_THREADS;
+	if (numThreads <= 1) {
+		func(arg, 0);
+		return;
+	}
+
+	for (i = 1; i < numThreads; i++) {
+		a[i].func = func;
+		a[i].arg = arg;
+		a[i].thread = i;
+#ifdef WIN32
+		h[i] = CreateThread(NULL, 0, thr_start, &a[i], 0, NULL);
+		started[i] = (h[i] != NULL);
+#else
+		started[i] = (pthread_create(&h[i], NULL, thr_start, &a[i]) == 0);
+#endif
+		if (!started[i])
+			err_report("thr_run: cannot start thread %d", i);
+	}
+
+	func(arg, 0);
+
+	for (i = 1; i < numThreads; i++) {
+		if (started[i]) {
+#ifdef WIN32
+			WaitForSingleObject(h[i], INFINITE);
+			CloseHandle(h[i]);
+#else
+			pthread_join(h[i], NULL);
+#endif
+		}
+		else
+			func(arg, i);
+	}
+}
+
+/*
+ * Background jobs.
+ */
+struct thr_str {
+	thrfunc func;
+	void *arg;
+	int numThreads;
+	volatile long done;
+	bool started;
+#ifdef WIN32
+	HANDLE h;
+#else
+	pthread_t h;
+#endif
+};
+
+#ifdef WIN32
+static DWORD WINAPI thr_background(LPVOID p)
+{
+	thr t = (thr)p;
+	thr_run(t->numThreads, t->func, t->arg);
+	thr_atomicInc(&t->done);
+	return 0;
+}
+#else
+static void *thr_background(void *p)
+{
+	thr t = (thr)p;
+	thr_run(t->numThreads, t->func, t->arg);
+	thr_atomicInc(&t->done);
+	return NULL;
+}
+#endif
+
+/*
+ * Start thr_run(numThreads, func, arg) on a background thread and return
+ * at once. If the thread can't be started the job is run to completion on
+ * the calling thread. Returns NULL if out of memory.
+ */
+thr thr_spawn(int numThreads, thrfunc func, void *arg)
+{
+	thr t = (thr)malloc(sizeof(struct thr_str));
+	if (!t) {
+		err_report("thr_spawn: cannot allocate %d bytes",
+											sizeof(struct thr_str));
+		return NULL;
+	}
+	t->func = func;
+	t->arg = arg;
+	t->numThreads = numThreads;
+	t->done = 0;
+
+#ifdef WIN32
+	t->h = CreateThread(NULL, 0, thr_background, t, 0, NULL);
+	t->started = (t->h != NULL);
+#else
+	t->started = (pthread_create(&t->h, NULL, thr_background, t) == 0);
+#endif
+	if (!t->started) {
+		err_report("thr_spawn: cannot start thread");
+		thr_background(t);
+	}
+	return t;
+}
+
+/*
+ * Has the background job finished?
+ */
+bool thr_isDone(thr t)
+{
+	return !t || t->done != 0;
+}
+
+/*
+ * Wait for the background job to finish and free it.
+ */
+void thr_join(thr t)
+{
+	if (!t)
+		return;
+	if (t->started) {
+#ifdef WIN32
+		WaitForSingleObject(t->h, INFINITE);
+		CloseHandle(t->h);
+#else
+		pthread_join(t->h, NULL);
+#endif
+	}
+	free(t);
+}
+
+/*
+ * Atomically increment *v, returning the new value.
+ */
+long thr_atomicInc(volatile long *v)
+{
+#ifdef WIN32
+	return InterlockedIncrement((LONG*)v);
+#else
+	return __sync_add_and_fetch(v, 1);
+#endif
+}
+
+/*
+ * Atomically add n to *v, returning the old value.
+ */
+long thr_atomicAdd(volatile long *v, long n)
+{
+#ifdef WIN32
+	return InterlockedExchangeAdd((LONG*)v, n);
+#else
+	return __sync_fetch_and_add(v, n);
+#endif
+}
+
+/*
+ * Wall clock time in seconds, for timing parallel work.
+ */
+double thr_seconds(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER freq, count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (double)count.QuadPart / (double)freq.QuadPart;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1.0e-6;
+#endif
+}
@@ -0,0 +1,52 @@
+/*
+Copyright (C) 2000-2001 Adrian Welbourn
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+
+See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+
+*/
+/*
+	File:		thread.h
+
+	Function:	simple worker threads - for spreading long precalculation
+				loops across all the CPUs. Uses Win32 threads on Windows
+				and pthreads elsewhere.
+*/
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "general.h"
+
+#define THR_MAX_THREADS	32
+
+/* Worker function, thread is 0 .. numThreads - 1 */
+typedef void (*thrfunc)(void *arg, int thread);
+
+int  thr_numCPUs(void);
+void thr_run(int numThreads, thrfunc func, void *arg);
+
+/* Background job, thr_run() on a thread of its own */
+typedef struct thr_str *thr;
+
+thr  thr_spawn(int numThreads, thrfunc func, void *arg);
+bool thr_isDone(thr t);
+void thr_join(thr t);
+
+long thr_atomicInc(volatile long *v);
+long thr_atomicAdd(volatile long *v, long n);
+double thr_seconds(void);
+
+#endif /* THREAD_H */
@@ -34,6 +34,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "textureFont.h"
 #include "lscape.h"
 #include "tgafile.h"
+#include "thread.h"
 
 /*
  * Timer for fps
@@ -128,6 +129,13 @@ static bool lscDrawInfo = false;
  */
 static bool lscUseTextureCombine = true;
 
+/*
+ * Work out the landscape textures in the background, uploading at most
+ * lscTexUploadBytes per frame
+ */
+static bool lscAsyncTextures = true;
+static int  lscTexUploadBytes = 256 * 1024;
+
 /*
  * Draw any messages in the top left of the window
  */
@@ -240,6 +248,9 @@ unsigned char *loadHeightmap(void)
 
 void lscCleanup()
 {
+	/* The texture build reads the heightmap */
+	if (lscape && !sharing)
+		lsc_cancelTexObjs(lscape);
 	if (lscHm)
 		free(lscHm);
 	lscHm = NULL;
@@ -319,9 +330,14 @@ void lscInit()
 
 	/* Create or load textures */
 	if (lscape) {
-		lsc_createColourMapTexObjs(lscape, lscHm, 1.0f);
-		if (globalGL.numTextureUnits > 1)
-			lsc_createTextureSplatTexObjs(lscape, lscHm, 1.0f);
+		if (lscAsyncTextures)
+			lsc_startTexObjs(lscape, lscHm, 1.0f,
+								globalGL.numTextureUnits > 1);
+		else {
+			lsc_createColourMapTexObjs(lscape, lscHm, 1.0f);
+			if (globalGL.numTextureUnits > 1)
+				lsc_createTextureSplatTexObjs(lscape, lscHm, 1.0f);
+		}
 	}
 
 	/* Create or load occlusion data */
@@ -352,6 +368,192 @@ bool lscCollisionCheck(vec3 *p, bbox entBox, float *frac, plane collisionPlane)
 	return false;
 }
 
+/*
+ * Fire a batch of random segments down at the landscape around the camera
+ * and time lsc_checkCollision() one segment at a time against
+ * lsc_checkCollisionBatch().
+ */
+#define LSC_BENCH_RAYS	100000
+
+static void lscCollisionBenchmark(void)
+{
+	struct bbox_str point = {{0, 0, 0}, {0, 0, 0}};
+	struct plane_str collision;
+	lscray rays;
+	bool *hit;
+	cam camera = cam_getGlobalCamera();
+	float range = 0.25f * lscHmSz * lscScale[0];
+	float frac;
+	vec3 p[2];
+	double t0, t1, t2;
+	int i, hits1 = 0, hits2, differ = 0;
+
+	if (!lscape || !lscape->data)
+		return;
+
+	rays = (lscray)malloc(LSC_BENCH_RAYS * sizeof(struct lscray_str));
+	hit = (bool *)malloc(LSC_BENCH_RAYS * sizeof(bool));
+	if (!rays || !hit) {
+		free(rays);
+		free(hit);
+		return;
+	}
+
+	srand(1);
+	for (i = 0; i < LSC_BENCH_RAYS; i++) {
+		rays[i].p[0][0] = camera->viewPt.origin[0] +
+							range * (rand() / (float)RAND_MAX - 0.5f);
+		rays[i].p[0][1] = camera->viewPt.origin[1] +
+							range * (rand() / (float)RAND_MAX - 0.5f);
+		rays[i].p[0][2] = 256.0f * lscScale[2];
+		rays[i].p[1][0] = rays[i].p[0][0] +
+							0.1f * range * (rand() / (float)RAND_MAX - 0.5f);
+		rays[i].p[1][1] = rays[i].p[0][1] +
+							0.1f * range * (rand() / (float)RAND_MAX - 0.5f);
+		rays[i].p[1][2] = (rand() / (float)RAND_MAX) * 256.0f * lscScale[2];
+	}
+
+	t0 = thr_seconds();
+	for (i = 0; i < LSC_BENCH_RAYS; i++) {
+		vec3_cpy(rays[i].p[0], p[0]);
+		vec3_cpy(rays[i].p[1], p[1]);
+		frac = 1.0f;
+		hit[i] = lsc_checkCollision(lscape, p, &point, &frac, &collision);
+		if (hit[i])
+			hits1++;
+	}
+	t1 = thr_seconds();
+	hits2 = lsc_checkCollisionBatch(lscape, rays, LSC_BENCH_RAYS);
+	t2 = thr_seconds();
+
+	for (i = 0; i < LSC_BENCH_RAYS; i++)
+		if (hit[i] != rays[i].hit)
+			differ++;
+
+	printf("Collision benchmark, %d rays:\n", LSC_BENCH_RAYS);
+	printf("  single: %d hits, %.0f rays/sec\n", hits1,
+							LSC_BENCH_RAYS / (t1 - t0 > 0.0 ? t1 - t0 : 1e-6));
+	printf("  batch:  %d hits, %.0f rays/sec, %d differ\n", hits2,
+							LSC_BENCH_RAYS / (t2 - t1 > 0.0 ? t2 - t1 : 1e-6),
+							differ);
+	fflush(stdout);
+
+	free(rays);
+	free(hit);
+}
+
+/*
+ * Stress test the shared patch cache from several threads, then compare its
+ * miss and thrash rates with an ordinary cache. Each frame works through a
+ * window of cache owners that slides along a ring, like patches coming into
+ * and going out of view, and then checks every object in the window is
+ * still intact.
+ */
+#define LSC_CCH_SIZE	(1024 * 1024)
+#define LSC_CCH_OWNERS	8192
+#define LSC_CCH_FRAMES	1000
+
+typedef struct lsccchtest_str {
+	cch c;
+	cchobj owners[LSC_CCH_OWNERS];
+	int first, count;			/* Window of owners this frame */
+	volatile long next;
+	volatile long misses;
+} *lsccchtest;
+
+#define lscCacheObjSize(o)	((((o) * 7) % 8 + 1) * 128)
+#define LSC_CCH_AVG_OBJ		576		/* Mean of lscCacheObjSize() */
+
+static void lscCacheWorker(void *arg, int thread)
+{
+	lsccchtest t = (lsccchtest)arg;
+	unsigned int *p;
+	long i;
+	int o, k;
+
+	while ((i = thr_atomicInc(&t->next) - 1) < t->count) {
+		o = (t->first + i) % LSC_CCH_OWNERS;
+		if (!cch_valid(t->c, &t->owners[o])) {
+			p = (unsigned int *)cch_malloc(t->c, lscCacheObjSize(o),
+														&t->owners[o]);
+			for (k = 0; k < lscCacheObjSize(o) / 4; k++)
+				p[k] = o * 2654435761u + k;
+			thr_atomicInc(&t->misses);
+		}
+	}
+}
+
+static void lscCacheRun(lsccchtest t, bool shared, int numThreads, int window)
+{
+	int frame, i, o, k, thrashed = 0, errors = 0;
+	unsigned int *p;
+	double t0, t1;
+
+	memset(t->owners, 0, sizeof(t->owners));
+	t->c = cch_create(0, false);
+	if (!t->c)
+		return;
+	t->c->shared = shared;
+	cch_init(t->c, LSC_CCH_SIZE);
+	t->misses = 0;
+
+	srand(1);
+	t0 = thr_seconds();
+	for (frame = 0; frame < LSC_CCH_FRAMES; frame++) {
+		cch_initFrame(t->c);
+		t->first = (frame * window / 32 + rand() % 16) % LSC_CCH_OWNERS;
+		t->count = window;
+		t->next = 0;
+		thr_run(numThreads, lscCacheWorker, t);
+		if (cch_thrashed(t->c)) {
+			thrashed++;
+			continue;
+		}
+		for (i = 0; i < window; i++) {
+			o = (t->first + i) % LSC_CCH_OWNERS;
+			p = (unsigned int *)t->owners[o]->data;
+			for (k = 0; k < lscCacheObjSize(o) / 4; k++)
+				if (p[k] != o * 2654435761u + k)
+					break;
+			if (!cch_valid(t->c, &t->owners[o]) ||
+					k < lscCacheObjSize(o) / 4)
+				errors++;
+		}
+	}
+	t1 = thr_seconds();
+
+	printf("  %s, %2d threads: %5.1f%% misses, %5.1f%% frames thrashed, "
+			"%d errors, %.0f allocs/sec\n",
+			shared ? "shared" : "single", numThreads,
+			100.0 * t->misses / ((double)window * LSC_CCH_FRAMES),
+			100.0 * thrashed / LSC_CCH_FRAMES, errors,
+			t->misses / (t1 - t0 > 0.0 ? t1 - t0 : 1e-6));
+	fflush(stdout);
+
+	cch_destroy(t->c);
+}
+
+static void lscCacheBenchmark(void)
+{
+	lsccchtest t = (lsccchtest)malloc(sizeof(struct lsccchtest_str));
+	int window, bytes;
+
+	if (!t)
+		return;
+
+	printf("Patch cache benchmark, %dk cache, %d frames:\n",
+									LSC_CCH_SIZE / 1024, LSC_CCH_FRAMES);
+	for (bytes = LSC_CCH_SIZE / 8; bytes <= LSC_CCH_SIZE; bytes *= 2) {
+		window = bytes / (LSC_CCH_AVG_OBJ + sizeof(struct cchobj_str));
+		printf(" working set %dk:\n", bytes / 1024);
+		lscCacheRun(t, false, 1, window);
+		lscCacheRun(t, true, 1, window);
+		lscCacheRun(t, true, thr_numCPUs(), window);
+	}
+
+	free(t);
+}
+
 void lscDraw(cam camera, int win_height)
 {
 	struct fru_str frustum;
@@ -359,6 +561,9 @@ void lscDraw(cam camera, int win_height)
 	/* Draw the landscape */
 	if (lscape && lscape->data) {
 
+		/* Upload any textures finished in the background */
+		lsc_updateTexObjs(lscape, lscTexUploadBytes);
+
 		/* Set up the view frustum */
 		fru_init(&frustum, camera);
 
@@ -536,6 +741,16 @@ void appKey(unsigned char key, int x, int y)
 		appReInit();
 		break;
 
+	case 'b':
+	case 'B':
+		lscCollisionBenchmark();
+		break;
+
+	case 'k':
+	case 'K':
+		lscCacheBenchmark();
+		break;
+
 	case 't':
 	case 'T':
 		lscUseTextureCombine = !lscUseTextureCombine;
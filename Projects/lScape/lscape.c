@@ -47,6 +47,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "lscape.h"
 #include "opengl.h"
+#include "thread.h"
 
 /*
  * Calculate the number of geoMipmap levels for a patch.
@@ -108,12 +109,20 @@ static void lsc_allocMem(lsc l)
 	/* patch error arrays */
 	l->patchErrArrSz = (numLevels * sizeof(float) + 15) & ~15;
 
-	space += (numPatchIdxs * sizeof(unsigned short) + 15) & ~15;
+	space += (numPatchIdxs * sizeof(lscidx) + 15) & ~15;
 	space += (numPatchesInHeightMap * sizeof(cchobj) + 15) & ~15;
+	space += (numPatchesInHeightMap * sizeof(int) + 15) & ~15;
+	space += (numPatchesInHeightMap * sizeof(struct lscvtxjob_str) + 15) & ~15;
 	space += numPatchesInHeightMap * l->patchErrArrSz;
 	space += (numPatchesInLandscape * sizeof(cchobj) + 15) & ~15;
 	space += (numNodesInLandscape * sizeof(int) + 15) & ~15;
+	space += (2 * numPatchesInLandscape * sizeof(struct lscclipnode_str)
+																+ 15) & ~15;
+	space += (6 * numPatchesInLandscape * sizeof(float) + 15) & ~15;
+	space += (numPatchesInLandscape * sizeof(int) + 15) & ~15;
 	space += (numPatchesInLandscape * sizeof(struct lscpatch_str) + 15) & ~15;
+	space += (numPatchesInLandscape * sizeof(struct lscvispatch_str)
+																+ 15) & ~15;
 	space += (2 * l->sectors * sizeof(float) + 15) & ~15;
 	space += (numNodesInHeightMap * l->sectors * l->maxOccPts *
 												2 * sizeof(int) + 15) & ~15;
@@ -130,12 +139,20 @@ static void lsc_allocMem(lsc l)
 
 	d = (unsigned char*)((int)(l->data + 15) & ~15);
 
-	l->patchIdx = (unsigned short*)d;
-	d += (numPatchIdxs * sizeof(unsigned short) + 15) & ~15;
+	l->patchIdx = (lscidx*)d;
+	d += (numPatchIdxs * sizeof(lscidx) + 15) & ~15;
 
 	l->patchVtxPtr = (cchobj*)d;
 	d += (numPatchesInHeightMap * sizeof(cchobj) + 15) & ~15;
 
+	l->patchVtxFrame = (int*)d;
+	d += (numPatchesInHeightMap * sizeof(int) + 15) & ~15;
+
+	l->vtxJobs = (lscvtxjob)d;
+	d += (numPatchesInHeightMap * sizeof(struct lscvtxjob_str) + 15) & ~15;
+	l->numVtxJobs = 0;
+	l->vtxFrame = 1;
+
 	l->patchErrArr = (float*)d;
 	d += numPatchesInHeightMap * l->patchErrArrSz;
 
@@ -145,19 +162,36 @@ static void lsc_allocMem(lsc l)
 	l->patches = (lscpatch)d;
 	d += (numPatchesInLandscape * sizeof(struct lscpatch_str) + 15) & ~15;
 
+	l->visPatches = (lscvispatch)d;
+	d += (numPatchesInLandscape * sizeof(struct lscvispatch_str)
+																+ 15) & ~15;
+	l->numVisPatches = 0;
+
 	l->quadtree = (int*)d;
 	d += (numNodesInLandscape * sizeof(int) + 15) & ~15;
 
+	/* No quadtree level has more nodes than there are patches */
+	l->clipNodes = (lscclipnode)d;
+	d += (2 * numPatchesInLandscape * sizeof(struct lscclipnode_str)
+																+ 15) & ~15;
+
+	l->clipBoxes = (float*)d;
+	d += (6 * numPatchesInLandscape * sizeof(float) + 15) & ~15;
+
+	l->clipFlags = (int*)d;
+	d += (numPatchesInLandscape * sizeof(int) + 15) & ~15;
+
 	l->sectorTrig = (float*)d;
 	d += (2 * l->sectors * sizeof(float) + 15) & ~15;
 
-	l->occPts = (int*)d;
+	l->occPts = l->occPtsMem = (int*)d;
 	d += (numNodesInHeightMap * l->sectors * l->maxOccPts *
 										2 * sizeof(int) + 15) & ~15;
 
 	/* Allow for indexing the arrays from the top of the quadtree */
 	diff = lsc_countNodes(l, l->hmSize >> 1);
 	l->patchVtxPtr = lsc_getPatchVtxPtr(l, -diff);
+	l->patchVtxFrame -= diff;
 	l->patchErrArr = lsc_getPatchErrArr(l, -diff);
 	diff = lsc_countNodes(l, (l->hmSize * l->hmTile) >> 1);
 	l->patchIdxPtr = lsc_getPatchIdxPtr(l, -diff);
@@ -171,10 +205,21 @@ static void lsc_allocMem(lsc l)
 	l->patchVtxCch.fast = false;
 #endif
 
+	/*
+	 * Build vertex arrays on worker threads if there is more than one CPU,
+	 * but only if there is no fast memory, which a shared cache can't use.
+	 * Whether there is any is only known once cch_init() has tried for it.
+	 */
+	l->patchVtxCch.shared = false;
 	cch_init(&l->patchVtxCch, l->patchVtxCchSz);
-	printf("Created %dk patch vertex array cache in %s memory\n",
+	if (!l->patchVtxCch.fast && thr_numCPUs() > 1) {
+		l->patchVtxCch.shared = true;
+		cch_init(&l->patchVtxCch, l->patchVtxCchSz);
+	}
+	printf("Created %dk patch vertex array cache in %s memory%s\n",
 								(l->patchVtxCch.size + 1023)/1024,
-								l->patchVtxCch.fast ? "fast" : "system");
+								l->patchVtxCch.fast ? "fast" : "system",
+								l->patchVtxCch.shared ? ", shared" : "");
 	fflush(stdout);
 
 	/* Create the patch index array cache */
@@ -194,17 +239,17 @@ static void lsc_setupPatchIdx(lsc l)
 {
 	int i, j, k = 0;
 	int patchSize = l->patchSize;
-	unsigned short *idx, *patchIdx = l->patchIdx;
+	lscidx *idx, *patchIdx = l->patchIdx;
 	int step = patchSize;
 
 	j = SQR(patchSize + 1);
 	for (i = 0; i < j; i++)
-		patchIdx[i] = 0xFFFF;
+		patchIdx[i] = LSC_IDX_NONE;
 	while (step > 0) {
 		for (j = 0; j <= patchSize; j += step) {
 			for (i = 0; i <= patchSize; i += step) {
 				idx = &patchIdx[j*(patchSize + 1) + i];
-				if (*idx == 0xFFFF)
+				if (*idx == LSC_IDX_NONE)
 					*idx = k++;
 			}
 		}
@@ -228,7 +273,7 @@ static void lsc_setupPatchVtxArr(lsc l, int m,
 	float baseTexScale = (float)l->baseTexTile / (float)l->hmSize;
 	int S = x0 % (l->hmSize / l->texTile);
 	int T = y0 % (l->hmSize / l->texTile);
-	unsigned short *patchIdx = l->patchIdx;
+	lscidx *patchIdx = l->patchIdx;
 
 	if (hm)
 		hm = &hm[x0 + y0*(hmSize+1)];
@@ -277,7 +322,7 @@ float *lsc_getPatchVtxArr(lsc l, int m,
 	 */
 
 	/* Check if this cache object is valid */
-	if (!(*obj) || (*obj)->owner != obj) {
+	if (!cch_valid(&l->patchVtxCch, obj)) {
 
 		/* Not valid, allocate cache object and rebuild array */
 
@@ -310,13 +355,77 @@ float *lsc_getPatchVtxArrCollisionDetect(lsc l, int m,
 	return lsc_getPatchVtxArr(l, m, x0, x1, y0, y1);
 }
 
+/*
+ * Queue a patch vertex array to be built by lsc_buildPatchVtxArrs(), unless
+ * it is already cached or queued this frame (heightmap tiles share arrays).
+ */
+void lsc_queuePatchVtxArr(lsc l, int m, int x0, int x1, int y0, int y1)
+{
+	lscvtxjob job;
+
+	if (l->patchVtxFrame[m] == l->vtxFrame)
+		return;
+	l->patchVtxFrame[m] = l->vtxFrame;
+
+	if (cch_valid(&l->patchVtxCch, lsc_getPatchVtxPtr(l,m)))
+		return;
+
+	job = &l->vtxJobs[l->numVtxJobs++];
+	job->m = m;
+	job->x0 = x0;
+	job->x1 = x1;
+	job->y0 = y0;
+	job->y1 = y1;
+}
+
+/*
+ * Worker thread, builds queued vertex arrays until there are none left.
+ */
+static void lsc_vtxWorker(void *arg, int thread)
+{
+	lsc l = (lsc)arg;
+	lscvtxjob job;
+	long i;
+
+	while ((i = thr_atomicInc(&l->nextVtxJob) - 1) < l->numVtxJobs) {
+		job = &l->vtxJobs[i];
+		lsc_getPatchVtxArr(l, job->m, job->x0, job->x1, job->y0, job->y1);
+	}
+}
+
+/*
+ * Build the queued patch vertex arrays, on worker threads if the vertex
+ * array cache is shared, and start a new queue.
+ */
+#define LSC_VTX_JOBS_PER_THREAD	4
+
+void lsc_buildPatchVtxArrs(lsc l)
+{
+	int numThreads = 1;
+
+	if (l->patchVtxCch.shared) {
+		numThreads = l->numVtxJobs / LSC_VTX_JOBS_PER_THREAD;
+		if (numThreads > thr_numCPUs())
+			numThreads = thr_numCPUs();
+	}
+
+	l->nextVtxJob = 0;
+	if (numThreads > 1)
+		thr_run(numThreads, lsc_vtxWorker, l);
+	else
+		lsc_vtxWorker(l, 0);
+
+	l->numVtxJobs = 0;
+	l->vtxFrame++;
+}
+
 /*
  * Calculate the error for a patch at a given level.
  */
 static float lsc_calcError(lsc l, int level, float *vtxArr)
 {
 	int step, limiti, limitj, patchSize = l->patchSize;
-	unsigned short *patchIdx = l->patchIdx;
+	lscidx *patchIdx = l->patchIdx;
 	int i0, i1, i2, j0, j1, j2, count = 0;
 	float z[4], zsl, zsr, zsa, zl, zr, za, zreal;
 	float err = 0.0f;
@@ -439,8 +548,8 @@ static void lsc_setupPatchErrArr(lsc l)
 /*
  * Write a horizontal triangle strip into a patch index array.
  */
-static int lsc_acrossStrip(unsigned short *patchIdx, int patchSize,
-							unsigned short *triIdx, int *idx,
+static int lsc_acrossStrip(lscidx *patchIdx, int patchSize,
+							lscidx *triIdx, int *idx,
 							int startx, int starty, int step, int end)
 {
 	int i, j0 = starty, j1 = starty + step, k = *idx, n = 0;
@@ -463,8 +572,8 @@ static int lsc_acrossStrip(unsigned short *patchIdx, int patchSize,
 /*
  * Write a vertical triangle strip into a patch index array.
  */
-static int lsc_downStrip(unsigned short *patchIdx, int patchSize,
-							unsigned short *triIdx, int *idx,
+static int lsc_downStrip(lscidx *patchIdx, int patchSize,
+							lscidx *triIdx, int *idx,
 							int startx, int starty, int step, int end)
 {
 	int i0 = startx, i1 = startx + step, j, k = *idx, n = 0;
@@ -488,8 +597,8 @@ static int lsc_downStrip(unsigned short *patchIdx, int patchSize,
  * Write the bottom row of triangle fans into a patch index array, to glue
  * the patch to a neighbour at a higher mip level.
  */
-static int lsc_bottomFans(unsigned short *patchIdx, int patchSize,
-							unsigned short *triIdx, int *idx,
+static int lsc_bottomFans(lscidx *patchIdx, int patchSize,
+							lscidx *triIdx, int *idx,
 							int minLevel, int maxLevel)
 {
 	int maxPoints = patchSize >> minLevel;
@@ -520,8 +629,8 @@ static int lsc_bottomFans(unsigned short *patchIdx, int patchSize,
  * Write the top row of triangle fans into a patch index array, to glue
  * the patch to a neighbour at a higher mip level.
  */
-static int lsc_topFans(unsigned short *patchIdx, int patchSize,
-							unsigned short *triIdx, int *idx,
+static int lsc_topFans(lscidx *patchIdx, int patchSize,
+							lscidx *triIdx, int *idx,
 							int minLevel, int maxLevel)
 {
 	int maxPoints = patchSize >> minLevel;
@@ -553,8 +662,8 @@ static int lsc_topFans(unsigned short *patchIdx, int patchSize,
  * Write the right column of triangle fans into a patch index array, to glue
  * the patch to a neighbour at a higher mip level.
  */
-static int lsc_rightFans(unsigned short *patchIdx, int patchSize,
-							unsigned short *triIdx, int *idx,
+static int lsc_rightFans(lscidx *patchIdx, int patchSize,
+							lscidx *triIdx, int *idx,
 							int minLevel, int maxLevel)
 {
 	int maxPoints = patchSize >> minLevel;
@@ -585,8 +694,8 @@ static int lsc_rightFans(unsigned short *patchIdx, int patchSize,
  * Write the left column of triangle fans into a patch index array, to glue
  * the patch to a neighbour at a higher mip level.
  */
-static int lsc_leftFans(unsigned short *patchIdx, int patchSize,
-							unsigned short *triIdx, int *idx,
+static int lsc_leftFans(lscidx *patchIdx, int patchSize,
+							lscidx *triIdx, int *idx,
 							int minLevel, int maxLevel)
 {
 	int maxPoints = patchSize >> minLevel;
@@ -613,19 +722,350 @@ static int lsc_leftFans(unsigned short *patchIdx, int patchSize,
 	return n;
 }
 
+/*
+ * Vertex cache optimisation.
+ *
+ * The strips and fans above are written out row by row, so by the time a
+ * strip comes back along the next row the vertexes it shares with the row
+ * before have long since dropped out of the post-transform vertex cache.
+ * We reorder the triangles with Tom Forsyth's "Linear-Speed Vertex Cache
+ * Optimisation": each vertex gets a score from its position in a modelled
+ * LRU cache and from how many triangles still need it, and we greedily
+ * output the triangle with the best total score, preferring triangles that
+ * use vertexes already in the cache.
+ */
+
+#define LSC_VCO_CACHE_SIZE		32
+#define LSC_VCO_DECAY_POWER		1.5f
+#define LSC_VCO_LAST_TRI_SCORE	0.75f
+#define LSC_VCO_VALENCE_SCALE	2.0f
+#define LSC_VCO_VALENCE_POWER	0.5f
+#define LSC_VCO_MAX_VALENCE		32	/* Size of valence score table */
+
+#define LSC_ACMR_FIFO_SIZE		16	/* Cache size used to report ACMR */
+
+/*
+ * Most memory for the index arrays optimised at setup. Levels whose arrays
+ * don't all fit are optimised each time they are rebuilt.
+ */
+#define LSC_VCO_ARRS_SIZE		(4*1024*1024)
+
+typedef struct lscvco_str {
+	int maxVtxs, maxTris;
+	int *active;				/* Triangles still to output per vertex */
+	int *adjStart;				/* Start of vertex's list in adj */
+	int *adj;					/* Triangles using each vertex */
+	int *cachePos;				/* Position in modelled cache, or -1 */
+	float *vtxScore;
+	float *triScore;
+	unsigned char *triDone;
+	lscidx *out;
+	float cacheScore[LSC_VCO_CACHE_SIZE];
+	float valenceScore[LSC_VCO_MAX_VALENCE];
+} *lscvco;
+
+/*
+ * Allocate the vertex cache optimiser work space, big enough for a
+ * level 0 patch.
+ */
+static lscvco lsc_createVco(int patchSize)
+{
+	int i;
+	int maxVtxs = lsc_numPatchVtxs(patchSize, 0);
+	int maxTris = lsc_numPatchTris(patchSize, 0);
+	size_t space = sizeof(struct lscvco_str);
+	unsigned char *d;
+	lscvco v;
+
+	space += (4 * maxVtxs + 1) * sizeof(int);
+	space += 3 * maxTris * sizeof(int);
+	space += (maxVtxs + maxTris) * sizeof(float);
+	space += 3 * maxTris * sizeof(lscidx);
+	space += maxTris;
+
+	d = (unsigned char*)malloc(space);
+	if (!d)
+		return NULL;
+
+	v = (lscvco)d;
+	d += sizeof(struct lscvco_str);
+	v->maxVtxs = maxVtxs;
+	v->maxTris = maxTris;
+	v->active = (int*)d;		d += maxVtxs * sizeof(int);
+	v->adjStart = (int*)d;		d += (maxVtxs + 1) * sizeof(int);
+	v->cachePos = (int*)d;		d += maxVtxs * sizeof(int);
+	v->adj = (int*)d;			d += 3 * maxTris * sizeof(int);
+	v->vtxScore = (float*)d;	d += maxVtxs * sizeof(float);
+	v->triScore = (float*)d;	d += maxTris * sizeof(float);
+	v->out = (lscidx*)d;		d += 3 * maxTris * sizeof(lscidx);
+	v->triDone = d;
+
+	/* Score tables */
+	for (i = 0; i < LSC_VCO_CACHE_SIZE; i++) {
+		if (i < 3) {
+			/*
+			 * The vertexes of the triangle we just output get a fixed
+			 * score, so we don't favour any one of them.
+			 */
+			v->cacheScore[i] = LSC_VCO_LAST_TRI_SCORE;
+		}
+		else {
+			v->cacheScore[i] = (float)pow(1.0f - (float)(i - 3) /
+									(LSC_VCO_CACHE_SIZE - 3),
+									LSC_VCO_DECAY_POWER);
+		}
+	}
+	v->valenceScore[0] = 0.0f;
+	for (i = 1; i < LSC_VCO_MAX_VALENCE; i++)
+		v->valenceScore[i] = LSC_VCO_VALENCE_SCALE *
+							(float)pow(i, -LSC_VCO_VALENCE_POWER);
+
+	return v;
+}
+
+/*
+ * Score a vertex.
+ */
+static float lsc_vcoScore(lscvco v, int k)
+{
+	int n = v->active[k];
+	float score;
+
+	/* No triangles left to use it, so it doesn't matter */
+	if (n == 0)
+		return -1.0f;
+
+	score = v->cachePos[k] >= 0 ? v->cacheScore[v->cachePos[k]] : 0.0f;
+
+	/* Boost vertexes with few triangles left, to get rid of them */
+	if (n < LSC_VCO_MAX_VALENCE)
+		score += v->valenceScore[n];
+	else
+		score += LSC_VCO_VALENCE_SCALE * (float)pow(n, -LSC_VCO_VALENCE_POWER);
+
+	return score;
+}
+
+/*
+ * Reorder the triangles in a patch index array for the vertex cache.
+ * triIdx is laid out as built by lsc_setupPatchIdxArr: the triangle count
+ * followed by the triangle list.
+ */
+void lsc_optimizeVtxCache(lsc l, lscidx *triIdx)
+{
+	lscvco v = (lscvco)l->vco;
+	int numTris = (int)triIdx[0];
+	lscidx *tris = triIdx + 1;
+	int cache[LSC_VCO_CACHE_SIZE + 3];
+	int newCache[LSC_VCO_CACHE_SIZE + 3];
+	int cacheCount = 0, newCount;
+	int numVtxs = 0, numOut = 0, scan = 0;
+	int i, j, k, t, best;
+	float bestScore;
+
+	if (!v || numTris < 2 || numTris > v->maxTris)
+		return;
+
+	/* Vertexes used at level L all come before those only used below it */
+	for (i = 0; i < 3*numTris; i++) {
+		if ((int)tris[i] >= numVtxs)
+			numVtxs = tris[i] + 1;
+	}
+	if (numVtxs > v->maxVtxs)
+		return;
+
+	/* Build the vertex to triangle adjacency lists */
+	memset(v->active, 0, numVtxs * sizeof(int));
+	for (i = 0; i < 3*numTris; i++)
+		v->active[tris[i]]++;
+
+	v->adjStart[0] = 0;
+	for (k = 0; k < numVtxs; k++) {
+		v->adjStart[k + 1] = v->adjStart[k] + v->active[k];
+		v->active[k] = 0;
+		v->cachePos[k] = -1;
+	}
+	for (t = 0; t < numTris; t++) {
+		for (j = 0; j < 3; j++) {
+			k = tris[3*t + j];
+			v->adj[v->adjStart[k] + v->active[k]++] = t;
+		}
+	}
+
+	for (k = 0; k < numVtxs; k++)
+		v->vtxScore[k] = lsc_vcoScore(v, k);
+
+	for (t = 0; t < numTris; t++) {
+		v->triScore[t] = v->vtxScore[tris[3*t]] + v->vtxScore[tris[3*t + 1]]
+											+ v->vtxScore[tris[3*t + 2]];
+		v->triDone[t] = 0;
+	}
+
+	best = -1;
+	while (numOut < numTris) {
+
+		/*
+		 * If nothing in the cache has triangles left, just take the best
+		 * remaining triangle. This only happens at the start and when we
+		 * run off the end of a disconnected piece of the patch.
+		 */
+		if (best < 0) {
+			bestScore = -1.0f;
+			while (v->triDone[scan])
+				scan++;
+			for (t = scan; t < numTris; t++) {
+				if (!v->triDone[t] && v->triScore[t] > bestScore) {
+					bestScore = v->triScore[t];
+					best = t;
+				}
+			}
+		}
+
+		/* Output the triangle */
+		t = best;
+		v->triDone[t] = 1;
+		v->out[3*numOut] = tris[3*t];
+		v->out[3*numOut + 1] = tris[3*t + 1];
+		v->out[3*numOut + 2] = tris[3*t + 2];
+		numOut++;
+
+		/* Move its vertexes to the front of the cache */
+		newCount = 0;
+		for (j = 0; j < 3; j++) {
+			int a, *list;
+
+			k = tris[3*t + j];
+			newCache[newCount++] = k;
+
+			/* Remove the triangle from the vertex's list */
+			list = &v->adj[v->adjStart[k]];
+			for (a = 0; a < v->active[k]; a++) {
+				if (list[a] == t) {
+					list[a] = list[--v->active[k]];
+					break;
+				}
+			}
+		}
+		for (i = 0; i < cacheCount; i++) {
+			k = cache[i];
+			if (k != newCache[0] && k != newCache[1] && k != newCache[2])
+				newCache[newCount++] = k;
+		}
+
+		/* Rescore cached vertexes and anything that just fell out */
+		cacheCount = MIN(newCount, LSC_VCO_CACHE_SIZE);
+		for (i = 0; i < newCount; i++) {
+			k = newCache[i];
+			cache[i] = k;
+			v->cachePos[k] = i < LSC_VCO_CACHE_SIZE ? i : -1;
+			v->vtxScore[k] = lsc_vcoScore(v, k);
+		}
+
+		/* Rescore their triangles and pick the next one */
+		best = -1;
+		bestScore = -1.0f;
+		for (i = 0; i < cacheCount; i++) {
+			int a, *list;
+
+			k = cache[i];
+			list = &v->adj[v->adjStart[k]];
+			for (a = 0; a < v->active[k]; a++) {
+				int u = list[a];
+				float score = v->vtxScore[tris[3*u]]
+								+ v->vtxScore[tris[3*u + 1]]
+								+ v->vtxScore[tris[3*u + 2]];
+				v->triScore[u] = score;
+				if (score > bestScore) {
+					bestScore = score;
+					best = u;
+				}
+			}
+		}
+	}
+
+	memcpy(tris, v->out, 3 * numTris * sizeof(lscidx));
+}
+
+/*
+ * Calculate the average cache miss ratio (transformed vertexes per
+ * triangle) of a patch index array for a FIFO vertex cache.
+ */
+float lsc_calcACMR(lscidx *triIdx, int fifoSize)
+{
+	int numTris = (int)triIdx[0];
+	lscidx *tris = triIdx + 1;
+	lscidx fifo[64];
+	int i, j, head = 0, count = 0, misses = 0;
+
+	if (numTris <= 0)
+		return 0.0f;
+	if (fifoSize > 64)
+		fifoSize = 64;
+
+	for (i = 0; i < 3*numTris; i++) {
+		for (j = 0; j < count; j++) {
+			if (fifo[j] == tris[i])
+				break;
+		}
+		if (j == count) {
+			/* Miss - push into the FIFO */
+			misses++;
+			if (count < fifoSize)
+				fifo[count++] = tris[i];
+			else {
+				fifo[head] = tris[i];
+				head = (head + 1) % fifoSize;
+			}
+		}
+	}
+
+	return (float)misses / (float)numTris;
+}
+
+/*
+ * Find the slot in vcoIdxArrs for level L and neighbour levels nL. All
+ * neighbour levels at or below L give the same index array, so each
+ * neighbour counts as one of the numLevels - L levels from L up.
+ */
+static int lsc_vcoIdxSlot(lsc l, int L, int nL)
+{
+	int j, b, k = 0, slot = 0;
+
+	for (j = 0; j < L; j++) {
+		b = l->numLevels - j;
+		slot += b*b*b*b;
+	}
+
+	b = l->numLevels - L;
+	for (j = 3; j >= 0; j--) {
+		int e = ((nL >> (j*8)) & 0xFF) - L;
+		k = k*b + (e > 0 ? e : 0);
+	}
+	return slot + k;
+}
+
 /*
  * Calculate the index array for patch at geomip level L, taking into account
  * the mip levels of its neighbour patches.
  */
 static void lsc_setupPatchIdxArr(lsc l, int n, int L, int nL,
-								 unsigned short *triIdx)
+								 lscidx *triIdx)
 {
 	int j, k = 1, N = 0;
 	int patchSize = l->patchSize;
-	unsigned short *patchIdx = l->patchIdx;
+	lscidx *patchIdx = l->patchIdx;
 	int step = 1 << L;
 	int numTriangles = 0;
 
+	/* Copy the array if it was optimised at setup */
+	if (l->vcacheOpt && l->vcoIdxArrs) {
+		lscidx *arr = l->vcoIdxArrs[lsc_vcoIdxSlot(l, L, nL)];
+		if (arr) {
+			memcpy(triIdx, arr, (3*(int)arr[0] + 1) * sizeof(lscidx));
+			return;
+		}
+	}
+
 	for (j = 0; j < 4; j++) {
 		if (((nL >> (j*8)) & 0xFF) > L)
 			N |= 0x01 << j;
@@ -757,16 +1197,114 @@ static void lsc_setupPatchIdxArr(lsc l, int n, int L, int nL,
 		}
 	}
 
-	triIdx[0] = (unsigned short)numTriangles;
+	triIdx[0] = (lscidx)numTriangles;
+
+	if (l->vcacheOpt)
+		lsc_optimizeVtxCache(l, triIdx);
+}
+
+/*
+ * Print the vertex cache performance of the patch index arrays at each
+ * level, before and after optimisation.
+ */
+static void lsc_reportACMR(lsc l)
+{
+	int L;
+	bool vcacheOpt = l->vcacheOpt;
+	lscidx *triIdx = (lscidx*)malloc((3*lsc_numPatchTris(l->patchSize, 0) + 1)
+														* sizeof(lscidx));
+	if (!triIdx)
+		return;
+
+	printf("Patch index ACMR (%d entry FIFO):\n", LSC_ACMR_FIFO_SIZE);
+	for (L = 0; L < l->numLevels; L++) {
+		int nL = L | (L << 8) | (L << 16) | (L << 24);
+		float before, after;
+
+		l->vcacheOpt = false;
+		lsc_setupPatchIdxArr(l, 0, L, nL, triIdx);
+		before = lsc_calcACMR(triIdx, LSC_ACMR_FIFO_SIZE);
+
+		if (l->vco) {
+			lsc_optimizeVtxCache(l, triIdx);
+			after = lsc_calcACMR(triIdx, LSC_ACMR_FIFO_SIZE);
+			printf("  level %d: %d tris, ACMR %.3f -> %.3f\n",
+							L, (int)triIdx[0], before, after);
+		}
+		else
+			printf("  level %d: %d tris, ACMR %.3f\n",
+							L, (int)triIdx[0], before);
+	}
+	fflush(stdout);
+
+	l->vcacheOpt = vcacheOpt;
+	free(triIdx);
+}
+
+/*
+ * Optimise the index arrays for every level and combination of neighbour
+ * levels once, so rebuilding a patch index array is just a copy. The
+ * coarsest levels are done first, for as many levels as fit in
+ * LSC_VCO_ARRS_SIZE.
+ */
+static void lsc_setupVcoIdxArrs(lsc l)
+{
+	int L, j, k, b, count, minLevel;
+	int numLevels = l->numLevels;
+	int numSlots = 0;
+	size_t size, space;
+	lscidx *d;
+
+	for (L = 0; L < numLevels; L++) {
+		b = numLevels - L;
+		numSlots += b*b*b*b;
+	}
+	space = numSlots * sizeof(lscidx*);
+
+	for (minLevel = numLevels; minLevel > 0; minLevel--) {
+		b = numLevels - (minLevel - 1);
+		size = b*b*b*b * (3*lsc_numPatchTris(l->patchSize, minLevel - 1) + 1)
+															* sizeof(lscidx);
+		if (space + size > LSC_VCO_ARRS_SIZE)
+			break;
+		space += size;
+	}
+
+	l->vcoIdxArrs = (lscidx**)malloc(space);
+	if (!l->vcoIdxArrs)
+		return;
+	memset(l->vcoIdxArrs, 0, numSlots * sizeof(lscidx*));
+	d = (lscidx*)(l->vcoIdxArrs + numSlots);
+
+	count = 0;
+	for (L = minLevel; L < numLevels; L++) {
+		b = numLevels - L;
+		for (k = 0; k < b*b*b*b; k++) {
+			int e = k, nL = 0;
+			for (j = 0; j < 4; j++) {
+				nL |= (L + e % b) << (j*8);
+				e /= b;
+			}
+
+			/* Not in the table yet, so this optimises it */
+			lsc_setupPatchIdxArr(l, 0, L, nL, d);
+			l->vcoIdxArrs[lsc_vcoIdxSlot(l, L, nL)] = d;
+			d += 3*(int)d[0] + 1;
+			count++;
+		}
+	}
+
+	printf("Optimised %d patch index arrays for levels %d to %d (%dk)\n",
+					count, minLevel, numLevels - 1, (space + 1023)/1024);
 }
 
 /*
  * Return the cached index array for a patch.
  */
-unsigned short *lsc_getPatchIdxArr(lsc l, int n, int L, int nL)
+lscidx *lsc_getPatchIdxArr(lsc l, int n, int L, int nL)
 {
 	cchobj *obj = lsc_getPatchIdxPtr(l,n);
-	unsigned short *idxArr;
+	lscidx *idxArr;
 	size_t size;
 	bool rebuild = false;
 	bool realloc = false;
@@ -779,32 +1317,32 @@ unsigned short *lsc_getPatchIdxArr(lsc l, int n, int L, int nL)
 	}
 	else {
 		/* Valid - check level and neighbour levels */
-		idxArr = (unsigned short *)(*obj)->data;
+		idxArr = (lscidx *)(*obj)->data;
 		if (*(int *)idxArr != L) {
 			/* Level is wrong */
 			realloc = true;
 			rebuild = true;
 		}
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 		if (*(int *)idxArr != nL) {
 			/* Neighbour levels wrong */
 			rebuild = true;
 			*(int *)idxArr = nL;
 		}
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 	}
 
 	if (realloc) {
 		/* Get a new cache object */
-		size = ((3*lsc_numPatchTris(l->patchSize, L) + 5) *
-									sizeof(unsigned short) + 15) & ~15;
-		idxArr = (unsigned short *)cch_malloc(&l->patchIdxCch, size, obj);
+		size = ((3*lsc_numPatchTris(l->patchSize, L) + 2*LSC_IDX_PER_INT + 1) *
+									sizeof(lscidx) + 15) & ~15;
+		idxArr = (lscidx *)cch_malloc(&l->patchIdxCch, size, obj);
 		/* AW TODO - some idxArr == NULL handling here please */
 
 		*(int *)idxArr = L;
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 		*(int *)idxArr = nL;
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 	}
 
 	if (rebuild)
@@ -817,10 +1355,10 @@ unsigned short *lsc_getPatchIdxArr(lsc l, int n, int L, int nL)
  * AW TODO: We shouldn't be using the rendering index arrays for collision
  * detection, these should be in a separate cache !
  */
-unsigned short *lsc_getPatchIdxArrCollisionDetect(lsc l, int n)
+lscidx *lsc_getPatchIdxArrCollisionDetect(lsc l, int n)
 {
 	cchobj *obj = lsc_getPatchIdxPtr(l,n);
-	unsigned short *idxArr;
+	lscidx *idxArr;
 	size_t size;
 	bool rebuild = false;
 	bool realloc = false;
@@ -835,32 +1373,32 @@ unsigned short *lsc_getPatchIdxArrCollisionDetect(lsc l, int n)
 	}
 	else {
 		/* Valid - check level and neighbour levels */
-		idxArr = (unsigned short *)(*obj)->data;
+		idxArr = (lscidx *)(*obj)->data;
 		if (*(int *)idxArr != L) {
 			/* Level is wrong */
 			realloc = true;
 			rebuild = true;
 		}
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 		if (*(int *)idxArr != nL) {
 			/* Neighbour levels wrong */
 			rebuild = true;
 			*(int *)idxArr = nL;
 		}
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 	}
 
 	if (realloc) {
 		/* Get a new cache object */
-		size = ((3*lsc_numPatchTris(l->patchSize, L) + 5) *
-									sizeof(unsigned short) + 15) & ~15;
-		idxArr = (unsigned short *)cch_malloc(&l->patchIdxCch, size, obj);
+		size = ((3*lsc_numPatchTris(l->patchSize, L) + 2*LSC_IDX_PER_INT + 1) *
+									sizeof(lscidx) + 15) & ~15;
+		idxArr = (lscidx *)cch_malloc(&l->patchIdxCch, size, obj);
 		/* AW TODO - some idxArr == NULL handling here please */
 
 		*(int *)idxArr = L;
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 		*(int *)idxArr = nL;
-		idxArr += 2;
+		idxArr += LSC_IDX_PER_INT;
 	}
 
 	if (rebuild)
@@ -976,6 +1514,12 @@ lsc lsc_create(int hmSize, int patchSize, int hmTile,
 	lsc l = (lsc)malloc(sizeof(struct lsc_str));
 	if (l) {
 		l->data = NULL;
+		l->occMap = NULL;
+		l->occMapSize = 0;
+		l->vco = NULL;
+		l->vcoIdxArrs = NULL;
+		l->vcacheOpt = false;
+		l->texBuild = NULL;
 		lsc_default(l, hmSize, patchSize, hmTile, hm, scale,
 						texSize, texTile, baseTexTile,
 							sectors, occPatchSz, maxOccPts
@@ -1003,6 +1547,9 @@ void lsc_default(lsc l, int hmSize, int patchSize, int hmTile,
 {
 	if (l) {
 
+		/* Stop building textures for the old landscape */
+		lsc_cancelTexObjs(l);
+
 		l->hmSize = hmSize;
 		l->patchSize = patchSize;
 		l->hmTile = (hmTile <= 0) ? 1 : hmTile;
@@ -1025,8 +1572,19 @@ void lsc_default(lsc l, int hmSize, int patchSize, int hmTile,
 		printf("Set up patches");
 		fflush(stdout);
 
+		lsc_releaseOcclusion(l, false);
 		if (l->data)
 			free(l->data);
+		l->data = NULL;
+		if (l->vcoIdxArrs)
+			free(l->vcoIdxArrs);
+		l->vcoIdxArrs = NULL;
+		if (patchSize > LSC_MAX_PATCHSIZE) {
+			printf("\nPatch size %d is bigger than LSC_MAX_PATCHSIZE (%d)\n",
+								patchSize, LSC_MAX_PATCHSIZE);
+			fflush(stdout);
+			return;
+		}
 		lsc_allocMem(l);
 		if (l->data) {
 			lsc_setupPatchIdx(l);
@@ -1035,6 +1593,15 @@ void lsc_default(lsc l, int hmSize, int patchSize, int hmTile,
 		}
 
 		printf("\n");
+		if (l->data) {
+			if (l->vco)
+				free(l->vco);
+			l->vco = lsc_createVco(patchSize);
+			l->vcacheOpt = (l->vco != NULL);
+			lsc_reportACMR(l);
+			if (l->vcacheOpt)
+				lsc_setupVcoIdxArrs(l);
+		}
 		fflush(stdout);
 	}
 }
@@ -1045,97 +1612,130 @@ void lsc_default(lsc l, int hmSize, int patchSize, int hmTile,
 void lsc_destroy(lsc l)
 {
 	if (l) {
+		lsc_cancelTexObjs(l);
+		lsc_releaseOcclusion(l, false);
 		if (l->data)
 			free(l->data);
 		if (l->patchVtxCch.base)
 			free(l->patchVtxCch.base);
 		if (l->patchIdxCch.base)
 			free(l->patchIdxCch.base);
+		if (l->vco)
+			free(l->vco);
+		if (l->vcoIdxArrs)
+			free(l->vcoIdxArrs);
 		free(l);
 	}
 }
 
 /*
- * Recursively clip the landscape quadtree to a view frustum.
+ * Clip the landscape to a view frustum.
+ *
+ * The quadtree is walked a level at a time rather than recursively. The
+ * nodes whose parents straddle the frustum have their bounding boxes
+ * gathered up, and the whole level is tested in one call to
+ * bbox_isInsideFrustumSoA(). Nodes are visited, and their clip flags set,
+ * exactly as a depth first walk would.
  */
-static void lsc_recurClip(lsc l, int n, int x0, int x1, int y0, int y1,
-							fru frustum, int parentClipFlags)
+void lsc_clip(lsc l, fru frustum)
 {
-	int node = l->quadtree[n];
-	int clipFlags = LSCQT_CF(node);
-	int prevClipFlags = clipFlags;		/* Remember current clip flags */
-
-	/* If parent node was all in, so are its children */
-	if (!parentClipFlags)
-		clipFlags = 0;
-
-	/* Else If parent node was all out, so are its children */
-	else if (parentClipFlags == 1)
-		clipFlags = 1;
-
-	/*
-	 * Else parent intersected frustum so children must be
-	 * tested against frustum.
-	 */
-	else {
+	int maxNodes = SQR(l->hmTile * l->patchTile);
+	lscclipnode cur = l->clipNodes;
+	lscclipnode next = l->clipNodes + maxNodes;
+	lscclipnode c, t;
+	int numCur, numNext, numTest, i;
+	int node, clipFlags, prevClipFlags;
+	int size = l->hmSize * l->hmTile;
+	struct bboxsoa_str boxes;
+
+	boxes.minx = l->clipBoxes;
+	boxes.miny = l->clipBoxes + maxNodes;
+	boxes.minz = l->clipBoxes + 2 * maxNodes;
+	boxes.maxx = l->clipBoxes + 3 * maxNodes;
+	boxes.maxy = l->clipBoxes + 4 * maxNodes;
+	boxes.maxz = l->clipBoxes + 5 * maxNodes;
+
+	/* Start at the root, with all clip flags on */
+	cur[0].n = 0;
+	cur[0].x0 = 0;
+	cur[0].y0 = 0;
+	cur[0].clipFlags = 0x7E;
+	numCur = 1;
+
+	while (numCur) {
 
-		/* Construct the bounding box */
-		struct bbox_str box;
-		box.minp[0] = x0;
-		box.minp[1] = y0;
-		box.minp[2] = LSCQT_Z0(node);
-		box.maxp[0] = x1;
-		box.maxp[1] = y1;
-		box.maxp[2] = LSCQT_Z1(node);
-		vec3_mul(box.minp, l->scale, box.minp);
-		vec3_mul(box.maxp, l->scale, box.maxp);
-
-		/* Clip to frustum */
-		clipFlags = bbox_isInsideFrustum(&box, frustum, parentClipFlags);
-	}
-
-	/* Save the clip flags */
-	if (clipFlags != prevClipFlags) {
-		node = LSCQT_SETCF(node, clipFlags);
-		l->quadtree[n] = node;
-	}
-
-	/* If the node is all out don't go any further */
-	if (clipFlags == 1)
-		return;
-
-	/*
-	 * Else if the clip code hasn't changed and the node is all in then we
-	 * can infer that none of its children's clip codes will have changed
-	 * either.
-	 */
-	else if ((clipFlags == prevClipFlags) && !clipFlags)
-		return;
-
-	/* Else if not a leaf recurse to child nodes */
-	else if (x1 - x0 > l->patchSize) {
+		/*
+		 * Nodes whose parents were all in or all out take their parents'
+		 * clip flags, the rest must be tested against the frustum.
+		 */
+		numTest = 0;
+		for (i = 0, c = cur; i < numCur; i++, c++) {
+			if (c->clipFlags == 0 || c->clipFlags == 1)
+				continue;
+			node = l->quadtree[c->n];
+			boxes.minx[numTest] = c->x0 * l->scale[0];
+			boxes.miny[numTest] = c->y0 * l->scale[1];
+			boxes.minz[numTest] = LSCQT_Z0(node) * l->scale[2];
+			boxes.maxx[numTest] = (c->x0 + size) * l->scale[0];
+			boxes.maxy[numTest] = (c->y0 + size) * l->scale[1];
+			boxes.maxz[numTest] = LSCQT_Z1(node) * l->scale[2];
+			l->clipFlags[numTest] = c->clipFlags;
+			numTest++;
+		}
+		bbox_isInsideFrustumSoA(&boxes, numTest, frustum, l->clipFlags);
+
+		numTest = 0;
+		numNext = 0;
+		for (i = 0, c = cur; i < numCur; i++, c++) {
+			node = l->quadtree[c->n];
+			prevClipFlags = LSCQT_CF(node);
+			if (c->clipFlags == 0 || c->clipFlags == 1)
+				clipFlags = c->clipFlags;
+			else
+				clipFlags = l->clipFlags[numTest++];
+
+			/* Save the clip flags */
+			if (clipFlags != prevClipFlags)
+				l->quadtree[c->n] = LSCQT_SETCF(node, clipFlags);
+
+			/* If the node is all out don't go any further */
+			if (clipFlags == 1)
+				continue;
+
+			/*
+			 * If the clip code hasn't changed and the node is all in then
+			 * we can infer that none of its children's clip codes will
+			 * have changed either.
+			 */
+			if ((clipFlags == prevClipFlags) && !clipFlags)
+				continue;
+
+			/* If not a leaf the child nodes go in the next level */
+			if (size > l->patchSize) {
+				t = next + numNext;
+				t[0].n = LSCQT_BL(c->n);
+				t[1].n = LSCQT_BR(c->n);
+				t[2].n = LSCQT_TL(c->n);
+				t[3].n = LSCQT_TR(c->n);
+				t[0].x0 = t[2].x0 = c->x0;
+				t[1].x0 = t[3].x0 = c->x0 + (size >> 1);
+				t[0].y0 = t[1].y0 = c->y0;
+				t[2].y0 = t[3].y0 = c->y0 + (size >> 1);
+				t[0].clipFlags = t[1].clipFlags =
+					t[2].clipFlags = t[3].clipFlags = clipFlags;
+				numNext += 4;
+			}
+		}
 
-		int xc, yc;
-		xc = (x0 + x1) >> 1;
-		yc = (y0 + y1) >> 1;
-		lsc_recurClip(l, LSCQT_BL(n), x0, xc, y0, yc, frustum, clipFlags);
-		lsc_recurClip(l, LSCQT_BR(n), xc, x1, y0, yc, frustum, clipFlags);
-		lsc_recurClip(l, LSCQT_TL(n), x0, xc, yc, y1, frustum, clipFlags);
-		lsc_recurClip(l, LSCQT_TR(n), xc, x1, yc, y1, frustum, clipFlags);
+		/* Move down a level */
+		t = cur;
+		cur = next;
+		next = t;
+		numCur = numNext;
+		size >>= 1;
 	}
 }
 
-/*
- * Clip the landscape to a view frustum.
- */
-void lsc_clip(lsc l, fru frustum)
-{
-	lsc_recurClip(l, 0,
-		0, l->hmSize * l->hmTile,
-		0, l->hmSize * l->hmTile,
-		frustum, 0x7E);		/* All clip flags on initially */
-}
-
 /*
  * Set the error metric for the current field of view and window height.
  */
@@ -52,9 +52,26 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "boundbox.h"
 #include "cache.h"
 
-#define LSC_MAX_PATCHSIZE	128	/* Because patch indexes are unsigned short */
 #define USE_NV_VAR_FENCE
 
+/*
+ * Patch index type. A patch vertex array holds (patchSize + 1)^2 vertexes,
+ * so unsigned short indexes limit the patch size to 128. Define
+ * LSC_32BIT_INDEXES to use unsigned int indexes and bigger patches.
+ */
+/*#define LSC_32BIT_INDEXES*/
+#ifdef LSC_32BIT_INDEXES
+typedef unsigned int lscidx;
+#define LSC_MAX_PATCHSIZE	1024
+#define LSC_IDX_GLTYPE		GL_UNSIGNED_INT
+#else
+typedef unsigned short lscidx;
+#define LSC_MAX_PATCHSIZE	128	/* Because patch indexes are unsigned short */
+#define LSC_IDX_GLTYPE		GL_UNSIGNED_SHORT
+#endif
+#define LSC_IDX_NONE		((lscidx)~0)
+#define LSC_IDX_PER_INT		(sizeof(int) / sizeof(lscidx))
+
 typedef struct lscpatch_str {
 	short newLevel;				/* New patch mip level */
 	int colourMapTexObj;		/* Patch colourmap texture object for */
@@ -64,6 +81,19 @@ typedef struct lscpatch_str {
 	float d;                    /* Perpendicular distance to viewpoint */
 } *lscpatch;
 
+typedef struct lscvtxjob_str {	/* Patch vertex array to build */
+	int m, x0, x1, y0, y1;
+} *lscvtxjob;
+
+typedef struct lscvispatch_str {	/* Patch visible this frame */
+	int n, m, x0, x1, y0, y1;
+} *lscvispatch;
+
+typedef struct lscclipnode_str {	/* Quadtree node waiting to be clipped */
+	int n, x0, y0;
+	int clipFlags;				/* Parent node's clip flags */
+} *lscclipnode;
+
 typedef struct lsc_str {
 	int hmSize;					/* height map size = 2^n (see above) */
 	int patchSize;				/* patch size = 2^p (see above) */
@@ -83,20 +113,37 @@ typedef struct lsc_str {
 	unsigned char *hm;			/* Heightmap data */
 
 	unsigned char *data;		/* Big chunk of mem for all landscape data */
-	unsigned short *patchIdx;	/* Patch indexes (max patchSize = 128) */
+	lscidx *patchIdx;			/* Patch indexes (see LSC_MAX_PATCHSIZE) */
 	struct cch_str patchVtxCch;	/* Cache for patch vertex arrays */
 	int patchVtxCchSz;			/* Requested cache size */
 	cchobj *patchVtxPtr;		/* Pointers to the patch vertex arrays */
+	int *patchVtxFrame;			/* Frame each vertex array was last queued */
+	int vtxFrame;				/* Frame count for patchVtxFrame */
+	lscvtxjob vtxJobs;			/* Vertex arrays to build this frame */
+	int numVtxJobs;
+	volatile long nextVtxJob;
 	float *patchErrArr;			/* Patch error arrays */
 	size_t patchErrArrSz;		/* Patch error array size */
 	struct cch_str patchIdxCch;	/* Cache for patch index arrays */
 	int patchIdxCchSz;			/* Requested cache size */
 	cchobj *patchIdxPtr;		/* Pointers to the patch index arrays */
+	bool vcacheOpt;				/* Reorder index arrays for vertex cache */
+	void *vco;					/* Vertex cache optimiser work space */
+	lscidx **vcoIdxArrs;		/* Index arrays optimised at setup */
 	lscpatch patches;			/* All landscape patches */
+	lscvispatch visPatches;		/* Patches to render this frame */
+	int numVisPatches;
 
 	int *quadtree;				/* Implicit quadtree */
+	lscclipnode clipNodes;		/* Two quadtree levels of nodes to clip */
+	float *clipBoxes;			/* Node bounding boxes for one level */
+	int *clipFlags;				/* Node clip flags for one level */
 	float *sectorTrig;			/* Sin and cos lookup table by sector */
 	int *occPts;				/* Hierarchical occlusion regions */
+	int *occPtsMem;				/* Occlusion regions in data */
+	void *occMap;				/* Mapped occlusion file, if occPts is in it */
+	size_t occMapSize;
+	void *texBuild;				/* Asynchronous texture build, or NULL */
 } *lsc;
 
 /* Macros for implicit quadtree */
@@ -129,8 +176,10 @@ typedef struct lsc_str {
 
 /* Return a pointer to the index array for a patch */
 #define lsc_getPatchIdxPtr(l,n)	(l->patchIdxPtr + n)
-unsigned short *lsc_getPatchIdxArr(lsc l, int n, int L, int nL);
-unsigned short *lsc_getPatchIdxArrCollisionDetect(lsc l, int n);
+lscidx *lsc_getPatchIdxArr(lsc l, int n, int L, int nL);
+lscidx *lsc_getPatchIdxArrCollisionDetect(lsc l, int n);
+void lsc_optimizeVtxCache(lsc l, lscidx *triIdx);
+float lsc_calcACMR(lscidx *triIdx, int fifoSize);
 
 /* Return a pointer to the vertex array for a patch */
 #define lsc_getPatchVtxPtr(l,m)	(l->patchVtxPtr + m)
@@ -138,6 +187,8 @@ float *lsc_getPatchVtxArr(lsc l, int m,
 						  int x0, int x1, int y0, int y1);
 float *lsc_getPatchVtxArrCollisionDetect(lsc l, int m,
 										 int x0, int x1, int y0, int y1);
+void lsc_queuePatchVtxArr(lsc l, int m, int x0, int x1, int y0, int y1);
+void lsc_buildPatchVtxArrs(lsc l);
 
 /* Return a pointer to the error array for a patch */
 #define lsc_getPatchErrArr(l,m)	\
@@ -170,13 +221,29 @@ void lsc_forceMipLevel(lsc l, int level);
 
 bool lsc_createColourMapTexObjs(lsc l, unsigned char *hm, float texScale);
 bool lsc_createTextureSplatTexObjs(lsc l, unsigned char *hm, float texScale);
+bool lsc_startTexObjs(lsc l, unsigned char *hm, float texScale, bool splat);
+int  lsc_updateTexObjs(lsc l, int maxBytes);
+void lsc_cancelTexObjs(lsc l);
 
 void lsc_getOcclusion(lsc l, unsigned char *hm);
+void lsc_updateOcclusion(lsc l, unsigned char *hm,
+						 int x0, int y0, int x1, int y1, int range);
+void lsc_releaseOcclusion(lsc l, bool keep);
 bool lsc_isPatchVisible(lsc l, int *v, int n, int x0, int x1, int y0, int y1);
 
 bool lsc_checkCollision(lsc l, vec3 *p, bbox entBox,
 						float *frac, plane collisionPlane);
 
+/* Segment for batched collision queries */
+typedef struct lscray_str {
+	vec3 p[2];					/* Segment start and end */
+	float frac;					/* Returned fraction of segment to hit */
+	struct plane_str plane;		/* Returned plane of triangle hit */
+	bool hit;					/* Returned true if segment hit */
+} *lscray;
+
+int lsc_checkCollisionBatch(lsc l, lscray rays, int numRays);
+
 void lsc_initTrace(void);
 
 void lscCleanup();
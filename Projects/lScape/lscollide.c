@@ -25,6 +25,7 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 
 #include "lscape.h"
 #include "opengl.h"
+#include "error.h"
 #include <limits.h>
 
 /*
@@ -150,7 +151,7 @@ static bool lsc_patchCheckCollision(lsc l, int n, int m,
 	lscpatch patch = lsc_getPatch(l, px, py);
 	vec3 offset;
 	float *vtxArr;
-	unsigned short *idxArr;
+	lscidx *idxArr;
 	int i, j, triCount;
 
 	float *tv[3];
@@ -606,3 +607,384 @@ bool lsc_checkCollision(lsc l, vec3 *p, bbox entBox,
 							p, move, &moveBox, entBox, &entAbsBox, nosize,
 							frac, collisionPlane);
 }
+
+/******************************************************************************/
+/*                        BATCHED COLLISION QUERIES                           */
+/******************************************************************************/
+
+/*
+ * lsc_checkCollisionBatch() checks many point sized segments against the
+ * landscape at once, e.g. particles or line of sight tests. The quadtree is
+ * walked once for the whole batch, carrying a list of the segments that
+ * overlap each node. The bounding box of the list is checked against each
+ * child node before any of the segments are, so groups of segments that are
+ * nowhere near a node are culled together.
+ *
+ * At the leaves each segment walks the patch grid cells it passes over,
+ * nearest first (a 2D DDA), and is tested against the two level 0
+ * triangles of each cell until it hits one. As in the rendered patches,
+ * the cell at x, y is split along the diagonal from its x, y corner to its
+ * x + 1, y + 1 corner. The triangle heights are read straight from the
+ * heightmap so the vertex array cache is not touched.
+ *
+ * As in lsc_patchCheckCollision(), only segments passing downwards through
+ * a triangle (from above to below) hit it.
+ */
+
+typedef struct lscbatch_str {
+	lsc l;
+	lscray rays;
+	float *inv;					/* 1 / segment direction, 3 per segment */
+	int *lists;					/* Segment lists, numRays per tree level */
+	int numRays;
+} *lscbatch;
+
+#define LSC_BATCH_BIG	1e30f	/* 1 / zero direction */
+#define LSC_BATCH_EPSILON	0.0001f	/* Triangle edge tolerance in cells */
+
+/*
+ * Clip segment i to a box. Returns false if it misses, or if it only
+ * reaches the box beyond its current hit fraction.
+ */
+static bool lsc_batchClip(lscbatch b, int i, vec3 minp, vec3 maxp,
+						  float *t0, float *t1)
+{
+	lscray r = &b->rays[i];
+	float *inv = &b->inv[3 * i];
+	float tn = 0.0f, tf = r->frac, s0, s1, tmp;
+	int j;
+
+	for (j = 0; j < 3; j++) {
+		s0 = (minp[j] - r->p[0][j]) * inv[j];
+		s1 = (maxp[j] - r->p[0][j]) * inv[j];
+		if (s0 > s1) {
+			tmp = s0;
+			s0 = s1;
+			s1 = tmp;
+		}
+		if (s0 > tn)
+			tn = s0;
+		if (s1 < tf)
+			tf = s1;
+		if (tn > tf)
+			return false;
+	}
+	*t0 = tn;
+	*t1 = tf;
+	return true;
+}
+
+/*
+ * Test a segment against one triangle of a patch grid cell. The triangle
+ * height is z = h + a * u + b * v, in heightmap units, where u and v are
+ * the position in the cell (u0, v0 at the segment start) and h the height
+ * at u = v = 0. upper is true for the triangle above the cell diagonal
+ * (v >= u).
+ */
+static bool lsc_batchTri(lscbatch b, lscray r, float *t,
+						 float u0, float v0, float du, float dv,
+						 float h, float a, float bb, bool upper)
+{
+	float s2 = b->l->scale[2];
+	float f0, fd, s, u, v;
+
+	/* Height of segment above triangle plane is f0 + s * fd */
+	f0 = r->p[0][2] - s2 * (h + a * u0 + bb * v0);
+	fd = (r->p[1][2] - r->p[0][2]) - s2 * (a * du + bb * dv);
+	if (f0 < 0.0f || fd >= 0.0f)
+		return false;				/* Starts below or not going down */
+	s = -f0 / fd;
+	if (s > *t)
+		return false;				/* Beyond current hit */
+
+	/* Check the hit point is inside the triangle */
+	u = u0 + s * du;
+	v = v0 + s * dv;
+	if (u < -LSC_BATCH_EPSILON || u > 1.0f + LSC_BATCH_EPSILON ||
+		v < -LSC_BATCH_EPSILON || v > 1.0f + LSC_BATCH_EPSILON)
+		return false;
+	if (upper ? (v < u - LSC_BATCH_EPSILON) : (v > u + LSC_BATCH_EPSILON))
+		return false;
+
+	*t = s;
+	return true;
+}
+
+/*
+ * Walk segment i across the grid cells of a patch.
+ */
+static bool lsc_batchPatch(lscbatch b, int i, int x0, int y0,
+						   vec3 minp, vec3 maxp)
+{
+	lsc l = b->l;
+	lscray r = &b->rays[i];
+	float *inv = &b->inv[3 * i];
+	int ps = l->patchSize, pitch = l->hmSize + 1;
+	unsigned char *hmp = NULL;
+	int ci, cj, stepi, stepj;
+	float t0, t1, tx, ty, dtx, dty, tc, t;
+	float d[3], du, dv, u0, v0;
+	float h00, h10, h01, h11;
+	bool hit;
+
+	if (!lsc_batchClip(b, i, minp, maxp, &t0, &t1))
+		return false;
+
+	if (l->hm)
+		hmp = &l->hm[(x0 % l->hmSize) + (y0 % l->hmSize) * pitch];
+
+	vec3_sub(r->p[1], r->p[0], d);
+	du = d[0] / l->scale[0];
+	dv = d[1] / l->scale[1];
+
+	/* Starting cell */
+	ci = (int)floor((r->p[0][0] + t0 * d[0]) / l->scale[0]) - x0;
+	cj = (int)floor((r->p[0][1] + t0 * d[1]) / l->scale[1]) - y0;
+	if (ci < 0) ci = 0; else if (ci >= ps) ci = ps - 1;
+	if (cj < 0) cj = 0; else if (cj >= ps) cj = ps - 1;
+
+	/* Segment fraction at the next cell boundary in x and y */
+	if (d[0] > 0.0f) {
+		stepi = 1;
+		tx = ((x0 + ci + 1) * l->scale[0] - r->p[0][0]) * inv[0];
+		dtx = l->scale[0] * inv[0];
+	}
+	else if (d[0] < 0.0f) {
+		stepi = -1;
+		tx = ((x0 + ci) * l->scale[0] - r->p[0][0]) * inv[0];
+		dtx = -l->scale[0] * inv[0];
+	}
+	else {
+		stepi = 0;
+		tx = dtx = LSC_BATCH_BIG;
+	}
+	if (d[1] > 0.0f) {
+		stepj = 1;
+		ty = ((y0 + cj + 1) * l->scale[1] - r->p[0][1]) * inv[1];
+		dty = l->scale[1] * inv[1];
+	}
+	else if (d[1] < 0.0f) {
+		stepj = -1;
+		ty = ((y0 + cj) * l->scale[1] - r->p[0][1]) * inv[1];
+		dty = -l->scale[1] * inv[1];
+	}
+	else {
+		stepj = 0;
+		ty = dty = LSC_BATCH_BIG;
+	}
+
+	for (;;) {
+		/* Corner heights of cell */
+		if (hmp) {
+			h00 = hmp[ci + cj * pitch];
+			h10 = hmp[ci + 1 + cj * pitch];
+			h01 = hmp[ci + (cj + 1) * pitch];
+			h11 = hmp[ci + 1 + (cj + 1) * pitch];
+		}
+		else
+			h00 = h10 = h01 = h11 = 0.0f;
+
+		/* Segment start relative to cell */
+		u0 = r->p[0][0] / l->scale[0] - (x0 + ci);
+		v0 = r->p[0][1] / l->scale[1] - (y0 + cj);
+
+		/* Diagonal runs from (ci, cj) to (ci + 1, cj + 1) */
+		t = r->frac;
+		hit  = lsc_batchTri(b, r, &t, u0, v0, du, dv,
+							h00, h11 - h01, h01 - h00, true);
+		hit |= lsc_batchTri(b, r, &t, u0, v0, du, dv,
+							h00, h10 - h00, h11 - h10, false);
+		if (hit) {
+			/* Cells are visited in order so this is the first hit */
+			float n[3], len;
+			n[0] = -l->scale[2] * (t * du + u0 < t * dv + v0 ?
+						h11 - h01 : h10 - h00) / l->scale[0];
+			n[1] = -l->scale[2] * (t * du + u0 < t * dv + v0 ?
+						h01 - h00 : h11 - h10) / l->scale[1];
+			n[2] = 1.0f;
+			len = 1.0f / vec3_getLen(n);
+			vec3_mulS(n, len, r->plane.v);
+			r->plane.d = -(r->plane.v[0] * (x0 + ci) * l->scale[0] +
+						   r->plane.v[1] * (y0 + cj) * l->scale[1] +
+						   r->plane.v[2] * h00 * l->scale[2]);
+			r->plane.signbits = 0;
+			r->frac = t;
+			r->hit = true;
+			return true;
+		}
+
+		/* Step to the next cell */
+		tc = tx < ty ? tx : ty;
+		if (tc > t1)
+			break;
+		if (tx < ty) {
+			ci += stepi;
+			if (ci < 0 || ci >= ps)
+				break;
+			tx += dtx;
+		}
+		else {
+			cj += stepj;
+			if (cj < 0 || cj >= ps)
+				break;
+			ty += dty;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Recursively check a list of segments against the landscape quadtree.
+ */
+static void lsc_recurBatch(lscbatch b, int n, int x0, int x1, int y0, int y1,
+						   int *list, int count)
+{
+	lsc l = b->l;
+	int *child = list + b->numRays;
+	int i, j, k, node, xc, yc, cx0, cx1, cy0, cy1, childCount;
+	vec3 pmin, pmax, minp, maxp;
+	float t0, t1, e;
+	lscray r;
+
+	/* Bounding box of the packet, each segment cut at its current hit */
+	for (j = 0; j < 3; j++) {
+		pmin[j] = LSC_BATCH_BIG;
+		pmax[j] = -LSC_BATCH_BIG;
+	}
+	for (i = 0; i < count; i++) {
+		r = &b->rays[list[i]];
+		for (j = 0; j < 3; j++) {
+			e = r->p[0][j] + r->frac * (r->p[1][j] - r->p[0][j]);
+			if (r->p[0][j] < pmin[j]) pmin[j] = r->p[0][j];
+			if (r->p[0][j] > pmax[j]) pmax[j] = r->p[0][j];
+			if (e < pmin[j]) pmin[j] = e;
+			if (e > pmax[j]) pmax[j] = e;
+		}
+	}
+
+	xc = (x0 + x1) >> 1;
+	yc = (y0 + y1) >> 1;
+
+	for (k = 0; k < 4; k++) {
+		cx0 = (k & 1) ? xc : x0;
+		cx1 = (k & 1) ? x1 : xc;
+		cy0 = (k & 2) ? yc : y0;
+		cy1 = (k & 2) ? y1 : yc;
+
+		/* Construct the child node bounding box */
+		node = l->quadtree[LSCQT_BL(n) + k];
+		minp[0] = cx0 * l->scale[0];
+		minp[1] = cy0 * l->scale[1];
+		minp[2] = LSCQT_Z0(node) * l->scale[2];
+		maxp[0] = cx1 * l->scale[0];
+		maxp[1] = cy1 * l->scale[1];
+		maxp[2] = LSCQT_Z1(node) * l->scale[2];
+
+		/* Cull the whole packet */
+		if (pmin[0] > maxp[0] || pmax[0] < minp[0] ||
+			pmin[1] > maxp[1] || pmax[1] < minp[1] ||
+			pmin[2] > maxp[2] || pmax[2] < minp[2])
+			continue;
+
+		if (cx1 - cx0 <= l->patchSize) {
+			/* Leaf */
+			for (i = 0; i < count; i++)
+				lsc_batchPatch(b, list[i], cx0, cy0, minp, maxp);
+			continue;
+		}
+
+		/* Segments that reach this child */
+		childCount = 0;
+		for (i = 0; i < count; i++)
+			if (lsc_batchClip(b, list[i], minp, maxp, &t0, &t1))
+				child[childCount++] = list[i];
+		if (childCount)
+			lsc_recurBatch(b, LSCQT_BL(n) + k,
+						   cx0, cx1, cy0, cy1, child, childCount);
+	}
+}
+
+/*
+ * Check a batch of point sized segments for collision with the landscape.
+ * The hit fraction, hit flag and plane are returned in each segment. Unlike
+ * lsc_checkCollision(), frac is the exact fraction along the segment of the
+ * hit point, it is not pulled back by LSC_EPSILON. Returns the number of
+ * segments that hit the landscape.
+ *
+ * The landscape is only read, so separate batches may be run on separate
+ * threads at the same time.
+ */
+int lsc_checkCollisionBatch(lsc l, lscray rays, int numRays)
+{
+	struct lscbatch_str b;
+	vec3 minp, maxp;
+	float t0, t1, d;
+	int i, j, size, levels, count, hits;
+
+	if (numRays <= 0)
+		return 0;
+
+	/* Number of quadtree levels above the patches */
+	size = l->hmSize * l->hmTile;
+	for (levels = 1; size > l->patchSize; size >>= 1)
+		levels++;
+
+	b.l = l;
+	b.rays = rays;
+	b.numRays = numRays;
+	b.inv = (float *)malloc(3 * numRays * sizeof(float));
+	b.lists = (int *)malloc(levels * numRays * sizeof(int));
+	if (!b.inv || !b.lists) {
+		free(b.inv);
+		free(b.lists);
+		err_report("lsc_checkCollisionBatch: cannot alloc %d rays", numRays);
+		return 0;
+	}
+
+	for (i = 0; i < numRays; i++) {
+		rays[i].frac = 1.0f;
+		rays[i].hit = false;
+		for (j = 0; j < 3; j++) {
+			d = rays[i].p[1][j] - rays[i].p[0][j];
+			if (d > 0.0f && d < 1.0f / LSC_BATCH_BIG)
+				b.inv[3 * i + j] = LSC_BATCH_BIG;
+			else if (d < 0.0f && d > -1.0f / LSC_BATCH_BIG)
+				b.inv[3 * i + j] = -LSC_BATCH_BIG;
+			else
+				b.inv[3 * i + j] = d == 0.0f ? LSC_BATCH_BIG : 1.0f / d;
+		}
+	}
+
+	/* Root node */
+	size = l->hmSize * l->hmTile;
+	minp[0] = minp[1] = 0.0f;
+	minp[2] = LSCQT_Z0(l->quadtree[0]) * l->scale[2];
+	maxp[0] = size * l->scale[0];
+	maxp[1] = size * l->scale[1];
+	maxp[2] = LSCQT_Z1(l->quadtree[0]) * l->scale[2];
+
+	count = 0;
+	for (i = 0; i < numRays; i++)
+		if (lsc_batchClip(&b, i, minp, maxp, &t0, &t1))
+			b.lists[count++] = i;
+
+	if (count) {
+		if (size <= l->patchSize) {
+			for (i = 0; i < count; i++)
+				lsc_batchPatch(&b, b.lists[i], 0, 0, minp, maxp);
+		}
+		else
+			lsc_recurBatch(&b, 0, 0, size, 0, size, b.lists, count);
+	}
+
+	/* A segment may hit several patches, only count it once */
+	hits = 0;
+	for (i = 0; i < numRays; i++)
+		if (rays[i].hit)
+			hits++;
+
+	free(b.inv);
+	free(b.lists);
+	return hits;
+}
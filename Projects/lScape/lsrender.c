@@ -38,7 +38,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 	int npx, npy, i, nL, icount;
 	vec3 offset;
 	float *vtxArr;
-	unsigned short *idxArr;
+	lscidx *idxArr;
 	bool useTextureCombine = mode & 0x10;
 
 	mode &= 0x0F;
@@ -91,7 +91,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 	if (!mode) {
 		/* Line mode */
 		glVertexPointer(3, GL_FLOAT, 32, vtxArr);
-		glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+		glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 	}
 	else if (mode == 1) {
 		/* Single pass texture mode */
@@ -103,7 +103,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 		glBindTexture(GL_TEXTURE_2D, patch->colourMapTexObj);
 		glTexCoordPointer(2, GL_FLOAT, 32, vtxArr + 4);
 		glVertexPointer(3, GL_FLOAT, 32, vtxArr);
-		glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+		glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 	}
 	else if (!useTextureCombine) {
 		/* Texture splat mode, assume multitexture extensions */
@@ -141,7 +141,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 			globalGL.glClientActiveTextureARB(GL_TEXTURE0_ARB);
 			glTexCoordPointer(2, GL_FLOAT, 32, vtxArr + 4);
 			glVertexPointer(3, GL_FLOAT, 32, vtxArr);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			globalGL.glActiveTextureARB(GL_TEXTURE1_ARB);
 			glEnable(GL_TEXTURE_2D);
@@ -176,7 +176,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 				globalGL.glLockArraysEXT(0,
 					lsc_numPatchVtxs(l->patchSize, patch->newLevel));
 
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			/* glBlendFunc(source, dest); */
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
@@ -185,13 +185,13 @@ static void lsc_renderPatch(lsc l, int n, int m,
 			glBindTexture(GL_TEXTURE_2D, l->splatTextureTexObj[1]);
 			globalGL.glActiveTextureARB(GL_TEXTURE0_ARB);
 			glBindTexture(GL_TEXTURE_2D, patch->blendMapTexObj[2]);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			globalGL.glActiveTextureARB(GL_TEXTURE1_ARB);
 			glBindTexture(GL_TEXTURE_2D, l->splatTextureTexObj[2]);
 			globalGL.glActiveTextureARB(GL_TEXTURE0_ARB);
 			glBindTexture(GL_TEXTURE_2D, patch->blendMapTexObj[3]);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			/* glBlendFunc(source, dest); */
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
@@ -202,7 +202,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 			glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 			globalGL.glActiveTextureARB(GL_TEXTURE0_ARB);
 			glBindTexture(GL_TEXTURE_2D, patch->colourMapTexObj);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			globalGL.glActiveTextureARB(GL_TEXTURE1_ARB);
 			glEnable(GL_TEXTURE_2D);
@@ -259,7 +259,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 			globalGL.glClientActiveTextureARB(GL_TEXTURE0_ARB);
 			glTexCoordPointer(2, GL_FLOAT, 32, vtxArr + 4);
 			glVertexPointer(3, GL_FLOAT, 32, vtxArr);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			globalGL.glActiveTextureARB(GL_TEXTURE1_ARB);
 			glEnable(GL_TEXTURE_2D);
@@ -304,7 +304,7 @@ static void lsc_renderPatch(lsc l, int n, int m,
 				globalGL.glLockArraysEXT(0,
 					lsc_numPatchVtxs(l->patchSize, patch->newLevel));
 
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			/* glBlendFunc(source, dest); */
 			glBlendFunc(GL_SRC_ALPHA, GL_ONE);
@@ -313,13 +313,13 @@ static void lsc_renderPatch(lsc l, int n, int m,
 			glBindTexture(GL_TEXTURE_2D, patch->blendMapTexObj[2]);
 			globalGL.glActiveTextureARB(GL_TEXTURE0_ARB);
 			glBindTexture(GL_TEXTURE_2D, l->splatTextureTexObj[1]);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			globalGL.glActiveTextureARB(GL_TEXTURE1_ARB);
 			glBindTexture(GL_TEXTURE_2D, patch->blendMapTexObj[3]);
 			globalGL.glActiveTextureARB(GL_TEXTURE0_ARB);
 			glBindTexture(GL_TEXTURE_2D, l->splatTextureTexObj[2]);
-			glDrawElements(GL_TRIANGLES, icount, GL_UNSIGNED_SHORT, idxArr);
+			glDrawElements(GL_TRIANGLES, icount, LSC_IDX_GLTYPE, idxArr);
 
 			glDisable(GL_BLEND);
 
@@ -341,10 +341,30 @@ static void lsc_renderPatch(lsc l, int n, int m,
 }
 
 /*
- * Recursivley render the visible parts of the landscape quadtree.
+ * Add a leaf patch to the list to render this frame, and queue its vertex
+ * array to be built if the cache is shared.
  */
-static void lsc_recurRender(lsc l, int n, int m,
-							int x0, int x1, int y0, int y1, int mode)
+static void lsc_addVisPatch(lsc l, int n, int m,
+							int x0, int x1, int y0, int y1)
+{
+	lscvispatch p = &l->visPatches[l->numVisPatches++];
+
+	p->n = n;
+	p->m = m;
+	p->x0 = x0;
+	p->x1 = x1;
+	p->y0 = y0;
+	p->y1 = y1;
+
+	if (l->patchVtxCch.shared)
+		lsc_queuePatchVtxArr(l, m, x0, x1, y0, y1);
+}
+
+/*
+ * Recursivley find the visible parts of the landscape quadtree.
+ */
+static void lsc_recurVisible(lsc l, int n, int m,
+							 int x0, int x1, int y0, int y1)
 {
 	int node = l->quadtree[n];
 	int clipFlags = LSCQT_CF(node);
@@ -358,34 +378,33 @@ static void lsc_recurRender(lsc l, int n, int m,
 		int xc, yc;
 		xc = (x0 + x1) >> 1;
 		yc = (y0 + y1) >> 1;
-		lsc_recurRender(l, LSCQT_BL(n), 0, x0, xc, y0, yc, mode);
-		lsc_recurRender(l, LSCQT_BR(n), 0, xc, x1, y0, yc, mode);
-		lsc_recurRender(l, LSCQT_TL(n), 0, x0, xc, yc, y1, mode);
-		lsc_recurRender(l, LSCQT_TR(n), 0, xc, x1, yc, y1, mode);
+		lsc_recurVisible(l, LSCQT_BL(n), 0, x0, xc, y0, yc);
+		lsc_recurVisible(l, LSCQT_BR(n), 0, xc, x1, y0, yc);
+		lsc_recurVisible(l, LSCQT_TL(n), 0, x0, xc, yc, y1);
+		lsc_recurVisible(l, LSCQT_TR(n), 0, xc, x1, yc, y1);
 	}
 	else if (x1 - x0 > l->patchSize) {
 
 		int xc, yc;
 		xc = (x0 + x1) >> 1;
 		yc = (y0 + y1) >> 1;
-		lsc_recurRender(l, LSCQT_BL(n), LSCQT_BL(m), x0, xc, y0, yc, mode);
-		lsc_recurRender(l, LSCQT_BR(n), LSCQT_BR(m), xc, x1, y0, yc, mode);
-		lsc_recurRender(l, LSCQT_TL(n), LSCQT_TL(m), x0, xc, yc, y1, mode);
-		lsc_recurRender(l, LSCQT_TR(n), LSCQT_TR(m), xc, x1, yc, y1, mode);
+		lsc_recurVisible(l, LSCQT_BL(n), LSCQT_BL(m), x0, xc, y0, yc);
+		lsc_recurVisible(l, LSCQT_BR(n), LSCQT_BR(m), xc, x1, y0, yc);
+		lsc_recurVisible(l, LSCQT_TL(n), LSCQT_TL(m), x0, xc, yc, y1);
+		lsc_recurVisible(l, LSCQT_TR(n), LSCQT_TR(m), xc, x1, yc, y1);
 	}
 
-	/* Leaf - render the patch */
-	else {
-
-		lsc_renderPatch(l, n, m, x0, x1, y0, y1, mode);
-	}
+	/* Leaf - add the patch */
+	else
+		lsc_addVisPatch(l, n, m, x0, x1, y0, y1);
 }
 
 /*
- * Recursivley render the visible parts of the landscape quadtree.
+ * Recursivley find the visible parts of the landscape quadtree, skipping
+ * occluded regions.
  */
-static void lsc_occRecurRender(lsc l, int n, int m, int *vpt,
-							   int x0, int x1, int y0, int y1, int mode)
+static void lsc_occRecurVisible(lsc l, int n, int m, int *vpt,
+								int x0, int x1, int y0, int y1)
 {
 	int node = l->quadtree[n];
 	int clipFlags = LSCQT_CF(node);
@@ -399,10 +418,10 @@ static void lsc_occRecurRender(lsc l, int n, int m, int *vpt,
 		int xc, yc;
 		xc = (x0 + x1) >> 1;
 		yc = (y0 + y1) >> 1;
-		lsc_occRecurRender(l, LSCQT_BL(n), 0, vpt, x0, xc, y0, yc, mode);
-		lsc_occRecurRender(l, LSCQT_BR(n), 0, vpt, xc, x1, y0, yc, mode);
-		lsc_occRecurRender(l, LSCQT_TL(n), 0, vpt, x0, xc, yc, y1, mode);
-		lsc_occRecurRender(l, LSCQT_TR(n), 0, vpt, xc, x1, yc, y1, mode);
+		lsc_occRecurVisible(l, LSCQT_BL(n), 0, vpt, x0, xc, y0, yc);
+		lsc_occRecurVisible(l, LSCQT_BR(n), 0, vpt, xc, x1, y0, yc);
+		lsc_occRecurVisible(l, LSCQT_TL(n), 0, vpt, x0, xc, yc, y1);
+		lsc_occRecurVisible(l, LSCQT_TR(n), 0, vpt, xc, x1, yc, y1);
 	}
 	else if (x1 - x0 > l->occPatchSize) {
 
@@ -413,14 +432,14 @@ static void lsc_occRecurRender(lsc l, int n, int m, int *vpt,
 
 		xc = (x0 + x1) >> 1;
 		yc = (y0 + y1) >> 1;
-		lsc_occRecurRender(l, LSCQT_BL(n), LSCQT_BL(m), vpt,
-													x0, xc, y0, yc, mode);
-		lsc_occRecurRender(l, LSCQT_BR(n), LSCQT_BR(m), vpt,
-													xc, x1, y0, yc, mode);
-		lsc_occRecurRender(l, LSCQT_TL(n), LSCQT_TL(m), vpt,
-													x0, xc, yc, y1, mode);
-		lsc_occRecurRender(l, LSCQT_TR(n), LSCQT_TR(m), vpt,
-													xc, x1, yc, y1, mode);
+		lsc_occRecurVisible(l, LSCQT_BL(n), LSCQT_BL(m), vpt,
+													x0, xc, y0, yc);
+		lsc_occRecurVisible(l, LSCQT_BR(n), LSCQT_BR(m), vpt,
+													xc, x1, y0, yc);
+		lsc_occRecurVisible(l, LSCQT_TL(n), LSCQT_TL(m), vpt,
+													x0, xc, yc, y1);
+		lsc_occRecurVisible(l, LSCQT_TR(n), LSCQT_TR(m), vpt,
+													xc, x1, yc, y1);
 	}
 	else if (x1 - x0 > l->patchSize) {
 
@@ -432,24 +451,49 @@ static void lsc_occRecurRender(lsc l, int n, int m, int *vpt,
 
 		xc = (x0 + x1) >> 1;
 		yc = (y0 + y1) >> 1;
-		lsc_occRecurRender(l, LSCQT_BL(n), LSCQT_BL(m), vpt,
-													x0, xc, y0, yc, mode);
-		lsc_occRecurRender(l, LSCQT_BR(n), LSCQT_BR(m), vpt,
-													xc, x1, y0, yc, mode);
-		lsc_occRecurRender(l, LSCQT_TL(n), LSCQT_TL(m), vpt,
-													x0, xc, yc, y1, mode);
-		lsc_occRecurRender(l, LSCQT_TR(n), LSCQT_TR(m), vpt,
-													xc, x1, yc, y1, mode);
+		lsc_occRecurVisible(l, LSCQT_BL(n), LSCQT_BL(m), vpt,
+													x0, xc, y0, yc);
+		lsc_occRecurVisible(l, LSCQT_BR(n), LSCQT_BR(m), vpt,
+													xc, x1, y0, yc);
+		lsc_occRecurVisible(l, LSCQT_TL(n), LSCQT_TL(m), vpt,
+													x0, xc, yc, y1);
+		lsc_occRecurVisible(l, LSCQT_TR(n), LSCQT_TR(m), vpt,
+													xc, x1, yc, y1);
 	}
 
-	/* Leaf - render the patch */
+	/* Leaf - add the patch */
 	else {
 
 		if (x1 - x0 == l->occPatchSize)
 			if (!lsc_isPatchVisible(l, vpt, m, x0, x1, y0, y1))
 				return;			/* Occluded */
 
-		lsc_renderPatch(l, n, m, x0, x1, y0, y1, mode);
+		lsc_addVisPatch(l, n, m, x0, x1, y0, y1);
+	}
+}
+
+/*
+ * Walk the visible parts of the landscape, listing the patches to render
+ * this frame. Occlusion is tested once here, not again while rendering.
+ */
+static void lsc_findVisible(lsc l, bool occDisable)
+{
+	l->numVisPatches = 0;
+
+	if (occDisable) {
+		lsc_recurVisible(l, 0, 0,
+			0, l->hmSize * l->hmTile,
+			0, l->hmSize * l->hmTile);
+	}
+	else {
+		float *origin = cam_getGlobalCamera()->viewPt.origin;
+		int vpt[3];
+		vpt[0] = (int)floor(0.5f + origin[0] / l->scale[0]);
+		vpt[1] = (int)floor(0.5f + origin[1] / l->scale[1]);
+		vpt[2] = (int)floor(0.5f + origin[2] / l->scale[2]);
+		lsc_occRecurVisible(l, 0, 0, vpt,
+			0, l->hmSize * l->hmTile,
+			0, l->hmSize * l->hmTile);
 	}
 }
 
@@ -458,9 +502,17 @@ static void lsc_occRecurRender(lsc l, int n, int m, int *vpt,
  */
 void lsc_render(lsc l, int mode, bool occDisable, bool useTextureCombine)
 {
+	int i;
+
 	cch_initFrame(&l->patchVtxCch);
 	cch_initFrame(&l->patchIdxCch);
 
+	/* Find the patches to render, and build any missing vertex arrays for
+	   them up front, in parallel if the cache allows it */
+	lsc_findVisible(l, occDisable);
+	if (l->patchVtxCch.shared)
+		lsc_buildPatchVtxArrs(l);
+
 	if (mode == 0) {
 		/* Line mode */
 		glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
@@ -508,22 +560,9 @@ void lsc_render(lsc l, int mode, bool occDisable, bool useTextureCombine)
 
 	mode |= (useTextureCombine << 4);
 
-	if (occDisable) {
-		lsc_recurRender(l, 0, 0,
-			0, l->hmSize * l->hmTile,
-			0, l->hmSize * l->hmTile,
-			mode);
-	}
-	else {
-		float *origin = cam_getGlobalCamera()->viewPt.origin;
-		int vpt[3];
-		vpt[0] = (int)floor(0.5f + origin[0] / l->scale[0]);
-		vpt[1] = (int)floor(0.5f + origin[1] / l->scale[1]);
-		vpt[2] = (int)floor(0.5f + origin[2] / l->scale[2]);
-		lsc_occRecurRender(l, 0, 0, vpt,
-			0, l->hmSize * l->hmTile,
-			0, l->hmSize * l->hmTile,
-			mode);
+	for (i = 0; i < l->numVisPatches; i++) {
+		lscvispatch p = &l->visPatches[i];
+		lsc_renderPatch(l, p->n, p->m, p->x0, p->x1, p->y0, p->y1, mode);
 	}
 	
 	/* Set back to default mode */
@@ -30,8 +30,15 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 #include "tgafile.h"
 #include "textureManager.h"
 #include "lscape.h"
+#include "thread.h"
 #include <limits.h>
 
+/*
+ * Define to check the threaded light map calculations against the
+ * original ones when the colourmap is created.
+ */
+/*#define LSC_CHECK_LIGHTMAPS*/
+
 /*
   lightMapPut()
 
@@ -124,6 +131,54 @@ static unsigned char *lsc_calcBumps(int size)
 	return bumpMap;
 }
 
+/*
+  Row bands
+
+  The map calculations below work on whole rows (or lines) of the map at a
+  time, which are independent of each other. lsc_forRows() shares bands of
+  rows out between worker threads.
+*/
+#define LSC_ROW_BAND	16			/* Rows per work item */
+
+typedef void (*lscrowfunc)(void *arg, int Y0, int Y1);
+
+typedef struct lscrowjob_str {
+	lscrowfunc func;
+	void *arg;
+	int rows;
+	volatile long next;				/* Next band */
+} *lscrowjob;
+
+/* Number of threads to use, or 0 for one per CPU */
+static int lsc_texThreads = 0;
+
+static void lsc_rowWorker(void *arg, int thread)
+{
+	lscrowjob j = (lscrowjob)arg;
+	int Y0;
+
+	while ((Y0 = LSC_ROW_BAND * (thr_atomicInc(&j->next) - 1)) < j->rows)
+		j->func(j->arg, Y0, MIN(Y0 + LSC_ROW_BAND, j->rows));
+}
+
+/*
+  forRows()
+
+  Call func for bands of rows 0 to rows-1 on all threads.
+*/
+static void lsc_forRows(int rows, lscrowfunc func, void *arg)
+{
+	struct lscrowjob_str j;
+	int numThreads = lsc_texThreads ? lsc_texThreads : thr_numCPUs();
+
+	j.func = func;
+	j.arg = arg;
+	j.rows = rows;
+	j.next = 0;
+	numThreads = MIN(numThreads, (rows + LSC_ROW_BAND - 1) / LSC_ROW_BAND);
+	thr_run(numThreads, lsc_rowWorker, &j);
+}
+
 /*
   calcNormals()
 
@@ -142,14 +197,30 @@ static unsigned char *lsc_calcBumps(int size)
 
   The bump map is deleted on completion.
 */
-static char *lsc_calcNormals(unsigned char *heightMap, int size, vec3 scale,
-							 float randScale, float cutoff, int frequency)
-{
-	unsigned char *bumpMap = NULL;
+typedef struct lscnrmjob_str {
+	unsigned char *heightMap;
+	int size;
+	float *scale;
+	float cutoff;
+	unsigned char *bumpMap;
 	int bumpMapSize;
-	float scaleBump = randScale / 255.0f;
-	float invFreq = 1.0f;
+	float scaleBump;
+	float invFreq;
 	char *normalMap;
+} *lscnrmjob;
+
+static void lsc_calcNormalRows(void *arg, int Y0, int Y1)
+{
+	lscnrmjob job = (lscnrmjob)arg;
+	unsigned char *heightMap = job->heightMap;
+	unsigned char *bumpMap = job->bumpMap;
+	int bumpMapSize = job->bumpMapSize;
+	char *normalMap = job->normalMap;
+	int size = job->size;
+	float *scale = job->scale;
+	float scaleBump = job->scaleBump;
+	float invFreq = job->invFreq;
+	float cutoff = job->cutoff;
 	int X, Y, i, j;
 	vec3 normal, temp, temp0, temp1;
 	
@@ -166,38 +237,9 @@ static char *lsc_calcNormals(unsigned char *heightMap, int size, vec3 scale,
 					-1,  1,  0,
 					-1,  0,  0 };
 
-	printf("Calculating normal map");
-	fflush(stdout);
-
-	/* Calculate the bumpmap */
-	if (randScale > 0.0f && frequency > 0) {
-		if (frequency > size)
-			frequency = size;
-		bumpMapSize = size / frequency;
-		bumpMap = lsc_calcBumps(bumpMapSize);
-		invFreq = 1.0f / frequency;
-	}
-	
-	/* Allocate space for the normal map */
-	normalMap = (char*)malloc(3 * SQR(size));
-	if (!normalMap) {
-		err_report("lsc_calcNormals: cannot allocate %d bytes", 3 * SQR(size));
-		if (bumpMap)
-			free(bumpMap);
-		return normalMap;
-	}
-	
-	/* For each point in the heightmap */
-	for (Y = 0; Y < size; Y++) {
-
-		/* Show progress */
-		if (!(Y & 0x3F)) {
-			printf(".");
-			fflush(stdout);
-		}
-
+	/* For each point in the band */
+	for (Y = Y0; Y < Y1; Y++) {
 		for (X = 0; X < size; X++) {
-			
 			/* Get the eight vectors connecting 
 			   this point to its neighbours */
 			for (i = 0; i < 8; i++) {
@@ -310,25 +352,309 @@ static char *lsc_calcNormals(unsigned char *heightMap, int size, vec3 scale,
 			normalMap[3*(X + Y*size) + 2] = (char)(127.0f * normal[2]);
 		}
 	}
+}
+
+static char *lsc_calcNormals(unsigned char *heightMap, int size, vec3 scale,
+							 float randScale, float cutoff, int frequency)
+{
+	struct lscnrmjob_str job;
+
+	printf("Calculating normal map");
+	fflush(stdout);
+
+	job.heightMap = heightMap;
+	job.size = size;
+	job.scale = scale;
+	job.cutoff = cutoff;
+	job.bumpMap = NULL;
+	job.bumpMapSize = 0;
+	job.scaleBump = randScale / 255.0f;
+	job.invFreq = 1.0f;
+
+	/* Calculate the bumpmap */
+	if (randScale > 0.0f && frequency > 0) {
+		if (frequency > size)
+			frequency = size;
+		job.bumpMapSize = size / frequency;
+		job.bumpMap = lsc_calcBumps(job.bumpMapSize);
+		job.invFreq = 1.0f / frequency;
+	}
+	
+	/* Allocate space for the normal map */
+	job.normalMap = (char*)malloc(3 * SQR(size));
+	if (!job.normalMap) {
+		err_report("lsc_calcNormals: cannot allocate %d bytes", 3 * SQR(size));
+		if (job.bumpMap)
+			free(job.bumpMap);
+		return job.normalMap;
+	}
 	
+	lsc_forRows(size, lsc_calcNormalRows, &job);
+
 	/* Delete the bump map */
-	if (bumpMap)
-		free(bumpMap);
+	if (job.bumpMap)
+		free(job.bumpMap);
 	
 	printf("\n");
 	fflush(stdout);
 
-	return normalMap;
+	return job.normalMap;
 }
 
 /*
   calcShadows()
 
+  A point is in shadow if the terrain casts a ray through or above it in the
+  light direction. Rather than casting a ray from every point, we sweep along
+  lines through the map in the light direction, one step along the major
+  axis at a time, keeping the rays cast so far. That makes the shadow map
+  close to linear in the number of points, and bands of lines can be done on
+  different threads.
+
+  Line l steps through minor axis coordinate l + floor(k * incm) at step k,
+  so at every step the lines cover each row (or column) exactly once. Each
+  line starts far enough upstream for any ray that reaches the map to have
+  been picked up, within LSC_SHADOW_MAX_TILES heightmap tiles.
+
+  A ray cast from step k of line l reaches step s at minor coordinate
+  l + floor(k * incm) + floor((s - k) * incm). That is on line l when
+  frac(s * incm) >= frac(k * incm), and on line l - 1 otherwise, so each
+  point is lit by the rays of its own line with a phase at or below its own,
+  and the rays of the next line with a phase above it. Ray heights fall by
+  the same amount each step, so each line keeps the highest ray by phase in
+  a pair of Fenwick trees, one for each side.
+
+  This is not the same as lsc_calcShadowsRef(), which differs in two ways:
+
+  - It does not cast rays from points already in shadow. Their rays can take
+	a different path from the ray that shadowed them, so it misses shadows.
+	For lights close to an axis this can be several percent of the map.
+  - It accumulates ray positions and heights in float, and truncates rather
+	than rounds down off the low edge of the map. This moves shadow edges by
+	a point either way, up to about 0.2% of the map for oblique lights.
+
+  There is no difference for lights along the axes or diagonals.
+  lsc_checkLightMaps() counts both, and checks that the reference shadows
+  no more than 1 in LSC_SHADOW_MAX_DIFF points that are lit here.
+*/
+#define LSC_SHADOW_MAX_TILES	4
+#define LSC_SHADOW_NO_RAY		-1.0e30
+#define LSC_SHADOW_MAX_DIFF		200
+
+typedef struct lscshdjob_str {
+	unsigned char *heightMap;
+	unsigned char *shadowMap;
+	int size;
+	int major;						/* Major axis, 0 = x, 1 = y */
+	int step;						/* Major axis step, +-1 */
+	int warmUp;						/* Steps to take before the map */
+	int steps;						/* warmUp + size */
+	double incm;					/* Minor axis step */
+	double incz;					/* Ray height step */
+	int *rank;						/* Rank of frac(k * incm), 1..numRanks */
+	int numRanks;
+	int failed;
+} *lscshdjob;
+
+typedef struct lscphase_str {
+	double phase;
+	int k;
+} lscphase;
+
+static int lsc_cmpPhase(const void *a, const void *b)
+{
+	double d = ((lscphase*)a)->phase - ((lscphase*)b)->phase;
+	return (d < 0.0) ? -1 : (d > 0.0) ? 1 : 0;
+}
+
+/* Fenwick tree of maxima over ranks 1..n */
+static void lsc_rayPut(double *tree, int n, int i, double v)
+{
+	for (; i <= n; i += i & -i)
+		if (tree[i] < v)
+			tree[i] = v;
+}
+
+static double lsc_rayMax(double *tree, int i)
+{
+	double v = LSC_SHADOW_NO_RAY;
+	for (; i > 0; i -= i & -i)
+		if (tree[i] > v)
+			v = tree[i];
+	return v;
+}
+
+/*
+  Sweep one line. below[] and above[] are the Fenwick trees for the rays
+  with a phase at or below, and above, each point's phase (above[] indexed
+  from the top). next[k] holds the highest ray from line + 1 that crosses
+  into this line at step k; it is replaced by the highest ray from this line
+  that crosses into line - 1. Shadows are only written if shade is set.
+*/
+static void lsc_calcShadowLine(lscshdjob j, int line, int shade,
+							   double *below, double *above, double *next)
+{
+	unsigned char *heightMap = j->heightMap;
+	int size = j->size;
+	int n = j->numRanks;
+	int k, a, m, r, x, y;
+	double h, ray;
+
+	for (k = 1; k <= n; k++)
+		below[k] = above[k] = LSC_SHADOW_NO_RAY;
+
+	a = (j->step > 0) ? -j->warmUp : (size - 1 + j->warmUp);
+	for (k = 0; k < j->steps; k++, a += j->step) {
+
+		/* Assume size is a power of two */
+		m = line + (int)floor(k * j->incm);
+		if (j->major == 0) {
+			x = a & (size - 1);
+			y = m & (size - 1);
+		}
+		else {
+			x = m & (size - 1);
+			y = a & (size - 1);
+		}
+		h = (double)heightMap[x + y*(size + 1)];
+		r = j->rank[k];
+
+		/* Ray heights are stored as at step 0 */
+		if (shade && k >= j->warmUp) {
+			ray = lsc_rayMax(below, r);
+			if (next[k] > ray)
+				ray = next[k];
+			j->shadowMap[x + y*size] = (h <= ray + k * j->incz) ? 255 : 0;
+		}
+		next[k] = lsc_rayMax(above, n - r);
+
+		/* This point casts a ray too */
+		lsc_rayPut(below, n, r, h - k * j->incz);
+		lsc_rayPut(above, n, n + 1 - r, h - k * j->incz);
+	}
+}
+
+static void lsc_calcShadowLines(void *arg, int L0, int L1)
+{
+	lscshdjob j = (lscshdjob)arg;
+	double *below, *above, *next;
+	int line;
+
+	below = (double*)malloc((2 * (j->numRanks + 1) + j->steps) * sizeof(double));
+	if (!below) {
+		j->failed = 1;
+		return;
+	}
+	above = below + j->numRanks + 1;
+	next = above + j->numRanks + 1;
+
+	/* Go down the band, so each line can hand its rays to the next */
+	lsc_calcShadowLine(j, L1, 0, below, above, next);
+	for (line = L1 - 1; line >= L0; line--)
+		lsc_calcShadowLine(j, line, 1, below, above, next);
+
+	free(below);
+}
+
+static unsigned char *lsc_calcShadows(unsigned char *heightMap, int size,
+											vec3 scale, vec3 dir)
+{
+	struct lscshdjob_str job;
+	unsigned char *shadowMap;
+	lscphase *phase;
+	vec3 L;
+	double major;
+	int k;
+	
+	printf("Calculating shadow map");
+	fflush(stdout);
+
+	/* Allocate space for the shadow map */
+	shadowMap = (unsigned char*)malloc(SQR(size));
+	if (!shadowMap) {
+		err_report("lsc_calcShadows: cannot allocate %d bytes", SQR(size));
+		return shadowMap;
+	}
+	memset(shadowMap, 0, SQR(size));
+	
+	/* Make sure the light source is normalised */
+	vec3_cpy(dir, L);
+	vec3_div(L, scale, L);
+	vec3_norm(L);
+	if (L[2] >= 0.0f) {
+		/* Pathological case */
+		err_report("lsc_calcShadows: light vector not pointing down");
+		return shadowMap;
+	}
+
+	/* Step one unit along the major axis at a time */
+	job.major = (fabs(L[0]) < fabs(L[1])) ? 1 : 0;
+	major = fabs(L[job.major]);
+	job.step = (L[job.major] < 0.0f) ? -1 : 1;
+	job.incm = L[1 - job.major] / major;
+	job.incz = L[2] / major;
+
+	/* Rays from the highest point reach zero after this many steps */
+	job.warmUp = (int)ceil(256.0 / -job.incz);
+	if (job.warmUp > LSC_SHADOW_MAX_TILES * size)
+		job.warmUp = LSC_SHADOW_MAX_TILES * size;
+	job.steps = job.warmUp + size;
+
+	/* Rank the phases of the steps, equal phases sharing a rank */
+	phase = (lscphase*)malloc(job.steps * sizeof(lscphase));
+	job.rank = (int*)malloc(job.steps * sizeof(int));
+	if (!phase || !job.rank) {
+		err_report("lsc_calcShadows: cannot allocate %d bytes",
+					job.steps * (sizeof(lscphase) + sizeof(int)));
+		if (phase)
+			free(phase);
+		if (job.rank)
+			free(job.rank);
+		free(shadowMap);
+		return NULL;
+	}
+	for (k = 0; k < job.steps; k++) {
+		phase[k].phase = k * job.incm - floor(k * job.incm);
+		phase[k].k = k;
+	}
+	qsort(phase, job.steps, sizeof(lscphase), lsc_cmpPhase);
+	for (k = 0, job.numRanks = 0; k < job.steps; k++) {
+		if (k == 0 || phase[k].phase != phase[k - 1].phase)
+			job.numRanks++;
+		job.rank[phase[k].k] = job.numRanks;
+	}
+	free(phase);
+
+	job.heightMap = heightMap;
+	job.shadowMap = shadowMap;
+	job.size = size;
+	job.failed = 0;
+	lsc_forRows(size, lsc_calcShadowLines, &job);
+	free(job.rank);
+
+	if (job.failed) {
+		err_report("lsc_calcShadows: cannot allocate line buffers");
+		free(shadowMap);
+		return NULL;
+	}
+	
+	printf("\n");
+	fflush(stdout);
+
+	return shadowMap;
+}
+
+#ifdef LSC_CHECK_LIGHTMAPS
+/*
+  calcShadowsRef()
+
   For each point in the heightmap we cast a ray in the light direction. Any 
   points intersected in x-y which are below the ray in z are deemed to be in
   shadow.
+
+  This is the original shadow calculation, kept to check lsc_calcShadows().
 */
-static unsigned char *lsc_calcShadows(unsigned char *heightMap, int size,
+static unsigned char *lsc_calcShadowsRef(unsigned char *heightMap, int size,
 											vec3 scale, vec3 dir)
 {
 	const float scaleNormal = 1.0f / 127.0f;
@@ -342,7 +668,7 @@ static unsigned char *lsc_calcShadows(unsigned char *heightMap, int size,
 	/* Allocate space for the shadow map */
 	shadowMap = (unsigned char*)malloc(SQR(size));
 	if (!shadowMap) {
-		err_report("lsc_calcShadows: cannot allocate %d bytes", SQR(size));
+		err_report("lsc_calcShadowsRef: cannot allocate %d bytes", SQR(size));
 		return shadowMap;
 	}
 	memset(shadowMap, 0, SQR(size));
@@ -353,7 +679,7 @@ static unsigned char *lsc_calcShadows(unsigned char *heightMap, int size,
 	vec3_norm(L);
 	if (L[2] == 0.0f) {
 		/* Pathological case */
-		err_report("lsc_calcShadows: light vector horizontal");
+		err_report("lsc_calcShadowsRef: light vector horizontal");
 		return shadowMap;
 	}
 	
@@ -416,14 +742,18 @@ static unsigned char *lsc_calcShadows(unsigned char *heightMap, int size,
 
 	return shadowMap;
 }
+#endif
 
+#ifdef LSC_CHECK_LIGHTMAPS
 /*
-  blurLightMap()
+  blurLightMapRef()
 
   Applies a simple blurring filter to the light map. The blurring filter is
   first weighted according to the light direction.
+
+  This is the original blur, kept to check lsc_blurLightMap().
 */
-static void lsc_blurLightMap(unsigned char *lightMap, int size, vec3 dir)
+static void lsc_blurLightMapRef(unsigned char *lightMap, int size, vec3 dir)
 {
 	char *lightMap2;
 	int blurMap[9] = { 64,  64,  64,
@@ -433,7 +763,7 @@ static void lsc_blurLightMap(unsigned char *lightMap, int size, vec3 dir)
 	
 	lightMap2 = (unsigned char*)malloc(SQR(size));
 	if (!lightMap2) {
-		err_report("lsc_blurLightMap: cannot allocate %d bytes", SQR(size));
+		err_report("lsc_blurLightMapRef: cannot allocate %d bytes", SQR(size));
 		return;
 	}
 	memset(lightMap2, 0, SQR(size));
@@ -473,6 +803,223 @@ static void lsc_blurLightMap(unsigned char *lightMap, int size, vec3 dir)
 	memcpy(lightMap, lightMap2, SQR(size));
 	free(lightMap2);
 }
+#endif
+
+/*
+  blurLightMap()
+
+  Applies a simple blurring filter to the light map. The blurring filter is
+  first weighted according to the light direction.
+
+  The 3x3 filter is 64 everywhere, 255 in the center, and 128 along one
+  column and one row picked by the light direction. That isn't separable,
+  but it is the sum of separable parts:
+
+    64 * (3x3 box + 3x1 column + 1x3 row - corner) + 191 * center
+
+  where the column and row are the 128 ones and the corner is where they
+  cross. Horizontal sums are calculated once per row, and the sums for
+  each output pixel are then added up from them, using SSE2 when we can.
+  The result is exactly the same as lsc_blurLightMapRef().
+*/
+#if defined(__SSE2__) || (defined(_MSC_VER) && _MSC_VER >= 1300)
+#define LSC_BLUR_SSE2
+#include <emmintrin.h>
+#endif
+
+typedef struct lscblurjob_str {
+	unsigned char *src;				/* Light map with a one pixel border */
+	unsigned short *hsum;			/* Horizontal sums of 3 from src */
+	unsigned char *dst;
+	int size;
+	int cx, cy;						/* Offset to 128 column and row */
+	int wx, wy;						/* 1 if there is a 128 column, row */
+	float rcp, bias;				/* For dividing by the filter sum */
+} *lscblurjob;
+
+static void lsc_blurSumRows(void *arg, int Y0, int Y1)
+{
+	lscblurjob j = (lscblurjob)arg;
+	int pitch = j->size + 2;
+	int X, Y;
+
+	for (Y = Y0; Y < Y1; Y++) {
+		unsigned char *s = j->src + Y*pitch;
+		unsigned short *h = j->hsum + Y*j->size;
+		X = 0;
+#ifdef LSC_BLUR_SSE2
+		{
+			__m128i zero = _mm_setzero_si128();
+			for (; X + 8 <= j->size; X += 8) {
+				__m128i a = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((__m128i*)(s + X)), zero);
+				__m128i b = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((__m128i*)(s + X + 1)), zero);
+				__m128i c = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((__m128i*)(s + X + 2)), zero);
+				_mm_storeu_si128((__m128i*)(h + X),
+						_mm_add_epi16(_mm_add_epi16(a, b), c));
+			}
+		}
+#endif
+		for (; X < j->size; X++)
+			h[X] = s[X] + s[X + 1] + s[X + 2];
+	}
+}
+
+static void lsc_blurRows(void *arg, int Y0, int Y1)
+{
+	lscblurjob j = (lscblurjob)arg;
+	int size = j->size;
+	int pitch = size + 2;
+	int X, Y;
+
+	for (Y = Y0; Y < Y1; Y++) {
+		/* Rows Y-1, Y, Y+1 and the 128 row, offset to column X */
+		unsigned short *h0 = j->hsum + Y*size;
+		unsigned short *h1 = h0 + size;
+		unsigned short *h2 = h1 + size;
+		unsigned short *hr = h1 + j->cy*size;
+		unsigned char *s0 = j->src + Y*pitch + 1;
+		unsigned char *s1 = s0 + pitch;
+		unsigned char *s2 = s1 + pitch;
+		unsigned char *sr = s1 + j->cy*pitch;
+		unsigned char *d = j->dst + Y*size;
+		int cx = j->cx;
+		X = 0;
+#ifdef LSC_BLUR_SSE2
+		{
+			__m128i zero = _mm_setzero_si128();
+			__m128i wx = _mm_set1_epi16((short)-j->wx);
+			__m128i wy = _mm_set1_epi16((short)-j->wy);
+			__m128i wxy = _mm_set1_epi16((short)-(j->wx & j->wy));
+			__m128i k191 = _mm_set1_epi16(191);
+			__m128 rcp = _mm_set1_ps(j->rcp);
+			__m128 bias = _mm_set1_ps(j->bias);
+
+			for (; X + 8 <= size; X += 8) {
+				__m128i box, col, row, crn, ctr, sum, lo, hi;
+
+				box = _mm_add_epi16(_mm_add_epi16(
+						_mm_loadu_si128((__m128i*)(h0 + X)),
+						_mm_loadu_si128((__m128i*)(h1 + X))),
+						_mm_loadu_si128((__m128i*)(h2 + X)));
+				col = _mm_add_epi16(_mm_add_epi16(
+						_mm_unpacklo_epi8(_mm_loadl_epi64(
+								(__m128i*)(s0 + X + cx)), zero),
+						_mm_unpacklo_epi8(_mm_loadl_epi64(
+								(__m128i*)(s1 + X + cx)), zero)),
+						_mm_unpacklo_epi8(_mm_loadl_epi64(
+								(__m128i*)(s2 + X + cx)), zero));
+				row = _mm_loadu_si128((__m128i*)(hr + X));
+				crn = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((__m128i*)(sr + X + cx)), zero);
+				ctr = _mm_unpacklo_epi8(
+						_mm_loadl_epi64((__m128i*)(s1 + X)), zero);
+
+				/* 16 bit sum of the 64 weighted parts */
+				sum = _mm_add_epi16(box, _mm_and_si128(col, wx));
+				sum = _mm_add_epi16(sum, _mm_and_si128(row, wy));
+				sum = _mm_sub_epi16(sum, _mm_and_si128(crn, wxy));
+
+				/* 32 bit 64 * sum + 191 * center */
+				ctr = _mm_mullo_epi16(ctr, k191);
+				lo = _mm_add_epi32(
+						_mm_slli_epi32(_mm_unpacklo_epi16(sum, zero), 6),
+						_mm_unpacklo_epi16(ctr, zero));
+				hi = _mm_add_epi32(
+						_mm_slli_epi32(_mm_unpackhi_epi16(sum, zero), 6),
+						_mm_unpackhi_epi16(ctr, zero));
+
+				/* Divide by the filter sum */
+				lo = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(
+						_mm_cvtepi32_ps(lo), rcp), bias));
+				hi = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(
+						_mm_cvtepi32_ps(hi), rcp), bias));
+
+				sum = _mm_packs_epi32(lo, hi);
+				_mm_storel_epi64((__m128i*)(d + X),
+						_mm_packus_epi16(sum, sum));
+			}
+		}
+#endif
+		for (; X < size; X++) {
+			int sum = h0[X] + h1[X] + h2[X];
+			int accum;
+			if (j->wx)
+				sum += s0[X + cx] + s1[X + cx] + s2[X + cx];
+			if (j->wy)
+				sum += hr[X];
+			if (j->wx && j->wy)
+				sum -= sr[X + cx];
+			accum = 64*sum + 191*s1[X];
+			accum = (int)((float)accum * j->rcp + j->bias);
+			if (accum > 255)
+				accum = 255;
+			d[X] = (unsigned char)accum;
+		}
+	}
+}
+
+static void lsc_blurLightMap(unsigned char *lightMap, int size, vec3 dir)
+{
+	struct lscblurjob_str job;
+	int pitch = size + 2;
+	int Y, divisor;
+	
+	job.src = (unsigned char*)malloc(SQR(pitch));
+	job.hsum = (unsigned short*)malloc(pitch * size * sizeof(unsigned short));
+	if (!job.src || !job.hsum) {
+		err_report("lsc_blurLightMap: cannot allocate %d bytes",
+					SQR(pitch) + pitch * size * sizeof(unsigned short));
+		if (job.src)
+			free(job.src);
+		if (job.hsum)
+			free(job.hsum);
+		return;
+	}
+	job.dst = lightMap;
+	job.size = size;
+	
+	/* Same weighting as lsc_blurLightMapRef() */
+	job.wx = job.wy = 1;
+	if (dir[0] > 0.6)
+		job.cx = 1;
+	else if (dir[0] < 0.6)
+		job.cx = -1;
+	else
+		job.cx = job.wx = 0;
+	if (dir[1] > 0.6)
+		job.cy = -1;
+	else if (dir[1] < 0.6)
+		job.cy = 1;
+	else
+		job.cy = job.wy = 0;
+
+	divisor = 64*9 + 191 + 64*3*job.wx + 64*3*job.wy - 64*job.wx*job.wy;
+
+	/*
+	 * accum / divisor rounded down. The bias is less than the distance
+	 * from any fraction k / divisor to the next integer, and much more
+	 * than the float rounding error for accum < 2^19.
+	 */
+	job.rcp = 1.0f / (float)divisor;
+	job.bias = 0.5f / (float)divisor;
+
+	/* Copy the light map with a wrapped border */
+	for (Y = -1; Y <= size; Y++) {
+		unsigned char *s = job.src + (Y + 1)*pitch;
+		memcpy(s + 1, lightMap + (Y & (size - 1))*size, size);
+		s[0] = s[size];
+		s[size + 1] = s[1];
+	}
+
+	lsc_forRows(size + 2, lsc_blurSumRows, &job);
+	lsc_forRows(size, lsc_blurRows, &job);
+
+	free(job.src);
+	free(job.hsum);
+}
 
 /*
   calcLighting()
@@ -482,42 +1029,28 @@ static void lsc_blurLightMap(unsigned char *lightMap, int size, vec3 dir)
   scaled to the range 0 to 255 and stored as an unsigned char. We then apply
   a blurring filter to soften the shadow edges.
 */
-static unsigned char *lsc_calcLighting(unsigned char *normalMap, 
-									   unsigned char *shadowMap, int size,
-									   vec3 scale, float amb, float diff,
-									   vec3 dir)
+typedef struct lsclgtjob_str {
+	unsigned char *normalMap;
+	unsigned char *shadowMap;
+	unsigned char *lightMap;
+	int size;
+	float amb, diff;
+	float *L;
+} *lsclgtjob;
+
+static void lsc_calcLightingRows(void *arg, int Y0, int Y1)
 {
 	const float scaleNormal = 1.0f / 127.0f;
 	const float scaleShadow = 1.0f / 255.0f;
-	unsigned char *lightMap;
+	lsclgtjob j = (lsclgtjob)arg;
+	unsigned char *normalMap = j->normalMap;
+	unsigned char *shadowMap = j->shadowMap;
+	int size = j->size;
 	int X, Y;
-	vec3 L, normal;
-	
-	printf("Calculating light map");
-	fflush(stdout);
-
-	/* Allocate space for the light map */
-	lightMap = (unsigned char*)malloc(SQR(size));
-	if (!lightMap) {
-		err_report("lsc_calcLighting: cannot allocate %d bytes", SQR(size));
-		return lightMap;
-	}
-	
-	/* Make sure the light source is normalised */
-	vec3_cpy(dir, L);
-	vec3_div(L, scale, L);
-	vec3_norm(L);
-	vec3_mulS(L, -1.0f, L);
-	
-	/* For each point */
-	for (Y = 0; Y < size; Y++) {
-
-		/* Show progress */
-		if (!(Y & 0x3F)) {
-			printf(".");
-			fflush(stdout);
-		}
+	vec3 normal;
 
+	/* For each point in the band */
+	for (Y = Y0; Y < Y1; Y++) {
 		for (X = 0; X < size; X++) {
 			float i, s, d;
 
@@ -526,7 +1059,7 @@ static unsigned char *lsc_calcLighting(unsigned char *normalMap,
 			normal[1] = normalMap[3*(X + Y*size) + 1];
 			normal[2] = normalMap[3*(X + Y*size) + 2];
 			vec3_mulS(normal, scaleNormal, normal);
-			d = vec3_dot(L, normal);
+			d = vec3_dot(j->L, normal);
 			if (d < 0.0f)
 				d = 0.0f;
 			
@@ -534,16 +1067,51 @@ static unsigned char *lsc_calcLighting(unsigned char *normalMap,
 			s = 1.0f;
 			if (shadowMap)
 				s = 1.0f - scaleShadow * shadowMap[X + Y*size];
-			i = amb + s * d * diff;
+			i = j->amb + s * d * j->diff;
 			if (i < 0.0f)
 				i = 0.0f;
 			else if (i > 1.0f)
 				i = 1.0f;
 			
 			/* Save in light map */
-			lightMap[X + Y*size] = (unsigned char)(i * 255.0f);
+			j->lightMap[X + Y*size] = (unsigned char)(i * 255.0f);
 		}
 	}
+}
+
+static unsigned char *lsc_calcLighting(unsigned char *normalMap, 
+									   unsigned char *shadowMap, int size,
+									   vec3 scale, float amb, float diff,
+									   vec3 dir)
+{
+	struct lsclgtjob_str job;
+	unsigned char *lightMap;
+	vec3 L;
+	
+	printf("Calculating light map");
+	fflush(stdout);
+
+	/* Allocate space for the light map */
+	lightMap = (unsigned char*)malloc(SQR(size));
+	if (!lightMap) {
+		err_report("lsc_calcLighting: cannot allocate %d bytes", SQR(size));
+		return lightMap;
+	}
+	
+	/* Make sure the light source is normalised */
+	vec3_cpy(dir, L);
+	vec3_div(L, scale, L);
+	vec3_norm(L);
+	vec3_mulS(L, -1.0f, L);
+	
+	job.normalMap = normalMap;
+	job.shadowMap = shadowMap;
+	job.lightMap = lightMap;
+	job.size = size;
+	job.amb = amb;
+	job.diff = diff;
+	job.L = L;
+	lsc_forRows(size, lsc_calcLightingRows, &job);
 
 	/* Blur the light map */
 	printf("blurring");
@@ -557,93 +1125,135 @@ static unsigned char *lsc_calcLighting(unsigned char *normalMap,
 	return lightMap;
 }
 
+#ifdef LSC_CHECK_LIGHTMAPS
 /*
-  calcTextures()
+  checkLightMaps()
 
-  mode == 0:
-  ---------
+  Compare the threaded normal, shadow and light map calculations against
+  the original single threaded ones, and time them.
+*/
+static void lsc_checkLightMaps(unsigned char *heightMap, int size,
+							   vec3 scale, vec3 dir)
+{
+	unsigned char *normalMap[2], *shadowMap[2], *lightMap[2];
+	double t[2];
+	int i, count, lit;
+	vec3 L;
 
-  This calculates one big texture map for the entire landscape, referred to as
-  the colourmap.
+	printf("Checking light maps against reference\n");
+
+	/* Normals - same calculation on one thread and on all of them */
+	srand(1);
+	lsc_texThreads = 1;
+	t[0] = thr_seconds();
+	normalMap[0] = (unsigned char*)lsc_calcNormals(heightMap, size, scale,
+												0.1f, 0.75f, 8);
+	t[0] = thr_seconds() - t[0];
+	srand(1);
+	lsc_texThreads = 0;
+	t[1] = thr_seconds();
+	normalMap[1] = (unsigned char*)lsc_calcNormals(heightMap, size, scale,
+												0.1f, 0.75f, 8);
+	t[1] = thr_seconds() - t[1];
+	if (normalMap[0] && normalMap[1]) {
+		printf("Normals: %.3fs -> %.3fs on %d threads, %s\n",
+				t[0], t[1], thr_numCPUs(),
+				memcmp(normalMap[0], normalMap[1], 3 * SQR(size)) ?
+											"DIFFERENT" : "identical");
+	}
 
-  Up to ten texture tga files are loaded and scaled in size by the factor
-  texScale. The files must be named colourn.tga, where n = 0 through 9. The
-  file with the lowest n is taken to represent the flattest terrain. The file
-  with the highest n is taken to represent the steepest terrain. E.g.
-
-    colour0    grass
-    colour1	   mud
-    colour2	   sand
-    colour3	   rock
-
-  One big texture map, size (texPerSide x texSize)^2 is allocated in memory.
-  For each point in the texture map a corresponding point in the heightmap 
-  is found and the values of normal.z and light are read from the normal and 
-  light maps (or more accurately, because the texture map point may lie
-  between heightmap points, the values of normal.z & light are linearly 
-  interpolated from the surrounding 4 heightmap points). The normal.z is 
-  converted to a gradient which is then scaled into the range 0 to N-1, where 
-  N is the number of texture maps read. The scaled gradient is then used as an
-  index to the required texture file from which a texel is copied to the 
-  heightmap texture (or if the scaled gradient is non-integer, two texels are
-  read from different texture files and the final texel is interpolated). If 
-  the scaled up texture files are smaller than the colourmap they will be
-  tiled. Finally the texel value may be scaled by the light value (can be
-  enabled / disabled with the prelit flag).
-
-  The colourmap is created in GL_RGB format (24bpp).
-
-
-  mode == 1:
-  ---------
+	/*
+	 * Shadows - different algorithm, count the points that changed. The
+	 * reference can miss shadows, but any it has that we don't are only
+	 * down to rounding, see lsc_calcShadows().
+	 */
+	t[0] = thr_seconds();
+	shadowMap[0] = lsc_calcShadowsRef(heightMap, size, scale, dir);
+	t[0] = thr_seconds() - t[0];
+	t[1] = thr_seconds();
+	shadowMap[1] = lsc_calcShadows(heightMap, size, scale, dir);
+	t[1] = thr_seconds() - t[1];
+	if (shadowMap[0] && shadowMap[1]) {
+		for (i = count = lit = 0; i < SQR(size); i++) {
+			if (shadowMap[0][i] != shadowMap[1][i]) {
+				count++;
+				if (!shadowMap[1][i])
+					lit++;
+			}
+		}
+		printf("Shadows: %.3fs -> %.3fs, %d of %d points differ, "
+				"%d lit here%s\n", t[0], t[1], count, SQR(size), lit,
+				(lit > SQR(size) / LSC_SHADOW_MAX_DIFF) ? " - TOO MANY" : "");
+	}
 
-  This calculates the blend maps used for alpha blended texture splatting.
+	/* Blur - must match exactly */
+	lightMap[0] = NULL;
+	if (normalMap[0] && shadowMap[0])
+		lightMap[0] = lsc_calcLighting(normalMap[0], shadowMap[0], size,
+										scale, 0.5f, 0.5f, dir);
+	lightMap[1] = lightMap[0] ? (unsigned char*)malloc(SQR(size)) : NULL;
+	if (lightMap[1]) {
+		vec3_cpy(dir, L);
+		vec3_div(L, scale, L);
+		vec3_norm(L);
+		vec3_mulS(L, -1.0f, L);
+		memcpy(lightMap[1], lightMap[0], SQR(size));
+		t[0] = thr_seconds();
+		lsc_blurLightMapRef(lightMap[0], size, L);
+		t[0] = thr_seconds() - t[0];
+		t[1] = thr_seconds();
+		lsc_blurLightMap(lightMap[1], size, L);
+		t[1] = thr_seconds() - t[1];
+		printf("Blur: %.3fs -> %.3fs, %s\n", t[0], t[1],
+				memcmp(lightMap[0], lightMap[1], SQR(size)) ?
+											"DIFFERENT" : "identical");
+	}
+	fflush(stdout);
 
-  Several blend maps are allocated sequentially in memory, each size
-  hmSize x hmSize. The number of blend maps created depends on the textures to
-  be used in texture splatting. The texture files must be named texturen.tga,
-  where n = 0 through 9. The file with the lowest n is taken to represent the
-  flattest terrain. The file with the highest n is taken to represent the
-  steepest terrain. E.g.
+	for (i = 0; i < 2; i++) {
+		if (normalMap[i])
+			free(normalMap[i]);
+		if (shadowMap[i])
+			free(shadowMap[i]);
+		if (lightMap[i])
+			free(lightMap[i]);
+	}
+}
+#endif
 
-    texture0    grass
-    texture1    mud
-    texture2    sand
-    texture3    rock
+/*
+  Texture sources for calcTextures().
 
-  One blend map is created for each texture map, plus one blend map for the
-  light map (e.g. 4 textures produces one light map plus 4 blend maps).
+  Everything needed to work out colourmap (mode 0) or blend map (mode 1)
+  texels one at a time, so the maps can also be built a piece at a time
+  (see the asynchronous texture build below).
+*/
+typedef struct lsctexsrc_str {
+	int mode;					/* 0 colourmap, 1 blend maps */
+	bool prelit;				/* Scale colourmap by light map */
+	char *normalMap;
+	unsigned char *lightMap;
+	int hmSize;
+	int textureMapSize;			/* Size of map being built */
+	int countLoaded;			/* Number of source textures */
+	int size[10];				/* Scaled source texture sizes (mode 0) */
+	unsigned char *data[10];	/* Scaled source textures (mode 0) */
+} *lsctexsrc;
 
-  The blend maps can be created in one of two formats, GL_ALPHA (8bpp) or
-  GL_RGBA (32bpp), depending on the value of the colourmap argument. If 
-  colourmap is null, GL_ALPHA format is used. If colourmap is non-null, it
-  is interpreted as a pointer to the colourmap created by mode 0 (above). In
-  this case the blend maps are created with GL_RGBA format and the colourmap
-  is copied into the RGB channels of each blend map.
+/*
+  loadTextures()
 
+  Load up to ten source texture files for calcTextures(), see below. In mode
+  0 copies of the colourn.tga files are kept, scaled by texScale. In mode 1
+  the texturen.tga files are only counted.
 */
-static unsigned char *lsc_calcTextures(int mode, bool prelit,
-									   unsigned char *heightMap,
-									   char *normalMap,
-									   unsigned char *lightMap,
-									   unsigned char *colourMap,
-									   int hmSize,
-									   int texPerSide, int texSize, 
-									   float texScale, int *numTextures)
+static void lsc_loadTextures(lsctexsrc s, float texScale)
 {
-	const float scaleNormal = 1.0f / 127.0f;
-	const float scaleLights = 1.0f / 255.0f;
-	
 	char filename[64];
-	int countLoaded = 0;
-	int size[10];
-	unsigned char *data[10];
-	unsigned char *textureMap;
-	int textureMapSize, i, X, Y;
+	int i;
 	float invTexScale = 1.0f / texScale;
 
-	/* Number of texture maps created */
-	*numTextures = 0;
+	s->countLoaded = 0;
 
 	/* Load up to ten texture files, must be square */
 	printf("Read textures");
@@ -656,7 +1266,7 @@ static unsigned char *lsc_calcTextures(int mode, bool prelit,
 		printf(".");
 		fflush(stdout);
 
-		if (mode == 0)
+		if (s->mode == 0)
 			/* If colour%d.tga found */
 			sprintf(filename, "data/colour%d.tga", i);
 		else
@@ -666,28 +1276,28 @@ static unsigned char *lsc_calcTextures(int mode, bool prelit,
 		if (f && f->data && f->width == f->height
 			&& (f->depth == 24 || f->depth == 32)) {
 
-			if (mode == 0) {
+			if (s->mode == 0) {
 
 				if (f->depth == 32)
 					tga_stripAlpha(f);
 			
 				/* Copy into memory, scaling if necessary */
-				size[countLoaded] = (int)(f->width * texScale);
-				data[countLoaded] = (unsigned char*)malloc(
-									3*SQR(size[countLoaded]));
-				if (!data[countLoaded]) {
+				s->size[s->countLoaded] = (int)(f->width * texScale);
+				s->data[s->countLoaded] = (unsigned char*)malloc(
+									3*SQR(s->size[s->countLoaded]));
+				if (!s->data[s->countLoaded]) {
 					err_report("lsc_calcTextures: cannot allocate %d bytes",
-									3*SQR(size[countLoaded]));
+									3*SQR(s->size[s->countLoaded]));
 					continue;
 				}
-				if (size[countLoaded] == (int)f->width) {
+				if (s->size[s->countLoaded] == (int)f->width) {
 					/* Copy texture to memory 1:1 */
-					memcpy(data[countLoaded], f->data, 3*SQR(size[countLoaded]));
+					memcpy(s->data[s->countLoaded], f->data, 3*SQR(s->size[s->countLoaded]));
 				}
 				else {
 					/* Copy texture into memory, scaling by texScale */
 					int j, k;
-					for (k = 0; k < size[countLoaded]; k++) {
+					for (k = 0; k < s->size[s->countLoaded]; k++) {
 						float fsk = k * invTexScale;
 						int sk0 = (int)floor(fsk);
 						int sk1 = (int)ceil(fsk);
@@ -695,7 +1305,7 @@ static unsigned char *lsc_calcTextures(int mode, bool prelit,
 							sk0 = (int)f->width - 1;
 						if (sk1 >= (int)f->width)
 							sk1 = (int)f->width - 1;
-						for (j = 0; j < size[countLoaded]; j++) {
+						for (j = 0; j < s->size[s->countLoaded]; j++) {
 							float fsj = j * invTexScale;
 							int sj0 = (int)floor(fsj);
 							int sj1 = (int)ceil(fsj);
@@ -704,7 +1314,7 @@ static unsigned char *lsc_calcTextures(int mode, bool prelit,
 							if (sj1 >= (int)f->width)
 								sj1 = (int)f->width - 1;
 							if (sk0 == sk1 && sj0 == sj1) {
-								memcpy(&data[countLoaded][3*(k*size[countLoaded]+j)],
+								memcpy(&s->data[s->countLoaded][3*(k*s->size[s->countLoaded]+j)],
 									&(f->data[3*(sk0*f->width+sj0)]), 3);
 							}
 							else {
@@ -751,7 +1361,7 @@ static unsigned char *lsc_calcTextures(int mode, bool prelit,
 										tex[l] = 255.0f;
 									ctex[l] = (unsigned char)(tex[l]);
 								}
-								memcpy(&data[countLoaded][3*(k*size[countLoaded]+j)],
+								memcpy(&s->data[s->countLoaded][3*(k*s->size[s->countLoaded]+j)],
 												ctex, 3);
 							}
 						}
@@ -759,308 +1369,412 @@ static unsigned char *lsc_calcTextures(int mode, bool prelit,
 				}
 			}
 
-			countLoaded++;
+			s->countLoaded++;
 		}
 		
 		if (f)
 			tga_destroy(f);
 	}
 
-	if (mode == 0) {
-	
-		printf("\nMerge textures");
-		fflush(stdout);
 
-		/* Now allocate memory for the colourmap */
-		textureMapSize = texPerSide * texSize;
-		textureMap = (unsigned char*)malloc(3*SQR(textureMapSize));
-		if (!textureMap) {
-			err_report("lsc_calcTextures: cannot allocate %d bytes",
-				3*SQR(textureMapSize));
-			for (i = 0; i < countLoaded; i++)
-				free(data[i]);
-			return textureMap;
-		}
+	/* AW TODO: currently the engine can only handle three splat textures */
+	if (s->mode == 1 && s->countLoaded > 3)
+		s->countLoaded = 3;
+}
 
-		/* Number of texture maps created */
-		*numTextures = 1;
+/*
+  freeTextures()
+
+  Free the source textures loaded by loadTextures().
+*/
+static void lsc_freeTextures(lsctexsrc s)
+{
+	int i;
+
+	if (s->mode == 0) {
+		for (i = 0; i < s->countLoaded; i++)
+			free(s->data[i]);
 	}
-	else {
+	s->countLoaded = 0;
+}
 
-		/* mode == 1 */
+/*
+  calcTexel()
 
-		printf("\nGenerate blend maps");
-		fflush(stdout);
+  Work out one texel at X, Y of the map described in calcTextures() below.
 
-		/* AW TODO: currently the engine can only handle three splat textures */
-		if (countLoaded > 3)
-			countLoaded = 3;
+  In mode 0 the RGB colourmap texel is written to out. In mode 1 the light
+  map texel and one texel for each blend map are written to out, layerSize
+  bytes apart. If colour is null these are GL_ALPHA texels. If colour is
+  non-null it points to the colourmap texel at X, Y and GL_RGBA texels are
+  written, with the colourmap texel in the RGB channels.
+*/
+static void lsc_calcTexel(lsctexsrc s, int X, int Y, unsigned char *colour,
+						  unsigned char *out, int layerSize)
+{
+	const float scaleNormal = 1.0f / 127.0f;
+	const float scaleLights = 1.0f / 255.0f;
 
-		/* One to one for blend maps */
-		textureMapSize = hmSize;
-		if (colourMap) {
-			textureMap = (unsigned char*)malloc(4*(countLoaded+1)*SQR(textureMapSize));
-			if (!textureMap) {
-				err_report("lsc_calcTextures: cannot allocate %d bytes",
-					4*countLoaded*SQR(textureMapSize));
-				return textureMap;
-			}
+	int hmSize = s->hmSize;
+	int textureMapSize = s->textureMapSize;
+	char *normalMap = s->normalMap;
+	unsigned char *lightMap = s->lightMap;
+	int countLoaded = s->countLoaded;
+	int i;
+	float r, g, b;
+
+	/* Scale y into the height map */
+	float fhY = (float)Y * (float)hmSize / (float)textureMapSize;
+	int hY0 = (int)floor(fhY);
+	int hY1 = (int)ceil(fhY);
+
+	/* Scale x into the height map */
+	float fhX = (float)X * (float)hmSize / (float)textureMapSize;
+	int hX0 = (int)floor(fhX);
+	int hX1 = (int)ceil(fhX);
+
+	/* Get gradient & light, lerping if necessary */
+	float grad;
+	float light;
+	if (hX0 == hX1 && hY0 == hY1) {
+		grad = lsc_normalMapGet(normalMap, hmSize, hX0, hY0)[2];
+		light = lsc_lightMapGet(lightMap, hmSize, hX0, hY0);
+	}
+	else {
+		float scale;
+		float grad00 = lsc_normalMapGet(normalMap, hmSize, hX0, hY0)[2];
+		float grad01 = lsc_normalMapGet(normalMap, hmSize, hX1, hY0)[2];
+		float grad10 = lsc_normalMapGet(normalMap, hmSize, hX0, hY1)[2];
+		float grad11 = lsc_normalMapGet(normalMap, hmSize, hX1, hY1)[2];
+		float light00 = lsc_lightMapGet(lightMap, hmSize, hX0, hY0);
+		float light01 = lsc_lightMapGet(lightMap, hmSize, hX1, hY0);
+		float light10 = lsc_lightMapGet(lightMap, hmSize, hX0, hY1);
+		float light11 = lsc_lightMapGet(lightMap, hmSize, hX1, hY1);
+		float grad0 = grad00;
+		float grad1 = grad10;
+		float light0 = light00;
+		float light1 = light10;
+		if (hX0 != hX1) {
+			/* Lerp x */
+			scale = (float)hX1 - fhX;
+			grad0 *= scale;
+			grad1 *= scale;
+			light0 *= scale;
+			light1 *= scale;
+			scale = fhX - (float)hX0;
+			grad0 += scale * grad01;
+			grad1 += scale * grad11;
+			light0 += scale * light01;
+			light1 += scale * light11;
 		}
-		else {
-			textureMap = (unsigned char*)malloc((countLoaded+1)*SQR(textureMapSize));
-			if (!textureMap) {
-				err_report("lsc_calcTextures: cannot allocate %d bytes",
-					countLoaded*SQR(textureMapSize));
-				return textureMap;
-			}
+		grad = grad0;
+		light = light0;
+		if (hY0 != hY1) {
+			/* Lerp y */
+			scale = (float)hY1 - fhY;
+			grad *= scale;
+			light *= scale;
+			scale = fhY - (float)hY0;
+			grad += scale * grad1;
+			light += scale * light1;
 		}
-
-		/* Number of texture maps created */
-		*numTextures = countLoaded + 1;
 	}
+	/* Scale grad to range 0 to 1 */
+	grad *= scaleNormal;
 	
-	/* Tile the source textures into the colourmap based on height map
-	   gradient, i.e. the size of the height map normal's z component. */
-	for (Y = 0; Y < textureMapSize; Y++) {
-		
-		/* Scale y into the height map */
-		float fhY = (float)Y * (float)hmSize / (float)textureMapSize;
-		int hY0 = (int)floor(fhY);
-		int hY1 = (int)ceil(fhY);
+	/*
+	 * Convert grad from normal.z to true gradient in range 0 to 1
+	 */
+	grad = 2.0f * acos(grad) / M_PI;
+	if (grad < 0.0f)
+		grad = 0.0f;
+	else if (grad > 1.0f)
+		grad = 1.0f;
+	
+	/* Scale light to range 0 to 1 */
+	light *= scaleLights;
+	if (light < 0.0f)
+		light = 0.0f;
+	else if (light > 1.0f)
+		light = 1.0f;
+
+	if (s->mode == 0) {
+	
+		/* Pixel colour if no textures loaded */
+		r = 200.0;
+		g =  25.0;
+		b = 200.0;
+	
+		/* Use the gradient to get indexes to the source textures */
+		if (countLoaded) {
+			float fIndex = grad * (float)(countLoaded - 1);
+			int Index0 = (int)floor(fIndex);
+			int Index1 = (int)ceil(fIndex);
+			int sourceSize = s->size[Index0];
+			int sourceX = X%sourceSize;
+			int sourceY = Y%sourceSize;
+			
+			r = s->data[Index0][3*(sourceY*sourceSize + sourceX) + 0];
+			g = s->data[Index0][3*(sourceY*sourceSize + sourceX) + 1];
+			b = s->data[Index0][3*(sourceY*sourceSize + sourceX) + 2];
+			
+			if (Index0 != Index1) {
+			
+				/* Lerp the texture between Index0 and Index1 */
+				float r2, g2, b2;
+				float scale = (float)Index1 - fIndex;
+				r *= scale;
+				g *= scale;
+				b *= scale;
+			
+				sourceSize = s->size[Index1];
+				sourceX = X%sourceSize;
+				sourceY = Y%sourceSize;
+			
+				r2 = s->data[Index1][3*(sourceY*sourceSize + sourceX) + 0];
+				g2 = s->data[Index1][3*(sourceY*sourceSize + sourceX) + 1];
+				b2 = s->data[Index1][3*(sourceY*sourceSize + sourceX) + 2];
+			
+				scale = fIndex - (float)Index0;
+			
+				r += r2 * scale;
+				g += g2 * scale;
+				b += b2 * scale;
+			}
+		}
 		
-		/* Show progress */
-		if (!(Y & 0x3F)) {
-			printf(".");
-			fflush(stdout);
+		if (s->prelit) {
+			/* Apply lighting model */
+			r *= light;
+			g *= light;
+			b *= light;
 		}
 
-		for (X = 0; X < textureMapSize; X++) {
-			float r, g, b;
+		/* Range check */
+		if (r < 0.0f)
+			r = 0.0f;
+		else if (r > 255.0f)
+			r = 255.0f;
+		if (g < 0.0f)
+			g = 0.0f;
+		else if (g > 255.0f)
+			g = 255.0f;
+		if (b < 0.0f)
+			b = 0.0f;
+		else if (b > 255.0f)
+			b = 255.0f;
+	
+		/* Write to colourmap */
+		out[0] = (unsigned char)r;
+		out[1] = (unsigned char)g;
+		out[2] = (unsigned char)b;
+	}
+	else {
 
-			/* Scale x into the height map */
-			float fhX = (float)X * (float)hmSize / (float)textureMapSize;
-			int hX0 = (int)floor(fhX);
-			int hX1 = (int)ceil(fhX);
+		/* mode == 1 */
+
+		/* Use the gradient to get indexes to the source textures */
+		if (countLoaded) {
+			float fIndex = grad * (float)(countLoaded - 1);
+			unsigned char* map = out;
+			int Index0, Index1;
+			float scale0, scale1;
+
+			Index0 = (int)floor(fIndex);
+			Index1 = (int)ceil(fIndex);
+			if (Index1 == Index0)
+				Index1++;
+			scale0 = (float)Index1 - fIndex;
+			scale1 = fIndex - (float)Index0;
 			
-			/* Get gradient & light, lerping if necessary */
-			float grad;
-			float light;
-			if (hX0 == hX1 && hY0 == hY1) {
-				grad = lsc_normalMapGet(normalMap, hmSize, hX0, hY0)[2];
-				light = lsc_lightMapGet(lightMap, hmSize, hX0, hY0);
+			/* Write to light map */
+			if (colour) {
+				map[0] = colour[0];
+				map[1] = colour[1];
+				map[2] = colour[2];
+				map[3] = (unsigned char)(light * 255.0f);
 			}
 			else {
-				float scale;
-				float grad00 = lsc_normalMapGet(normalMap, hmSize, hX0, hY0)[2];
-				float grad01 = lsc_normalMapGet(normalMap, hmSize, hX1, hY0)[2];
-				float grad10 = lsc_normalMapGet(normalMap, hmSize, hX0, hY1)[2];
-				float grad11 = lsc_normalMapGet(normalMap, hmSize, hX1, hY1)[2];
-				float light00 = lsc_lightMapGet(lightMap, hmSize, hX0, hY0);
-				float light01 = lsc_lightMapGet(lightMap, hmSize, hX1, hY0);
-				float light10 = lsc_lightMapGet(lightMap, hmSize, hX0, hY1);
-				float light11 = lsc_lightMapGet(lightMap, hmSize, hX1, hY1);
-				float grad0 = grad00;
-				float grad1 = grad10;
-				float light0 = light00;
-				float light1 = light10;
-				if (hX0 != hX1) {
-					/* Lerp x */
-					scale = (float)hX1 - fhX;
-					grad0 *= scale;
-					grad1 *= scale;
-					light0 *= scale;
-					light1 *= scale;
-					scale = fhX - (float)hX0;
-					grad0 += scale * grad01;
-					grad1 += scale * grad11;
-					light0 += scale * light01;
-					light1 += scale * light11;
-				}
-				grad = grad0;
-				light = light0;
-				if (hY0 != hY1) {
-					/* Lerp y */
-					scale = (float)hY1 - fhY;
-					grad *= scale;
-					light *= scale;
-					scale = fhY - (float)hY0;
-					grad += scale * grad1;
-					light += scale * light1;
-				}
+				map[0] = (unsigned char)(light * 255.0f);
 			}
-			/* Scale grad to range 0 to 1 */
-			grad *= scaleNormal;
-			
-			/*
-			 * Convert grad from normal.z to true gradient in range 0 to 1
-			 */
-			grad = 2.0f * acos(grad) / M_PI;
-			if (grad < 0.0f)
-				grad = 0.0f;
-			else if (grad > 1.0f)
-				grad = 1.0f;
-			
-			/* Scale light to range 0 to 1 */
-			light *= scaleLights;
-			if (light < 0.0f)
-				light = 0.0f;
-			else if (light > 1.0f)
-				light = 1.0f;
-
-			if (mode == 0) {
-			
-				/* Pixel colour if no textures loaded */
-				r = 200.0;
-				g =  25.0;
-				b = 200.0;
-			
-				/* Use the gradient to get indexes to the source textures */
-				if (countLoaded) {
-					float fIndex = grad * (float)(countLoaded - 1);
-					int Index0 = (int)floor(fIndex);
-					int Index1 = (int)ceil(fIndex);
-					int sourceSize = size[Index0];
-					int sourceX = X%sourceSize;
-					int sourceY = Y%sourceSize;
-					
-					r = data[Index0][3*(sourceY*sourceSize + sourceX) + 0];
-					g = data[Index0][3*(sourceY*sourceSize + sourceX) + 1];
-					b = data[Index0][3*(sourceY*sourceSize + sourceX) + 2];
-					
-					if (Index0 != Index1) {
-					
-						/* Lerp the texture between Index0 and Index1 */
-						float r2, g2, b2;
-						float scale = (float)Index1 - fIndex;
-						r *= scale;
-						g *= scale;
-						b *= scale;
-					
-						sourceSize = size[Index1];
-						sourceX = X%sourceSize;
-						sourceY = Y%sourceSize;
-					
-						r2 = data[Index1][3*(sourceY*sourceSize + sourceX) + 0];
-						g2 = data[Index1][3*(sourceY*sourceSize + sourceX) + 1];
-						b2 = data[Index1][3*(sourceY*sourceSize + sourceX) + 2];
-					
-						scale = fIndex - (float)Index0;
-					
-						r += r2 * scale;
-						g += g2 * scale;
-						b += b2 * scale;
-					}
+
+			/* Write to blend maps */
+			map += layerSize;
+			for (i = 0; i < countLoaded; i++) {
+				if (colour) {
+					map[0] = colour[0];
+					map[1] = colour[1];
+					map[2] = colour[2];
+					if (i == Index0)
+						map[3] = (unsigned char)(scale0 * light * 255.0f);
+					else if (i == Index1)
+						map[3] = (unsigned char)(scale1 * light * 255.0f);
+					else
+						map[3] = 0;
 				}
-				
-				if (prelit) {
-					/* Apply lighting model */
-					r *= light;
-					g *= light;
-					b *= light;
+				else {
+					if (i == Index0)
+						map[0] = (unsigned char)(scale0 * light * 255.0f);
+					else if (i == Index1)
+						map[0] = (unsigned char)(scale1 * light * 255.0f);
+					else
+						map[0] = 0;
 				}
-
-				/* Range check */
-				if (r < 0.0f)
-					r = 0.0f;
-				else if (r > 255.0f)
-					r = 255.0f;
-				if (g < 0.0f)
-					g = 0.0f;
-				else if (g > 255.0f)
-					g = 255.0f;
-				if (b < 0.0f)
-					b = 0.0f;
-				else if (b > 255.0f)
-					b = 255.0f;
-			
-				/* Write to colourmap */
-				textureMap[3*(X + Y*textureMapSize) + 0] = (unsigned char)r;
-				textureMap[3*(X + Y*textureMapSize) + 1] = (unsigned char)g;
-				textureMap[3*(X + Y*textureMapSize) + 2] = (unsigned char)b;
+				map += layerSize;
 			}
-			else {
+		}
+	}
+}
 
-				/* mode == 1 */
-
-				/* Use the gradient to get indexes to the source textures */
-				if (countLoaded) {
-					float fIndex = grad * (float)(countLoaded - 1);
-					unsigned char* map = textureMap;
-					int Index0, Index1;
-					float scale0, scale1;
-
-					Index0 = (int)floor(fIndex);
-					Index1 = (int)ceil(fIndex);
-					if (Index1 == Index0)
-						Index1++;
-					scale0 = (float)Index1 - fIndex;
-					scale1 = fIndex - (float)Index0;
-					
-					/* Write to light map */
-					if (colourMap) {
-						map[4 * (X + Y*textureMapSize) + 0] =
-							colourMap[3 * (X + Y*textureMapSize) + 0];
-						map[4 * (X + Y*textureMapSize) + 1] =
-							colourMap[3 * (X + Y*textureMapSize) + 1];
-						map[4 * (X + Y*textureMapSize) + 2] =
-							colourMap[3 * (X + Y*textureMapSize) + 2];
-						map[4 * (X + Y*textureMapSize) + 3] =
-									(unsigned char)(light * 255.0f);
-					}
-					else {
-						map[X + Y*textureMapSize] =
-									(unsigned char)(light * 255.0f);
-					}
+/*
+  calcTextures()
 
-					/* Write to blend maps */
-					if (colourMap)
-						map += 4*SQR(textureMapSize);
-					else
-						map += SQR(textureMapSize);
-					for (i = 0; i < countLoaded; i++) {
-						if (colourMap) {
-							map[4 * (X + Y*textureMapSize) + 0] =
-								colourMap[3 * (X + Y*textureMapSize) + 0];
-							map[4 * (X + Y*textureMapSize) + 1] =
-								colourMap[3 * (X + Y*textureMapSize) + 1];
-							map[4 * (X + Y*textureMapSize) + 2] =
-								colourMap[3 * (X + Y*textureMapSize) + 2];
-							if (i == Index0)
-								map[4 * (X + Y*textureMapSize) + 3] =
-											(unsigned char)(scale0 * light * 255.0f);
-							else if (i == Index1)
-								map[4 * (X + Y*textureMapSize) + 3] =
-											(unsigned char)(scale1 * light * 255.0f);
-							else
-								map[4 * (X + Y*textureMapSize) + 3] = 0;
-						}
-						else {
-							if (i == Index0)
-								map[X + Y*textureMapSize] =
-											(unsigned char)(scale0 * light * 255.0f);
-							else if (i == Index1)
-								map[X + Y*textureMapSize] =
-											(unsigned char)(scale1 * light * 255.0f);
-							else
-								map[X + Y*textureMapSize] = 0;
-						}
+  mode == 0:
+  ---------
 
-						if (colourMap)
-							map += 4*SQR(textureMapSize);
-						else
-							map += SQR(textureMapSize);
-					}
-				}
-			}
+  This calculates one big texture map for the entire landscape, referred to as
+  the colourmap.
+
+  Up to ten texture tga files are loaded and scaled in size by the factor
+  texScale. The files must be named colourn.tga, where n = 0 through 9. The
+  file with the lowest n is taken to represent the flattest terrain. The file
+  with the highest n is taken to represent the steepest terrain. E.g.
+
+    colour0    grass
+    colour1	   mud
+    colour2	   sand
+    colour3	   rock
+
+  One big texture map, size (texPerSide x texSize)^2 is allocated in memory.
+  For each point in the texture map a corresponding point in the heightmap 
+  is found and the values of normal.z and light are read from the normal and 
+  light maps (or more accurately, because the texture map point may lie
+  between heightmap points, the values of normal.z & light are linearly 
+  interpolated from the surrounding 4 heightmap points). The normal.z is 
+  converted to a gradient which is then scaled into the range 0 to N-1, where 
+  N is the number of texture maps read. The scaled gradient is then used as an
+  index to the required texture file from which a texel is copied to the 
+  heightmap texture (or if the scaled gradient is non-integer, two texels are
+  read from different texture files and the final texel is interpolated). If 
+  the scaled up texture files are smaller than the colourmap they will be
+  tiled. Finally the texel value may be scaled by the light value (can be
+  enabled / disabled with the prelit flag).
+
+  The colourmap is created in GL_RGB format (24bpp).
+
+
+  mode == 1:
+  ---------
+
+  This calculates the blend maps used for alpha blended texture splatting.
+
+  Several blend maps are allocated sequentially in memory, each size
+  hmSize x hmSize. The number of blend maps created depends on the textures to
+  be used in texture splatting. The texture files must be named texturen.tga,
+  where n = 0 through 9. The file with the lowest n is taken to represent the
+  flattest terrain. The file with the highest n is taken to represent the
+  steepest terrain. E.g.
+
+    texture0    grass
+    texture1    mud
+    texture2    sand
+    texture3    rock
+
+  One blend map is created for each texture map, plus one blend map for the
+  light map (e.g. 4 textures produces one light map plus 4 blend maps).
+
+  The blend maps can be created in one of two formats, GL_ALPHA (8bpp) or
+  GL_RGBA (32bpp), depending on the value of the colourmap argument. If 
+  colourmap is null, GL_ALPHA format is used. If colourmap is non-null, it
+  is interpreted as a pointer to the colourmap created by mode 0 (above). In
+  this case the blend maps are created with GL_RGBA format and the colourmap
+  is copied into the RGB channels of each blend map.
+
+*/
+static unsigned char *lsc_calcTextures(int mode, bool prelit,
+									   unsigned char *heightMap,
+									   char *normalMap,
+									   unsigned char *lightMap,
+									   unsigned char *colourMap,
+									   int hmSize,
+									   int texPerSide, int texSize, 
+									   float texScale, int *numTextures)
+{
+	struct lsctexsrc_str s;
+	unsigned char *textureMap;
+	int textureMapSize, bpp, X, Y;
+
+	/* Number of texture maps created */
+	*numTextures = 0;
+
+	s.mode = mode;
+	s.prelit = prelit;
+	s.normalMap = normalMap;
+	s.lightMap = lightMap;
+	s.hmSize = hmSize;
+	lsc_loadTextures(&s, texScale);
+
+	if (mode == 0) {
+	
+		printf("\nMerge textures");
+		fflush(stdout);
+
+		/* Now allocate memory for the colourmap */
+		textureMapSize = texPerSide * texSize;
+		bpp = 3;
+		textureMap = (unsigned char*)malloc(3*SQR(textureMapSize));
+		if (!textureMap) {
+			err_report("lsc_calcTextures: cannot allocate %d bytes",
+				3*SQR(textureMapSize));
+			lsc_freeTextures(&s);
+			return textureMap;
+		}
+
+		/* Number of texture maps created */
+		*numTextures = 1;
+	}
+	else {
+
+		/* mode == 1 */
+
+		printf("\nGenerate blend maps");
+		fflush(stdout);
+
+		/* One to one for blend maps */
+		textureMapSize = hmSize;
+		bpp = colourMap ? 4 : 1;
+		textureMap = (unsigned char*)malloc(
+						bpp*(s.countLoaded+1)*SQR(textureMapSize));
+		if (!textureMap) {
+			err_report("lsc_calcTextures: cannot allocate %d bytes",
+				bpp*(s.countLoaded+1)*SQR(textureMapSize));
+			return textureMap;
 		}
+
+		/* Number of texture maps created */
+		*numTextures = s.countLoaded + 1;
 	}
+	s.textureMapSize = textureMapSize;
 	
-	if (mode == 0) {
+	/* Tile the source textures into the colourmap based on height map
+	   gradient, i.e. the size of the height map normal's z component. */
+	for (Y = 0; Y < textureMapSize; Y++) {
+		
+		/* Show progress */
+		if (!(Y & 0x3F)) {
+			printf(".");
+			fflush(stdout);
+		}
 
-		/* Free up temporary storage */
-		for (i = 0; i < countLoaded; i++)
-			free(data[i]);
+		for (X = 0; X < textureMapSize; X++)
+			lsc_calcTexel(&s, X, Y,
+				colourMap ? &colourMap[3*(X + Y*textureMapSize)] : NULL,
+				&textureMap[bpp*(X + Y*textureMapSize)],
+				bpp*SQR(textureMapSize));
 	}
+	
+	/* Free up temporary storage */
+	lsc_freeTextures(&s);
 
 	printf("\n");
 	fflush(stdout);
@@ -1137,6 +1851,10 @@ bool lsc_createColourMapTexObjs(lsc l, unsigned char *hm, float texScale)
 
 		/* Create colourmap */
 
+#ifdef LSC_CHECK_LIGHTMAPS
+		lsc_checkLightMaps(hm, hmSize, scale, lightDir);
+#endif
+
 		/* AW TODO: calculate best values automatically */
 		/* This was tuned to a 2048 map single texture map */
 		/* normalMap = lsc_calcNormals(hm, hmSize, scale, 0.1f, 0.75f, 32); */
@@ -1288,6 +2006,42 @@ bool lsc_createColourMapTexObjs(lsc l, unsigned char *hm, float texScale)
 	return true;
 }
 
+/*
+  loadSplatTexObjs()
+
+  Load the texture files used for texture splatting into texture objects.
+  Returns the number loaded.
+*/
+static int lsc_loadSplatTexObjs(lsc l)
+{
+	int k, countLoaded = 0;
+
+	for (k = 0; k < 10; k++) {
+		tga f;
+		char filename[64];
+		
+		/* If texture%d.tga found and is square */
+		sprintf(filename, "data/texture%d.tga", k);
+		f = tga_create(filename);
+		if (f && f->data && f->width == f->height
+			&& (f->depth == 24 || f->depth == 32)) {
+			tga_destroy(f);
+			l->splatTextureTexObj[countLoaded] = 
+				txm_addTgaFile(filename, false, true, true);
+			countLoaded++;
+		}
+		else if (f) {
+			tga_destroy(f);
+		}
+
+		/* AW TODO: currently the engine can only handle three splat textures */
+		if (countLoaded >= 3)
+			break;
+	}
+
+	return countLoaded;
+}
+
 /*
   createTextureSplatTexObjs()
 
@@ -1318,7 +2072,7 @@ bool lsc_createTextureSplatTexObjs(lsc l, unsigned char *hm, float texScale)
 	unsigned char *alphaMap   = NULL;
 	int textureMapSize = l->texTile * l->texSize;
 	unsigned char *textureMap = NULL;
-	int k, countLoaded;
+	int k;
 	char fileName[30];
 	FILE *f;
 	bool readFromFile = false;
@@ -1529,29 +2283,637 @@ bool lsc_createTextureSplatTexObjs(lsc l, unsigned char *hm, float texScale)
 	free(alphas);
 
 	/* Load splat textures */
-	countLoaded = 0;
-	for (k = 0; k < 10; k++) {
-		tga f;
-		char filename[64];
-		
-		/* If texture%d.tga found and is square */
-		sprintf(filename, "data/texture%d.tga", k);
-		f = tga_create(filename);
-		if (f && f->data && f->width == f->height
-			&& (f->depth == 24 || f->depth == 32)) {
-			tga_destroy(f);
-			l->splatTextureTexObj[countLoaded] = 
-				txm_addTgaFile(filename, false, true, true);
-			countLoaded++;
+	lsc_loadSplatTexObjs(l);
+
+	return true;
+}
+
+/*
+  Asynchronous texture build.
+
+  createColourMapTexObjs() and createTextureSplatTexObjs() work out the whole
+  colourmap and all the blend maps before the first frame is drawn.
+  startTexObjs() instead creates all the texture objects at once, filled
+  with a flat placeholder colour, and assigns them to the patches. The maps
+  are then worked out on worker threads, LSC_TEX_BLOCK x LSC_TEX_BLOCK texels
+  at a time, straight into a CPU copy of each texture object and its
+  mipmaps. Each frame the render thread calls updateTexObjs(), which uploads
+  finished blocks with glTexSubImage2D() up to a byte budget, so the
+  landscape sharpens a few patches at a time.
+
+  Mipmap levels smaller than a block are rebuilt by the render thread from
+  the level above as each block is uploaded.
+
+  The Colour%d.raw and UnlitColour%d.raw files are read if they exist, but
+  are only written by the synchronous functions.
+*/
+
+#define LSC_TEX_BLOCK		64		/* Block size in texels */
+#define LSC_TEX_MAX_LAYERS	4		/* Light map + three blend maps */
+
+#define LSC_TEX_PENDING		0		/* Block states */
+#define LSC_TEX_READY		1
+#define LSC_TEX_DONE		2
+
+typedef struct lsctexset_str {
+	int mapSize;				/* Size of whole map in texels */
+	int tileSize;				/* Texture object size */
+	int perSide;				/* Texture objects per map side */
+	int numLayers;				/* Texture objects per tile */
+	int bpp;					/* Bytes per texel */
+	int format;					/* GL_RGB or GL_RGBA */
+	int blockSize;				/* Block size, up to LSC_TEX_BLOCK */
+	int blocksPerSide;			/* Blocks per texture object side */
+	int numBlocks;
+	int numLevels;				/* Mipmap levels */
+	int *texObjs;				/* Texture objects, by layer then tile */
+	unsigned char **mips;		/* CPU copy of each texture object */
+	unsigned char *file;		/* Map read from file, or NULL */
+} *lsctexset;
+
+typedef struct lsctexbuild_str {
+	lsc l;
+	unsigned char *hm;
+	float texScale;
+	int numSets;
+	struct lsctexset_str set[2];	/* Colourmap, blend maps */
+	struct lsctexsrc_str colour;	/* Lit colourmap */
+	struct lsctexsrc_str unlit;		/* Unlit colourmap for blend maps */
+	struct lsctexsrc_str blend;		/* Blend maps */
+	int numThreads;
+	int totalBlocks;
+	int firstBlock;					/* First block not uploaded */
+	volatile long next;				/* Next block to work out */
+	volatile long cancel;			/* Stop working out blocks */
+	volatile long *state;			/* Block states */
+	thr job;
+} *lsctexbuild;
+
+/*
+  texLevel()
+
+  Return a pointer to mipmap level m of the CPU copy of a texture object.
+*/
+static unsigned char *lsc_texLevel(lsctexset s, int obj, int m)
+{
+	unsigned char *p = s->mips[obj];
+	int i;
+
+	for (i = 0; i < m; i++)
+		p += s->bpp * SQR(s->tileSize >> i);
+	return p;
+}
+
+/*
+  texHalve()
+
+  Work out a w x h region at x0, y0 of a mipmap level from the 2 x 2 texels
+  under each texel in the level above.
+*/
+static void lsc_texHalve(unsigned char *src, unsigned char *dst, int dstSize,
+						 int bpp, int x0, int y0, int w, int h)
+{
+	int srcSize = dstSize << 1;
+	int x, y, c;
+	unsigned char *s0, *s1, *d;
+
+	for (y = y0; y < y0 + h; y++) {
+		s0 = &src[bpp * (2*y*srcSize + 2*x0)];
+		s1 = s0 + bpp * srcSize;
+		d = &dst[bpp * (y*dstSize + x0)];
+		for (x = 0; x < w; x++) {
+			for (c = 0; c < bpp; c++)
+				d[c] = (unsigned char)((s0[c] + s0[c + bpp] +
+										s1[c] + s1[c + bpp] + 2) >> 2);
+			s0 += 2 * bpp;
+			s1 += 2 * bpp;
+			d += bpp;
 		}
-		else if (f) {
-			tga_destroy(f);
+	}
+}
+
+/*
+  texSource()
+
+  Find the map texel that goes in texel X, Y of texture object i, j. This
+  follows the way createColourMapTexObjs() and createTextureSplatTexObjs()
+  cut up the maps, so that each texture object tiles seamlessly with its
+  neighbours.
+*/
+static void lsc_texSource(lsctexset s, int i, int j, int X, int Y,
+						  int *mX, int *mY)
+{
+	int last = s->tileSize - 1;
+
+	if (Y < last) {
+		*mY = j * s->tileSize + Y;
+		if (X < last)
+			*mX = i * s->tileSize + X;
+		else
+			*mX = ((i + 1) * s->tileSize) % s->mapSize;
+	}
+	else {
+		*mY = ((j + 1) * s->tileSize) % s->mapSize;
+		if (s->perSide == 1 && X == last)
+			*mX = 0;
+		else
+			*mX = i * s->tileSize + X;
+	}
+}
+
+/*
+  texFindBlock()
+
+  Get the set, texture object tile and texel position of block b.
+*/
+static lsctexset lsc_texFindBlock(lsctexbuild b, int block,
+								  int *tile, int *X0, int *Y0)
+{
+	lsctexset s = &b->set[0];
+	int k;
+
+	for (k = 0; k < b->numSets - 1 && block >= s->numBlocks; k++) {
+		block -= s->numBlocks;
+		s++;
+	}
+	*tile = block / SQR(s->blocksPerSide);
+	block %= SQR(s->blocksPerSide);
+	*X0 = (block % s->blocksPerSide) * s->blockSize;
+	*Y0 = (block / s->blocksPerSide) * s->blockSize;
+	return s;
+}
+
+/*
+  texCalcBlock()
+
+  Work out one block of texels, and its mipmaps down to one texel.
+*/
+static void lsc_texCalcBlock(lsctexbuild b, int block)
+{
+	int tile, X0, Y0, X, Y, mX, mY, k, m, n;
+	lsctexset s = lsc_texFindBlock(b, block, &tile, &X0, &Y0);
+	int tiles = SQR(s->perSide);
+	unsigned char *level[LSC_TEX_MAX_LAYERS];
+	unsigned char texel[4 * LSC_TEX_MAX_LAYERS];
+	unsigned char rgb[3];
+
+	for (k = 0; k < s->numLayers; k++)
+		level[k] = lsc_texLevel(s, k * tiles + tile, 0);
+
+	for (Y = Y0; Y < Y0 + s->blockSize; Y++) {
+		for (X = X0; X < X0 + s->blockSize; X++) {
+			n = s->bpp * (X + Y * s->tileSize);
+			lsc_texSource(s, tile % s->perSide, tile / s->perSide,
+							X, Y, &mX, &mY);
+			if (s == &b->set[0]) {
+				/* Colourmap */
+				if (s->file)
+					memcpy(&level[0][n],
+							&s->file[3 * (mX + mY * s->mapSize)], 3);
+				else
+					lsc_calcTexel(&b->colour, mX, mY, NULL, &level[0][n], 0);
+			}
+			else {
+				/* Blend maps, with unlit colourmap in RGB */
+				if (s->file)
+					memcpy(rgb, &s->file[3 * (mX + mY * s->mapSize)], 3);
+				else
+					lsc_calcTexel(&b->unlit, mX, mY, NULL, rgb, 0);
+				for (k = 0; k < s->numLayers; k++)
+					memcpy(&texel[4 * k], &level[k][n], 4);
+				lsc_calcTexel(&b->blend, mX, mY, rgb, texel, 4);
+				for (k = 0; k < s->numLayers; k++)
+					memcpy(&level[k][n], &texel[4 * k], 4);
+			}
 		}
+	}
 
-		/* AW TODO: currently the engine can only handle three splat textures */
-		if (countLoaded >= 3)
+	/* Mipmaps */
+	for (m = 1; (s->blockSize >> m) > 0; m++) {
+		for (k = 0; k < s->numLayers; k++)
+			lsc_texHalve(lsc_texLevel(s, k * tiles + tile, m - 1),
+						 lsc_texLevel(s, k * tiles + tile, m),
+						 s->tileSize >> m, s->bpp, X0 >> m, Y0 >> m,
+						 s->blockSize >> m, s->blockSize >> m);
+	}
+}
+
+/*
+  texWorker()
+
+  Worker thread, works out blocks until there are none left.
+*/
+static void lsc_texWorker(void *arg, int thread)
+{
+	lsctexbuild b = (lsctexbuild)arg;
+	long block;
+
+	while (!b->cancel) {
+		block = thr_atomicInc(&b->next) - 1;
+		if (block >= b->totalBlocks)
 			break;
+		lsc_texCalcBlock(b, block);
+
+		/* The interlocked increment makes the block visible to the
+		   render thread before it sees it as ready */
+		thr_atomicInc(&b->state[block]);
+	}
+}
+
+/*
+  texBuild()
+
+  Background job - work out the normal and light maps, then share the blocks
+  out between the worker threads.
+*/
+static void lsc_texBuild(void *arg, int thread)
+{
+	lsctexbuild b = (lsctexbuild)arg;
+	lsc l = b->l;
+	vec3 lightDir = {1, 0, -1};
+	char *normalMap = NULL;
+	unsigned char *shadowMap = NULL;
+	unsigned char *lightMap = NULL;
+	double t0 = thr_seconds();
+
+	normalMap = lsc_calcNormals(b->hm, l->hmSize, l->scale, 0.1f, 0.75f, 8);
+	shadowMap = lsc_calcShadows(b->hm, l->hmSize, l->scale, lightDir);
+	if (normalMap && shadowMap)
+		lightMap  = lsc_calcLighting(normalMap, shadowMap, l->hmSize,
+									 l->scale, 0.5f, 0.5f, lightDir);
+	if (shadowMap)
+		free(shadowMap);
+
+	if (lightMap) {
+		b->colour.mode = 0;
+		b->colour.prelit = true;
+		b->colour.normalMap = normalMap;
+		b->colour.lightMap = lightMap;
+		b->colour.hmSize = l->hmSize;
+		b->colour.textureMapSize = b->set[0].mapSize;
+		b->colour.countLoaded = 0;
+		if (!b->set[0].file || (b->numSets > 1 && !b->set[1].file))
+			lsc_loadTextures(&b->colour, b->texScale);
+
+		/* Unlit colourmap shares the colourmap source textures */
+		b->unlit = b->colour;
+		b->unlit.prelit = false;
+		b->unlit.textureMapSize = l->hmSize;
+
+		b->blend.normalMap = normalMap;
+		b->blend.lightMap = lightMap;
+
+		thr_run(b->numThreads, lsc_texWorker, b);
+
+		printf("\nTextures worked out in %.2fs\n", thr_seconds() - t0);
+		fflush(stdout);
+
+		lsc_freeTextures(&b->colour);
+	}
+
+	if (normalMap)
+		free(normalMap);
+	if (lightMap)
+		free(lightMap);
+}
+
+/*
+  texCreateSet()
+
+  Allocate the CPU copies of a set of texture objects, fill them with a
+  placeholder texel for each layer and create the texture objects.
+*/
+static bool lsc_texCreateSet(lsctexset s, unsigned char placeholder[][4])
+{
+	int numObjs = s->numLayers * SQR(s->perSide);
+	int i, k, m, n, size = 0;
+	unsigned char *p;
+
+	for (m = 0; (s->tileSize >> m) > 0; m++)
+		size += s->bpp * SQR(s->tileSize >> m);
+	s->numLevels = m;
+
+	s->blockSize = s->tileSize < LSC_TEX_BLOCK ? s->tileSize : LSC_TEX_BLOCK;
+	s->blocksPerSide = s->tileSize / s->blockSize;
+	s->numBlocks = SQR(s->perSide * s->blocksPerSide);
+
+	s->texObjs = (int*)calloc(numObjs, sizeof(int));
+	s->mips = (unsigned char**)calloc(numObjs, sizeof(unsigned char*));
+	if (!s->texObjs || !s->mips) {
+		err_report("lsc_startTexObjs: cannot allocate %d bytes",
+			numObjs * (sizeof(int) + sizeof(unsigned char*)));
+		return false;
+	}
+
+	for (i = 0; i < numObjs; i++) {
+		k = i / SQR(s->perSide);
+		p = s->mips[i] = (unsigned char*)malloc(size);
+		if (!p) {
+			err_report("lsc_startTexObjs: cannot allocate %d bytes", size);
+			return false;
+		}
+		for (n = 0; n < size; n += s->bpp)
+			memcpy(&p[n], placeholder[k], s->bpp);
+
+		/* Make an OpenGL texture object (edge clamped) */
+		s->texObjs[i] = txm_addRawData(p, s->tileSize, s->tileSize,
+										s->format, false, true);
+	}
+	return true;
+}
+
+/*
+  texFree()
+
+  Free an asynchronous texture build. The build must have finished.
+*/
+static void lsc_texFree(lsctexbuild b)
+{
+	lsctexset s;
+	int i, k;
+
+	for (k = 0; k < b->numSets; k++) {
+		s = &b->set[k];
+		if (s->mips) {
+			for (i = 0; i < s->numLayers * SQR(s->perSide); i++)
+				if (s->mips[i])
+					free(s->mips[i]);
+			free(s->mips);
+		}
+		if (s->texObjs)
+			free(s->texObjs);
+		if (s->file)
+			free(s->file);
+	}
+	if (b->state)
+		free((void*)b->state);
+	free(b);
+}
+
+/*
+  texReadFile()
+
+  Read a colourmap saved by the synchronous functions, if there is one.
+*/
+static unsigned char *lsc_texReadFile(char *fileName, int size)
+{
+	unsigned char *map = NULL;
+	FILE *f = fopen(fileName, "rb");
+
+	if (f) {
+		map = (unsigned char*)malloc(3*SQR(size));
+		if (map && fread(map, 1, 3*SQR(size), f) != (size_t)(3*SQR(size))) {
+			free(map);
+			map = NULL;
+		}
+		fclose(f);
+	}
+	return map;
+}
+
+/*
+  startTexObjs()
+
+  Start building the colourmap texture objects, and if splat is true the
+  blend map texture objects, in the background. See above.
+*/
+bool lsc_startTexObjs(lsc l, unsigned char *hm, float texScale, bool splat)
+{
+	unsigned char placeholder[LSC_TEX_MAX_LAYERS][4] = {
+		{128, 128, 128, 191},
+		{128, 128, 128, 191},
+		{128, 128, 128,   0},
+		{128, 128, 128,   0}
+	};
+	lsctexbuild b;
+	lsctexset s;
+	char fileName[30];
+	int k, px, py, tx, ty, pcount = l->patchTile * l->hmTile;
+	int patchesPerTexObj;
+
+	lsc_cancelTexObjs(l);
+
+	b = (lsctexbuild)calloc(1, sizeof(struct lsctexbuild_str));
+	if (!b) {
+		err_report("lsc_startTexObjs: cannot allocate %d bytes",
+										sizeof(struct lsctexbuild_str));
+		return false;
+	}
+	b->l = l;
+	b->hm = hm;
+	b->texScale = texScale;
+
+	/* Leave a CPU for the render thread */
+	b->numThreads = thr_numCPUs() - 1;
+	if (b->numThreads < 1)
+		b->numThreads = 1;
+
+	/* Colourmap */
+	s = &b->set[0];
+	s->mapSize = l->texTile * l->texSize;
+	s->tileSize = l->texSize;
+	s->perSide = l->texTile;
+	s->numLayers = 1;
+	s->bpp = 3;
+	s->format = GL_RGB;
+	sprintf(fileName, "data/Colour%d.raw", l->hmSize);
+	s->file = lsc_texReadFile(fileName, s->mapSize);
+	b->numSets = 1;
+
+	/* Blend maps */
+	if (splat) {
+		if (s->mapSize != l->hmSize) {
+			err_report("lsc_startTexObjs: bad colour map size %d",
+												s->mapSize);
+			splat = false;
+		}
+	}
+	if (splat) {
+		s = &b->set[1];
+		s->mapSize = l->hmSize;
+		s->tileSize = l->texSize < l->hmSize ? l->texSize : l->hmSize;
+		s->perSide = s->mapSize / s->tileSize;
+		s->bpp = 4;
+		s->format = GL_RGBA;
+		sprintf(fileName, "data/UnlitColour%d.raw", l->hmSize);
+		s->file = lsc_texReadFile(fileName, s->mapSize);
+
+		/* Light map + one blend map per splat texture */
+		b->blend.mode = 1;
+		b->blend.hmSize = l->hmSize;
+		b->blend.textureMapSize = l->hmSize;
+		b->blend.countLoaded = lsc_loadSplatTexObjs(l);
+		s->numLayers = b->blend.countLoaded + 1;
+		b->numSets = 2;
+	}
+
+	/* Texture objects */
+	for (k = 0; k < b->numSets; k++) {
+		s = &b->set[k];
+		if (!lsc_texCreateSet(s, placeholder)) {
+			lsc_texFree(b);
+			return false;
+		}
+		b->totalBlocks += s->numBlocks;
+
+		/* Assign texture ids to landscape patches */
+		patchesPerTexObj = l->patchTile / s->perSide;
+		for (py = 0; py < pcount; py++) {
+			ty = (py % l->patchTile) / patchesPerTexObj;
+			for (px = 0; px < pcount; px++) {
+				lscpatch patch = lsc_getPatch(l, px, py);
+				int n;
+				tx = (px % l->patchTile) / patchesPerTexObj;
+				if (k == 0)
+					patch->colourMapTexObj =
+								s->texObjs[ty*s->perSide + tx];
+				else
+					for (n = 0; n < s->numLayers; n++)
+						patch->blendMapTexObj[n] = s->texObjs[
+								n*SQR(s->perSide) + ty*s->perSide + tx];
+			}
+		}
+	}
+
+	b->state = (volatile long*)calloc(b->totalBlocks, sizeof(long));
+	if (!b->state) {
+		err_report("lsc_startTexObjs: cannot allocate %d bytes",
+										b->totalBlocks * sizeof(long));
+		lsc_texFree(b);
+		return false;
+	}
+
+	b->job = thr_spawn(1, lsc_texBuild, b);
+	if (!b->job) {
+		lsc_texFree(b);
+		return false;
 	}
+	l->texBuild = b;
+
+	/* Base texture */
+	{
+		tga tgaFile = tga_create("data/terrain.tga");
+		if (tgaFile && tgaFile->data && tgaFile->width == tgaFile->height
+				&& (tgaFile->depth == 24 || tgaFile->depth == 32)) {
 
+			if (tgaFile->depth == 32)
+				tga_stripAlpha(tgaFile);
+
+			/* Make an OpenGL texture object (wrapped) */
+			l->baseTextureTexObj = txm_addRawData(tgaFile->data,
+					tgaFile->width, tgaFile->height, GL_RGB, true, true);
+		}
+		if (tgaFile)
+			tga_destroy(tgaFile);
+	}
 	return true;
 }
+
+/*
+  texUpload()
+
+  Upload a finished block and its mipmaps. Returns the number of bytes
+  uploaded.
+*/
+static int lsc_texUpload(lsctexbuild b, int block)
+{
+	int tile, X0, Y0, k, m, obj, w, size, bytes = 0;
+	lsctexset s = lsc_texFindBlock(b, block, &tile, &X0, &Y0);
+	unsigned char *p;
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	for (k = 0; k < s->numLayers; k++) {
+		obj = k * SQR(s->perSide) + tile;
+		glBindTexture(GL_TEXTURE_2D, s->texObjs[obj]);
+
+		for (m = 0; m < s->numLevels; m++) {
+			size = s->tileSize >> m;
+			w = s->blockSize >> m;
+			p = lsc_texLevel(s, obj, m);
+			if (!w) {
+				/* Level smaller than a block - rebuild the texel under
+				   this block from the level above */
+				w = 1;
+				lsc_texHalve(lsc_texLevel(s, obj, m - 1), p, size, s->bpp,
+								X0 >> m, Y0 >> m, 1, 1);
+			}
+			glPixelStorei(GL_UNPACK_ROW_LENGTH, size);
+			glPixelStorei(GL_UNPACK_SKIP_PIXELS, X0 >> m);
+			glPixelStorei(GL_UNPACK_SKIP_ROWS, Y0 >> m);
+			glTexSubImage2D(GL_TEXTURE_2D, m, X0 >> m, Y0 >> m, w, w,
+							s->format, GL_UNSIGNED_BYTE, p);
+			bytes += s->bpp * SQR(w);
+		}
+	}
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+
+	return bytes;
+}
+
+/*
+  updateTexObjs()
+
+  Call from the render thread once a frame. Uploads finished blocks until
+  maxBytes have been uploaded (at least one block if any are ready). Returns
+  the number of blocks still to upload, 0 once the build has finished.
+*/
+int lsc_updateTexObjs(lsc l, int maxBytes)
+{
+	lsctexbuild b = (lsctexbuild)l->texBuild;
+	int i, bytes = 0, left = 0;
+	bool done;
+
+	if (!b)
+		return 0;
+
+	/* Check before looking at the blocks, so that if the job has
+	   finished all its blocks are seen */
+	done = thr_isDone(b->job);
+
+	for (i = b->firstBlock; i < b->totalBlocks; i++) {
+		if (b->state[i] == LSC_TEX_READY && bytes < maxBytes) {
+			bytes += lsc_texUpload(b, i);
+			b->state[i] = LSC_TEX_DONE;
+		}
+		if (b->state[i] != LSC_TEX_DONE) {
+			if (!left)
+				b->firstBlock = i;
+			left++;
+		}
+	}
+	if (!left)
+		b->firstBlock = b->totalBlocks;
+
+	if (done) {
+		/* Finished, or gave up - any pending blocks are left as they are */
+		for (i = b->firstBlock; i < b->totalBlocks; i++)
+			if (b->state[i] == LSC_TEX_READY)
+				return left;
+		lsc_cancelTexObjs(l);
+		return 0;
+	}
+
+	return left;
+}
+
+/*
+  cancelTexObjs()
+
+  Stop an asynchronous texture build, waiting for the worker threads, and
+  free it. Blocks not yet uploaded keep whatever they have.
+*/
+void lsc_cancelTexObjs(lsc l)
+{
+	lsctexbuild b = (lsctexbuild)l->texBuild;
+
+	if (!b)
+		return;
+	b->cancel = 1;
+	thr_join(b->job);
+	lsc_texFree(b);
+	l->texBuild = NULL;
+}
@@ -40,12 +40,26 @@ Foundation, Inc., 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
 	hierarchy of occlusion regions corresponding to a terrain quadtree.
 
 	See the referenced paper (above) for full details.
+
+	Finding the horizons is slow, so the patches are shared out between
+	worker threads and the results are kept in data/Height<n>.vis, which is
+	mapped straight into memory next time. lsc_updateOcclusion() rebuilds
+	just the patches around an edited part of the heightmap.
 */
 
 #include "lscape.h"
 #include "error.h"
+#include "thread.h"
 #include <limits.h>
 
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 /*
   Occlusion node, used to build a linked list of occlusion regions when
   merging the occlusion regions for each point in a patch.
@@ -622,68 +636,272 @@ static void lscvis_mergePatchOcclusionRegions(lscvis l, int **patchOccPts,
 }
 
 /*
- * Recursively merge the merged occlusion regions for adjacent patches to
- * form an occlusion region quadtree.
- */
-static void lscvis_recurSetupQuadtree(lscvis l, int n,
-									  int x0, int x1, int y0, int y1)
-{
-	int xc, yc, p0[2], i, ptsRqd;
-	int *occPts[5];
+  lscvis_mergeNode()
 
-	xc = (x0 + x1) >> 1;
-	yc = (y0 + y1) >> 1;
+  Merge the occlusion regions for the four child nodes of node n.
+*/
+static void lscvis_mergeNode(lscvis l, int n)
+{
+	int i, *occPts[5];
 
 	occPts[0] = l->occPts + n*l->sectors*l->maxOccPts*2;
+	occPts[1] = l->occPts + LSCQT_BL(n)*l->sectors*l->maxOccPts*2;
+	occPts[2] = l->occPts + LSCQT_BR(n)*l->sectors*l->maxOccPts*2;
+	occPts[3] = l->occPts + LSCQT_TL(n)*l->sectors*l->maxOccPts*2;
+	occPts[4] = l->occPts + LSCQT_TR(n)*l->sectors*l->maxOccPts*2;
+
+	/* For each sector */
+	for (i = 0; i < l->sectors; i++) {
+		lscvis_mergePatchOcclusionRegions(l, &occPts[1], occPts[0]);
+		occPts[0] += 2 * l->maxOccPts;
+		occPts[1] += 2 * l->maxOccPts;
+		occPts[2] += 2 * l->maxOccPts;
+		occPts[3] += 2 * l->maxOccPts;
+		occPts[4] += 2 * l->maxOccPts;
+	}
+}
 
-	if (x1 - x0 > l->patchSize) {
-
-		/* Recur to child nodes */
-		lscvis_recurSetupQuadtree(l, LSCQT_BL(n), x0, xc, y0, yc);
-		lscvis_recurSetupQuadtree(l, LSCQT_BR(n), xc, x1, y0, yc);
-		lscvis_recurSetupQuadtree(l, LSCQT_TL(n), x0, xc, yc, y1);
-		lscvis_recurSetupQuadtree(l, LSCQT_TR(n), xc, x1, yc, y1);
-
-		/* Now merge the occlusion regions for the child nodes */
-		occPts[1] = l->occPts + LSCQT_BL(n)*l->sectors*l->maxOccPts*2;
-		occPts[2] = l->occPts + LSCQT_BR(n)*l->sectors*l->maxOccPts*2;
-		occPts[3] = l->occPts + LSCQT_TL(n)*l->sectors*l->maxOccPts*2;
-		occPts[4] = l->occPts + LSCQT_TR(n)*l->sectors*l->maxOccPts*2;
-
-		/* For each sector */
-		for (i = 0; i < l->sectors; i++) {
-			lscvis_mergePatchOcclusionRegions(l, &occPts[1], occPts[0]);
-			occPts[0] += 2 * l->maxOccPts;
-			occPts[1] += 2 * l->maxOccPts;
-			occPts[2] += 2 * l->maxOccPts;
-			occPts[3] += 2 * l->maxOccPts;
-			occPts[4] += 2 * l->maxOccPts;
-		}
+/*
+  lscvis_calcPatch()
+
+  Calculate the merged occlusion regions for leaf node n, i.e. a patch,
+  with bottom left corner x0, y0.
+*/
+static void lscvis_calcPatch(lscvis l, int n, int x0, int y0)
+{
+	int i, p0[2], ptsRqd;
+	int *occPts = l->occPts + n*l->sectors*l->maxOccPts*2;
+
+	p0[0] = x0;
+	p0[1] = y0;
+
+	/* For each sector */
+	for (i = 0; i < l->sectors; i++) {
+
+		lscvis_calcHorizonPoints(l, p0, i);
+		ptsRqd = lscvis_mergeOcclusionRegions(l, p0, occPts);
+
+		occPts += 2 * l->maxOccPts;
+
+		l->avgPtsRqd += ptsRqd;
+		if (ptsRqd > l->maxPtsRqd)
+			l->maxPtsRqd = ptsRqd;
 	}
-	else {
+}
 
-		/* This is a leaf node, i.e. a patch */
-		p0[0] = x0;
-		p0[1] = y0;
+/*
+  Occlusion build job, shared by the worker threads.
 
-		/* For each sector */
-		for (i = 0; i < l->sectors; i++) {
+  The quadtree is built a level at a time from the patches up. Nodes are
+  numbered a level at a time (see LSCQT_BL etc.), so the nodes at each
+  level are contiguous. Each worker takes the next dirty node from the
+  current level until there are none left. Every node only depends on its
+  children so the result doesn't depend on the number of threads.
+*/
+typedef struct lscvisjob_str {
+	struct lscvis_str vis[THR_MAX_THREADS];	/* Per thread work space */
+	unsigned char *dirty;		/* Nodes to (re)calculate */
+	int leafLevel;				/* Quadtree level of the patches */
+	int first, last;			/* Node range for current level */
+	volatile long next;			/* Next node to look at */
+	volatile long done;			/* Patches done, for progress report */
+	int numDirtyPatches;
+} *lscvisjob;
 
-			printf("Patch %d of %d, sector %d of %d    \r",
-					(x0/l->patchSize) + (y0/l->patchSize)*l->patchTile,
-					SQR(l->patchTile), i, l->sectors);
+/*
+  lscvis_levelStart()
+
+  Number of the first quadtree node at a level.
+*/
+static int lscvis_levelStart(int level)
+{
+	return ((1 << (2*level)) - 1) / 3;
+}
+
+/*
+  lscvis_worker()
+
+  Occlusion build worker thread.
+*/
+static void lscvis_worker(void *arg, int thread)
+{
+	lscvisjob j = (lscvisjob)arg;
+	lscvis l = &j->vis[thread];
+	int n, k, c, x0, y0, size;
+	long done;
+
+	while ((n = j->first + thr_atomicInc(&j->next) - 1) < j->last) {
+
+		if (!j->dirty[n])
+			continue;
+
+		if (j->last < lscvis_levelStart(j->leafLevel + 1)) {
+			lscvis_mergeNode(l, n);
+			continue;
+		}
+
+		/* Find the patch corner from the node number */
+		x0 = y0 = 0;
+		size = l->hmSize;
+		for (k = j->leafLevel - 1; k >= 0; k--) {
+			c = ((n - j->first) >> (2*k)) & 3;
+			size >>= 1;
+			if (c & 1)
+				x0 += size;
+			if (c & 2)
+				y0 += size;
+		}
+
+		lscvis_calcPatch(l, n, x0, y0);
+
+		done = thr_atomicInc(&j->done);
+		if (thread == 0) {
+			printf("Patch %d of %d    \r", (int)done, j->numDirtyPatches);
 			fflush(stdout);
+		}
+	}
+}
+
+/*
+  lscvis_overlap()
+
+  Check if the range a0..a1 in the heightmap overlaps b0..b1 anywhere
+  in the tiled heightmap.
+*/
+static bool lscvis_overlap(int a0, int a1, int b0, int b1, int hmSize)
+{
+	int k;
+
+	if (b1 - b0 >= hmSize)
+		return true;
+
+	k = ((b0 % hmSize) + hmSize) % hmSize - b0;
+	b0 += k;
+	b1 += k;
+
+	return (a0 <= b1 && a1 >= b0) ||
+		   (a0 <= b1 - hmSize && a1 >= b0 - hmSize) ||
+		   (a0 <= b1 + hmSize && a1 >= b0 + hmSize);
+}
+
+/*
+  lscvis_build()
 
-			lscvis_calcHorizonPoints(l, p0, i);
-			ptsRqd = lscvis_mergeOcclusionRegions(l, p0, occPts[0]);
+  Build merged occlusion regions for the patches touching the heightmap
+  rectangle x0..x1, y0..y1, and everything above them in the quadtree.
+*/
+static void lscvis_build(lscvis vis, int x0, int y0, int x1, int y1)
+{
+	struct lscvisjob_str *j;
+	int i, n, level, leafLevel = 0, numNodes, numThreads;
+	int patchSize = vis->patchSize;
+	double t;
 
-			occPts[0] += 2 * l->maxOccPts;
+	while ((patchSize << leafLevel) < vis->hmSize)
+		leafLevel++;
+	numNodes = lscvis_levelStart(leafLevel + 1);
 
-			l->avgPtsRqd += ptsRqd;
-			if (ptsRqd > l->maxPtsRqd)
-				l->maxPtsRqd = ptsRqd;
+	j = (lscvisjob)malloc(sizeof(struct lscvisjob_str));
+	if (!j) {
+		err_report("Failed to build occlusion regions");
+		return;
+	}
+	j->dirty = (unsigned char*)malloc(numNodes);
+	if (!j->dirty) {
+		err_report("Failed to build occlusion regions");
+		free(j);
+		return;
+	}
+	j->leafLevel = leafLevel;
+	j->done = 0;
+	j->numDirtyPatches = 0;
+
+	/* Mark the patches that need recalculating */
+	memset(j->dirty, 0, numNodes);
+	n = lscvis_levelStart(leafLevel);
+	for (i = 0; i < (1 << (2*leafLevel)); i++) {
+		int k, c, px = 0, py = 0, size = vis->hmSize;
+		for (k = leafLevel - 1; k >= 0; k--) {
+			c = (i >> (2*k)) & 3;
+			size >>= 1;
+			if (c & 1)
+				px += size;
+			if (c & 2)
+				py += size;
+		}
+		if (lscvis_overlap(px, px + patchSize, x0, x1, vis->hmSize) &&
+			lscvis_overlap(py, py + patchSize, y0, y1, vis->hmSize)) {
+			j->dirty[n + i] = 1;
+			j->numDirtyPatches++;
 		}
 	}
+
+	/* And the nodes above them */
+	for (level = leafLevel - 1; level >= 0; level--) {
+		for (n = lscvis_levelStart(level);
+				n < lscvis_levelStart(level + 1); n++) {
+			j->dirty[n] = j->dirty[LSCQT_BL(n)] | j->dirty[LSCQT_BR(n)] |
+						  j->dirty[LSCQT_TL(n)] | j->dirty[LSCQT_TR(n)];
+		}
+	}
+
+	/* Give each thread its own copy of the patch work space */
+	numThreads = thr_numCPUs();
+	for (i = 0; i < numThreads; i++) {
+		j->vis[i] = *vis;
+		j->vis[i].horizonPoints =
+				(int*)malloc(4*SQR(vis->patchSize + 1)*sizeof(int));
+		j->vis[i].occArr = (occNode)malloc(SQR(vis->patchSize + 1)
+											* sizeof(struct occNode_str));
+		if (!j->vis[i].horizonPoints || !j->vis[i].occArr) {
+			if (j->vis[i].horizonPoints)
+				free(j->vis[i].horizonPoints);
+			if (j->vis[i].occArr)
+				free(j->vis[i].occArr);
+			break;
+		}
+	}
+	numThreads = i;
+	if (!numThreads) {
+		err_report("Failed to build patch occlusion list");
+		free(j->dirty);
+		free(j);
+		return;
+	}
+
+	printf("Calculating occlusion regions for %d patches on %d threads\n",
+							j->numDirtyPatches, numThreads);
+	fflush(stdout);
+	t = thr_seconds();
+
+	/* Patches first, then merge a level at a time up to the root */
+	for (level = leafLevel; level >= 0; level--) {
+		j->first = lscvis_levelStart(level);
+		j->last = lscvis_levelStart(level + 1);
+		j->next = 0;
+		thr_run(MIN(numThreads, j->last - j->first), lscvis_worker, j);
+	}
+
+	t = thr_seconds() - t;
+
+	for (i = 0; i < numThreads; i++) {
+		vis->avgPtsRqd += j->vis[i].avgPtsRqd;
+		if (j->vis[i].maxPtsRqd > vis->maxPtsRqd)
+			vis->maxPtsRqd = j->vis[i].maxPtsRqd;
+		free(j->vis[i].horizonPoints);
+		free(j->vis[i].occArr);
+	}
+	if (j->numDirtyPatches)
+		vis->avgPtsRqd /= vis->sectors * j->numDirtyPatches;
+
+	printf("\n");
+	printf("Avg Points Per Sector: %d\n", vis->avgPtsRqd);
+	printf("Max Points Per Sector: %d\n", vis->maxPtsRqd);
+	printf("Occlusion regions took %.2f seconds\n", t);
+	fflush(stdout);
+
+	free(j->dirty);
+	free(j);
 }
 
 
@@ -691,6 +909,37 @@ static void lscvis_recurSetupQuadtree(lscvis l, int n,
   LANDSCAPE METHODS
 ******************************************************************************/
 
+/*
+  Occlusion file header. The occlusion points follow at dataOffset, in the
+  same layout as l->occPts, so the file can be mapped and used in place.
+*/
+typedef struct lscocchdr_str {
+	int magic;					/* LSC_OCC_MAGIC */
+	int version;				/* LSC_OCC_VERSION */
+	int hmSize;
+	int occPatchSize;
+	int sectors;
+	int maxOccPts;
+	int numNodes;				/* Number of nodes in the file */
+	int dataOffset;				/* Byte offset of the occlusion points */
+} *lscocchdr;
+
+#define LSC_OCC_MAGIC		0x434F534C	/* "LSOC" */
+#define LSC_OCC_VERSION		1
+
+#define LSC_OCC_HMTILE		2	/* Heightmap tiles to search for horizon */
+#define LSC_OCC_SUBSECTORS	256	/* Total sub-sectors to search */
+
+/*
+  lsc_occFileName
+
+  Name of the occlusion file for the landscape.
+*/
+static void lsc_occFileName(lsc l, char *fileName)
+{
+	sprintf(fileName, "data/Height%d.vis", l->hmSize);
+}
+
 /*
   lsc_writeOccToFile
 
@@ -700,10 +949,12 @@ static void lsc_writeOccToFile(lsc l)
 {
 	char fileName[30];
 	FILE *f;
+	struct lscocchdr_str hdr;
+	char pad[16];
 	size_t space;
 	int numNodesInHeightMap = lsc_countHeightMapNodes(l);
 
-	sprintf(fileName, "data/Height%d.vis", l->hmSize);
+	lsc_occFileName(l, fileName);
 	f = fopen(fileName, "wb");
 
 	if (!f) {
@@ -711,74 +962,196 @@ static void lsc_writeOccToFile(lsc l)
 		return;
 	}
 
-	space = (char*)(&(l->baseTextureTexObj)) - (char*)(l);
-	space = (space + 15) & ~15;
-	fwrite(l, 1, space, f);
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LSC_OCC_MAGIC;
+	hdr.version = LSC_OCC_VERSION;
+	hdr.hmSize = l->hmSize;
+	hdr.occPatchSize = l->occPatchSize;
+	hdr.sectors = l->sectors;
+	hdr.maxOccPts = l->maxOccPts;
+	hdr.numNodes = numNodesInHeightMap;
+	hdr.dataOffset = (sizeof(hdr) + 15) & ~15;
+
+	memset(pad, 0, sizeof(pad));
+	fwrite(&hdr, 1, sizeof(hdr), f);
+	fwrite(pad, 1, hdr.dataOffset - sizeof(hdr), f);
 
 	space = numNodesInHeightMap * l->sectors * l->maxOccPts *
 												2 * sizeof(int);
-	space = (space + 15) & ~15;
-	fwrite(l->occPts, 1, space, f);
+	if (fwrite(l->occPts, 1, space, f) != space)
+		err_report("lsc_writeOccToFile: cannot write %s", fileName);
 
 	fclose(f);
 }
 
+/*
+  lsc_mapFile
+
+  Map a whole file read only into memory. Returns NULL on failure.
+*/
+static void *lsc_mapFile(char *fileName, size_t *size)
+{
+	void *view = NULL;
+#ifdef WIN32
+	HANDLE file, mapping;
+
+	file = CreateFile(fileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+					  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return NULL;
+	*size = GetFileSize(file, NULL);
+	mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping) {
+		view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		/* The view keeps the file open */
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
+#else
+	int fd;
+	struct stat st;
+
+	fd = open(fileName, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		*size = st.st_size;
+		view = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+		if (view == MAP_FAILED)
+			view = NULL;
+	}
+	close(fd);
+#endif
+	return view;
+}
+
+/*
+  lsc_unmapFile
+
+  Unmap a file mapped by lsc_mapFile.
+*/
+static void lsc_unmapFile(void *view, size_t size)
+{
+#ifdef WIN32
+	UnmapViewOfFile(view);
+#else
+	munmap(view, size);
+#endif
+}
+
+/*
+  lsc_releaseOcclusion
+
+  Unmap the occlusion file, if it's mapped. If keep is true, copy the
+  occlusion data into memory first.
+*/
+void lsc_releaseOcclusion(lsc l, bool keep)
+{
+	if (!l->occMap)
+		return;
+
+	if (keep && l->occPtsMem) {
+		memcpy(l->occPtsMem, l->occPts, lsc_countHeightMapNodes(l) *
+					l->sectors * l->maxOccPts * 2 * sizeof(int));
+	}
+	lsc_unmapFile(l->occMap, l->occMapSize);
+	l->occMap = NULL;
+	l->occMapSize = 0;
+	l->occPts = l->occPtsMem;
+}
+
 /*
   lsc_readOccFromFile
 
-  Read the hierarchical terrain visibility data from file to memory.
+  Map the hierarchical terrain visibility data file into memory.
 */
 static bool lsc_readOccFromFile(lsc l)
 {
 	char fileName[30];
-	FILE *f;
-	size_t space;
-	struct lsc_str ltemp;
+	lscocchdr hdr;
+	size_t size, space;
 	bool err = false;
 	int numNodesInHeightMap = lsc_countHeightMapNodes(l);
 
-	sprintf(fileName, "data/Height%d.vis", l->hmSize);
-	f = fopen(fileName, "rb");
+	lsc_releaseOcclusion(l, false);
 
-	if (!f) {
+	lsc_occFileName(l, fileName);
+	hdr = (lscocchdr)lsc_mapFile(fileName, &size);
+
+	if (!hdr) {
 		err_report("lsc_readOccFromFile: cannot open %s", fileName);
 		return false;
 	}
 
-	space = (char*)(&(l->baseTextureTexObj)) - (char*)(l);
-	fread(&ltemp, 1, space, f);
-	space = (space + 15) & ~15;
-	fseek(f, space, SEEK_SET);
+	space = numNodesInHeightMap * l->sectors * l->maxOccPts *
+												2 * sizeof(int);
 
-	if (l->hmSize != ltemp.hmSize) {
+	if (size < sizeof(struct lscocchdr_str) ||
+		hdr->magic != LSC_OCC_MAGIC || hdr->version != LSC_OCC_VERSION) {
+		err_report("lsc_readOccFromFile: %s is not a version %d file",
+											fileName, LSC_OCC_VERSION);
+		lsc_unmapFile(hdr, size);
+		return false;
+	}
+	if (l->hmSize != hdr->hmSize) {
 		err_report("lsc_readOccFromFile: hmSize mismatch");
 		err = true;
 	}
-	if (l->occPatchSize != ltemp.occPatchSize) {
+	if (l->occPatchSize != hdr->occPatchSize) {
 		err_report("lsc_readOccFromFile: occPatchSize mismatch");
 		err = true;
 	}
-	if (l->sectors != ltemp.sectors) {
+	if (l->sectors != hdr->sectors) {
 		err_report("lsc_readOccFromFile: sectors mismatch");
 		err = true;
 	}
-	if (l->maxOccPts != ltemp.maxOccPts) {
+	if (l->maxOccPts != hdr->maxOccPts) {
 		err_report("lsc_readOccFromFile: maxOccPts mismatch");
 		err = true;
 	}
+	if (numNodesInHeightMap != hdr->numNodes ||
+		(hdr->dataOffset & 15) || size < hdr->dataOffset + space) {
+		err_report("lsc_readOccFromFile: %s is truncated", fileName);
+		err = true;
+	}
 	if (err) {
-		fclose(f);
+		lsc_unmapFile(hdr, size);
 		return false;
 	}
 
-	space = numNodesInHeightMap * l->sectors * l->maxOccPts *
-												2 * sizeof(int);
-	fread(l->occPts, 1, space, f);
-
-	fclose(f);
+	l->occMap = hdr;
+	l->occMapSize = size;
+	l->occPts = (int*)((unsigned char*)hdr + hdr->dataOffset);
 	return true;
 }
 
+/*
+  lsc_initVis()
+
+  Set up a visibility object for building occlusion regions.
+*/
+static void lsc_initVis(lsc l, lscvis vis, unsigned char *hm, int hmTile,
+						int subSectors)
+{
+	vis->hmSize = l->hmSize;
+	vis->patchSize = l->occPatchSize;
+	vis->hmTile = hmTile;
+	vis->patchTile = l->hmSize / l->occPatchSize;
+	vis->sectors = l->sectors;
+	vis->subSectors = subSectors;
+	vis->maxOccPts = l->maxOccPts;
+	vis->sectorTrig = l->sectorTrig;
+	vis->occPts = l->occPts;
+	vis->hm = hm;
+	vis->subSectorTrig = NULL;
+	vis->horizonPoints = NULL;
+	vis->occArr = NULL;
+	vis->occFree = 0;
+	vis->occList = NULL;
+	vis->avgPtsRqd = 0;
+	vis->maxPtsRqd = 0;
+}
+
 /*
   lsc_calcOcclusion()
 
@@ -789,32 +1162,19 @@ static bool lsc_readOccFromFile(lsc l)
   set of maxOccPts 2D points defines a convex occlusion region in the 2D
   space of the corresponding sectors piPlane.
 
+  Only the patches touching the heightmap rectangle x0..x1, y0..y1 are
+  recalculated, along with the nodes above them.
+
   Note that the hmTile factor can be different than used by the source
   landcsape at rendering time. This is because there is no point in
   calculating the occlusion regions beyond the the far viewing distance.
 */
 static void lsc_calcOcclusion(lsc l, unsigned char *hm, int hmTile,
-							  int subSectors)
+							  int subSectors, int x0, int y0, int x1, int y1)
 {
 	struct lscvis_str vis;
 
-	vis.hmSize = l->hmSize;
-	vis.patchSize = l->occPatchSize;
-	vis.hmTile = hmTile;
-	vis.patchTile = l->hmSize / l->occPatchSize;
-	vis.sectors = l->sectors;
-	vis.subSectors = subSectors;
-	vis.maxOccPts = l->maxOccPts;
-	vis.sectorTrig = l->sectorTrig;
-	vis.occPts = l->occPts;
-	vis.hm = hm;
-	vis.subSectorTrig = NULL;
-	vis.horizonPoints = NULL;
-	vis.occArr = NULL;
-	vis.occFree = 0;
-	vis.occList = NULL;
-	vis.avgPtsRqd = 0;
-	vis.maxPtsRqd = 0;
+	lsc_initVis(l, &vis, hm, hmTile, subSectors);
 
 	/* Build sin and cos tables */
 	printf("Calculating sin and cos tables");
@@ -827,39 +1187,9 @@ static void lsc_calcOcclusion(lsc l, unsigned char *hm, int hmTile,
 	printf("\n");
 	fflush(stdout);
 
-	/* Allocate space for horizon points for each point in a single patch */
-	vis.horizonPoints = (int*)malloc(4*SQR(vis.patchSize + 1)*sizeof(int));
-	if (!vis.horizonPoints) {
-		err_report("Failed to build occlusion regions");
-		free(vis.subSectorTrig);
-		return;
-	}
-
-	/* Allocate space for the current patch occlusion list */
-	vis.occArr = (occNode)malloc(SQR(vis.patchSize + 1)
-					* sizeof(struct occNode_str));
-	if (!vis.occArr) {
-		err_report("Failed to build patch occlusion list");
-		free(vis.subSectorTrig);
-		free(vis.horizonPoints);
-		return;
-	}
-
-	printf("Calculating occlusion regions\n");
-	fflush(stdout);
-	lscvis_recurSetupQuadtree(&vis, 0, 0, vis.hmSize, 0, vis.hmSize);
-
-	/* AW TODO: wrong! */
-	vis.avgPtsRqd /= vis.sectors * SQR(vis.patchTile);
-
-	printf("\n");
-	printf("Avg Points Per Sector: %d\n", vis.avgPtsRqd);
-	printf("Max Points Per Sector: %d\n", vis.maxPtsRqd);
-	fflush(stdout);
+	lscvis_build(&vis, x0, y0, x1, y1);
 
 	free(vis.subSectorTrig);
-	free(vis.horizonPoints);
-	free(vis.occArr);
 }
 
 /*
@@ -871,23 +1201,7 @@ static void lsc_buildTrigTables(lsc l)
 {
 	struct lscvis_str vis;
 
-	vis.hmSize = l->hmSize;
-	vis.patchSize = l->occPatchSize;
-	vis.hmTile = 1;
-	vis.patchTile = l->hmSize / l->occPatchSize;
-	vis.sectors = l->sectors;
-	vis.subSectors = 1;
-	vis.maxOccPts = l->maxOccPts;
-	vis.sectorTrig = l->sectorTrig;
-	vis.occPts = l->occPts;
-	vis.hm = NULL;
-	vis.subSectorTrig = NULL;
-	vis.horizonPoints = NULL;
-	vis.occArr = NULL;
-	vis.occFree = 0;
-	vis.occList = NULL;
-	vis.avgPtsRqd = 0;
-	vis.maxPtsRqd = 0;
+	lsc_initVis(l, &vis, NULL, 1, 1);
 
 	/* Build sin and cos tables */
 	printf("Calculating sin and cos tables");
@@ -903,6 +1217,19 @@ static void lsc_buildTrigTables(lsc l)
 	free(vis.subSectorTrig);
 }
 
+/*
+  lsc_occSubSectors()
+
+  Number of sub-sectors to search for the horizon in each sector.
+*/
+static int lsc_occSubSectors(lsc l)
+{
+	int subSectors = LSC_OCC_SUBSECTORS / l->sectors;
+	if (subSectors < 1)
+		subSectors = 1;
+	return subSectors;
+}
+
 /*
   lsc_getOcclusion()
 
@@ -911,13 +1238,8 @@ static void lsc_buildTrigTables(lsc l)
 void lsc_getOcclusion(lsc l, unsigned char *hm)
 {
 	if (!lsc_readOccFromFile(l)) {
-
-		int hmTile = 2;
-		int subSectors = 256 / l->sectors;
-		if (subSectors < 1)
-			subSectors = 1;
-
-		lsc_calcOcclusion(l, hm, hmTile, subSectors);
+		lsc_calcOcclusion(l, hm, LSC_OCC_HMTILE, lsc_occSubSectors(l),
+										0, 0, l->hmSize, l->hmSize);
 		lsc_writeOccToFile(l);
 	}
 	else {
@@ -925,6 +1247,32 @@ void lsc_getOcclusion(lsc l, unsigned char *hm)
 	}
 }
 
+/*
+  lsc_updateOcclusion()
+
+  Recalculate the occlusion regions after the heights in the heightmap
+  rectangle x0..x1, y0..y1 have changed, and dump to file.
+
+  Raising the terrain can hide patches a long way away, and lowering it
+  can reveal them. Patches within range of the rectangle are recalculated
+  too; anything further away keeps its old occlusion region. That is
+  conservative when the terrain was raised, but not when it was lowered,
+  so pass a range of at least the far viewing distance in that case.
+*/
+void lsc_updateOcclusion(lsc l, unsigned char *hm,
+						 int x0, int y0, int x1, int y1, int range)
+{
+	if (!l->sectors || !l->occPtsMem)
+		return;
+
+	/* Can't update a mapped file in place */
+	lsc_releaseOcclusion(l, true);
+
+	lsc_calcOcclusion(l, hm, LSC_OCC_HMTILE, lsc_occSubSectors(l),
+						x0 - range, y0 - range, x1 + range, y1 + range);
+	lsc_writeOccToFile(l);
+}
+
 
 /******************************************************************************
   RENDER TIME VISIBILITY TESTING
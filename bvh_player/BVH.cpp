@@ -4,7 +4,6 @@
 **/
 
 
-#include <fstream>
 #include <string.h>
 
 #include "BVH.h"
@@ -57,32 +56,244 @@ void  BVH::Clear()
 	num_frame = 0;
 	interval = 0.0;
 	motion = NULL;
+
+	pose_parent.clear();
+	pose_rotation.clear();
+	rot_channel.clear();
+	rot_column.clear();
+
+	rot_track.clear();
+	rot_key_frame.clear();
+	rot_key.clear();
+	pos_key_frame.clear();
+	pos_key.clear();
 }
 
 
 
 //
-//  BVHt@C̃[h
+//  t@C̃}bvÉiBVHt@CELbVt@C̓ǂݍݗpj
 //
-void  BVH::Load( const char * bvh_file_name )
+
+#ifdef  _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+
+// ǂݍݐpŃ}bvt@C
+struct  MappedFile
 {
-	#define  BUFFER_LENGTH  1024*4
+	const char *  data; // 擪AhX
+	size_t        size; // TCY
+#ifdef  _WIN32
+	HANDLE        file;
+	HANDLE        map;
+#endif
+};
+
+// t@C}bviJȂꍇȄꍇ falsej
+static bool  MapFile( const char * file_name, MappedFile & mf )
+{
+	mf.data = NULL;
+	mf.size = 0;
+#ifdef  _WIN32
+	mf.file = CreateFileA( file_name, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if ( mf.file == INVALID_HANDLE_VALUE )
+		return  false;
+	mf.size = GetFileSize( mf.file, NULL );
+	mf.map = ( mf.size > 0 ) ? CreateFileMappingA( mf.file, NULL, PAGE_READONLY, 0, 0, NULL ) : NULL;
+	if ( mf.map == NULL )
+	{
+		CloseHandle( mf.file );
+		return  false;
+	}
+	mf.data = (const char *) MapViewOfFile( mf.map, FILE_MAP_READ, 0, 0, 0 );
+	if ( mf.data == NULL )
+	{
+		CloseHandle( mf.map );
+		CloseHandle( mf.file );
+		return  false;
+	}
+#else
+	struct stat  st;
+	int  fd = open( file_name, O_RDONLY );
+	if ( fd < 0 )
+		return  false;
+	if ( ( fstat( fd, &st ) != 0 ) || ( st.st_size == 0 ) )
+	{
+		close( fd );
+		return  false;
+	}
+	void *  p = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+	close( fd );
+	if ( p == MAP_FAILED )
+		return  false;
+	mf.data = (const char *) p;
+	mf.size = st.st_size;
+#endif
+	return  true;
+}
 
-	ifstream  file;
-	char      line[ BUFFER_LENGTH ];
-	char *    token;
-	char      separater[] = " :,\t";
-	vector< Joint * >   joint_stack;
-	Joint *   joint = NULL;
-	Joint *   new_joint = NULL;
-	bool      is_site = false;
-	double    x, y ,z;
-	int       i, j;
+// }bv̉
+static void  UnmapFile( MappedFile & mf )
+{
+#ifdef  _WIN32
+	UnmapViewOfFile( mf.data );
+	CloseHandle( mf.map );
+	CloseHandle( mf.file );
+#else
+	munmap( (void *) mf.data, mf.size );
+#endif
+	mf.data = NULL;
+	mf.size = 0;
+}
 
+
+// ؂蕶̔iȑO strtok ̋؂蕶 " :,\t" Ɖsj
+static inline bool  IsSeparator( char c )
+{
+	return  ( c == ' ' ) || ( c == ':' ) || ( c == ',' ) || ( c == '\t' ) || ( c == '\r' ) || ( c == '\n' );
+}
+
+// ̒P擾iPꂪȂ falsej
+static inline bool  NextToken( const char * & p, const char * end, const char * & token, int & length )
+{
+	while ( ( p < end ) && IsSeparator( *p ) )  p ++;
+	if ( p == end )
+		return  false;
+	token = p;
+	while ( ( p < end ) && !IsSeparator( *p ) )  p ++;
+	length = p - token;
+	return  true;
+}
+
+// P̔r
+static inline bool  IsToken( const char * token, int length, const char * word )
+{
+	return  ( strncmp( token, word, length ) == 0 ) && ( word[ length ] == '\0' );
+}
+
+// ̓ǂݍ
+static bool  ParseInteger( const char * & p, const char * end, int & value )
+{
+	const char *  token;
+	int  length;
+	if ( !NextToken( p, end, token, length ) )
+		return  false;
+
+	char  buffer[ 64 ];
+	if ( length > 63 )  length = 63;
+	memcpy( buffer, token, length );
+	buffer[ length ] = '\0';
+	value = atoi( buffer );
+	return  true;
+}
+
+// ̓ǂݍ
+//  "-12.345678" ̂悤ȉ15ȓŎŵȂĺA 10 ̗ݏ
+//  double Őmɕ\̂ŁAP̏Z atof Ɠiۂ߂jlɂȂB
+//  ȊȌ atof ɔCB
+static bool  ParseNumber( const char * & p, const char * end, double & value )
+{
+	static const double  pow10[] = {
+		1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+	const char *  token;
+	int  length;
+	if ( !NextToken( p, end, token, length ) )
+		return  false;
+
+	const char *  s = token;
+	const char *  e = token + length;
+	bool    negative = false;
+	double  mantissa = 0.0;
+	int     digits = 0, scale = 0;
+
+	if ( ( *s == '-' ) || ( *s == '+' ) )
+		negative = ( *s++ == '-' );
+	while ( ( s < e ) && ( *s >= '0' ) && ( *s <= '9' ) )
+	{
+		mantissa = mantissa * 10.0 + ( *s++ - '0' );
+		digits ++;
+	}
+	if ( ( s < e ) && ( *s == '.' ) )
+	{
+		s ++;
+		while ( ( s < e ) && ( *s >= '0' ) && ( *s <= '9' ) )
+		{
+			mantissa = mantissa * 10.0 + ( *s++ - '0' );
+			digits ++;
+			scale ++;
+		}
+	}
+	if ( ( s == e ) && ( digits > 0 ) && ( digits <= 15 ) && ( scale <= 22 ) )
+	{
+		value = mantissa / pow10[ scale ];
+		if ( negative )
+			value = -value;
+		return  true;
+	}
+
+	char  buffer[ 64 ];
+	if ( length > 63 )  length = 63;
+	memcpy( buffer, token, length );
+	buffer[ length ] = '\0';
+	value = atof( buffer );
+	return  true;
+}
+
+
+
+//
+//  BVHt@C̃[h
+//
+void  BVH::Load( const char * bvh_file_name, bool use_cache )
+{
 	// 
 	Clear();
 
+	// LbVt@C̃t@CƑΉĂ΁Aǂݍ
+	string  cache_file_name;
+	if ( use_cache )
+	{
+		cache_file_name = string( bvh_file_name ) + "c";
+		if ( LoadCache( cache_file_name.c_str(), bvh_file_name ) )
+			return;
+	}
+
 	// t@C̏it@CE얼j̐ݒ
+	SetFileName( bvh_file_name );
+
+	// t@C}bv
+	MappedFile  mf;
+	if ( !MapFile( bvh_file_name, mf ) )  return; // t@CJȂI
+
+	// KwE[Vf[^̓ǂݍ
+	is_load_success = Parse( mf.data, mf.data + mf.size );
+
+	// t@C̃}bv
+	UnmapFile( mf );
+
+	// LbVt@C̍쐬
+	if ( use_cache && is_load_success )
+		SaveCache( cache_file_name.c_str() );
+}
+
+
+// t@C瓮얼ݒ
+void  BVH::SetFileName( const char * bvh_file_name )
+{
 	file_name = bvh_file_name;
 	const char *  mn_first = bvh_file_name;
 	const char *  mn_last = bvh_file_name + strlen( bvh_file_name );
@@ -95,26 +306,30 @@ void  BVH::Load( const char * bvh_file_name )
 	if ( mn_last < mn_first )
 		mn_last = bvh_file_name + strlen( bvh_file_name );
 	motion_name.assign( mn_first, mn_last );
+}
+
 
-	// t@C̃I[v
-	file.open( bvh_file_name, ios::in );
-	if ( file.is_open() == 0 )  return; // t@CJȂI
+// KwE[Vf[^̉
+bool  BVH::Parse( const char * p, const char * end )
+{
+	vector< Joint * >   joint_stack;
+	Joint *   joint = NULL;
+	Joint *   new_joint = NULL;
+	bool      is_site = false;
+	const char *  token;
+	int       length;
+	double    x, y ,z;
+	int       i, j, n;
 
 	// Kw̓ǂݍ
-	while ( ! file.eof() )
+	while ( true )
 	{
 		// t@C̍Ō܂łĂ܂ُI
-		if ( file.eof() )  goto bvh_error;
-
-		// Psǂݍ݁A擪̒P擾
-		file.getline( line, BUFFER_LENGTH );
-		token = strtok( line, separater );
-
-		// s̏ꍇ͎̍s
-		if ( token == NULL )  continue;
+		if ( !NextToken( p, end, token, length ) )
+			return  false;
 
 		// ֐߃ubN̊Jn
-		if ( strcmp( token, "{" ) == 0 )
+		if ( IsToken( token, length, "{" ) )
 		{
 			// ݂̊֐߂X^bNɐς
 			joint_stack.push_back( joint );
@@ -122,9 +337,11 @@ void  BVH::Load( const char * bvh_file_name )
 			continue;
 		}
 		// ֐߃ubN̏I
-		if ( strcmp( token, "}" ) == 0 )
+		if ( IsToken( token, length, "}" ) )
 		{
 			// ݂̊֐߂X^bNo
+			if ( joint_stack.size() == 0 )
+				return  false;
 			joint = joint_stack.back();
 			joint_stack.pop_back();
 			is_site = false;
@@ -132,8 +349,8 @@ void  BVH::Load( const char * bvh_file_name )
 		}
 
 		// ֐ߏ̊Jn
-		if ( ( strcmp( token, "ROOT" ) == 0 ) ||
-		     ( strcmp( token, "JOINT" ) == 0 ) )
+		if ( IsToken( token, length, "ROOT" ) ||
+		     IsToken( token, length, "JOINT" ) )
 		{
 			// ֐߃f[^̍쐬
 			new_joint = new Joint();
@@ -146,10 +363,11 @@ void  BVH::Load( const char * bvh_file_name )
 			if ( joint )
 				joint->children.push_back( new_joint );
 
-			// ֐ߖ̓ǂݍ
-			token = strtok( NULL, "" );
-			while ( *token == ' ' )  token ++;
-			new_joint->name = token;
+			// ֐ߖ̓ǂݍ݁is̎cŚj
+			while ( ( p < end ) && ( ( *p == ' ' ) || ( *p == '\t' ) ) )  p ++;
+			token = p;
+			while ( ( p < end ) && ( *p != '\r' ) && ( *p != '\n' ) )  p ++;
+			new_joint->name.assign( token, p );
 
 			// CfbNX֒ǉ
 			joint_index[ new_joint->name ] = new_joint;
@@ -157,7 +375,7 @@ void  BVH::Load( const char * bvh_file_name )
 		}
 
 		// [̊Jn
-		if ( ( strcmp( token, "End" ) == 0 ) )
+		if ( IsToken( token, length, "End" ) )
 		{
 			new_joint = joint;
 			is_site = true;
@@ -165,16 +383,13 @@ void  BVH::Load( const char * bvh_file_name )
 		}
 
 		// ֐߂̃ItZbg or [ʒȕ
-		if ( strcmp( token, "OFFSET" ) == 0 )
+		if ( IsToken( token, length, "OFFSET" ) )
 		{
 			// Wlǂݍ
-			token = strtok( NULL, separater );
-			x = token ? atof( token ) : 0.0;
-			token = strtok( NULL, separater );
-			y = token ? atof( token ) : 0.0;
-			token = strtok( NULL, separater );
-			z = token ? atof( token ) : 0.0;
-			
+			if ( ( joint == NULL ) ||
+			     !ParseNumber( p, end, x ) || !ParseNumber( p, end, y ) || !ParseNumber( p, end, z ) )
+				return  false;
+
 			// ֐߂̃ItZbgɍWlݒ
 			if ( is_site )
 			{
@@ -194,11 +409,12 @@ void  BVH::Load( const char * bvh_file_name )
 		}
 
 		// ֐߂̃`l
-		if ( strcmp( token, "CHANNELS" ) == 0 )
+		if ( IsToken( token, length, "CHANNELS" ) )
 		{
 			// `lǂݍ
-			token = strtok( NULL, separater );
-			joint->channels.resize( token ? atoi( token ) : 0 );
+			if ( ( joint == NULL ) || !ParseInteger( p, end, n ) || ( n < 0 ) )
+				return  false;
+			joint->channels.resize( n );
 
 			// `lǂݍ
 			for ( i=0; i<joint->channels.size(); i++ )
@@ -211,87 +427,1006 @@ void  BVH::Load( const char * bvh_file_name )
 				joint->channels[ i ] = channel;
 
 				// `l̎ނ̔
-				token = strtok( NULL, separater );
-				if ( strcmp( token, "Xrotation" ) == 0 )
+				if ( !NextToken( p, end, token, length ) )
+					return  false;
+				if ( IsToken( token, length, "Xrotation" ) )
 					channel->type = X_ROTATION;
-				else if ( strcmp( token, "Yrotation" ) == 0 )
+				else if ( IsToken( token, length, "Yrotation" ) )
 					channel->type = Y_ROTATION;
-				else if ( strcmp( token, "Zrotation" ) == 0 )
+				else if ( IsToken( token, length, "Zrotation" ) )
 					channel->type = Z_ROTATION;
-				else if ( strcmp( token, "Xposition" ) == 0 )
+				else if ( IsToken( token, length, "Xposition" ) )
 					channel->type = X_POSITION;
-				else if ( strcmp( token, "Yposition" ) == 0 )
+				else if ( IsToken( token, length, "Yposition" ) )
 					channel->type = Y_POSITION;
-				else if ( strcmp( token, "Zposition" ) == 0 )
+				else if ( IsToken( token, length, "Zposition" ) )
 					channel->type = Z_POSITION;
 			}
+			continue;
 		}
 
 		// Motionf[^̃ZNVֈڂ
-		if ( strcmp( token, "MOTION" ) == 0 )
+		if ( IsToken( token, length, "MOTION" ) )
 			break;
 	}
 
 
 	// [V̓ǂݍ
-	file.getline( line, BUFFER_LENGTH );
-	token = strtok( line, separater );
-	if ( strcmp( token, "Frames" ) != 0 )  goto bvh_error;
-	token = strtok( NULL, separater );
-	if ( token == NULL )  goto bvh_error;
-	num_frame = atoi( token );
-
-	file.getline( line, BUFFER_LENGTH );
-	token = strtok( line, ":" );
-	if ( strcmp( token, "Frame Time" ) != 0 )  goto bvh_error;
-	token = strtok( NULL, separater );
-	if ( token == NULL )  goto bvh_error;
-	interval = atof( token );
+	if ( !NextToken( p, end, token, length ) || !IsToken( token, length, "Frames" ) )
+		return  false;
+	if ( !ParseInteger( p, end, num_frame ) || ( num_frame < 0 ) )
+		return  false;
+
+	if ( !NextToken( p, end, token, length ) || !IsToken( token, length, "Frame" ) )
+		return  false;
+	if ( !NextToken( p, end, token, length ) || !IsToken( token, length, "Time" ) )
+		return  false;
+	if ( !ParseNumber( p, end, interval ) )
+		return  false;
 
 	num_channel = channels.size();
 	motion = new double[ num_frame * num_channel ];
 
 	// [Vf[^̓ǂݍ
-	for ( i=0; i<num_frame; i++ )
+	n = num_frame * num_channel;
+	for ( j=0; j<n; j++ )
 	{
-		file.getline( line, BUFFER_LENGTH );
-		token = strtok( line, separater );
-		for ( j=0; j<num_channel; j++ )
+		if ( !ParseNumber( p, end, motion[ j ] ) )
+			return  false;
+	}
+
+	// pvZp̊Kw\̍쐬
+	FlattenHierarchy();
+
+	// [h̐
+	return  true;
+}
+
+
+
+//
+//  oCiLbV
+//
+//  Kwƃ[Vf[^ifloatĵ܂ܕׂt@CB
+//  t@C}bvāA͂Ȃœǂݍ߂B
+//  [Vf[^ float Ɋۂ߂ĕۑ邽߁AeLXg烍[hlƂ
+//  float ̐xiLVxjňvB
+//
+
+#define  BVH_CACHE_VERSION  2
+
+// LbVt@C̃wb_
+struct  CacheHeader
+{
+	char    magic[ 4 ];       // "BVHC"
+	int     version;          // BVH_CACHE_VERSION
+	double  source_size;      // BVHt@C̃TCY
+	double  source_time;      // BVHt@C̍XV
+	unsigned int  source_hash; // BVHt@C̓ẽnbViFNV-1aj
+	double  interval;         // t[Ԃ̎ԊԊu
+	int     num_joint;        // ֐ߐ
+	int     num_channel;      // `l
+	int     num_frame;        // t[
+	int     motion_offset;    // [Vf[^̈ʒuit@C擪A16oCgEj
+};
+
+// LbVt@C̊֐ߏǐɊ֐ߖA`l̎ށAWoCgE܂ł̋lߕj
+struct  CacheJoint
+{
+	double  offset[ 3 ];      // ڑʒu
+	double  site[ 3 ];        // [ʒu
+	int     parent;           // e֐߂̔ԍi[g֐߂ -1j
+	int     has_site;         // [ʒuǂ
+	int     num_channel;      // `l
+	int     name_length;      // ֐ߖ̒
+};
+
+// t@C̃TCYEXV擾
+static bool  GetFileStamp( const char * file_name, double & size, double & time )
+{
+	struct stat  st;
+	if ( stat( file_name, &st ) != 0 )
+		return  false;
+	size = (double) st.st_size;
+	time = (double) st.st_mtime;
+	return  true;
+}
+
+// t@C̓ẽnbViFNV-1aj擾
+static bool  GetFileHash( const char * file_name, unsigned int & hash )
+{
+	MappedFile  mf;
+	if ( !MapFile( file_name, mf ) )
+		return  false;
+	hash = 2166136261U;
+	for ( size_t i=0; i<mf.size; i++ )
+		hash = ( hash ^ (unsigned char) mf.data[ i ] ) * 16777619U;
+	UnmapFile( mf );
+	return  true;
+}
+
+
+// oCiLbV̓ǂݍ݁ibvh_file_name ^΁AƑΉĂ邩mFj
+bool  BVH::LoadCache( const char * cache_file_name, const char * bvh_file_name )
+{
+	MappedFile   mf;
+	CacheHeader  header;
+	CacheJoint   cj;
+	double       size, time, cache_size, cache_time;
+	unsigned int hash;
+	int          i, j, n;
+
+	// 
+	Clear();
+
+	// t@C}bv
+	if ( !MapFile( cache_file_name, mf ) )
+		return  false;
+	const char *  p = mf.data;
+	const char *  end = mf.data + mf.size;
+
+	// wb_̊mF
+	if ( mf.size < sizeof( CacheHeader ) )
+		goto cache_error;
+	memcpy( &header, p, sizeof( CacheHeader ) );
+	p += sizeof( CacheHeader );
+	if ( ( memcmp( header.magic, "BVHC", 4 ) != 0 ) || ( header.version != BVH_CACHE_VERSION ) )
+		goto cache_error;
+	if ( ( header.num_joint <= 0 ) || ( header.num_channel < 0 ) || ( header.num_frame < 0 ) )
+		goto cache_error;
+	if ( header.motion_offset + (double) header.num_frame * header.num_channel * sizeof( float ) > mf.size )
+		goto cache_error;
+
+	// BVHt@CXVĂΎgȂ
+	//  XV͂PbPʂȂ̂ŁALbV̂Ɠbiȍ~jɍXVĂ
+	//  TCYEXVł͌ȂB̏ꍇẽnbVׂB
+	if ( bvh_file_name )
+	{
+		if ( !GetFileStamp( bvh_file_name, size, time ) )
+			goto cache_error;
+		if ( ( size != header.source_size ) || ( time != header.source_time ) )
+			goto cache_error;
+		if ( !GetFileStamp( cache_file_name, cache_size, cache_time ) || ( time >= cache_time ) )
+		{
+			if ( !GetFileHash( bvh_file_name, hash ) || ( hash != header.source_hash ) )
+				goto cache_error;
+		}
+	}
+
+	// ֐ߏ̓ǂݍ
+	for ( i=0; i<header.num_joint; i++ )
+	{
+		if ( end - p < sizeof( CacheJoint ) )
+			goto cache_error;
+		memcpy( &cj, p, sizeof( CacheJoint ) );
+		p += sizeof( CacheJoint );
+
+		n = ( cj.name_length + cj.num_channel * sizeof( int ) + 7 ) & ~7;
+		if ( ( cj.name_length < 0 ) || ( cj.num_channel < 0 ) || ( cj.parent >= i ) || ( end - p < n ) )
+			goto cache_error;
+
+		// ֐߃f[^̍쐬
+		Joint *  joint = new Joint();
+		joint->index = i;
+		joint->parent = ( cj.parent >= 0 ) ? joints[ cj.parent ] : NULL;
+		joint->has_site = ( cj.has_site != 0 );
+		for ( j=0; j<3; j++ )
 		{
-			if ( token == NULL )
-				goto bvh_error;
-			motion[ i*num_channel + j ] = atof( token );
-			token = strtok( NULL, separater );
+			joint->offset[ j ] = cj.offset[ j ];
+			joint->site[ j ] = cj.site[ j ];
 		}
+		joint->name.assign( p, cj.name_length );
+		joints.push_back( joint );
+		if ( joint->parent )
+			joint->parent->children.push_back( joint );
+		joint_index[ joint->name ] = joint;
+
+		// `l̍쐬
+		joint->channels.resize( cj.num_channel );
+		for ( j=0; j<cj.num_channel; j++ )
+		{
+			int  type;
+			memcpy( &type, p + cj.name_length + j * sizeof( int ), sizeof( int ) );
+
+			Channel *  channel = new Channel();
+			channel->joint = joint;
+			channel->type = (ChannelEnum) type;
+			channel->index = channels.size();
+			channels.push_back( channel );
+			joint->channels[ j ] = channel;
+		}
+		p += n;
+	}
+	if ( ( channels.size() != header.num_channel ) || ( p - mf.data > header.motion_offset ) )
+		goto cache_error;
+
+	// [Vf[^̓ǂݍ
+	num_channel = header.num_channel;
+	num_frame = header.num_frame;
+	interval = header.interval;
+	n = num_frame * num_channel;
+	motion = new double[ n ];
+	{
+		const float *  data = (const float *)( mf.data + header.motion_offset );
+		for ( i=0; i<n; i++ )
+			motion[ i ] = data[ i ];
 	}
 
-	// t@C̃N[Y
-	file.close();
+	// t@C̏̐ݒ
+	SetFileName( bvh_file_name ? bvh_file_name : cache_file_name );
+
+	// }bv̉
+	UnmapFile( mf );
+
+	// pvZp̊Kw\̍쐬
+	FlattenHierarchy();
 
 	// [h̐
 	is_load_success = true;
+	return  true;
+
+cache_error:
+	UnmapFile( mf );
+	Clear();
+	return  false;
+}
+
+
+// oCiLbV̏o
+bool  BVH::SaveCache( const char * cache_file_name ) const
+{
+	CacheHeader  header;
+	CacheJoint   cj;
+	vector< char >  buffer;
+	int  i, j, n;
+
+	if ( !is_load_success || ( motion == NULL ) )
+		return  false;
+
+	// wb_̐ݒ
+	memset( &header, 0, sizeof( CacheHeader ) );
+	memcpy( header.magic, "BVHC", 4 );
+	header.version = BVH_CACHE_VERSION;
+	if ( !GetFileStamp( file_name.c_str(), header.source_size, header.source_time ) )
+		return  false;
+	if ( !GetFileHash( file_name.c_str(), header.source_hash ) )
+		return  false;
+	header.interval = interval;
+	header.num_joint = joints.size();
+	header.num_channel = num_channel;
+	header.num_frame = num_frame;
+	buffer.resize( sizeof( CacheHeader ) );
+
+	// ֐ߏ̐ݒ
+	for ( i=0; i<joints.size(); i++ )
+	{
+		const Joint *  joint = joints[ i ];
+		memset( &cj, 0, sizeof( CacheJoint ) );
+		for ( j=0; j<3; j++ )
+		{
+			cj.offset[ j ] = joint->offset[ j ];
+			cj.site[ j ] = joint->site[ j ];
+		}
+		cj.parent = joint->parent ? joint->parent->index : -1;
+		cj.has_site = joint->has_site;
+		cj.num_channel = joint->channels.size();
+		cj.name_length = joint->name.size();
+
+		n = buffer.size();
+		buffer.resize( n + sizeof( CacheJoint ) + ( ( cj.name_length + cj.num_channel * sizeof( int ) + 7 ) & ~7 ), 0 );
+		memcpy( &buffer[ n ], &cj, sizeof( CacheJoint ) );
+		n += sizeof( CacheJoint );
+		memcpy( &buffer[ n ], joint->name.data(), cj.name_length );
+		n += cj.name_length;
+		for ( j=0; j<cj.num_channel; j++ )
+		{
+			int  type = joint->channels[ j ]->type;
+			memcpy( &buffer[ n ], &type, sizeof( int ) );
+			n += sizeof( int );
+		}
+	}
+
+	// [Vf[^̐ݒ
+	header.motion_offset = ( buffer.size() + 15 ) & ~15;
+	n = num_frame * num_channel;
+	buffer.resize( header.motion_offset + n * sizeof( float ), 0 );
+	float *  data = (float *) &buffer[ header.motion_offset ];
+	for ( i=0; i<n; i++ )
+		data[ i ] = (float) motion[ i ];
+	memcpy( &buffer[ 0 ], &header, sizeof( CacheHeader ) );
+
+	// t@Cւ̏o
+	FILE *  fp = fopen( cache_file_name, "wb" );
+	if ( fp == NULL )
+		return  false;
+	bool  success = ( fwrite( &buffer[ 0 ], 1, buffer.size(), fp ) == buffer.size() );
+	fclose( fp );
+	if ( !success )
+		remove( cache_file_name );
+	return  success;
+}
+
+
+
+//
+//  [hx̌viNX֐j
+//
+//  num_files ̃t@C num_repeat 񂸂[hAPbɃ[hł
+//  t@CԂBuse_cache ^ȂAOɃLbVt@C쐬ĂvB
+//
+double  BVH::BenchmarkLoad( int num_files, const char ** file_names, int num_repeat, bool use_cache )
+{
+	BVH  bvh;
+	int  i, j, count = 0;
 
-	return;
+	if ( use_cache )
+		for ( i=0; i<num_files; i++ )
+			bvh.Load( file_names[ i ], true );
+
+	clock_t  start = clock();
+	for ( j=0; j<num_repeat; j++ )
+	{
+		for ( i=0; i<num_files; i++ )
+		{
+			bvh.Load( file_names[ i ], use_cache );
+			if ( bvh.IsLoadSuccess() )
+				count ++;
+		}
+	}
+	double  seconds = (double)( clock() - start ) / CLOCKS_PER_SEC;
 
-bvh_error:
-	file.close();
+	return  ( seconds > 0.0 ) ? count / seconds : 0.0;
 }
 
 
 
 //
-//  BVHiEp̕`֐
+//  p̌vZ
+//
+//  ֐߂͐eɕłit@C̏oĵŁA֐ߔԍ̏
+//  e̍sɎ̕ϊ|Ă΁AP̑őS֐߂̍s񂪋܂B
+//  e֐߂̕ϊ RenderFigure() ƓAsړi[g֐߂̓[Vf[^
+//  擪R`lAȊO͐ڑʒuǰɉ]`lɊ|́B
 //
 
 #include <math.h>
+#include <algorithm>
+#if defined( _M_X64 ) || ( defined( _M_IX86_FP ) && ( _M_IX86_FP >= 2 ) ) || defined( __SSE2__ )
+#define  BVH_SSE
+#include <emmintrin.h>
+#endif
+
+#define  BVH_DEG_TO_RAD  ( 3.14159265358979323846 / 180.0 )
+
+
+#ifdef  BVH_SSE
+
+// Svf sinEcos 𓯎ɌvZipx͓xj
+//  90xPʂ̏ی -45`45x̎cɕAc sinEcos 𑽍ŋߎ
+//  یɉēւE]B덷 float ̊ۂߌ덷xB
+static inline void  SinCos4( __m128 deg, __m128 & s, __m128 & c )
+{
+	__m128i  q = _mm_cvtps_epi32( _mm_mul_ps( deg, _mm_set1_ps( 1.0f / 90.0f ) ) );
+	__m128   r = _mm_sub_ps( deg, _mm_mul_ps( _mm_cvtepi32_ps( q ), _mm_set1_ps( 90.0f ) ) );
+	r = _mm_mul_ps( r, _mm_set1_ps( (float) BVH_DEG_TO_RAD ) );
+	__m128   r2 = _mm_mul_ps( r, r );
+
+	// sin(r) = r + r^3 ( s1 + r^2 ( s2 + r^2 s3 ) )
+	__m128   ps = _mm_add_ps( _mm_mul_ps( r2, _mm_set1_ps( -1.9515295891e-4f ) ), _mm_set1_ps( 8.3321608736e-3f ) );
+	ps = _mm_add_ps( _mm_mul_ps( r2, ps ), _mm_set1_ps( -1.6666654611e-1f ) );
+	ps = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( r2, r ), ps ), r );
+
+	// cos(r) = 1 - r^2/2 + r^4 ( c1 + r^2 ( c2 + r^2 c3 ) )
+	__m128   pc = _mm_add_ps( _mm_mul_ps( r2, _mm_set1_ps( 2.443315711809948e-5f ) ), _mm_set1_ps( -1.388731625493765e-3f ) );
+	pc = _mm_add_ps( _mm_mul_ps( r2, pc ), _mm_set1_ps( 4.166664568298827e-2f ) );
+	pc = _mm_add_ps( _mm_mul_ps( _mm_mul_ps( r2, r2 ), pc ), _mm_sub_ps( _mm_set1_ps( 1.0f ), _mm_mul_ps( r2, _mm_set1_ps( 0.5f ) ) ) );
+
+	// یȂ sin  cos ւAی 2,3  sin  1,2  cos ͕𔽓]
+	__m128   swap = _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_and_si128( q, _mm_set1_epi32( 1 ) ), _mm_set1_epi32( 1 ) ) );
+	__m128   sign_s = _mm_castsi128_ps( _mm_slli_epi32( _mm_and_si128( q, _mm_set1_epi32( 2 ) ), 30 ) );
+	__m128   sign_c = _mm_castsi128_ps( _mm_slli_epi32( _mm_and_si128( _mm_add_epi32( q, _mm_set1_epi32( 1 ) ), _mm_set1_epi32( 2 ) ), 30 ) );
+	s = _mm_xor_ps( _mm_or_ps( _mm_and_ps( swap, pc ), _mm_andnot_ps( swap, ps ) ), sign_s );
+	c = _mm_xor_ps( _mm_or_ps( _mm_and_ps( swap, ps ), _mm_andnot_ps( swap, pc ) ), sign_c );
+}
+
+#endif
+
+
+// pvZp̊Kw\̍쐬
+void  BVH::FlattenHierarchy()
+{
+	int  i, j;
+
+	pose_parent.resize( joints.size() );
+	pose_rotation.resize( joints.size() + 1 );
+	rot_channel.clear();
+	rot_column.clear();
+
+	for ( i=0; i<joints.size(); i++ )
+	{
+		const Joint *  joint = joints[ i ];
+		pose_parent[ i ] = joint->parent ? joint->parent->index : -1;
+		pose_rotation[ i ] = rot_channel.size();
+
+		// ] R ́A a Ɨ b = (a+1)%3 ς
+		for ( j=0; j<joint->channels.size(); j++ )
+		{
+			const Channel *  channel = joint->channels[ j ];
+			if ( channel->type == X_ROTATION )
+				rot_column.push_back( 1 );
+			else if ( channel->type == Y_ROTATION )
+				rot_column.push_back( 2 );
+			else if ( channel->type == Z_ROTATION )
+				rot_column.push_back( 0 );
+			else
+				continue;
+			rot_channel.push_back( channel->index );
+		}
+	}
+	pose_rotation[ joints.size() ] = rot_channel.size();
+}
+
+
+// wt[̑S֐߂̃[hϊsvZ
+void  BVH::ComputePose( int frame_no, float * matrices, float scale ) const
+{
+	// ̃[Vf[^ĂΈkf[^vZ
+	if ( motion == NULL )
+		ComputePoseAt( frame_no * interval, matrices, scale );
+	else
+		ComputePose( motion + frame_no * num_channel, matrices, scale );
+}
+
+
+// w肳ꂽp̑S֐߂̃[hϊsvZ
+void  BVH::ComputePose( const double * data, float * matrices, float scale ) const
+{
+	int  i, j, k;
+
+	for ( i=0; i<pose_parent.size(); i++ )
+	{
+		const Joint *  joint = joints[ i ];
+		double  m[ 12 ]; // Ǐϊi]̂REsړj
+
+		// sړ
+		m[ 0 ] = 1.0;  m[ 1 ] = 0.0;  m[ 2 ] = 0.0;
+		m[ 3 ] = 0.0;  m[ 4 ] = 1.0;  m[ 5 ] = 0.0;
+		m[ 6 ] = 0.0;  m[ 7 ] = 0.0;  m[ 8 ] = 1.0;
+		if ( pose_parent[ i ] < 0 )
+		{
+			m[ 9 ] = data[ 0 ] * scale;  m[ 10 ] = data[ 1 ] * scale;  m[ 11 ] = data[ 2 ] * scale;
+		}
+		else
+		{
+			m[ 9 ] = joint->offset[ 0 ] * scale;  m[ 10 ] = joint->offset[ 1 ] * scale;  m[ 11 ] = joint->offset[ 2 ] * scale;
+		}
+
+		// ]ɉE|
+		for ( k=pose_rotation[ i ]; k<pose_rotation[ i + 1 ]; k++ )
+		{
+			double  angle = data[ rot_channel[ k ] ] * BVH_DEG_TO_RAD;
+			double  c = cos( angle ), s = sin( angle );
+			double *  a = m + rot_column[ k ] * 3;
+			double *  b = m + ( ( rot_column[ k ] + 1 ) % 3 ) * 3;
+			for ( j=0; j<3; j++ )
+			{
+				double  aj = a[ j ], bj = b[ j ];
+				a[ j ] = c * aj + s * bj;
+				b[ j ] = c * bj - s * aj;
+			}
+		}
+
+		// e֐߂̍s|
+		float *  out = matrices + i * 16;
+		if ( pose_parent[ i ] < 0 )
+		{
+			for ( j=0; j<4; j++ )
+			{
+				out[ j*4 + 0 ] = m[ j*3 + 0 ];
+				out[ j*4 + 1 ] = m[ j*3 + 1 ];
+				out[ j*4 + 2 ] = m[ j*3 + 2 ];
+			}
+		}
+		else
+		{
+			const float *  p = matrices + pose_parent[ i ] * 16;
+			for ( j=0; j<4; j++ )
+			{
+				out[ j*4 + 0 ] = p[ 0 ] * m[ j*3 ] + p[ 4 ] * m[ j*3 + 1 ] + p[  8 ] * m[ j*3 + 2 ];
+				out[ j*4 + 1 ] = p[ 1 ] * m[ j*3 ] + p[ 5 ] * m[ j*3 + 1 ] + p[  9 ] * m[ j*3 + 2 ];
+				out[ j*4 + 2 ] = p[ 2 ] * m[ j*3 ] + p[ 6 ] * m[ j*3 + 1 ] + p[ 10 ] * m[ j*3 + 2 ];
+			}
+			out[ 12 ] += p[ 12 ];
+			out[ 13 ] += p[ 13 ];
+			out[ 14 ] += p[ 14 ];
+		}
+		out[ 3 ] = 0.0f;  out[ 7 ] = 0.0f;  out[ 11 ] = 0.0f;  out[ 15 ] = 1.0f;
+	}
+}
+
+
+// ̎p܂Ƃ߂ČvZ
+//  SSE2 gꍇ́AS̎p float ̂SvfɂP蓖ĂāA
+//  ComputePose() ƓvZSpɍsB
+void  BVH::ComputePoses( int num_pose, const double * const * data, float * matrices, float scale ) const
+{
+	int  num_joint = pose_parent.size();
+	int  p = 0;
+
+#ifdef  BVH_SSE
+	int  i, j, k, l;
+
+	// S֐߂̃[hϊsi12vfAevf͂Spj
+	vector< float >  work( num_joint * 12 * 4 + 4 );
+	__m128 *  global = (__m128 *)( ( (size_t) &work[ 0 ] + 15 ) & ~(size_t) 15 );
+	__m128    vscale = _mm_set1_ps( scale );
+
+	for ( ; p+4<=num_pose; p+=4 )
+	{
+		const double * const *  d = data + p;
+
+		for ( i=0; i<num_joint; i++ )
+		{
+			const Joint *  joint = joints[ i ];
+			__m128  m[ 12 ];
+
+			// sړ
+			m[ 0 ] = _mm_set1_ps( 1.0f );  m[ 1 ] = _mm_setzero_ps();   m[ 2 ] = _mm_setzero_ps();
+			m[ 3 ] = _mm_setzero_ps();     m[ 4 ] = _mm_set1_ps( 1.0f ); m[ 5 ] = _mm_setzero_ps();
+			m[ 6 ] = _mm_setzero_ps();     m[ 7 ] = _mm_setzero_ps();   m[ 8 ] = _mm_set1_ps( 1.0f );
+			if ( pose_parent[ i ] < 0 )
+			{
+				for ( j=0; j<3; j++ )
+					m[ 9 + j ] = _mm_mul_ps( _mm_setr_ps( d[ 0 ][ j ], d[ 1 ][ j ], d[ 2 ][ j ], d[ 3 ][ j ] ), vscale );
+			}
+			else
+			{
+				for ( j=0; j<3; j++ )
+					m[ 9 + j ] = _mm_set1_ps( joint->offset[ j ] * scale );
+			}
+
+			// ]ɉE|
+			for ( k=pose_rotation[ i ]; k<pose_rotation[ i + 1 ]; k++ )
+			{
+				int  ch = rot_channel[ k ];
+				__m128  c, s;
+				SinCos4( _mm_setr_ps( d[ 0 ][ ch ], d[ 1 ][ ch ], d[ 2 ][ ch ], d[ 3 ][ ch ] ), s, c );
+				__m128 *  a = m + rot_column[ k ] * 3;
+				__m128 *  b = m + ( ( rot_column[ k ] + 1 ) % 3 ) * 3;
+				for ( j=0; j<3; j++ )
+				{
+					__m128  aj = a[ j ], bj = b[ j ];
+					a[ j ] = _mm_add_ps( _mm_mul_ps( c, aj ), _mm_mul_ps( s, bj ) );
+					b[ j ] = _mm_sub_ps( _mm_mul_ps( c, bj ), _mm_mul_ps( s, aj ) );
+				}
+			}
+
+			// e֐߂̍s|
+			__m128 *  out = global + i * 12;
+			if ( pose_parent[ i ] < 0 )
+			{
+				for ( j=0; j<12; j++ )
+					out[ j ] = m[ j ];
+			}
+			else
+			{
+				const __m128 *  q = global + pose_parent[ i ] * 12;
+				for ( j=0; j<4; j++ )
+				{
+					for ( l=0; l<3; l++ )
+						out[ j*3 + l ] = _mm_add_ps( _mm_add_ps(
+							_mm_mul_ps( q[ l ], m[ j*3 ] ), _mm_mul_ps( q[ 3 + l ], m[ j*3 + 1 ] ) ),
+							_mm_mul_ps( q[ 6 + l ], m[ j*3 + 2 ] ) );
+				}
+				out[ 9 ]  = _mm_add_ps( out[ 9 ],  q[ 9 ] );
+				out[ 10 ] = _mm_add_ps( out[ 10 ], q[ 10 ] );
+				out[ 11 ] = _mm_add_ps( out[ 11 ], q[ 11 ] );
+			}
+		}
+
+		// Sp̍sApƂ 4x4 sɕבւďo
+		for ( i=0; i<num_joint; i++ )
+		{
+			float  e[ 12 ][ 4 ];
+			for ( j=0; j<12; j++ )
+				_mm_storeu_ps( e[ j ], global[ i * 12 + j ] );
+			for ( l=0; l<4; l++ )
+			{
+				float *  out = matrices + ( ( p + l ) * num_joint + i ) * 16;
+				for ( j=0; j<4; j++ )
+				{
+					out[ j*4 + 0 ] = e[ j*3 + 0 ][ l ];
+					out[ j*4 + 1 ] = e[ j*3 + 1 ][ l ];
+					out[ j*4 + 2 ] = e[ j*3 + 2 ][ l ];
+					out[ j*4 + 3 ] = 0.0f;
+				}
+				out[ 15 ] = 1.0f;
+			}
+		}
+	}
+#endif
+
+	// c̎piSSE gȂΑSj͂PvZ
+	for ( ; p<num_pose; p++ )
+		ComputePose( data[ p ], matrices + p * num_joint * 16, scale );
+}
+
+
+
+//
+//  pvZ̑x̌v
+//
+//  [Vf[^̂΂΂̃t[ num_pose IсA̎p̌vZ
+//  num_repeat JԂāAPbɌvZłp̐ԂB
+//  batch ^Ȃ ComputePoses() ł܂Ƃ߂āAUȂ ComputePose() łPvZB
+//
+double  BVH::BenchmarkPose( int num_pose, int num_repeat, bool batch ) const
+{
+	int  i, j;
+
+	if ( !is_load_success || ( motion == NULL ) || ( num_frame == 0 ) || ( num_pose <= 0 ) )
+		return  0.0;
+
+	vector< const double * >  data( num_pose );
+	vector< float >  matrices( num_pose * joints.size() * 16 );
+	for ( i=0; i<num_pose; i++ )
+		data[ i ] = motion + ( ( i * 7919 ) % num_frame ) * num_channel;
+
+	clock_t  start = clock();
+	for ( j=0; j<num_repeat; j++ )
+	{
+		if ( batch )
+			ComputePoses( num_pose, &data[ 0 ], &matrices[ 0 ] );
+		else
+			for ( i=0; i<num_pose; i++ )
+				ComputePose( data[ i ], &matrices[ i * joints.size() * 16 ] );
+	}
+	double  seconds = (double)( clock() - start ) / CLOCKS_PER_SEC;
+
+	return  ( seconds > 0.0 ) ? (double) num_pose * num_repeat / seconds : 0.0;
+}
+
+
+
+//
+//  [Vf[^̈kE
+//
+//  e֐߂̉]`l͂܂Ƃ߂ĂP̎lɂĩׂt[ƓςɂȂȂ
+//  悤ɕ낦jA16rbg~SɗʎqĕۑB[g֐߂̕sړ
+//  i`l 0`2ARenderFigure() Ɠj float ŕۑB
+//  ǂ̋ȐAÕL[̕Ԃƌ̒lƂ̍e덷Ɏ܂L[΂A
+//  ܂ȂȂʒuɎ̃L[uBԂ͉]ʐ`ԁAsړ`ԁB
+//
+
+// l̐ ( a = a * b )
+static inline void  QuatMultiply( double * a, const double * b )
+{
+	double  x = a[ 3 ] * b[ 0 ] + a[ 0 ] * b[ 3 ] + a[ 1 ] * b[ 2 ] - a[ 2 ] * b[ 1 ];
+	double  y = a[ 3 ] * b[ 1 ] - a[ 0 ] * b[ 2 ] + a[ 1 ] * b[ 3 ] + a[ 2 ] * b[ 0 ];
+	double  z = a[ 3 ] * b[ 2 ] + a[ 0 ] * b[ 1 ] - a[ 1 ] * b[ 0 ] + a[ 2 ] * b[ 3 ];
+	double  w = a[ 3 ] * b[ 3 ] - a[ 0 ] * b[ 0 ] - a[ 1 ] * b[ 1 ] - a[ 2 ] * b[ 2 ];
+	a[ 0 ] = x;  a[ 1 ] = y;  a[ 2 ] = z;  a[ 3 ] = w;
+}
+
+// l̗ʎqE
+static inline void  QuatEncode( const double * q, short * key )
+{
+	for ( int i=0; i<4; i++ )
+		key[ i ] = (short) floor( q[ i ] * 32767.0 + 0.5 );
+}
+static inline void  QuatDecode( const short * key, double * q )
+{
+	double  len = 0.0;
+	int  i;
+	for ( i=0; i<4; i++ )
+	{
+		q[ i ] = key[ i ];
+		len += q[ i ] * q[ i ];
+	}
+	len = 1.0 / sqrt( len );
+	for ( i=0; i<4; i++ )
+		q[ i ] *= len;
+}
+
+// ʐ`ԁia  b ̓ς͕łȂƁj
+static inline void  QuatSlerp( const double * a, const double * b, double t, double * q )
+{
+	double  d = a[ 0 ] * b[ 0 ] + a[ 1 ] * b[ 1 ] + a[ 2 ] * b[ 2 ] + a[ 3 ] * b[ 3 ];
+	double  wa = 1.0 - t, wb = t;
+	int  i;
+	if ( d < 0.9999 )
+	{
+		double  angle = acos( d );
+		double  s = 1.0 / sin( angle );
+		wa = sin( wa * angle ) * s;
+		wb = sin( wb * angle ) * s;
+	}
+	// pxΐ`ԂĐK
+	double  len = 0.0;
+	for ( i=0; i<4; i++ )
+	{
+		q[ i ] = wa * a[ i ] + wb * b[ i ];
+		len += q[ i ] * q[ i ];
+	}
+	len = 1.0 / sqrt( len );
+	for ( i=0; i<4; i++ )
+		q[ i ] *= len;
+}
+
+// ̉]̍̊pxixj
+static inline double  QuatAngle( const double * a, const double * b )
+{
+	double  d = fabs( a[ 0 ] * b[ 0 ] + a[ 1 ] * b[ 1 ] + a[ 2 ] * b[ 2 ] + a[ 3 ] * b[ 3 ] );
+	return  ( d >= 1.0 ) ? 0.0 : 2.0 * acos( d ) / BVH_DEG_TO_RAD;
+}
+
+// Ȑ̎ fit[PʁjރL[ƁÅԂ̕Ԃ̔䗦擾
+static inline int  FindKey( const int * key_frame, const BVH::Track & track, double f, double & t )
+{
+	const int *  first = key_frame + track.first_key;
+	int  k = upper_bound( first, first + track.num_key, (int) floor( f ) ) - first - 1;
+	if ( k < 0 )
+		k = 0;
+	if ( k >= track.num_key - 1 )
+	{
+		t = 0.0;
+		return  track.num_key - 1;
+	}
+	t = ( f - first[ k ] ) / ( first[ k + 1 ] - first[ k ] );
+	return  k;
+}
+
+
+// [Vf[^̈k
+void  BVH::Compress( double rotation_tolerance, double position_tolerance, bool keep_motion )
+{
+	int  i, j, k, f, e;
+
+	if ( !is_load_success || ( motion == NULL ) || ( num_frame == 0 ) )
+		return;
+
+	rot_track.resize( joints.size() );
+	rot_key_frame.clear();
+	rot_key.clear();
+	pos_key_frame.clear();
+	pos_key.clear();
+
+	// e֐߂̉]
+	vector< double >  quat( num_frame * 4 );
+	for ( i=0; i<joints.size(); i++ )
+	{
+		rot_track[ i ].first_key = rot_key_frame.size();
+		rot_track[ i ].num_key = 0;
+		if ( pose_rotation[ i ] == pose_rotation[ i + 1 ] )
+			continue;
+
+		// St[̉]lɕϊi]`lɉE|j
+		for ( f=0; f<num_frame; f++ )
+		{
+			double *  q = &quat[ f * 4 ];
+			q[ 0 ] = 0.0;  q[ 1 ] = 0.0;  q[ 2 ] = 0.0;  q[ 3 ] = 1.0;
+			for ( k=pose_rotation[ i ]; k<pose_rotation[ i + 1 ]; k++ )
+			{
+				double  half = motion[ f * num_channel + rot_channel[ k ] ] * BVH_DEG_TO_RAD * 0.5;
+				double  r[ 4 ] = { 0.0, 0.0, 0.0, cos( half ) };
+				r[ ( rot_column[ k ] + 2 ) % 3 ] = sin( half ); //  1,2  XA2,0  YA0,1  Z
+				QuatMultiply( q, r );
+			}
+			if ( ( f > 0 ) && ( q[ 0 ] * q[ -4 ] + q[ 1 ] * q[ -3 ] + q[ 2 ] * q[ -2 ] + q[ 3 ] * q[ -1 ] < 0.0 ) )
+				for ( j=0; j<4; j++ )
+					q[ j ] = -q[ j ];
+		}
+
+		// L[t[̑I
+		short   key[ 4 ];
+		double  qa[ 4 ], qb[ 4 ], qi[ 4 ];
+		for ( f=0; ; f=e )
+		{
+			QuatEncode( &quat[ f * 4 ], key );
+			rot_key_frame.push_back( f );
+			rot_key.insert( rot_key.end(), key, key + 4 );
+			if ( f == num_frame - 1 )
+				break;
+			QuatDecode( key, qa );
+
+			// Ԃ̌덷e덷Ɏ܂ÃL[։΂
+			for ( e=f+1; e<num_frame-1; e++ )
+			{
+				QuatEncode( &quat[ ( e + 1 ) * 4 ], key );
+				QuatDecode( key, qb );
+				for ( j=f+1; j<=e; j++ )
+				{
+					QuatSlerp( qa, qb, (double)( j - f ) / ( e + 1 - f ), qi );
+					if ( QuatAngle( qi, &quat[ j * 4 ] ) > rotation_tolerance )
+						break;
+				}
+				if ( j <= e )
+					break;
+			}
+		}
+		rot_track[ i ].num_key = rot_key_frame.size() - rot_track[ i ].first_key;
+	}
+
+	// [g֐߂̕sړ
+	for ( i=0; i<3; i++ )
+	{
+		root_track[ i ].first_key = pos_key_frame.size();
+		for ( f=0; ; f=e )
+		{
+			pos_key_frame.push_back( f );
+			pos_key.push_back( ( i < num_channel ) ? (float) motion[ f * num_channel + i ] : 0.0f );
+			if ( ( i >= num_channel ) || ( f == num_frame - 1 ) )
+				break;
+			double  va = pos_key.back();
+
+			for ( e=f+1; e<num_frame-1; e++ )
+			{
+				double  vb = (float) motion[ ( e + 1 ) * num_channel + i ];
+				for ( j=f+1; j<=e; j++ )
+				{
+					double  t = (double)( j - f ) / ( e + 1 - f );
+					if ( fabs( va + ( vb - va ) * t - motion[ j * num_channel + i ] ) > position_tolerance )
+						break;
+				}
+				if ( j <= e )
+					break;
+			}
+		}
+		root_track[ i ].num_key = pos_key_frame.size() - root_track[ i ].first_key;
+	}
+
+	// ̃[Vf[^̉
+	if ( !keep_motion )
+	{
+		delete[]  motion;
+		motion = NULL;
+	}
+}
+
+
+// kf[^̃oCg擾
+int  BVH::GetCompressedSize() const
+{
+	return  rot_track.size() * sizeof( Track ) + sizeof( root_track ) +
+		rot_key_frame.size() * sizeof( int ) + rot_key.size() * sizeof( short ) +
+		pos_key_frame.size() * sizeof( int ) + pos_key.size() * sizeof( float );
+}
+
+
+// Cӂ̎̑S֐߂̃[hϊsAkf[^ԂČvZ
+void  BVH::ComputePoseAt( double time, float * matrices, float scale ) const
+{
+	int  i, j, k;
+
+	// kĂȂΒÕt[̎p
+	double  f = ( interval > 0.0 ) ? time / interval : 0.0;
+	if ( f > num_frame - 1 )
+		f = num_frame - 1;
+	if ( f < 0.0 )
+		f = 0.0;
+	if ( !IsCompressed() )
+	{
+		ComputePose( (int) f, matrices, scale );
+		return;
+	}
+
+	for ( i=0; i<pose_parent.size(); i++ )
+	{
+		const Joint *  joint = joints[ i ];
+		double  m[ 12 ]; // Ǐϊi]̂REsړj
+		double  t;
+
+		// sړ
+		if ( pose_parent[ i ] < 0 )
+		{
+			for ( j=0; j<3; j++ )
+			{
+				k = FindKey( &pos_key_frame[ 0 ], root_track[ j ], f, t );
+				const float *  v = &pos_key[ root_track[ j ].first_key + k ];
+				m[ 9 + j ] = ( ( t > 0.0 ) ? v[ 0 ] + ( v[ 1 ] - v[ 0 ] ) * t : v[ 0 ] ) * scale;
+			}
+		}
+		else
+		{
+			m[ 9 ] = joint->offset[ 0 ] * scale;  m[ 10 ] = joint->offset[ 1 ] * scale;  m[ 11 ] = joint->offset[ 2 ] * scale;
+		}
+
+		// ]ilԂčsɕϊj
+		if ( rot_track[ i ].num_key == 0 )
+		{
+			m[ 0 ] = 1.0;  m[ 1 ] = 0.0;  m[ 2 ] = 0.0;
+			m[ 3 ] = 0.0;  m[ 4 ] = 1.0;  m[ 5 ] = 0.0;
+			m[ 6 ] = 0.0;  m[ 7 ] = 0.0;  m[ 8 ] = 1.0;
+		}
+		else
+		{
+			double  q[ 4 ], qa[ 4 ], qb[ 4 ];
+			k = FindKey( &rot_key_frame[ 0 ], rot_track[ i ], f, t );
+			const short *  key = &rot_key[ ( rot_track[ i ].first_key + k ) * 4 ];
+			QuatDecode( key, qa );
+			if ( t > 0.0 )
+			{
+				QuatDecode( key + 4, qb );
+				QuatSlerp( qa, qb, t, q );
+			}
+			else
+			{
+				for ( j=0; j<4; j++ )
+					q[ j ] = qa[ j ];
+			}
+			double  x = q[ 0 ], y = q[ 1 ], z = q[ 2 ], w = q[ 3 ];
+			m[ 0 ] = 1.0 - 2.0 * ( y*y + z*z );  m[ 1 ] = 2.0 * ( x*y + z*w );        m[ 2 ] = 2.0 * ( x*z - y*w );
+			m[ 3 ] = 2.0 * ( x*y - z*w );        m[ 4 ] = 1.0 - 2.0 * ( x*x + z*z );  m[ 5 ] = 2.0 * ( y*z + x*w );
+			m[ 6 ] = 2.0 * ( x*z + y*w );        m[ 7 ] = 2.0 * ( y*z - x*w );        m[ 8 ] = 1.0 - 2.0 * ( x*x + y*y );
+		}
+
+		// e֐߂̍s|
+		float *  out = matrices + i * 16;
+		if ( pose_parent[ i ] < 0 )
+		{
+			for ( j=0; j<4; j++ )
+			{
+				out[ j*4 + 0 ] = m[ j*3 + 0 ];
+				out[ j*4 + 1 ] = m[ j*3 + 1 ];
+				out[ j*4 + 2 ] = m[ j*3 + 2 ];
+			}
+		}
+		else
+		{
+			const float *  p = matrices + pose_parent[ i ] * 16;
+			for ( j=0; j<4; j++ )
+			{
+				out[ j*4 + 0 ] = p[ 0 ] * m[ j*3 ] + p[ 4 ] * m[ j*3 + 1 ] + p[  8 ] * m[ j*3 + 2 ];
+				out[ j*4 + 1 ] = p[ 1 ] * m[ j*3 ] + p[ 5 ] * m[ j*3 + 1 ] + p[  9 ] * m[ j*3 + 2 ];
+				out[ j*4 + 2 ] = p[ 2 ] * m[ j*3 ] + p[ 6 ] * m[ j*3 + 1 ] + p[ 10 ] * m[ j*3 + 2 ];
+			}
+			out[ 12 ] += p[ 12 ];
+			out[ 13 ] += p[ 13 ];
+			out[ 14 ] += p[ 14 ];
+		}
+		out[ 3 ] = 0.0f;  out[ 7 ] = 0.0f;  out[ 11 ] = 0.0f;  out[ 15 ] = 1.0f;
+	}
+}
+
+
+
+//
+//  BVHiEp̕`֐
+//
+
 #include <gl/glut.h>
 
 
 // wt[̎p`
 void  BVH::RenderFigure( int frame_no, float scale )
 {
-	// BVHiEpw肵ĕ`
-	RenderFigure( joints[ 0 ], motion + frame_no * num_channel, scale );
+	// S֐߂̍svZĂ`
+	vector< float >  matrices( joints.size() * 16 );
+	ComputePose( frame_no, &matrices[ 0 ], scale );
+	RenderPose( &matrices[ 0 ], scale );
+}
+
+
+// Cӂ̎̎p`
+void  BVH::RenderFigureAt( double time, float scale )
+{
+	vector< float >  matrices( joints.size() * 16 );
+	ComputePoseAt( time, &matrices[ 0 ], scale );
+	RenderPose( &matrices[ 0 ], scale );
+}
+
+
+// vZς݂̎p`
+void  BVH::RenderPose( const float * matrices, float scale ) const
+{
+	int  i;
+	for ( i=0; i<joints.size(); i++ )
+	{
+		glPushMatrix();
+		glMultMatrixf( matrices + i * 16 );
+		RenderLinks( joints[ i ], scale );
+		glPopMatrix();
+	}
 }
 
 
@@ -325,6 +1460,23 @@ void  BVH::RenderFigure( const Joint * joint, const double * data, float scale )
 	}
 
 	// N`
+	RenderLinks( joint, scale );
+
+	// q֐߂ɑ΂čċAĂяo
+	for ( i=0; i<joint->children.size(); i++ )
+	{
+		RenderFigure( joint->children[ i ], data, scale );
+	}
+
+	glPopMatrix();
+}
+
+
+// ֐߂q֐߁E[ւ̃N`iNX֐j
+void  BVH::RenderLinks( const Joint * joint, float scale )
+{
+	int  i;
+
 	// ֐ߍWň_疖[_ւ̃N`
 	if ( joint->children.size() == 0 )
 	{
@@ -363,14 +1515,6 @@ void  BVH::RenderFigure( const Joint * joint, const double * data, float scale )
 				child->offset[ 0 ] * scale, child->offset[ 1 ] * scale, child->offset[ 2 ] * scale );
 		}
 	}
-
-	// q֐߂ɑ΂čċAĂяo
-	for ( i=0; i<joint->children.size(); i++ )
-	{
-		RenderFigure( joint->children[ i ], data, scale );
-	}
-
-	glPopMatrix();
 }
 
 
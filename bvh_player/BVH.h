@@ -32,6 +32,13 @@ class  BVH
 	};
 	struct  Joint;
 
+	// k[Vf[^̂P{̋ȐiL[͈̔́j
+	struct  Track
+	{
+		int                  first_key; // ŏ̃L[̔ԍ
+		int                  num_key;   // L[̐
+	};
+
 	// `l
 	struct  Channel
 	{
@@ -90,6 +97,20 @@ class  BVH
 	double                   interval;    // t[Ԃ̎ԊԊu
 	double *                 motion;      // [t[ԍ][`lԍ]
 
+	/*  pvZpɕRKw\  */
+	vector< int >            pose_parent;   // e֐߂̔ԍ [֐ߔԍ]i[g֐߂ -1j
+	vector< int >            pose_rotation; // ]`l͈̔ [֐ߔԍ]`[֐ߔԍ+1]
+	vector< int >            rot_channel;   // ]`l̃`lԍ
+	vector< int >            rot_column;    // ]ŕς̑g̍ŏ̗iX:1,2 Y:2,0 Z:0,1j
+
+	/*  k[Vf[^iCompress() ō쐬j  */
+	vector< Track >          rot_track;     // ֐߂̉] [֐ߔԍ]i]`l̂Ȃ֐߂̓L[Ȃj
+	Track                    root_track[3]; // [g֐߂̕sړi`l 0`2j
+	vector< int >            rot_key_frame; // ]̃L[̃t[ԍ
+	vector< short >          rot_key;       // ]̃L[il x,y,z,w  1/32767 Pʂɗʎqj
+	vector< int >            pos_key_frame; // sړ̃L[̃t[ԍ
+	vector< float >          pos_key;       // sړ̃L[
+
 
   public:
 	// RXgN^EfXgN^
@@ -100,8 +121,25 @@ class  BVH
 	// S̃NA
 	void  Clear();
 
-	// BVHt@C̃[h
-	void  Load( const char * bvh_file_name );
+	// BVHt@C̃[hiuse_cache ^ȂoCiLbV𗘗pE쐬j
+	void  Load( const char * bvh_file_name, bool use_cache = false );
+
+	// oCiLbV̓ǂݍ݁Eo
+	bool  LoadCache( const char * cache_file_name, const char * bvh_file_name = NULL );
+	bool  SaveCache( const char * cache_file_name ) const;
+
+	// [hx̌viPb̃[hԂjiNX֐j
+	static double  BenchmarkLoad( int num_files, const char ** file_names, int num_repeat, bool use_cache );
+
+  private:
+	// KwE[Vf[^̉
+	bool  Parse( const char * text, const char * text_end );
+
+	// t@C瓮얼ݒ
+	void  SetFileName( const char * bvh_file_name );
+
+	// pvZp̊Kw\̍쐬
+	void  FlattenHierarchy();
 
   public:
 	/*  f[^ANZX֐  */
@@ -129,10 +167,44 @@ class  BVH
 	// [Vf[^̏̎擾
 	int     GetNumFrame() const { return  num_frame; }
 	double  GetInterval() const { return  interval; }
-	double  GetMotion( int f, int c ) const { return  motion[ f*num_channel + c ]; }
+	// iCompress() Ō̃[Vf[^ 0 Ԃj
+	double  GetMotion( int f, int c ) const { return  motion ? motion[ f*num_channel + c ] : 0.0; }
 
-	// [Vf[^̏̕ύX
-	void  SetMotion( int f, int c, double v ) { motion[ f*num_channel + c ] = v; }
+	// [Vf[^̏̕ύXikς݂̏ꍇAkf[^ɂ͔fȂj
+	// iCompress() Ō̃[Vf[^͉Ȃj
+	void  SetMotion( int f, int c, double v ) { if ( motion )  motion[ f*num_channel + c ] = v; }
+
+  public:
+	/*  [Vf[^̈k  */
+
+	// ]lA[g̕sړ float ̋ȐɂāAe덷ixEjȓ
+	// L[t[Ԉikeep_motion UȂ猳̃[Vf[^j
+	void  Compress( double rotation_tolerance, double position_tolerance, bool keep_motion = true );
+
+	// kς݂ǂ擾
+	bool  IsCompressed() const { return  rot_track.size() > 0; }
+
+	// kf[^̃oCg擾
+	int   GetCompressedSize() const;
+
+  public:
+	/*  p̌vZ֐  */
+
+	// wt[̑S֐߂̃[hϊsvZ
+	// imatrices ͊֐ߐ~16  floatAOpenGL ƓD 4x4 sj
+	void  ComputePose( int frame_no, float * matrices, float scale = 1.0f ) const;
+	void  ComputePose( const double * data, float * matrices, float scale = 1.0f ) const;
+
+	// Cӂ̎̑S֐߂̃[hϊsAkf[^ԂČvZ
+	// i]͋ʐ`ԁAsړ͐`ԁBkĂȂΒÕt[̎pj
+	void  ComputePoseAt( double time, float * matrices, float scale = 1.0f ) const;
+
+	// ̎p܂Ƃ߂ČvZidata[i]  i Ԗڂ̎p̃[Vf[^j
+	// iSSE2 gꍇ͂SpɌvZj
+	void  ComputePoses( int num_pose, const double * const * data, float * matrices, float scale = 1.0f ) const;
+
+	// pvZ̑x̌viPb̎pԂj
+	double  BenchmarkPose( int num_pose, int num_repeat, bool batch ) const;
 
   public:
 	/*  p̕`֐  */
@@ -140,9 +212,18 @@ class  BVH
 	// wt[̎p`
 	void  RenderFigure( int frame_no, float scale = 1.0f );
 
+	// Cӂ̎̎p`
+	void  RenderFigureAt( double time, float scale = 1.0f );
+
+	// vZς݂̎p`
+	void  RenderPose( const float * matrices, float scale = 1.0f ) const;
+
 	// w肳ꂽBVHiEp`iNX֐j
 	static void  RenderFigure( const Joint * root, const double * data, float scale = 1.0f );
 
+	// ֐߂q֐߁E[ւ̃N`iNX֐j
+	static void  RenderLinks( const Joint * joint, float scale );
+
 	// BVHîP{̃N`iNX֐j
 	static void  RenderBone( float x0, float y0, float z0, float x1, float y1, float z1 );
 };
@@ -9,6 +9,7 @@
 #endif
 
 #include <GL/glut.h>
+#include <math.h>
 
 #include "BVH.h"
 
@@ -48,6 +49,10 @@ int    frame_no = 0;
 // BVHf[^
 BVH *   bvh = NULL;
 
+// [hxEpvZ̑x̌vʁib L[Ōvj
+char   load_benchmark[ 64 ] = "";
+char   pose_benchmark[ 64 ] = "";
+
 
 
 //
@@ -137,7 +142,7 @@ void  display( void )
 	// LN^`
 	glColor3f( 1.0f, 0.0f, 0.0f );
 	if ( bvh )
-		bvh->RenderFigure( frame_no, 0.02f );
+		bvh->RenderFigureAt( animation_time, 0.02f );
 
 	// Ԃƃt[ԍ\
 	char  message[ 64 ];
@@ -146,6 +151,8 @@ void  display( void )
 	else
 		sprintf( message, "Press 'L' key to Load a BVH file" );
 	drawMessage( 0, message );
+	drawMessage( 1, load_benchmark );
+	drawMessage( 2, pose_benchmark );
 
 	// obNobt@ɕ`悵ʂtgobt@ɕ\
     glutSwapBuffers();
@@ -260,19 +267,19 @@ void  keyboard( unsigned char key, int mx, int my )
 		on_animation = !on_animation;
 
 	// n L[Ŏ̃t[
-	if ( ( key == 'n' ) && !on_animation )
+	if ( ( key == 'n' ) && !on_animation && bvh )
 	{
-		animation_time += bvh->GetInterval();
 		frame_no ++;
 		frame_no = frame_no % bvh->GetNumFrame();
+		animation_time = frame_no * bvh->GetInterval();
 	}
 
 	// p L[őÕt[
 	if ( ( key == 'p' ) && !on_animation && ( frame_no > 0 ) && bvh )
 	{
-		animation_time -= bvh->GetInterval();
 		frame_no --;
 		frame_no = frame_no % bvh->GetNumFrame();
+		animation_time = frame_no * bvh->GetInterval();
 	}
 
 	// r L[ŃAj[ṼZbg
@@ -282,6 +289,20 @@ void  keyboard( unsigned char key, int mx, int my )
 		frame_no = 0;
 	}
 
+	// b L[Ō݂̓̃[hxieLXgELbVj
+	// pvZ̑xiPpE܂Ƃ߂ājv
+	if ( ( key == 'b' ) && bvh )
+	{
+		const char *  file_name = bvh->GetFileName().c_str();
+		double  text = BVH::BenchmarkLoad( 1, &file_name, 10, false );
+		double  cache = BVH::BenchmarkLoad( 1, &file_name, 10, true );
+		sprintf( load_benchmark, "Load: %.1f /s (text), %.1f /s (cache)", text, cache );
+
+		double  single = bvh->BenchmarkPose( 256, 20, false );
+		double  batch = bvh->BenchmarkPose( 256, 20, true );
+		sprintf( pose_benchmark, "Pose: %.0f /s (single), %.0f /s (batch)", single, batch );
+	}
+
 	// l L[ōĐ̕ύX
 	if ( key == 'l' )
 	{
@@ -308,10 +329,11 @@ void  keyboard( unsigned char key, int mx, int my )
 		// t@Cw肳ꂽVݒ
 		if( ret )
 		{
-			// f[^ǂݍ
+			// f[^ǂݍ݁ioCiLbV𗘗pj
 			if ( bvh )
 				delete  bvh;
-			bvh = new BVH( file_name );
+			bvh = new BVH();
+			bvh->Load( file_name, true );
 
 			// ǂݍ݂Ɏs폜
 			if ( !bvh->IsLoadSuccess() )
@@ -319,10 +341,15 @@ void  keyboard( unsigned char key, int mx, int my )
 				delete  bvh;
 				bvh = NULL;
 			}
+			// 玞ŕԂł悤Ɉk
+			else
+				bvh->Compress( 0.1, 0.01 );
 
 			//	Aj[VZbg
 			animation_time = 0.0f;
 			frame_no = 0;
+			load_benchmark[ 0 ] = '\0';
+			pose_benchmark[ 0 ] = '\0';
 		}
 #endif
 	}
@@ -355,6 +382,11 @@ void  idle( void )
 		// ݂̃t[ԍvZ
 		if ( bvh )
 		{
+			// ĐԂ𓮍̒Ő܂Ԃ
+			float  length = bvh->GetNumFrame() * bvh->GetInterval();
+			if ( length > 0.0f )
+				animation_time = fmod( animation_time, length );
+
 			frame_no = animation_time / bvh->GetInterval();
 			frame_no = frame_no % bvh->GetNumFrame();
 		}
@@ -7,8 +7,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
 #include "collision.h"
 
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define CDR_SSE2
+#include <emmintrin.h>
+#endif
+
 /*
 General CDR Algorithm
 ---------------------
@@ -58,6 +64,9 @@ There are three main avenues for optimization:
 #endif
 #define CDR_MAX_HITS 40
 #define CDR_TOLERANCE 1e-8
+#define CDR_MAX_SLIDES 25 // max collisions per sweep
+#define CDR_NUDGE 0.05    // see CDR_SweepUpdate
+#define CDR_MAX_PLANES 16 // faces plane-tested at once by CDR_Search
 
 struct hit_t
 {
@@ -81,13 +90,29 @@ struct sweep_t
 	hit_t ppl[CDR_MAX_HITS];
 };
 
+#define CDR_MAX_OBJ 1000
+
+struct search_t
+{
+	hit_t    obj[CDR_MAX_OBJ];
+	int      objcount;
+	hull_t **hull; // candidates from CSG_Query, one block per job,
+	int      hullmax; // split by level of CDR_Search's recursion
+	int      hulltop;
+};
+
 static vert_t *CDR_VERT_POOL;
 static surf_t *CDR_SURF_POOL;
 static hull_t *CDR_WORLD;
 
-#define CDR_MAX_OBJ 1000
-static hit_t CDR_OBJ_LIST[CDR_MAX_OBJ];
-static int   CDR_OBJ_COUNT;
+// One search per job of CDR_CollideBatch; CDR_Collide uses the first.
+static search_t *CDR_SEARCH[CSG_MAX_THREADS];
+
+static vec3   *CDR_BATCH_POSITION;
+static vec3   *CDR_BATCH_IMPULSE;
+static double *CDR_BATCH_RADIUS;
+static int     CDR_BATCH_COUNT;
+static int     CDR_BATCH_JOBS;
 
 static int    CDR_GetMaxAxis(vec3 &n);
 static double CDR_SnapTo(double z, double z0);
@@ -98,8 +123,14 @@ static void   CDR_SweepPpl(sweep_t *sweep, vec3 e[], vec3 &n, int k, double t);
 static void   CDR_SweepCollision(sweep_t *sweep, vec3 e[], vec3 &n, int k);
 static void   CDR_SweepUpdate(sweep_t *sweep);
 
-static void CDR_Search(bbox_t *bbox, hull_t *hull);
-static vec3 CDR_GetPolyNormal(poly_t *poly);
+static search_t *CDR_GetSearch(int i);
+static void      CDR_EndSearch(search_t *search);
+static void      CDR_Resolve(search_t *search, vec3 &position, vec3 &impulse, double radius);
+static void      CDR_CollideJob(int job);
+static int       CDR_Outside(bbox_t *bbox1, bbox_t *bbox2);
+static void      CDR_PlaneTest(poly_t *face[], int count, vec3 &center, double reach, int skip[]);
+static void      CDR_Search(search_t *search, bbox_t *bbox, hull_t *hull, vec3 &center, double reach);
+static vec3      CDR_GetPolyNormal(poly_t *poly);
 
 // ****************************************************************************
 // ****************************************************************************
@@ -121,6 +152,88 @@ void CDR_Initialize(hull_t *world)
 }
 
 void CDR_Collide(vec3 &position, vec3 &impulse, double radius)
+{
+	// *************************************************
+	// The vertex and surface pools grow as hulls are
+	// added, and may have moved since CDR_Initialize.
+	// *************************************************
+	
+	CDR_VERT_POOL = CSG_GetVertPool();
+	CDR_SURF_POOL = CSG_GetSurfPool();
+	
+	search_t *search = CDR_GetSearch(0);
+	
+	CDR_Resolve(search, position, impulse, radius);
+	CDR_EndSearch(search);
+}
+
+void CDR_CollideBatch(vec3 position[], vec3 impulse[], double radius[], int count)
+{
+	CSG_PUSHNAME("CDR_CollideBatch");
+	
+	// *****************************************************
+	// Resolves count spheres at once, as if by calling
+	// CDR_Collide on each in turn, sharing them out between
+	// the threads set up by CSG_SetThreadCount. The results
+	// are the same as CDR_Collide's. The world must not be
+	// changed while this is running.
+	// *****************************************************
+	
+	CDR_VERT_POOL = CSG_GetVertPool();
+	CDR_SURF_POOL = CSG_GetSurfPool();
+	
+	int jobs = CSG_GetThreadCount();
+	
+	if(jobs > count) jobs = count;
+	
+	for(int i = 0; i < jobs; i++)
+	{
+		CDR_GetSearch(i); // allocate up front, not on the workers
+	}
+	CDR_BATCH_POSITION = position;
+	CDR_BATCH_IMPULSE  = impulse;
+	CDR_BATCH_RADIUS   = radius;
+	CDR_BATCH_COUNT    = count;
+	CDR_BATCH_JOBS     = jobs;
+	
+	CSG_RunJobs(CDR_CollideJob, jobs);
+	CSG_POPNAME_;
+}
+
+static search_t *CDR_GetSearch(int i)
+{
+	if(!CDR_SEARCH[i])
+	{
+		CDR_SEARCH[i] = (search_t*)CSG_AllocMem(sizeof(search_t), 1);
+	}
+	return CDR_SEARCH[i];
+}
+
+static void CDR_EndSearch(search_t *search)
+{
+	// Free the candidate list once the job is done with it
+	CSG_FreeMem(search->hull);
+	search->hull    = NULL;
+	search->hullmax = 0;
+}
+
+static void CDR_CollideJob(int job)
+{
+	// ****************************************
+	// Each job takes an equal share of the batch
+	// ****************************************
+	
+	int i   = (int)((double)CDR_BATCH_COUNT * job / CDR_BATCH_JOBS);
+	int end = (int)((double)CDR_BATCH_COUNT * (job+1) / CDR_BATCH_JOBS);
+	
+	for(; i < end; i++)
+	{
+		CDR_Resolve(CDR_SEARCH[job], CDR_BATCH_POSITION[i], CDR_BATCH_IMPULSE[i], CDR_BATCH_RADIUS[i]);
+	}
+	CDR_EndSearch(CDR_SEARCH[job]);
+}
+
+static void CDR_Resolve(search_t *search, vec3 &position, vec3 &impulse, double radius)
 {
 	// ************************************
 	// Compute effective collision boundary
@@ -133,14 +246,24 @@ void CDR_Collide(vec3 &position, vec3 &impulse, double radius)
 	bbox.minv = midp - vec3(cr, cr, cr);
 	bbox.maxv = midp + vec3(cr, cr, cr);
 	
+	// ************************************************
+	// The sphere can only get as far from position as
+	// the impulse plus the nudges in CDR_SweepUpdate,
+	// so any face whose plane is further away than that
+	// (plus the radius) cannot be hit.
+	// ************************************************
+	
+	double reach = cr*2.0 + CDR_MAX_SLIDES*CDR_NUDGE;
+	
 	// **********************************
 	// Enumerate polygons within boundary
 	// **********************************
 	
-	CDR_OBJ_COUNT = 0;
-	CDR_Search(&bbox, CDR_WORLD);
+	search->objcount = 0;
+	search->hulltop  = 0;
+	CDR_Search(search, &bbox, CDR_WORLD, position, reach);
 	
-	if(CDR_OBJ_COUNT < 1)
+	if(search->objcount < 1)
 	{
 		position += impulse;
 		return;
@@ -160,15 +283,15 @@ void CDR_Collide(vec3 &position, vec3 &impulse, double radius)
 		sweep.slide    = sweep.residual;
 		sweep.residual = vec3(0.0, 0.0, 0.0);
 		
-		for(int i = 0; i < 25; i++) //FIXME: max collisions per sweep = 25
+		for(int i = 0; i < CDR_MAX_SLIDES; i++)
 		{
 			sweep.t = 1.0; // no hit
 			sweep.hitcount = 0;
 			sweep.pplcount = 0;
 			
-			for(int j = 0; j < CDR_OBJ_COUNT; j++)
+			for(int j = 0; j < search->objcount; j++)
 			{
-				hit_t *obj = &CDR_OBJ_LIST[j];
+				hit_t *obj = &search->obj[j];
 				
 				CDR_SweepCollision(&sweep, obj->e, obj->n, obj->k);
 			}
@@ -387,7 +510,7 @@ static void CDR_SweepUpdate(sweep_t *sweep)
 		vec3 va = m - na*(m*na);
 // horrible hack: makes collisions sort-of work  =(
 sweep->slide = va;
-sweep->position += na*0.05;
+sweep->position += na*CDR_NUDGE;
 return;
 	
 		int blocked = 0;
@@ -435,7 +558,69 @@ return;
 	sweep->slide   *= 0.0;
 }
 
-static void CDR_Search(bbox_t *bbox, hull_t *hull)
+static int CDR_Outside(bbox_t *bbox1, bbox_t *bbox2)
+{
+	// ************************************************
+	// Same as CSG_Intersect(bbox1, bbox2, 7), without
+	// setting CSG_CODE_IN/OUT, so that it is thread-safe
+	// ************************************************
+	
+	return bbox1->maxv.x <= bbox2->minv.x + CSG_MAXERR ||
+	       bbox1->minv.x >= bbox2->maxv.x - CSG_MAXERR ||
+	       bbox1->maxv.y <= bbox2->minv.y + CSG_MAXERR ||
+	       bbox1->minv.y >= bbox2->maxv.y - CSG_MAXERR ||
+	       bbox1->maxv.z <= bbox2->minv.z + CSG_MAXERR ||
+	       bbox1->minv.z >= bbox2->maxv.z - CSG_MAXERR;
+}
+
+static void CDR_PlaneTest(poly_t *face[], int count, vec3 &center, double reach, int skip[])
+{
+	// *************************************************
+	// Sets skip[i] for each face whose plane is further
+	// than reach from center. The planes are gathered so
+	// that two can be tested at a time with SSE2.
+	// *************************************************
+	
+	double nx[CDR_MAX_PLANES], ny[CDR_MAX_PLANES], nz[CDR_MAX_PLANES], nd[CDR_MAX_PLANES];
+	int i;
+	
+	for(i = 0; i < count; i++)
+	{
+		surf_t *surf = &CDR_SURF_POOL[face[i]->surf_id & CSG_SURF_MASK];
+		
+		nx[i] = surf->norm.x;
+		ny[i] = surf->norm.y;
+		nz[i] = surf->norm.z;
+		nd[i] = surf->dist;
+	}
+#ifdef CDR_SSE2
+	__m128d px = _mm_set1_pd(center.x);
+	__m128d py = _mm_set1_pd(center.y);
+	__m128d pz = _mm_set1_pd(center.z);
+	__m128d pr = _mm_set1_pd(reach);
+	__m128d sign = _mm_set1_pd(-0.0);
+	
+	for(i = 0; i+1 < count; i += 2)
+	{
+		__m128d d = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&nx[i]), px),
+		            _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&ny[i]), py),
+		            _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&nz[i]), pz), _mm_loadu_pd(&nd[i]))));
+		
+		int bits = _mm_movemask_pd(_mm_cmpgt_pd(_mm_andnot_pd(sign, d), pr));
+		
+		skip[i+0] = bits & 1;
+		skip[i+1] = bits >> 1;
+	}
+#else
+	i = 0;
+#endif
+	for(; i < count; i++)
+	{
+		skip[i] = fabs(nx[i]*center.x + ny[i]*center.y + nz[i]*center.z + nd[i]) > reach;
+	}
+}
+
+static void CDR_Search(search_t *search, bbox_t *bbox, hull_t *hull, vec3 &center, double reach)
 {
 	CSG_PUSHNAME("Search");
 	
@@ -444,49 +629,176 @@ static void CDR_Search(bbox_t *bbox, hull_t *hull)
 	// collision effect sphere.
 	// *******************************************************
 	
-	if(CSG_Intersect(bbox, &hull->bbox, 7))
+	if(CDR_Outside(bbox, &hull->bbox))
 	{
 		CSG_POPNAME_;
 	}
-	for(poly_t *f = hull->face; f; f = f->next)
+	poly_t *face[CDR_MAX_PLANES];
+	int     skip[CDR_MAX_PLANES];
+	
+	for(poly_t *f = hull->face; f; )
 	{
-		if(CSG_Intersect(bbox, &f->bbox, 7)) continue;
+		int count = 0;
 		
-		for(poly_t *p = f->down; p; p = p->next)
+		for(; f && count < CDR_MAX_PLANES; f = f->next)
 		{
-			//FIXME: optimize: don't re-test single-polygon faces
-			if(CSG_Intersect(bbox, &p->bbox, 7)) continue;
-			
-			CSG_ASSERT(CDR_OBJ_COUNT+(p->vertcount*2)+1 <= CDR_MAX_OBJ, "too many polygons");
-			
-			hit_t *obj1 = &CDR_OBJ_LIST[CDR_OBJ_COUNT++];
-			obj1->k = p->vertcount;
-			obj1->n = CDR_GetPolyNormal(p);
+			face[count++] = f;
+		}
+		CDR_PlaneTest(face, count, center, reach, skip);
+		
+		for(int k = 0; k < count; k++)
+		{
+			if(skip[k]) continue;
+			if(CDR_Outside(bbox, &face[k]->bbox)) continue;
 			
-			for(int i = 0; i < p->vertcount; i++)
+			for(poly_t *p = face[k]->down; p; p = p->next)
 			{
-				int j = (i>0)?(i-1):(p->vertcount-1);
+				//FIXME: optimize: don't re-test single-polygon faces
+				if(CDR_Outside(bbox, &p->bbox)) continue;
 				
-				obj1->e[i] = CDR_VERT_POOL[p->vref[i]];
+				CSG_ASSERT(search->objcount+(p->vertcount*2)+1 <= CDR_MAX_OBJ, "too many polygons");
 				
-				hit_t *obj2 = &CDR_OBJ_LIST[CDR_OBJ_COUNT++];
-				obj2->k = 1;
-				obj2->e[0] = CDR_VERT_POOL[p->vref[i]];
+				hit_t *obj1 = &search->obj[search->objcount++];
+				obj1->k = p->vertcount;
+				obj1->n = CDR_GetPolyNormal(p);
 				
-				hit_t *obj3 = &CDR_OBJ_LIST[CDR_OBJ_COUNT++];
-				obj3->k = 2;
-				obj3->e[0] = CDR_VERT_POOL[p->vref[i]];
-				obj3->e[1] = CDR_VERT_POOL[p->vref[j]];
+				for(int i = 0; i < p->vertcount; i++)
+				{
+					int j = (i>0)?(i-1):(p->vertcount-1);
+					
+					obj1->e[i] = CDR_VERT_POOL[p->vref[i]];
+					
+					hit_t *obj2 = &search->obj[search->objcount++];
+					obj2->k = 1;
+					obj2->e[0] = CDR_VERT_POOL[p->vref[i]];
+					
+					hit_t *obj3 = &search->obj[search->objcount++];
+					obj3->k = 2;
+					obj3->e[0] = CDR_VERT_POOL[p->vref[i]];
+					obj3->e[1] = CDR_VERT_POOL[p->vref[j]];
+				}
 			}
 		}
 	}
-	for(hull_t *h = hull->down; h; h = h->next)
+	// ***********************************************
+	// Only descend into children whose boxes overlap,
+	// in the same order as the hull->down list.
+	// ***********************************************
+	
+	int base  = search->hulltop;
+	int count = CSG_Query(hull, bbox, 7, search->hull + base, search->hullmax - base);
+	
+	if(base + count > search->hullmax)
 	{
-		CDR_Search(bbox, h);
+		int max = search->hullmax ? search->hullmax*2 : 256;
+		
+		while(base + count > max) max *= 2;
+		
+		hull_t **list = (hull_t**)CSG_AllocMem(sizeof(hull_t*), max);
+		
+		CSG_ASSERT(list, "out of memory");
+		if(!list)
+		{
+			CSG_POPNAME_; // leave out this hull's children
+		}
+		memcpy(list, search->hull, sizeof(hull_t*) * base); // the levels above still need theirs
+		CSG_FreeMem(search->hull);
+		search->hull    = list;
+		search->hullmax = max;
+		CSG_Query(hull, bbox, 7, search->hull + base, count);
 	}
+	search->hulltop = base + count;
+	
+	for(int i = 0; i < count; i++)
+	{
+		CDR_Search(search, bbox, search->hull[base + i], center, reach); // list may move
+	}
+	search->hulltop = base;
 	CSG_POPNAME_;
 }
 
+double CDR_Benchmark(int count, int steps, double radius, int batch, double *checksum)
+{
+	CSG_PUSHNAME("CDR_Benchmark");
+	
+	// *****************************************************
+	// Headless timing of CDR_Collide, or of CDR_CollideBatch
+	// if batch is set. Moves count spheres for the given
+	// number of steps each, starting from points scattered
+	// through the world's children (with a private
+	// generator, so the modeler's rand() sequence is left
+	// alone). Returns the time taken in seconds, and a sum
+	// of the final positions for comparing runs.
+	// *****************************************************
+	
+	bbox_t bbox;
+	unsigned int seed = 12345;
+	
+	bbox.minv = vec3(0.0, 0.0, 0.0);
+	bbox.maxv = vec3(0.0, 0.0, 0.0);
+	
+	for(hull_t *h = CDR_WORLD->down; h; h = h->next)
+	{
+		if(h == CDR_WORLD->down) bbox = h->bbox;
+		
+		for(int axis = 0; axis < 3; axis++)
+		{
+			if(bbox.minv[axis] > h->bbox.minv[axis]) bbox.minv[axis] = h->bbox.minv[axis];
+			if(bbox.maxv[axis] < h->bbox.maxv[axis]) bbox.maxv[axis] = h->bbox.maxv[axis];
+		}
+	}
+	vec3 size = bbox.maxv - bbox.minv;
+	
+	vec3   *position = (vec3  *)CSG_AllocMem(sizeof(vec3),   count);
+	vec3   *impulse  = (vec3  *)CSG_AllocMem(sizeof(vec3),   count);
+	double *radii    = (double*)CSG_AllocMem(sizeof(double), count);
+	int i, j;
+	
+	for(i = 0; i < count; i++)
+	{
+		for(int axis = 0; axis < 3; axis++)
+		{
+			seed = seed*1103515245 + 12345;
+			position[i][axis] = bbox.minv[axis] + size[axis]*((seed >> 8) & 0xffff)/65535.0;
+			seed = seed*1103515245 + 12345;
+			impulse[i][axis] = (((seed >> 8) & 0xffff)/32767.5 - 1.0)*radius;
+		}
+		radii[i] = radius;
+	}
+	clock_t start = clock();
+	
+	if(batch)
+	{
+		for(j = 0; j < steps; j++)
+		{
+			CDR_CollideBatch(position, impulse, radii, count);
+		}
+	}
+	else
+	{
+		for(i = 0; i < count; i++)
+		{
+			for(j = 0; j < steps; j++)
+			{
+				CDR_Collide(position[i], impulse[i], radius);
+			}
+		}
+	}
+	double seconds = (double)(clock() - start)/CLOCKS_PER_SEC;
+	double sum = 0.0;
+	
+	for(i = 0; i < count; i++)
+	{
+		sum += position[i].x + position[i].y + position[i].z;
+	}
+	CSG_FreeMem(position);
+	CSG_FreeMem(impulse);
+	CSG_FreeMem(radii);
+	
+	if(checksum) *checksum = sum;
+	CSG_POPNAME(seconds);
+}
+
 static vec3 CDR_GetPolyNormal(poly_t *poly)
 {
 	vec3 n = CDR_SURF_POOL[poly->surf_id & CSG_SURF_MASK].norm;
@@ -10,5 +10,7 @@
 
 void CDR_Initialize(hull_t *world);
 void CDR_Collide(vec3 &position, vec3 &impulse, double radius);
+void CDR_CollideBatch(vec3 position[], vec3 impulse[], double radius[], int count);
+double CDR_Benchmark(int count, int steps, double radius, int batch, double *checksum);
 
 #endif
@@ -11,6 +11,8 @@
 #include "hcsg.h"
 #ifdef __MAC__
 #include <Windows.h>
+#else
+#include <windows.h>
 #endif
 
 static vert_t *CSG_VERT_POOL  = NULL;
@@ -19,6 +21,106 @@ static ccof_t *CSG_CCOF_POOL  = NULL;
 static int     CSG_VERT_COUNT = 0;
 static int     CSG_SURF_COUNT = 0;
 static int     CSG_CCOF_COUNT = 0;
+static int     CSG_VERT_MAX   = 0;
+static int     CSG_SURF_MAX   = 0;
+
+// Hash tables for finding existing vertices and surfaces. Each
+// bucket holds the most recent pool index hashed to it, and the
+// NEXT arrays (which parallel the pools) chain the rest.
+
+static int    *CSG_VERT_HASH  = NULL;
+static int    *CSG_SURF_HASH  = NULL;
+static int    *CSG_VERT_NEXT  = NULL;
+static int    *CSG_SURF_NEXT  = NULL;
+static int     CSG_VERT_HASH_SIZE = 0;
+static int     CSG_SURF_HASH_SIZE = 0;
+
+#define CSG_VERT_CELL 0.00001 // hash grid spacing for vertices
+#define CSG_DIST_CELL 0.00001 // hash grid spacing for surface distances
+#define CSG_NORM_CELL 0.001   // hash grid spacing for surface normals
+
+// Polygons and hulls are carved out of blocks of CSG_BLOCK_SIZE
+// and recycled through free lists linked by their NEXT fields.
+// Vertex and surface references live in one block per object,
+// recycled by power-of-two size class.
+
+#define CSG_REF_CLASSES 24
+
+static poly_t *CSG_FREE_POLYS = NULL;
+static hull_t *CSG_FREE_HULLS = NULL;
+static vref_t *CSG_FREE_REFS[CSG_REF_CLASSES];
+
+// Frame arena for short-lived polygons. Chunks are kept in a
+// list and reused once the frame is reset, which happens after
+// each top-level boolean operation. New chunks go on the end of
+// the list, so the chunks before CSG_FRAME_CURR are all in use.
+
+struct frame_t
+{
+	frame_t *next;
+	int      size;
+	int      used;
+};
+
+static frame_t *CSG_FRAME_HEAD = NULL;
+static frame_t *CSG_FRAME_CURR = NULL;
+static int      CSG_BOOLEAN_DEPTH = 0;
+
+// Worker threads for the read-only intersection scans done by
+// boolean operations (see CSG_RunJobs). Each scan writes one
+// result per hull, and the caller then walks the results in list
+// order, so the output does not depend on the thread count.
+
+#ifndef __MAC__
+static HANDLE        CSG_THREAD[CSG_MAX_THREADS];
+static HANDLE        CSG_THREAD_START = NULL; // one count per worker per batch
+static HANDLE        CSG_THREAD_DONE  = NULL; // set by the last worker to finish
+static volatile LONG CSG_JOB_NEXT;
+static volatile LONG CSG_JOB_ACTIVE;
+static volatile LONG CSG_JOB_STOP;
+static int           CSG_THREAD_QUIT = 0;
+#endif
+static int           CSG_THREAD_COUNT = 1;
+static void        (*CSG_JOB_FUNC)(int job);
+static int           CSG_JOB_COUNT;
+static hull_t       *CSG_JOB_HULL;
+static poly_t       *CSG_JOB_FACE;
+static hull_t      **CSG_JOB_LIST;
+static int          *CSG_JOB_CODE;
+static poly_t      **CSG_JOB_MATCH;
+static int           CSG_JOB_SIZE;
+static int           CSG_JOB_FIRST;
+
+// Child trees (see CSG_TreeInsert). Nodes are kept in a growable
+// array per tree; free nodes are chained through their PARENT.
+
+struct node_t
+{
+	bbox_t  bbox;
+	hull_t *hull; // NULL for internal nodes
+	int     parent;
+	int     child1;
+	int     child2;
+	int     height; // 0 for leaves
+};
+
+struct tree_t
+{
+	node_t *node;
+	int     nodemax;
+	int     root;
+	int     free;
+	int     leaves;
+};
+
+#define CSG_TREE_STACK 256 // traversal stack; enough for any balanced tree
+#define CSG_QUERY_MAX  256 // results gathered on the stack before using the frame
+
+static int     CSG_LINK_STAMP = 0;
+
+#define CSG_CLASS_OUT 1 // CSG_Classify results, which mirror
+#define CSG_CLASS_IN  2 // CSG_CODE_OUT and CSG_CODE_IN
+
 static ccof_t *CSG_CCOF[CSG_MAX_DEPTH+1];
 static int     CSG_POLYGONALIZATION_DEPTH = 1;
 static hull_t *CSG_WORLD = NULL;
@@ -54,6 +156,32 @@ static int     CSG_MEMORY_CHECK = 0;
 static int CSG_RESOLVE_ADD_2D = CSG_RESOLVE_KEEP_NEW;
 static int CSG_RESOLVE_ADD_3D = CSG_RESOLVE_KEEP_OLD;
 
+static int           CSG_Cell(double x, double cell);
+static unsigned long CSG_Hash(int x, int y, int z, int w);
+static void          CSG_RehashVerts(int size);
+static void          CSG_RehashSurfs(int size);
+static void         *CSG_GrowMem(void *src, int size, int count, int nelems);
+static vref_t       *CSG_AllocRefs(int count);
+static int           CSG_RefsMem(vref_t *refs);
+static void          CSG_CopyList(void *parent, poly_t *src);
+static void          CSG_CopyList(void *parent, hull_t *src);
+static void          CSG_FreeRefs(vref_t *refs);
+static poly_t       *CSG_AllocScratch(int vertcount, sref_t surf_id);
+static int           CSG_SetCode(int code);
+static int           CSG_Classify(bbox_t *bbox1, bbox_t *bbox2, int mask);
+static int           CSG_Classify(poly_t *poly1, poly_t *poly2);
+static int           CSG_Classify(hull_t *hull1, hull_t *hull2);
+static int           CSG_Intersect(hull_t *hull1, hull_t *hull2, int *code, int i);
+static int          *CSG_ClassifyList(hull_t *src, hull_t *list[], int count, int first);
+static poly_t      **CSG_MatchList(poly_t *face, hull_t *list[], int count);
+static hull_t      **CSG_Children(hull_t *hull, bbox_t *bbox, int mask, int *count);
+static void          CSG_TreeInsert(hull_t *parent, hull_t *hull);
+static void          CSG_TreeRemove(hull_t *parent, hull_t *hull);
+static void          CSG_TreeClear(hull_t *parent);
+static void          CSG_TreeCopy(hull_t *dst, hull_t *src);
+static void          CSG_TreeRefit(hull_t *hull);
+static poly_t       *CSG_FindCCOF(poly_t *face, hull_t *hull);
+
 // ==============================================================
 // HCSG: Hierarchial Constructive Solid Geometry Data Structures:
 // 
@@ -78,12 +206,18 @@ void CSG_Initialize(void)
 	// Initialize HCSG engine
 	// **********************
 	
-	CSG_VERT_POOL = (vert_t*)CSG_AllocMem(sizeof(vert_t), CSG_MAX_VERTS);
-	CSG_SURF_POOL = (surf_t*)CSG_AllocMem(sizeof(surf_t), CSG_MAX_SURFS);
+	CSG_VERT_POOL = (vert_t*)CSG_AllocMem(sizeof(vert_t), CSG_INIT_VERTS);
+	CSG_SURF_POOL = (surf_t*)CSG_AllocMem(sizeof(surf_t), CSG_INIT_SURFS);
 	CSG_CCOF_POOL = (ccof_t*)CSG_AllocMem(sizeof(ccof_t), CSG_MAX_CCOFS);
+	CSG_VERT_NEXT = (int   *)CSG_AllocMem(sizeof(int),    CSG_INIT_VERTS);
+	CSG_SURF_NEXT = (int   *)CSG_AllocMem(sizeof(int),    CSG_INIT_SURFS);
 	CSG_VERT_COUNT = 0;
 	CSG_SURF_COUNT = 0;
 	CSG_CCOF_COUNT = 0;
+	CSG_VERT_MAX   = CSG_INIT_VERTS;
+	CSG_SURF_MAX   = CSG_INIT_SURFS;
+	CSG_RehashVerts(CSG_INIT_VERTS);
+	CSG_RehashSurfs(CSG_INIT_SURFS);
 	CSG_MEMORY_CHECK = 1;
 	CSG_POPNAME_;
 }
@@ -120,7 +254,9 @@ int CSG_GetMemInUse(void *obj)
 	// global memory used by the HCSG engine including
 	// all pools, etc. If -1 is specified, the function
 	// returns the amount of global memory used by the
-	// pools (VERT, SURF, CCOF) only.
+	// pools (VERT, SURF, CCOF) and the modeler, plus
+	// the parts of the POLY, HULL and reference blocks
+	// and the frame arena that no object is using.
 	// **************************************************
 	
 	int mem;
@@ -132,9 +268,31 @@ int CSG_GetMemInUse(void *obj)
 	else if(obj == (void*)-1)
 	{
 		mem  = CSG_GetMemInUse_Modeler();
-		mem += sizeof(vert_t) * CSG_MAX_VERTS;
-		mem += sizeof(surf_t) * CSG_MAX_SURFS;
+		mem += sizeof(vert_t) * CSG_VERT_MAX;
+		mem += sizeof(surf_t) * CSG_SURF_MAX;
 		mem += sizeof(ccof_t) * CSG_MAX_CCOFS;
+		mem += sizeof(int) * (CSG_VERT_MAX + CSG_VERT_HASH_SIZE);
+		mem += sizeof(int) * (CSG_SURF_MAX + CSG_SURF_HASH_SIZE);
+		
+		for(poly_t *p = CSG_FREE_POLYS; p; p = p->next)
+		{
+			mem += sizeof(poly_t);
+		}
+		for(hull_t *h = CSG_FREE_HULLS; h; h = h->next)
+		{
+			mem += sizeof(hull_t);
+		}
+		for(int k = 0; k < CSG_REF_CLASSES; k++)
+		{
+			for(vref_t *r = CSG_FREE_REFS[k]; r; r = *(vref_t**)r)
+			{
+				mem += CSG_RefsMem(r);
+			}
+		}
+		for(frame_t *f = CSG_FRAME_HEAD; f; f = f->next)
+		{
+			mem += sizeof(frame_t) + f->size;
+		}
 	}
 	else
 	{
@@ -148,8 +306,7 @@ int CSG_GetMemInUse(void *obj)
 			{
 				mem += CSG_GetMemInUse(p);
 			}
-			mem += sizeof(vref_t) * poly->vertcount;
-			mem += sizeof(sref_t) * poly->vertcount;
+			mem += CSG_RefsMem(poly->vref); // VREF and SREF
 			mem += sizeof(poly_t);
 		}
 		else if(*(int*)obj == CSG_TYPE_HULL)
@@ -164,7 +321,12 @@ int CSG_GetMemInUse(void *obj)
 			{
 				mem += CSG_GetMemInUse(h);
 			}
-			mem += sizeof(vref_t) * hull->vertcount;
+			if(hull->tree)
+			{
+				mem += sizeof(tree_t);
+				mem += sizeof(node_t) * hull->tree->nodemax;
+			}
+			mem += CSG_RefsMem(hull->vref);
 			mem += sizeof(hull_t);
 		}
 	}
@@ -288,6 +450,118 @@ void CSG_Print(hull_t *hull)
 	CSG_POPNAME_;
 }
 
+static int CSG_Cell(double x, double cell)
+{
+	// *******************************************
+	// Returns the hash grid cell that x lies in.
+	// Clamped, so that the result fits in an int.
+	// *******************************************
+	
+	double c = floor(x / cell);
+	
+	if(c < -1.0e9) c = -1.0e9;
+	if(c > +1.0e9) c = +1.0e9;
+	return (int)c;
+}
+
+static unsigned long CSG_Hash(int x, int y, int z, int w)
+{
+	return ((unsigned long)x * 73856093UL) ^
+	       ((unsigned long)y * 19349663UL) ^
+	       ((unsigned long)z * 83492791UL) ^
+	       ((unsigned long)w * 2654435761UL);
+}
+
+static unsigned long CSG_HashVert(vert_t &vert)
+{
+	return CSG_Hash(CSG_Cell(vert.x, CSG_VERT_CELL),
+	                CSG_Cell(vert.y, CSG_VERT_CELL),
+	                CSG_Cell(vert.z, CSG_VERT_CELL), 0);
+}
+
+static unsigned long CSG_HashSurf(surf_t &surf)
+{
+	// ************************************************
+	// A surface and its flip side (-norm, -dist) must
+	// hash alike, so only absolute values are used.
+	// ************************************************
+	
+	return CSG_Hash(CSG_Cell(fabs(surf.norm.x), CSG_NORM_CELL),
+	                CSG_Cell(fabs(surf.norm.y), CSG_NORM_CELL),
+	                CSG_Cell(fabs(surf.norm.z), CSG_NORM_CELL),
+	                CSG_Cell(fabs(surf.dist),   CSG_DIST_CELL));
+}
+
+static void *CSG_GrowMem(void *src, int size, int count, int nelems)
+{
+	CSG_PUSHNAME("GrowMem");
+	
+	// ***********************************************
+	// Reallocate a block of memory to hold nelems
+	// elements, keeping the first count of them.
+	// ***********************************************
+	
+	void *dst = CSG_AllocMem(size, nelems);
+	
+	memcpy(dst, src, size * count);
+	CSG_FreeMem(src);
+	CSG_POPNAME(dst);
+}
+
+static void CSG_RehashVerts(int size)
+{
+	CSG_PUSHNAME("RehashVerts");
+	
+	// *************************************************
+	// Rebuild the vertex hash table with size buckets
+	// (a power of two). Pool indices are chained in
+	// increasing order, so each chain runs newest first.
+	// *************************************************
+	
+	CSG_FreeMem(CSG_VERT_HASH);
+	CSG_VERT_HASH = (int*)CSG_AllocMem(sizeof(int), size);
+	CSG_VERT_HASH_SIZE = size;
+	
+	for(int i = 0; i < size; i++)
+	{
+		CSG_VERT_HASH[i] = -1;
+	}
+	for(int j = 0; j < CSG_VERT_COUNT; j++)
+	{
+		int *bucket = &CSG_VERT_HASH[CSG_HashVert(CSG_VERT_POOL[j]) & (size-1)];
+		
+		CSG_VERT_NEXT[j] = *bucket;
+		*bucket = j;
+	}
+	CSG_POPNAME_;
+}
+
+static void CSG_RehashSurfs(int size)
+{
+	CSG_PUSHNAME("RehashSurfs");
+	
+	// **************************************
+	// Same as CSG_RehashVerts, for surfaces.
+	// **************************************
+	
+	CSG_FreeMem(CSG_SURF_HASH);
+	CSG_SURF_HASH = (int*)CSG_AllocMem(sizeof(int), size);
+	CSG_SURF_HASH_SIZE = size;
+	
+	for(int i = 0; i < size; i++)
+	{
+		CSG_SURF_HASH[i] = -1;
+	}
+	for(int j = 0; j < CSG_SURF_COUNT; j++)
+	{
+		int *bucket = &CSG_SURF_HASH[CSG_HashSurf(CSG_SURF_POOL[j]) & (size-1)];
+		
+		CSG_SURF_NEXT[j] = *bucket;
+		*bucket = j;
+	}
+	CSG_POPNAME_;
+}
+
 vref_t CSG_AddToVertPool(vert_t &vert)
 {
 	CSG_PUSHNAME("AddToVertPool");
@@ -295,22 +569,65 @@ vref_t CSG_AddToVertPool(vert_t &vert)
 	// **********************************************
 	// Add a vertex to the vertex pool. If the vertex
 	// already exists, return its index.
+	// 
+	// Any vertex within CSG_MAXERR of this one lies
+	// in one of the hash cells overlapped by a box of
+	// that size around it (usually just one cell), so
+	// only those are searched. If several vertices
+	// match, the first one in the pool is returned,
+	// just as a search of the whole pool would.
 	// **********************************************
 	
-	int i;
+	vert_t v = vert; // vert may be in the pool, which may move
+	double e = CSG_MAXERR * 1.01;
+	int x1 = CSG_Cell(v.x - e, CSG_VERT_CELL), x2 = CSG_Cell(v.x + e, CSG_VERT_CELL);
+	int y1 = CSG_Cell(v.y - e, CSG_VERT_CELL), y2 = CSG_Cell(v.y + e, CSG_VERT_CELL);
+	int z1 = CSG_Cell(v.z - e, CSG_VERT_CELL), z2 = CSG_Cell(v.z + e, CSG_VERT_CELL);
+	int i = -1;
 	
-	for(i = 0; i < CSG_VERT_COUNT; i++)
+	for(int x = x1; x <= x2; x++)
+	for(int y = y1; y <= y2; y++)
+	for(int z = z1; z <= z2; z++)
 	{
-		vec3 err = vert - CSG_VERT_POOL[i];
+		int j = CSG_VERT_HASH[CSG_Hash(x, y, z, 0) & (CSG_VERT_HASH_SIZE-1)];
 		
-		if(err*err <= CSG_MAXERR*CSG_MAXERR)
+		for(; j >= 0; j = CSG_VERT_NEXT[j])
 		{
-			CSG_POPNAME((vref_t)i);
+			if(i >= 0 && j >= i) continue;
+			
+			vec3 err = v - CSG_VERT_POOL[j];
+			
+			if(err*err <= CSG_MAXERR*CSG_MAXERR)
+			{
+				i = j;
+			}
 		}
 	}
-	CSG_ASSERT(CSG_VERT_COUNT < CSG_MAX_VERTS, "too many vertices");
-	CSG_VERT_POOL[i] = vert;
+	if(i >= 0)
+	{
+		CSG_POPNAME((vref_t)i);
+	}
+	if(CSG_VERT_COUNT == CSG_VERT_MAX)
+	{
+		CSG_VERT_POOL = (vert_t*)CSG_GrowMem(CSG_VERT_POOL, sizeof(vert_t), CSG_VERT_COUNT, CSG_VERT_MAX*2);
+		CSG_VERT_NEXT = (int   *)CSG_GrowMem(CSG_VERT_NEXT, sizeof(int),    CSG_VERT_COUNT, CSG_VERT_MAX*2);
+		CSG_VERT_MAX *= 2;
+	}
+	i = CSG_VERT_COUNT;
+	CSG_VERT_POOL[i] = v;
 	CSG_VERT_COUNT++;
+	
+	if(CSG_VERT_COUNT > CSG_VERT_HASH_SIZE)
+	{
+		CSG_RehashVerts(CSG_VERT_HASH_SIZE*2);
+	}
+	else
+	{
+		int *bucket = &CSG_VERT_HASH[CSG_HashVert(v) & (CSG_VERT_HASH_SIZE-1)];
+		
+		CSG_VERT_NEXT[i] = *bucket;
+		*bucket = i;
+	}
 	CSG_POPNAME((vref_t)i);
 }
 
@@ -321,30 +638,65 @@ sref_t CSG_AddToSurfPool(surf_t &surf)
 	// *************************************************
 	// Add a surface to the surface pool. If the surface
 	// already exists, return its index.
+	// 
+	// As with vertices, only the hash cells that could
+	// hold a matching surface are searched. For unit
+	// normals, n1*n2 >= 1 - CSG_MAXERR2 means that no
+	// component differs by more than sqrt(2*MAXERR2).
 	// *************************************************
 	
-	int i;
-	
-	for(i = 0; i < CSG_SURF_COUNT; i++)
-	{
-		if(fabs(CSG_SURF_POOL[i].dist - surf.dist) <= CSG_MAXERR)
+	surf_t s = surf; // surf may be in the pool, which may move
+	double e = CSG_MAXERR * 1.01;
+	double en = sqrt(2.0 * CSG_MAXERR2) * 1.01;
+	double ax = fabs(s.norm.x), ay = fabs(s.norm.y), az = fabs(s.norm.z), ad = fabs(s.dist);
+	int x1 = CSG_Cell(ax - en, CSG_NORM_CELL), x2 = CSG_Cell(ax + en, CSG_NORM_CELL);
+	int y1 = CSG_Cell(ay - en, CSG_NORM_CELL), y2 = CSG_Cell(ay + en, CSG_NORM_CELL);
+	int z1 = CSG_Cell(az - en, CSG_NORM_CELL), z2 = CSG_Cell(az + en, CSG_NORM_CELL);
+	int d1 = CSG_Cell(ad - e,  CSG_DIST_CELL), d2 = CSG_Cell(ad + e,  CSG_DIST_CELL);
+	int i = -1;
+	sref_t side = 0;
+	
+	for(int x = x1; x <= x2; x++)
+	for(int y = y1; y <= y2; y++)
+	for(int z = z1; z <= z2; z++)
+	for(int d = d1; d <= d2; d++)
+	{
+		int j = CSG_SURF_HASH[CSG_Hash(x, y, z, d) & (CSG_SURF_HASH_SIZE-1)];
+		
+		for(; j >= 0; j = CSG_SURF_NEXT[j])
 		{
-			if(fabs(CSG_SURF_POOL[i].norm*surf.norm - 1.0) <= CSG_MAXERR2)
+			if(i >= 0 && j >= i) continue;
+			
+			if(fabs(CSG_SURF_POOL[j].dist - s.dist) <= CSG_MAXERR)
 			{
-				CSG_POPNAME((sref_t)i);
+				if(fabs(CSG_SURF_POOL[j].norm*s.norm - 1.0) <= CSG_MAXERR2)
+				{
+					i = j, side = 0;
+					continue;
+				}
 			}
-		}
-		if(fabs(CSG_SURF_POOL[i].dist + surf.dist) <= CSG_MAXERR)
-		{
-			if(fabs(CSG_SURF_POOL[i].norm*surf.norm + 1.0) <= CSG_MAXERR2)
+			if(fabs(CSG_SURF_POOL[j].dist + s.dist) <= CSG_MAXERR)
 			{
-				CSG_POPNAME((sref_t)i | CSG_SIDE_MASK);
+				if(fabs(CSG_SURF_POOL[j].norm*s.norm + 1.0) <= CSG_MAXERR2)
+				{
+					i = j, side = CSG_SIDE_MASK;
+				}
 			}
 		}
 	}
-	CSG_ASSERT(CSG_SURF_COUNT < CSG_MAX_SURFS, "too many surfaces");
+	if(i >= 0)
+	{
+		CSG_POPNAME((sref_t)i | side);
+	}
+	if(CSG_SURF_COUNT == CSG_SURF_MAX)
+	{
+		CSG_SURF_POOL = (surf_t*)CSG_GrowMem(CSG_SURF_POOL, sizeof(surf_t), CSG_SURF_COUNT, CSG_SURF_MAX*2);
+		CSG_SURF_NEXT = (int   *)CSG_GrowMem(CSG_SURF_NEXT, sizeof(int),    CSG_SURF_COUNT, CSG_SURF_MAX*2);
+		CSG_SURF_MAX *= 2;
+	}
+	i = CSG_SURF_COUNT;
 	CSG_SURF_COUNT++;
-	CSG_SURF_POOL[i] = surf;
+	CSG_SURF_POOL[i] = s;
 	
 	// **************************************************
 	// Compute surface mask. This field controls active
@@ -352,9 +704,9 @@ sref_t CSG_AddToSurfPool(surf_t &surf)
 	// HULL bounding box checks.
 	// **************************************************
 	
-	double nx = fabs(surf.norm.x);
-	double ny = fabs(surf.norm.y);
-	double nz = fabs(surf.norm.z);
+	double nx = fabs(s.norm.x);
+	double ny = fabs(s.norm.y);
+	double nz = fabs(s.norm.z);
 	int mask;
 	
 	if(nx >= ny && nx >= nz) mask = 2+4; else
@@ -363,6 +715,18 @@ sref_t CSG_AddToSurfPool(surf_t &surf)
 	
 	CSG_SURF_POOL[i].mask = mask;
 	CSG_SURF_POOL[i].data = rand();
+	
+	if(CSG_SURF_COUNT > CSG_SURF_HASH_SIZE)
+	{
+		CSG_RehashSurfs(CSG_SURF_HASH_SIZE*2);
+	}
+	else
+	{
+		int *bucket = &CSG_SURF_HASH[CSG_HashSurf(s) & (CSG_SURF_HASH_SIZE-1)];
+		
+		CSG_SURF_NEXT[i] = *bucket;
+		*bucket = i;
+	}
 	CSG_POPNAME((sref_t)i);
 }
 
@@ -437,11 +801,10 @@ void CSG_Copy(poly_t *dst, poly_t *src)
 	// unchanged.
 	// **********************************************
 	
-	if(dst->vref) CSG_FreeMem(dst->vref);
-	if(dst->sref) CSG_FreeMem(dst->sref);
+	CSG_FreeRefs(dst->vref);
 	
-	dst->vref = (vref_t*)CSG_AllocMem(sizeof(vref_t), src->vertcount);
-	dst->sref = (sref_t*)CSG_AllocMem(sizeof(sref_t), src->vertcount);
+	dst->vref = CSG_AllocRefs(src->vertcount*2);
+	dst->sref = dst->vref + src->vertcount;
 	memcpy(dst->vref, src->vref, sizeof(vref_t) * src->vertcount);
 	memcpy(dst->sref, src->sref, sizeof(sref_t) * src->vertcount);
 	dst->vertcount = src->vertcount;
@@ -451,10 +814,73 @@ void CSG_Copy(poly_t *dst, poly_t *src)
 void CSG_Copy(hull_t *dst, hull_t *src)
 {
 	CSG_PUSHNAME("Copy[HULL]");
-	CSG_ASSERT(0, "not implemented!");
+	
+	// ***************************************************
+	// Replace everything below dst with a copy of what is
+	// below src: VREF, faces (with their sub-polygons) and
+	// sub-hulls, all in the same order. dst keeps its own
+	// parent, DEPTH and place in its parent's list.
+	// ***************************************************
+	
+	CSG_TreeClear(dst);
+	
+	while(dst->face) CSG_Free(dst->face);
+	while(dst->down) CSG_Free(dst->down);
+	
+	CSG_FreeRefs(dst->vref);
+	
+	dst->vref = CSG_AllocRefs(src->vertcount);
+	memcpy(dst->vref, src->vref, sizeof(vref_t) * src->vertcount);
+	
+	dst->vertcount = src->vertcount;
+	dst->bbox      = src->bbox;
+	dst->shape     = src->shape;
+	CSG_TreeRefit(dst);
+	
+	CSG_CopyList(dst, src->face);
+	CSG_CopyList(dst, src->down);
+	CSG_TreeCopy(dst, src);
 	CSG_POPNAME_;
 }
 
+static void CSG_CopyList(void *parent, poly_t *src)
+{
+	// *************************************************
+	// Deep-copies the list starting at src into parent.
+	// Linking prepends, so the tail is copied first.
+	// *************************************************
+	
+	if(!src) return;
+	
+	CSG_CopyList(parent, src->next);
+	
+	poly_t *dst = CSG_Clone(parent, src);
+	CSG_CopyList(dst, src->down);
+}
+
+static void CSG_CopyList(void *parent, hull_t *src)
+{
+	// ************************************************
+	// As above, but the copies are linked by hand and
+	// left out of parent's tree, which CSG_TreeCopy
+	// then builds from src's in one go.
+	// ************************************************
+	
+	if(!src) return;
+	
+	CSG_CopyList(parent, src->next);
+	
+	hull_t *up  = (hull_t*)parent;
+	hull_t *dst = CSG_Alloc(NULL);
+	
+	dst->parent = up;
+	dst->depth  = up->depth + 1;
+	dst->next   = up->down;
+	dst->stamp  = ++CSG_LINK_STAMP;
+	up->down    = dst;
+	CSG_Copy(dst, src);
+}
+
 poly_t *CSG_Clone(void *parent, poly_t *src)
 {
 	CSG_PUSHNAME("Clone[POLY]");
@@ -485,12 +911,13 @@ hull_t *CSG_Clone(void *parent, hull_t *src)
 	
 	hull_t *dst = CSG_Alloc(parent);
 	
-	dst->vref = (vref_t*)CSG_AllocMem(sizeof(vref_t), src->vertcount);
+	dst->vref = CSG_AllocRefs(src->vertcount);
 	memcpy(dst->vref, src->vref, sizeof(vref_t) * src->vertcount);
 	
 	dst->vertcount = src->vertcount;
 	dst->bbox      = src->bbox;
 	dst->shape     = src->shape;
+	CSG_TreeRefit(dst);
 	
 	for(poly_t *p = src->face; p; p = p->next)
 	{
@@ -521,6 +948,102 @@ void *CSG_AllocMem(int size, int nelems)
 	CSG_POPNAME(tmp);
 }
 
+void *CSG_AllocFrame(int size, int nelems)
+{
+	CSG_PUSHNAME("AllocFrame");
+	
+	// ************************************************
+	// Allocate a zeroed block from the frame arena. It
+	// is not freed individually; the whole arena is
+	// released at once by CSG_ResetFrame.
+	// ************************************************
+	
+	int bytes = (size * nelems + 7) & ~7;
+	
+	frame_t *last = NULL;
+	
+	while(CSG_FRAME_CURR && CSG_FRAME_CURR->used + bytes > CSG_FRAME_CURR->size)
+	{
+		last = CSG_FRAME_CURR;
+		CSG_FRAME_CURR = CSG_FRAME_CURR->next;
+		if(CSG_FRAME_CURR) CSG_FRAME_CURR->used = 0; // not used since the reset
+	}
+	if(!CSG_FRAME_CURR)
+	{
+		int fsize = bytes > CSG_FRAME_SIZE ? bytes : CSG_FRAME_SIZE;
+		frame_t *frame = (frame_t*)CSG_AllocMem(sizeof(frame_t) + fsize, 1);
+		
+		frame->size = fsize;
+		frame->next = NULL;
+		
+		if(last) last->next     = frame;
+		else     CSG_FRAME_HEAD = frame;
+		CSG_FRAME_CURR = frame;
+	}
+	char *tmp = (char*)(CSG_FRAME_CURR + 1) + CSG_FRAME_CURR->used;
+	
+	CSG_FRAME_CURR->used += bytes;
+	memset(tmp, 0, bytes);
+	CSG_POPNAME(tmp);
+}
+
+void CSG_ResetFrame(void)
+{
+	CSG_FRAME_CURR = CSG_FRAME_HEAD;
+	if(CSG_FRAME_CURR) CSG_FRAME_CURR->used = 0;
+}
+
+static vref_t *CSG_AllocRefs(int count)
+{
+	CSG_PUSHNAME("AllocRefs");
+	
+	// *************************************************
+	// Allocate room for count vertex/surface references.
+	// The size class is kept in the word just before
+	// the block, so CSG_FreeRefs knows where it goes.
+	// *************************************************
+	
+	int k = 0;
+	
+	while((4 << k) < count) k++;
+	CSG_ASSERT(k < CSG_REF_CLASSES, "too many references");
+	
+	vref_t *refs = CSG_FREE_REFS[k];
+	
+	if(refs)
+	{
+		CSG_FREE_REFS[k] = *(vref_t**)refs;
+	}
+	else
+	{
+		// 4 refs is enough room for the free list link,
+		// even where vref_t is smaller than a pointer.
+		
+		refs = (vref_t*)CSG_AllocMem(sizeof(vref_t), (4 << k) + 1) + 1;
+		refs[-1] = k;
+	}
+	CSG_POPNAME(refs);
+}
+
+static int CSG_RefsMem(vref_t *refs)
+{
+	// Size of the block holding refs, as allocated
+	
+	if(!refs) return 0;
+	
+	return sizeof(vref_t) * ((4 << (int)refs[-1]) + 1);
+}
+
+static void CSG_FreeRefs(vref_t *refs)
+{
+	if(!refs) return;
+	
+	int k = (int)refs[-1];
+	
+	*(vref_t**)refs = CSG_FREE_REFS[k];
+	CSG_FREE_REFS[k] = refs;
+}
+
 poly_t *CSG_Alloc(void *parent, int vertcount, sref_t surf_id)
 {
 	CSG_PUSHNAME("Alloc[POLY]");
@@ -529,7 +1052,20 @@ poly_t *CSG_Alloc(void *parent, int vertcount, sref_t surf_id)
 	// Allocate new polygon and link to parent
 	// ***************************************
 	
-	poly_t *poly = (poly_t*)CSG_AllocMem(sizeof(poly_t), 1);
+	if(!CSG_FREE_POLYS)
+	{
+		poly_t *block = (poly_t*)CSG_AllocMem(sizeof(poly_t), CSG_BLOCK_SIZE);
+		
+		for(int i = 0; i < CSG_BLOCK_SIZE; i++)
+		{
+			block[i].next = CSG_FREE_POLYS;
+			CSG_FREE_POLYS = &block[i];
+		}
+	}
+	poly_t *poly = CSG_FREE_POLYS;
+	CSG_FREE_POLYS = poly->next;
+	memset(poly, 0, sizeof(poly_t));
+	
 	poly->flags   = CSG_TYPE_POLY;
 	poly->surf_id = surf_id;
 	CSG_Link(parent, poly);
@@ -539,16 +1075,37 @@ poly_t *CSG_Alloc(void *parent, int vertcount, sref_t surf_id)
 		// *********************************************
 		// Allocate space for vertices if vertcount > 0,
 		// otherwise leave as NULL. Note that vertcount
-		// of polygon is left at 0 regardless.
+		// of polygon is left at 0 regardless. VREF and
+		// SREF share one block.
 		// *********************************************
 		
-		poly->vref = (vref_t*)CSG_AllocMem(sizeof(vref_t), vertcount);
-		poly->sref = (sref_t*)CSG_AllocMem(sizeof(sref_t), vertcount);
+		poly->vref = CSG_AllocRefs(vertcount*2);
+		poly->sref = poly->vref + vertcount;
 	}
 	poly->q = (double)rand();
 	CSG_POPNAME(poly);
 }
 
+static poly_t *CSG_AllocScratch(int vertcount, sref_t surf_id)
+{
+	CSG_PUSHNAME("AllocScratch");
+	
+	// ************************************************
+	// Allocate an unlinked polygon in the frame arena.
+	// It must not be passed to CSG_Free, and must not
+	// outlive the current boolean operation.
+	// ************************************************
+	
+	poly_t *poly = (poly_t*)CSG_AllocFrame(sizeof(poly_t), 1);
+	
+	poly->flags   = CSG_TYPE_POLY;
+	poly->surf_id = surf_id;
+	poly->vref    = (vref_t*)CSG_AllocFrame(sizeof(vref_t), vertcount*2);
+	poly->sref    = poly->vref + vertcount;
+	poly->q       = (double)rand(); // keep the same random sequence as CSG_Alloc
+	CSG_POPNAME(poly);
+}
+
 hull_t *CSG_Alloc(void *parent)
 {
 	CSG_PUSHNAME("Alloc[HULL]");
@@ -557,8 +1114,22 @@ hull_t *CSG_Alloc(void *parent)
 	// Allocate new hull and link to parent
 	// ************************************
 	
-	hull_t *hull = (hull_t*)CSG_AllocMem(sizeof(hull_t), 1);
+	if(!CSG_FREE_HULLS)
+	{
+		hull_t *block = (hull_t*)CSG_AllocMem(sizeof(hull_t), CSG_BLOCK_SIZE);
+		
+		for(int i = 0; i < CSG_BLOCK_SIZE; i++)
+		{
+			block[i].next = CSG_FREE_HULLS;
+			CSG_FREE_HULLS = &block[i];
+		}
+	}
+	hull_t *hull = CSG_FREE_HULLS;
+	CSG_FREE_HULLS = hull->next;
+	memset(hull, 0, sizeof(hull_t));
+	
 	hull->flags = CSG_TYPE_HULL;
+	hull->node  = -1;
 	CSG_Link(parent, hull);
 	CSG_POPNAME(hull);
 }
@@ -604,9 +1175,16 @@ void CSG_Free(poly_t *poly)
 		pnext = p->next;
 		CSG_Free(p);
 	}
-	CSG_FreeMem(poly->vref);
-	CSG_FreeMem(poly->sref);
-	CSG_FreeMem(poly);
+	CSG_FreeRefs(poly->vref);
+	
+	// *************************************************
+	// Return to the free list. FLAGS is cleared so that
+	// callers such as CSG_Clip can tell it was freed.
+	// *************************************************
+	
+	poly->flags = 0;
+	poly->next  = CSG_FREE_POLYS;
+	CSG_FREE_POLYS = poly;
 	CSG_POPNAME_;
 }
 
@@ -630,8 +1208,16 @@ void CSG_Free(hull_t *hull)
 		hnext = h->next;
 		CSG_Free(h);
 	}
-	CSG_FreeMem(hull->vref);
-	CSG_FreeMem(hull);
+	CSG_FreeRefs(hull->vref);
+	
+	if(hull->tree)
+	{
+		CSG_FreeMem(hull->tree->node);
+		CSG_FreeMem(hull->tree);
+	}
+	hull->flags = 0;
+	hull->next  = CSG_FREE_HULLS;
+	CSG_FREE_HULLS = hull;
 	CSG_POPNAME_;
 }
 
@@ -716,80 +1302,499 @@ void CSG_Unlink(hull_t *hull)
 			
 			h->next = hull->next;
 		}
-		hull->parent = NULL;
-		hull->next   = NULL;
+		CSG_TreeRemove(parent, hull);
+		hull->parent = NULL;
+		hull->next   = NULL;
+	}
+	hull->depth = 0;
+	CSG_POPNAME_;
+}
+
+void CSG_Link(void *parent, poly_t *poly)
+{
+	CSG_PUSHNAME("Link[POLY]");
+	
+	// **********************
+	// Link polygon to parent
+	// **********************
+	
+	poly->parent = parent;
+	
+	if(!parent)
+	{
+		poly->depth = 0; // this is a dangerous assumption..?
+		CSG_POPNAME_;
+	}
+	switch(*(int*)parent)
+	{
+		case CSG_TYPE_POLY:
+		{
+			poly_t *dst = (poly_t*)parent;
+			
+			poly->depth = dst->depth + 1;
+			poly->next  = dst->down;
+			dst->down   = poly;
+			break;
+		}
+		case CSG_TYPE_HULL:
+		{
+			hull_t *dst = (hull_t*)parent;
+			
+			poly->depth = 0;
+			poly->next  = dst->face;
+			dst->face   = poly;
+			break;
+		}
+	}
+	CSG_POPNAME_;
+}
+
+void CSG_Link(void *parent, hull_t *hull)
+{
+	CSG_PUSHNAME("Link[HULL]");
+	
+	// *******************
+	// Link hull to parent
+	// *******************
+	
+	hull->parent = parent;
+	
+	if(!parent)
+	{
+		hull->depth = -1;
+		CSG_POPNAME_;
+	}
+	switch(*(int*)parent)
+	{
+		case CSG_TYPE_HULL:
+		{
+			hull_t *dst = (hull_t*)parent;
+			
+			hull->depth = dst->depth + 1;
+			hull->next  = dst->down;
+			hull->stamp = ++CSG_LINK_STAMP;
+			dst->down   = hull;
+			CSG_TreeInsert(dst, hull);
+			break;
+		}
+	}
+	CSG_POPNAME_;
+}
+
+// ****************************************************************************
+// Child trees. Each hull keeps a bounding volume tree over its child hulls,
+// so that scans over the children (boolean ops, CCOF generation, collision)
+// only visit those whose boxes overlap. Hulls are inserted where they add
+// least to the surface area of the tree (the SAH cost), and the tree is kept
+// balanced by rotations, in the manner of Box2D's dynamic tree. A hull whose
+// box changes is refitted by removing and reinserting it.
+// ****************************************************************************
+
+static double CSG_Area(bbox_t *bbox)
+{
+	vec3 d = bbox->maxv - bbox->minv;
+	return d.x*d.y + d.y*d.z + d.z*d.x;
+}
+
+static bbox_t CSG_Union(bbox_t *bbox1, bbox_t *bbox2)
+{
+	bbox_t bbox;
+	
+	bbox.minv.x = bbox1->minv.x < bbox2->minv.x ? bbox1->minv.x : bbox2->minv.x;
+	bbox.minv.y = bbox1->minv.y < bbox2->minv.y ? bbox1->minv.y : bbox2->minv.y;
+	bbox.minv.z = bbox1->minv.z < bbox2->minv.z ? bbox1->minv.z : bbox2->minv.z;
+	bbox.maxv.x = bbox1->maxv.x > bbox2->maxv.x ? bbox1->maxv.x : bbox2->maxv.x;
+	bbox.maxv.y = bbox1->maxv.y > bbox2->maxv.y ? bbox1->maxv.y : bbox2->maxv.y;
+	bbox.maxv.z = bbox1->maxv.z > bbox2->maxv.z ? bbox1->maxv.z : bbox2->maxv.z;
+	return bbox;
+}
+
+static int CSG_TreeAllocNode(tree_t *tree)
+{
+	if(tree->free < 0)
+	{
+		int nodemax = tree->nodemax ? tree->nodemax*2 : 16;
+		
+		tree->node = (node_t*)CSG_GrowMem(tree->node, sizeof(node_t), tree->nodemax, nodemax);
+		
+		for(int i = nodemax-1; i >= tree->nodemax; i--)
+		{
+			tree->node[i].parent = tree->free;
+			tree->free = i;
+		}
+		tree->nodemax = nodemax;
+	}
+	int i = tree->free;
+	
+	tree->free = tree->node[i].parent;
+	tree->node[i].hull   = NULL;
+	tree->node[i].parent = -1;
+	tree->node[i].child1 = -1;
+	tree->node[i].child2 = -1;
+	tree->node[i].height = 0;
+	return i;
+}
+
+static void CSG_TreeFreeNode(tree_t *tree, int i)
+{
+	tree->node[i].parent = tree->free;
+	tree->node[i].height = -1;
+	tree->free = i;
+}
+
+static void CSG_TreeFix(tree_t *tree, int i)
+{
+	node_t *n = &tree->node[i];
+	node_t *c1 = &tree->node[n->child1];
+	node_t *c2 = &tree->node[n->child2];
+	
+	n->bbox   = CSG_Union(&c1->bbox, &c2->bbox);
+	n->height = 1 + (c1->height > c2->height ? c1->height : c2->height);
+}
+
+static int CSG_TreeBalance(tree_t *tree, int a)
+{
+	// ************************************************
+	// If either child of node a is more than one level
+	// taller than the other, rotate it up into a's
+	// place. Returns the index of the new subtree root.
+	// ************************************************
+	
+	node_t *node = tree->node;
+	
+	if(node[a].hull || node[a].height < 2)
+	{
+		return a;
+	}
+	int b = node[a].child1;
+	int c = node[a].child2;
+	int balance = node[c].height - node[b].height;
+	
+	if(balance > 1 || balance < -1)
+	{
+		// rotate up the taller child (u), keeping the
+		// taller of its children (x) and giving the
+		// other (y) to a in u's place
+		
+		int u = balance > 1 ? c : b;
+		int f = node[u].child1;
+		int g = node[u].child2;
+		int x = node[f].height > node[g].height ? f : g;
+		int y = (x == f) ? g : f;
+		
+		node[u].child1 = a;
+		node[u].child2 = x;
+		node[u].parent = node[a].parent;
+		node[a].parent = u;
+		
+		if(node[u].parent < 0)
+		{
+			tree->root = u;
+		}
+		else if(node[node[u].parent].child1 == a)
+		{
+			node[node[u].parent].child1 = u;
+		}
+		else
+		{
+			node[node[u].parent].child2 = u;
+		}
+		if(u == c) node[a].child2 = y;
+		else       node[a].child1 = y;
+		
+		node[y].parent = a;
+		CSG_TreeFix(tree, a);
+		CSG_TreeFix(tree, u);
+		return u;
+	}
+	return a;
+}
+
+static void CSG_TreeInsert(hull_t *parent, hull_t *hull)
+{
+	CSG_PUSHNAME("TreeInsert");
+	
+	// *************************************************
+	// Insert hull into parent's tree, next to the node
+	// for which the increase in total surface area is
+	// least.
+	// *************************************************
+	
+	if(!parent->tree)
+	{
+		parent->tree = (tree_t*)CSG_AllocMem(sizeof(tree_t), 1);
+		parent->tree->root = -1;
+		parent->tree->free = -1;
+	}
+	tree_t *tree = parent->tree;
+	int leaf = CSG_TreeAllocNode(tree);
+	
+	tree->node[leaf].hull = hull;
+	tree->node[leaf].bbox = hull->bbox;
+	tree->leaves++;
+	hull->node = leaf;
+	
+	if(tree->root < 0)
+	{
+		tree->root = leaf;
+		CSG_POPNAME_;
+	}
+	bbox_t bbox = hull->bbox;
+	int i = tree->root;
+	
+	while(!tree->node[i].hull)
+	{
+		node_t *n  = &tree->node[i];
+		node_t *c1 = &tree->node[n->child1];
+		node_t *c2 = &tree->node[n->child2];
+		
+		bbox_t b  = CSG_Union(&n->bbox, &bbox);
+		bbox_t b1 = CSG_Union(&c1->bbox, &bbox);
+		bbox_t b2 = CSG_Union(&c2->bbox, &bbox);
+		
+		double area  = CSG_Area(&b);
+		double cost  = 2.0 * area; // new parent here
+		double inher = 2.0 * (area - CSG_Area(&n->bbox));
+		double cost1 = CSG_Area(&b1) + inher;
+		double cost2 = CSG_Area(&b2) + inher;
+		
+		if(!c1->hull) cost1 -= CSG_Area(&c1->bbox);
+		if(!c2->hull) cost2 -= CSG_Area(&c2->bbox);
+		
+		if(cost < cost1 && cost < cost2) break;
+		
+		i = (cost1 < cost2) ? n->child1 : n->child2;
+	}
+	int sibling = i;
+	int oldparent = tree->node[sibling].parent;
+	int newparent = CSG_TreeAllocNode(tree);
+	
+	tree->node[newparent].parent = oldparent;
+	tree->node[newparent].child1 = sibling;
+	tree->node[newparent].child2 = leaf;
+	tree->node[sibling].parent = newparent;
+	tree->node[leaf].parent    = newparent;
+	
+	if(oldparent < 0)
+	{
+		tree->root = newparent;
+	}
+	else if(tree->node[oldparent].child1 == sibling)
+	{
+		tree->node[oldparent].child1 = newparent;
+	}
+	else
+	{
+		tree->node[oldparent].child2 = newparent;
+	}
+	for(i = newparent; i >= 0; i = tree->node[i].parent)
+	{
+		CSG_TreeFix(tree, i);
+		i = CSG_TreeBalance(tree, i);
+	}
+	CSG_POPNAME_;
+}
+
+static void CSG_TreeClear(hull_t *parent)
+{
+	// ***********************************************
+	// Drop parent's tree, so that freeing all of its
+	// children doesn't rebalance it once per child.
+	// ***********************************************
+	
+	if(!parent->tree) return;
+	
+	for(hull_t *h = parent->down; h; h = h->next)
+	{
+		h->node = -1;
+	}
+	CSG_FreeMem(parent->tree->node);
+	CSG_FreeMem(parent->tree);
+	parent->tree = NULL;
+}
+
+static void CSG_TreeCopy(hull_t *dst, hull_t *src)
+{
+	CSG_PUSHNAME("TreeCopy");
+	
+	// ****************************************************
+	// Give dst a copy of src's tree, after dst's children
+	// have been copied from src's in the same order. Only
+	// the leaves' hull pointers need changing.
+	// ****************************************************
+	
+	CSG_TreeClear(dst);
+	
+	if(!src->tree)
+	{
+		CSG_POPNAME_;
+	}
+	tree_t *tree = (tree_t*)CSG_AllocMem(sizeof(tree_t), 1);
+	
+	*tree = *src->tree;
+	tree->node = (node_t*)CSG_AllocMem(sizeof(node_t), tree->nodemax);
+	memcpy(tree->node, src->tree->node, sizeof(node_t) * tree->nodemax);
+	dst->tree = tree;
+	
+	hull_t *s = src->down, *d = dst->down;
+	
+	for(; s && d; s = s->next, d = d->next)
+	{
+		d->node = s->node;
+		
+		if(d->node >= 0) tree->node[d->node].hull = d;
+	}
+	CSG_ASSERT(!s && !d, "children differ");
+	CSG_POPNAME_;
+}
+
+static void CSG_TreeRemove(hull_t *parent, hull_t *hull)
+{
+	CSG_PUSHNAME("TreeRemove");
+	
+	// ************************************************
+	// Remove hull from parent's tree. Its sibling takes
+	// the place of their shared parent node.
+	// ************************************************
+	
+	if(hull->node < 0)
+	{
+		CSG_POPNAME_;
+	}
+	tree_t *tree = parent->tree;
+	int leaf = hull->node;
+	
+	hull->node = -1;
+	tree->leaves--;
+	
+	if(leaf == tree->root)
+	{
+		tree->root = -1;
+		CSG_TreeFreeNode(tree, leaf);
+		CSG_POPNAME_;
+	}
+	int up    = tree->node[leaf].parent;
+	int grand = tree->node[up].parent;
+	int sibling = (tree->node[up].child1 == leaf) ?
+	              tree->node[up].child2 : tree->node[up].child1;
+	
+	tree->node[sibling].parent = grand;
+	
+	if(grand < 0)
+	{
+		tree->root = sibling;
+	}
+	else
+	{
+		if(tree->node[grand].child1 == up) tree->node[grand].child1 = sibling;
+		else                               tree->node[grand].child2 = sibling;
+		
+		for(int i = grand; i >= 0; i = tree->node[i].parent)
+		{
+			CSG_TreeFix(tree, i);
+			i = CSG_TreeBalance(tree, i);
+		}
 	}
-	hull->depth = 0;
+	CSG_TreeFreeNode(tree, up);
+	CSG_TreeFreeNode(tree, leaf);
 	CSG_POPNAME_;
 }
 
-void CSG_Link(void *parent, poly_t *poly)
+static void CSG_TreeRefit(hull_t *hull)
 {
-	CSG_PUSHNAME("Link[POLY]");
+	// *******************************************
+	// Called whenever a linked hull's BBOX changes
+	// *******************************************
 	
-	// **********************
-	// Link polygon to parent
-	// **********************
+	if(hull->node >= 0)
+	{
+		hull_t *parent = (hull_t*)hull->parent;
+		
+		CSG_TreeRemove(parent, hull);
+		CSG_TreeInsert(parent, hull);
+	}
+}
+
+static int CSG_CompareStamps(const void *a, const void *b)
+{
+	return (*(hull_t**)b)->stamp - (*(hull_t**)a)->stamp; // newest first
+}
+
+int CSG_Query(hull_t *hull, bbox_t *bbox, int mask, hull_t *list[], int max)
+{
+	CSG_PUSHNAME("Query");
 	
-	poly->parent = parent;
+	// *****************************************************
+	// Finds the children of hull whose boxes are not
+	// outside bbox, as judged by CSG_Intersect(BBOX,BBOX)
+	// with the given mask. Returns how many there are. If
+	// that is no more than max, they are stored in list in
+	// the same order as hull->down; otherwise the caller
+	// should try again with a bigger list. Safe to call
+	// from several threads at once.
+	// *****************************************************
 	
-	if(!parent)
+	tree_t *tree = hull->tree;
+	int stack[CSG_TREE_STACK];
+	int depth = 0;
+	int count = 0;
+	
+	if(!tree || tree->root < 0)
 	{
-		poly->depth = 0; // this is a dangerous assumption..?
-		CSG_POPNAME_;
+		CSG_POPNAME(0);
 	}
-	switch(*(int*)parent)
+	stack[depth++] = tree->root;
+	
+	while(depth > 0)
 	{
-		case CSG_TYPE_POLY:
+		node_t *n = &tree->node[stack[--depth]];
+		
+		if(CSG_Classify(bbox, &n->bbox, mask) & CSG_CLASS_OUT) continue;
+		
+		if(n->hull)
 		{
-			poly_t *dst = (poly_t*)parent;
-			
-			poly->depth = dst->depth + 1;
-			poly->next  = dst->down;
-			dst->down   = poly;
-			break;
+			if(count < max) list[count] = n->hull;
+			count++;
 		}
-		case CSG_TYPE_HULL:
+		else
 		{
-			hull_t *dst = (hull_t*)parent;
-			
-			poly->depth = 0;
-			poly->next  = dst->face;
-			dst->face   = poly;
-			break;
+			CSG_ASSERT(depth+2 <= CSG_TREE_STACK, "tree too deep");
+			stack[depth++] = n->child2;
+			stack[depth++] = n->child1;
 		}
 	}
-	CSG_POPNAME_;
+	if(count <= max)
+	{
+		qsort(list, count, sizeof(hull_t*), CSG_CompareStamps);
+	}
+	CSG_POPNAME(count);
 }
 
-void CSG_Link(void *parent, hull_t *hull)
+static hull_t **CSG_Children(hull_t *hull, bbox_t *bbox, int mask, int *count)
 {
-	CSG_PUSHNAME("Link[HULL]");
+	CSG_PUSHNAME("Children");
 	
-	// *******************
-	// Link hull to parent
-	// *******************
+	// **************************************************
+	// CSG_Query into the frame arena, for use inside a
+	// boolean operation.
+	// **************************************************
 	
-	hull->parent = parent;
+	hull_t *tmp[CSG_QUERY_MAX];
+	hull_t **list;
+	int n = CSG_Query(hull, bbox, mask, tmp, CSG_QUERY_MAX);
 	
-	if(!parent)
+	list = (hull_t**)CSG_AllocFrame(sizeof(hull_t*), n);
+	
+	if(n <= CSG_QUERY_MAX)
 	{
-		hull->depth = -1;
-		CSG_POPNAME_;
+		memcpy(list, tmp, sizeof(hull_t*) * n);
 	}
-	switch(*(int*)parent)
+	else
 	{
-		case CSG_TYPE_HULL:
-		{
-			hull_t *dst = (hull_t*)parent;
-			
-			hull->depth = dst->depth + 1;
-			hull->next  = dst->down;
-			dst->down   = hull;
-			break;
-		}
+		CSG_Query(hull, bbox, mask, list, n);
 	}
-	CSG_POPNAME_;
+	*count = n;
+	CSG_POPNAME(list);
 }
 
 int CSG_Count(poly_t *poly)
@@ -922,32 +1927,289 @@ void CSG_GenCCOF(poly_t *face, hull_t *hull)
 	// Internal recursive stuff for CCOF
 	// *********************************
 	
+	// ***********************************************
+	// Only children whose boxes overlap face (within
+	// its plane) can hold a coincident face.
+	// ***********************************************
+	
+	int mask = CSG_SURF_POOL[face->surf_id & CSG_SURF_MASK].mask;
+	int count;
+	
+	hull_t **list  = CSG_Children(hull, &face->bbox, mask, &count);
+	poly_t **match = CSG_MatchList(face, list, count);
+	
+	for(int i = 0; i < count; i++)
+	{
+		hull_t *h = list[i];
+		poly_t *p = match ? match[i] : CSG_FindCCOF(face, h);
+		
+		if(!p) continue;
+		
+		if(h->depth >= CSG_POLYGONALIZATION_DEPTH)
+		{
+			CSG_ASSERT(CSG_CCOF_COUNT < CSG_MAX_CCOFS, "too many CCOFs");
+			
+			ccof_t *cc = &CSG_CCOF_POOL[CSG_CCOF_COUNT++];
+			
+			cc->face = p;
+			cc->next = CSG_CCOF[h->depth];
+			CSG_CCOF[h->depth] = cc;
+		}
+		CSG_GenCCOF(face, h);
+	}
+	CSG_POPNAME_;
+}
+
+static poly_t *CSG_FindCCOF(poly_t *face, hull_t *hull)
+{
+	// ***********************************************
+	// Returns the face of hull that is coplanar with,
+	// opposite to and overlapping face, or NULL. This
+	// does not touch CSG_CODE_IN/OUT, so it may run on
+	// any thread.
+	// ***********************************************
+	
 	sref_t surf_id_opp = face->surf_id ^ CSG_SIDE_MASK;
 	
-	for(hull_t *h = hull->down; h; h = h->next)
+	for(poly_t *p = hull->face; p; p = p->next)
+	{
+		if(p->surf_id != surf_id_opp) continue;
+		if(CSG_Classify(p, face) & CSG_CLASS_OUT) continue;
+		
+		return p;
+	}
+	return NULL;
+}
+
+// ****************************************************************************
+// Parallel scans. These run the read-only tests for every child of a hull at
+// once, ahead of the serial loops in CSG_GenCCOF, CSG_BooleanOp and
+// CSG_BooleanAdd, which then pick the results up in list order. Lists that
+// are too short to be worth sharing out are left to the serial code, as is
+// everything when only one thread is in use.
+// ****************************************************************************
+
+#ifndef __MAC__
+static void CSG_DoJobs(void)
+{
+	LONG job;
+	
+	while((job = InterlockedIncrement(&CSG_JOB_NEXT) - 1) < CSG_JOB_COUNT)
+	{
+		CSG_JOB_FUNC(job);
+	}
+}
+
+static DWORD WINAPI CSG_Worker(LPVOID param)
+{
+	for(;;)
+	{
+		WaitForSingleObject(CSG_THREAD_START, INFINITE);
+		
+		if(CSG_THREAD_QUIT) break;
+		
+		CSG_DoJobs();
+		
+		if(InterlockedDecrement(&CSG_JOB_ACTIVE) == 0)
+		{
+			SetEvent(CSG_THREAD_DONE);
+		}
+	}
+	return 0;
+}
+#endif
+
+void CSG_RunJobs(void (*func)(int job), int count)
+{
+	// **************************************************
+	// Calls func(0) .. func(count-1), sharing the jobs
+	// out between the worker threads and this one. Jobs
+	// may run in any order, so each must only write its
+	// own part of the output. Not reentrant: jobs must
+	// not start jobs of their own.
+	// **************************************************
+	
+#ifndef __MAC__
+	if(CSG_THREAD_COUNT > 1 && count > 1)
+	{
+		CSG_JOB_FUNC   = func;
+		CSG_JOB_COUNT  = count;
+		CSG_JOB_NEXT   = 0;
+		CSG_JOB_ACTIVE = CSG_THREAD_COUNT - 1;
+		
+		ReleaseSemaphore(CSG_THREAD_START, CSG_THREAD_COUNT - 1, NULL);
+		CSG_DoJobs();
+		WaitForSingleObject(CSG_THREAD_DONE, INFINITE);
+		return;
+	}
+#endif
+	for(int job = 0; job < count; job++)
+	{
+		func(job);
+	}
+}
+
+static void CSG_ClassifyJob(int job)
+{
+	int i   = job * CSG_THREAD_BATCH;
+	int end = i + CSG_THREAD_BATCH;
+	
+	if(end > CSG_JOB_SIZE) end = CSG_JOB_SIZE;
+	
+	for(; i < end; i++)
 	{
-		for(poly_t *p = h->face; p; p = p->next)
+#ifndef __MAC__
+		if(i >= CSG_JOB_STOP) break; // an earlier hull already hit
+#endif
+		int code = CSG_Classify(CSG_JOB_HULL, CSG_JOB_LIST[i]);
+		
+		CSG_JOB_CODE[i] = code;
+		
+		if(CSG_JOB_FIRST && !(code & CSG_CLASS_OUT))
 		{
-			if(p->surf_id != surf_id_opp) continue;
-			if(CSG_Intersect(p, face))    continue;
+#ifndef __MAC__
+			LONG stop;
 			
-			if(h->depth >= CSG_POLYGONALIZATION_DEPTH)
+			while((stop = CSG_JOB_STOP) > i + 1)
 			{
-				CSG_ASSERT(CSG_CCOF_COUNT < CSG_MAX_CCOFS, "too many CCOFs");
-				
-				ccof_t *cc = &CSG_CCOF_POOL[CSG_CCOF_COUNT++];
-				
-				cc->face = p;
-				cc->next = CSG_CCOF[h->depth];
-				CSG_CCOF[h->depth] = cc;
+				if(InterlockedCompareExchange(&CSG_JOB_STOP, i + 1, stop) == stop) break;
 			}
-			CSG_GenCCOF(face, h);
+#endif
 			break;
 		}
 	}
+}
+
+static int *CSG_ClassifyList(hull_t *src, hull_t *list[], int count, int first)
+{
+	CSG_PUSHNAME("ClassifyList");
+	
+	// **************************************************
+	// Classifies src against each hull in list, on all
+	// threads. Returns the CSG_Classify codes in list
+	// order, or NULL if the serial code should be used
+	// instead. If first is set, only the hulls up to the
+	// first one src is not outside of are sure to be
+	// classified; the rest may be left at -1. The codes
+	// live in the frame arena, so they last until the
+	// outermost boolean operation returns, through any
+	// ops the caller recurses into.
+	// **************************************************
+	
+	if(CSG_THREAD_COUNT < 2 || count < CSG_THREAD_BATCH*2)
+	{
+		CSG_POPNAME(NULL);
+	}
+	CSG_JOB_LIST = list;
+	CSG_JOB_CODE = (int*)CSG_AllocFrame(sizeof(int), count);
+	
+	for(int i = 0; i < count; i++)
+	{
+		CSG_JOB_CODE[i] = -1;
+	}
+	CSG_JOB_HULL  = src;
+	CSG_JOB_SIZE  = count;
+	CSG_JOB_FIRST = first;
+#ifndef __MAC__
+	CSG_JOB_STOP  = count;
+#endif
+	CSG_RunJobs(CSG_ClassifyJob, (count + CSG_THREAD_BATCH-1) / CSG_THREAD_BATCH);
+	CSG_POPNAME(CSG_JOB_CODE);
+}
+
+static void CSG_MatchJob(int job)
+{
+	int i   = job * CSG_THREAD_BATCH;
+	int end = i + CSG_THREAD_BATCH;
+	
+	if(end > CSG_JOB_SIZE) end = CSG_JOB_SIZE;
+	
+	for(; i < end; i++)
+	{
+		CSG_JOB_MATCH[i] = CSG_FindCCOF(CSG_JOB_FACE, CSG_JOB_LIST[i]);
+	}
+}
+
+static poly_t **CSG_MatchList(poly_t *face, hull_t *list[], int count)
+{
+	CSG_PUSHNAME("MatchList");
+	
+	// ***********************************************
+	// Runs CSG_FindCCOF for each hull in list, on all
+	// threads. Returns the faces in list order, or
+	// NULL if the serial code should be used instead.
+	// ***********************************************
+	
+	if(CSG_THREAD_COUNT < 2 || count < CSG_THREAD_BATCH*2)
+	{
+		CSG_POPNAME(NULL);
+	}
+	CSG_JOB_LIST  = list;
+	CSG_JOB_MATCH = (poly_t**)CSG_AllocFrame(sizeof(poly_t*), count);
+	CSG_JOB_FACE  = face;
+	CSG_JOB_SIZE = count;
+	CSG_RunJobs(CSG_MatchJob, (count + CSG_THREAD_BATCH-1) / CSG_THREAD_BATCH);
+	CSG_POPNAME(CSG_JOB_MATCH);
+}
+
+void CSG_SetThreadCount(int count)
+{
+	CSG_PUSHNAME("SetThreadCount");
+	
+	// *****************************************************
+	// Sets the number of threads (counting the caller) used
+	// for the intersection scans in boolean operations. The
+	// results are the same for any count; 0 means one per
+	// processor. Debug builds use one thread, since the
+	// function name stack is shared, as does the Mac build.
+	// *****************************************************
+	
+#if !CSG_DEBUG && !defined(__MAC__)
+	int i;
+	
+	if(count <= 0)
+	{
+		SYSTEM_INFO info;
+		
+		GetSystemInfo(&info);
+		count = (int)info.dwNumberOfProcessors;
+	}
+	if(count > CSG_MAX_THREADS) count = CSG_MAX_THREADS;
+	if(count < 1)               count = 1;
+	
+	if(CSG_THREAD_COUNT > 1)
+	{
+		CSG_THREAD_QUIT = 1;
+		ReleaseSemaphore(CSG_THREAD_START, CSG_THREAD_COUNT - 1, NULL);
+		
+		for(i = 0; i < CSG_THREAD_COUNT - 1; i++)
+		{
+			WaitForSingleObject(CSG_THREAD[i], INFINITE);
+			CloseHandle(CSG_THREAD[i]);
+		}
+		CSG_THREAD_QUIT = 0;
+	}
+	if(count > 1 && !CSG_THREAD_START)
+	{
+		CSG_THREAD_START = CreateSemaphore(NULL, 0, CSG_MAX_THREADS, NULL);
+		CSG_THREAD_DONE  = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+	for(i = 0; i < count - 1; i++)
+	{
+		DWORD id;
+		
+		CSG_THREAD[i] = CreateThread(NULL, 0, CSG_Worker, NULL, 0, &id);
+	}
+	CSG_THREAD_COUNT = count;
+#endif
 	CSG_POPNAME_;
 }
 
+int CSG_GetThreadCount(void)
+{
+	return CSG_THREAD_COUNT;
+}
+
 void CSG_Update(bbox_t *bbox, vref_t vref[], int vertcount)
 {
 	CSG_PUSHNAME("Update[BBOX]");
@@ -1010,8 +2272,8 @@ void CSG_Update(hull_t *hull)
 	edgecount /= 2;
 	vertcount  = edgecount - facecount + 2; // Euler formula: V=E-F+2
 	
-	CSG_FreeMem(hull->vref);
-	hull->vref = (vref_t*)CSG_AllocMem(sizeof(vref_t), vertcount);
+	CSG_FreeRefs(hull->vref);
+	hull->vref = CSG_AllocRefs(vertcount);
 	hull->vertcount = 0;
 	
 	for(p = hull->face; p; p = p->next)
@@ -1030,6 +2292,7 @@ void CSG_Update(hull_t *hull)
 		}
 	}
 	CSG_Update(&hull->bbox, hull->vref, hull->vertcount);
+	CSG_TreeRefit(hull);
 	CSG_CHECK(hull);
 	CSG_POPNAME_;
 }
@@ -1174,17 +2437,31 @@ int CSG_Intersect(bbox_t *bbox1, bbox_t *bbox2, int mask)
 	// polygon or polyhedron is tested against a single
 	// plane - in this case, the polygon or polyhedron
 	// being entirely coplanar results in an error.
+	// 
+	// The CSG_Classify functions do the same tests but
+	// return CSG_CLASS_OUT/IN bits instead of setting the
+	// static variables, so that they may be used from
+	// more than one thread at once.
 	// **************************************************
 	
-	CSG_CODE_OUT = 1;
-	CSG_CODE_IN  = 0;
-	
+	CSG_POPNAME(CSG_SetCode(CSG_Classify(bbox1, bbox2, mask)));
+}
+
+static int CSG_SetCode(int code)
+{
+	CSG_CODE_OUT = (code & CSG_CLASS_OUT) ? 1 : 0;
+	CSG_CODE_IN  = (code & CSG_CLASS_IN)  ? 1 : 0;
+	return CSG_CODE_OUT;
+}
+
+static int CSG_Classify(bbox_t *bbox1, bbox_t *bbox2, int mask)
+{
 	if(mask & 1)
 	{
 		if(bbox1->maxv.x <= bbox2->minv.x + CSG_MAXERR ||
 		   bbox1->minv.x >= bbox2->maxv.x - CSG_MAXERR )
 		{
-			CSG_POPNAME(1);
+			return CSG_CLASS_OUT;
 		}
 	}
 	if(mask & 2)
@@ -1192,7 +2469,7 @@ int CSG_Intersect(bbox_t *bbox1, bbox_t *bbox2, int mask)
 		if(bbox1->maxv.y <= bbox2->minv.y + CSG_MAXERR ||
 		   bbox1->minv.y >= bbox2->maxv.y - CSG_MAXERR )
 		{
-			CSG_POPNAME(1);
+			return CSG_CLASS_OUT;
 		}
 	}
 	if(mask & 4)
@@ -1200,11 +2477,9 @@ int CSG_Intersect(bbox_t *bbox1, bbox_t *bbox2, int mask)
 		if(bbox1->maxv.z <= bbox2->minv.z + CSG_MAXERR ||
 		   bbox1->minv.z >= bbox2->maxv.z - CSG_MAXERR )
 		{
-			CSG_POPNAME(1);
+			return CSG_CLASS_OUT;
 		}
 	}
-	CSG_CODE_OUT = 0;
-	
 	if(bbox1->minv.x >= bbox2->minv.x - CSG_MAXERR &&
 	   bbox1->maxv.x <= bbox2->maxv.x + CSG_MAXERR &&
 	   bbox1->minv.y >= bbox2->minv.y - CSG_MAXERR &&
@@ -1212,9 +2487,9 @@ int CSG_Intersect(bbox_t *bbox1, bbox_t *bbox2, int mask)
 	   bbox1->minv.z >= bbox2->minv.z - CSG_MAXERR &&
 	   bbox1->maxv.z <= bbox2->maxv.z + CSG_MAXERR )
 	{
-		CSG_CODE_IN = 1;
+		return CSG_CLASS_IN;
 	}
-	CSG_POPNAME(0);
+	return 0;
 }
 
 int CSG_Intersect(poly_t *poly1, sref_t surf_id)
@@ -1269,24 +2544,31 @@ int CSG_Intersect(poly_t *poly1, poly_t *poly2)
 	// Intersection between two polygons
 	// *********************************
 	
-	int n;
-	
 	sref_t surf_id1 = poly1->surf_id & CSG_SURF_MASK;
 	sref_t surf_id2 = poly2->surf_id & CSG_SURF_MASK;
 	
 	CSG_ASSERT(surf_id1 == surf_id2, "not coplanar");
+	CSG_POPNAME(CSG_SetCode(CSG_Classify(poly1, poly2)));
+}
+
+static int CSG_Classify(poly_t *poly1, poly_t *poly2)
+{
+	int n;
+	
+	sref_t surf_id1 = poly1->surf_id & CSG_SURF_MASK;
 	
 	int mask = CSG_SURF_POOL[surf_id1].mask;
+	int code = CSG_Classify(&poly1->bbox, &poly2->bbox, mask);
 	
-	if(CSG_Intersect(&poly1->bbox, &poly2->bbox, mask))
+	if(code & CSG_CLASS_OUT)
 	{
-		CSG_POPNAME(1);
+		return CSG_CLASS_OUT;
 	}
 	// ***********
 	// Inside test
 	// ***********
 	
-	if(CSG_CODE_IN)
+	if(code & CSG_CLASS_IN)
 	{
 		for(n = 0; n < poly2->vertcount; n++)
 		{
@@ -1298,9 +2580,8 @@ int CSG_Intersect(poly_t *poly1, poly_t *poly2)
 		}
 		if(n == poly2->vertcount)
 		{
-			CSG_POPNAME(0);
+			return CSG_CLASS_IN;
 		}
-		CSG_CODE_IN = 0;
 	}
 	// ************
 	// Outside test
@@ -1312,7 +2593,7 @@ int CSG_Intersect(poly_t *poly1, poly_t *poly2)
 		
 		if(CSG_In(poly2->vref, poly2->vertcount, surf_id))
 		{
-			CSG_POPNAME(CSG_CODE_OUT = 1);
+			return CSG_CLASS_OUT;
 		}
 	}
 	for(n = 0; n < poly2->vertcount; n++)
@@ -1321,10 +2602,10 @@ int CSG_Intersect(poly_t *poly1, poly_t *poly2)
 		
 		if(CSG_In(poly1->vref, poly1->vertcount, surf_id))
 		{
-			CSG_POPNAME(CSG_CODE_OUT = 1);
+			return CSG_CLASS_OUT;
 		}
 	}
-	CSG_POPNAME(0);
+	return 0;
 }
 
 int CSG_Intersect(hull_t *hull1, hull_t *hull2)
@@ -1352,17 +2633,38 @@ int CSG_Intersect(hull_t *hull1, hull_t *hull2)
 	// rotated slightly then the error would occur.
 	// *************************************************
 	
+	CSG_POPNAME(CSG_SetCode(CSG_Classify(hull1, hull2)));
+}
+
+static int CSG_Intersect(hull_t *hull1, hull_t *hull2, int *code, int i)
+{
+	// *************************************************
+	// Same as CSG_Intersect(hull1, hull2), but uses the
+	// code from CSG_ClassifyList where there is one.
+	// *************************************************
+	
+	if(code && code[i] >= 0)
+	{
+		return CSG_SetCode(code[i]);
+	}
+	return CSG_Intersect(hull1, hull2);
+}
+
+static int CSG_Classify(hull_t *hull1, hull_t *hull2)
+{
 	poly_t *p;
 	
-	if(CSG_Intersect(&hull1->bbox, &hull2->bbox, 7))
+	int code = CSG_Classify(&hull1->bbox, &hull2->bbox, 7);
+	
+	if(code & CSG_CLASS_OUT)
 	{
-		CSG_POPNAME(1);
+		return CSG_CLASS_OUT;
 	}
 	// ***********
 	// Inside test
 	// ***********
 	
-	if(CSG_CODE_IN)
+	if(code & CSG_CLASS_IN)
 	{
 		for(p = hull2->face; p; p = p->next)
 		{
@@ -1375,9 +2677,8 @@ int CSG_Intersect(hull_t *hull1, hull_t *hull2)
 		}
 		if(!p)
 		{
-			CSG_POPNAME(0);
+			return CSG_CLASS_IN;
 		}
-		CSG_CODE_IN = 0;
 	}
 	// ************
 	// Outside test
@@ -1389,7 +2690,7 @@ int CSG_Intersect(hull_t *hull1, hull_t *hull2)
 		
 		if(CSG_In(hull2->vref, hull2->vertcount, surf_id))
 		{
-			CSG_POPNAME(CSG_CODE_OUT = 1);
+			return CSG_CLASS_OUT;
 		}
 	}
 	for(p = hull2->face; p; p = p->next)
@@ -1398,10 +2699,10 @@ int CSG_Intersect(hull_t *hull1, hull_t *hull2)
 		
 		if(CSG_In(hull1->vref, hull1->vertcount, surf_id))
 		{
-			CSG_POPNAME(CSG_CODE_OUT = 1);
+			return CSG_CLASS_OUT;
 		}
 	}
-	CSG_POPNAME(0);
+	return 0;
 }
 
 int CSG_Intersect(poly_t *poly1, hull_t *hull2)
@@ -1633,8 +2934,8 @@ poly_t *CSG_Split(void *parent, poly_t *poly, sref_t surf_id)
 	// Allocate for worst-case
 	// ***********************
 	
-	poly_t *split1 = CSG_Alloc(NULL, poly->vertcount+1, poly->surf_id);
-	poly_t *split2 = CSG_Alloc(NULL, poly->vertcount+1, poly->surf_id);
+	poly_t *split1 = CSG_AllocScratch(poly->vertcount+1, poly->surf_id);
+	poly_t *split2 = CSG_AllocScratch(poly->vertcount+1, poly->surf_id);
 	
 	// Inner Fragment: split1
 	// Outer Fragment: split2
@@ -1719,8 +3020,11 @@ poly_t *CSG_Split(void *parent, poly_t *poly, sref_t surf_id)
 	}
 	CSG_Copy(poly, split1);
 	CSG_Copy(pnew, split2);
-	CSG_Free(split1);
-	CSG_Free(split2);
+	
+	if(CSG_BOOLEAN_DEPTH == 0)
+	{
+		CSG_ResetFrame(); // not inside a boolean op, so nothing else is live
+	}
 	CSG_Update(poly);
 	CSG_Update(pnew);
 #if CSG_DEBUG
@@ -1776,6 +3080,8 @@ void CSG_BooleanOp(hull_t *dst, hull_t *src, int target_depth, int op, int clip)
 	CSG_ASSERT(target_depth > dst->depth, "incompatible depths");
 	CSG_ASSERT(op == CSG_ADD || op == CSG_SUB, "unknown op");
 	
+	CSG_BOOLEAN_DEPTH++;
+	
 	if(target_depth - dst->depth == 1)
 	{
 		if(op == CSG_ADD)
@@ -1787,13 +3093,29 @@ void CSG_BooleanOp(hull_t *dst, hull_t *src, int target_depth, int op, int clip)
 	}
 	else
 	{
-		for(hull_t *h = dst->down; h; h = h->next)
+		// ***********************************************
+		// Recursing into h only changes h's descendants,
+		// so the children can all be classified up front.
+		// ***********************************************
+		
+		int count;
+		
+		hull_t **list = CSG_Children(dst, &src->bbox, 7, &count);
+		int     *code = CSG_ClassifyList(src, list, count, 0);
+		
+		for(int i = 0; i < count; i++)
 		{
-			if(CSG_Intersect(src, h)) continue;
+			hull_t *h = list[i];
+			
+			if(CSG_Intersect(src, h, code, i)) continue;
 			
 			CSG_BooleanOp(h, src, target_depth, op, CSG_CODE_IN ? 0 : 1);
 		}
 	}
+	if(--CSG_BOOLEAN_DEPTH == 0)
+	{
+		CSG_ResetFrame();
+	}
 	CSG_POPNAME_;
 }
 
@@ -1876,9 +3198,22 @@ void CSG_BooleanAdd(hull_t *dst, hull_t *src, int clip)
 	}
 	else if(CSG_RESOLVE_ADD_3D == CSG_RESOLVE_KEEP_OLD)
 	{
-		for(hull_t *h = dst->down; h; h = h->next)
+		// *************************************************
+		// src does not change until the loop finds a hull
+		// that overlaps it, so the scan can be done up front
+		// (stopping at the first hit).
+		// *************************************************
+		
+		int count;
+		
+		hull_t **list = CSG_Children(dst, &src->bbox, 7, &count);
+		int     *code = CSG_ClassifyList(src, list, count, 1);
+		
+		for(int i = 0; i < count; i++)
 		{
-			if(CSG_Intersect(src, h)) continue;
+			hull_t *h = list[i];
+			
+			if(CSG_Intersect(src, h, code, i)) continue;
 			if(CSG_CODE_IN == 0)
 			{
 				int split = 0;
@@ -55,9 +55,13 @@ enum CSG_OPTYPE
 	CSG_PUSH, // used in modeler
 	CSG_POP   // used in modeler
 };
-#define CSG_MAX_VERTS          60000
-#define CSG_MAX_SURFS          10000
+#define CSG_INIT_VERTS         4096 // initial pool sizes; the VERT and SURF
+#define CSG_INIT_SURFS         1024 // pools grow as needed
 #define CSG_MAX_CCOFS          1000
+#define CSG_BLOCK_SIZE         256   // polys/hulls allocated at a time
+#define CSG_FRAME_SIZE         65536 // bytes per frame arena chunk
+#define CSG_MAX_THREADS        16
+#define CSG_THREAD_BATCH       32 // hulls per job in parallel scans
 #define CSG_MAX_VERTS_PER_HULL 100
 #define CSG_MAX_VERTS_PER_POLY 100
 #define CSG_MAX_FACES_PER_HULL 100
@@ -79,6 +83,7 @@ struct bbox_t; // prototype
 struct ccof_t; // prototype
 struct poly_t; // prototype
 struct hull_t; // prototype
+struct tree_t; // prototype
 
 struct surf_t
 {
@@ -128,6 +133,9 @@ struct hull_t
 	int     vertcount;
 	vref_t *vref;
 	void   *shape; // non-geometric data
+	int     stamp; // link order: children are listed newest first
+	int     node;  // index in parent's tree, or -1
+	tree_t *tree;  // bounding volume tree over children
 };
 
 // *******************
@@ -157,6 +165,8 @@ void    CSG_Copy(hull_t *dst, hull_t *src);
 poly_t *CSG_Clone(void *parent, poly_t *src);
 hull_t *CSG_Clone(void *parent, hull_t *src);
 void   *CSG_AllocMem(int size, int nelems);
+void   *CSG_AllocFrame(int size, int nelems);
+void    CSG_ResetFrame(void);
 poly_t *CSG_Alloc(void *parent, int vertcount, sref_t surf_id);
 hull_t *CSG_Alloc(void *parent);
 void    CSG_FreeMem(void *dst);
@@ -167,11 +177,15 @@ void    CSG_Unlink(poly_t *poly);
 void    CSG_Unlink(hull_t *hull);
 void    CSG_Link(void *parent, poly_t *poly);
 void    CSG_Link(void *parent, hull_t *hull);
+int     CSG_Query(hull_t *hull, bbox_t *bbox, int mask, hull_t *list[], int max);
 int     CSG_Count(poly_t *poly);
 int     CSG_Count(hull_t *hull);
 int     CSG_Count(ccof_t *ccof);
 
 void    CSG_SetPolygonalizationDepth(int depth);
+void    CSG_SetThreadCount(int count);
+int     CSG_GetThreadCount(void);
+void    CSG_RunJobs(void (*func)(int job), int count);
 
 void    CSG_GenCCOF(poly_t *face);
 void    CSG_GenCCOF(poly_t *face, hull_t *hull);
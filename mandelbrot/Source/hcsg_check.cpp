@@ -0,0 +1,307 @@
+// **************************************************************************
+// HCSG Demo
+// (c) Bernie Freidin, 1999-2000
+// **************************************************************************
+
+// **************************************************************
+// Self-checks for the HCSG library. This is a separate console
+// program, not part of the demo; build it with collision.cpp,
+// hcsg.cpp, hcsg_modeler.cpp, strtok_r.cpp and vector.cpp, and
+// run it. Prints the errors each check finds, and exits with 1
+// if there were any.
+//
+// Start it with -benchmark [script] to time collision detection
+// instead, on the world built by a modeler script (by default
+// Scripts/CSG_default_script.txt, from the demo's directory).
+// **************************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hcsg.h"
+#include "hcsg_modeler.h"
+#include "collision.h"
+
+static int CheckFrame(void)
+{
+	// *****************************************************
+	// Checks the frame arena. Fills blocks spanning several
+	// chunks, twice so that the chunks get reused, and
+	// checks that none was handed out again while in use.
+	// Returns the number of errors found.
+	// *****************************************************
+	
+	const int count = 4*CSG_FRAME_SIZE/1000 + 1;
+	char *block[4*CSG_FRAME_SIZE/1000 + 1];
+	int errors = 0;
+	int pass, i, n;
+	
+	for(pass = 0; pass < 2; pass++)
+	{
+		CSG_ResetFrame();
+		
+		for(i = 0; i < count; i++)
+		{
+			int size = (i == count/2) ? CSG_FRAME_SIZE*2 : 1000; // one oversized
+			
+			block[i] = (char*)CSG_AllocFrame(1, size);
+			memset(block[i], i + 1, size);
+		}
+		for(i = 0; i < count; i++)
+		{
+			int size = (i == count/2) ? CSG_FRAME_SIZE*2 : 1000;
+			
+			for(n = 0; n < size; n++)
+			{
+				if(block[i][n] != (char)(i + 1)) break;
+			}
+			if(n < size) errors++;
+		}
+	}
+	CSG_ResetFrame();
+	return errors;
+}
+
+static hull_t *BuildScene(void)
+{
+	// *************************************************
+	// Builds a scratch world: 20x16 boxes, crossed by
+	// bars one level down, crossed by two slabs another
+	// level down. The last slab only overlaps the first,
+	// so it is split many times in one boolean op, with
+	// enough blocks to span several arena chunks.
+	// *************************************************
+	
+	hull_t *world = CSG_SolidCube(-1000.0, -1000.0, -1000.0,
+	                              +1000.0, +1000.0, +1000.0);
+	hull_t *src;
+	int i, j;
+	
+	world->depth = 0;
+	
+	for(i = 0; i < 20; i++)
+	{
+		for(j = 0; j < 16; j++)
+		{
+			src = CSG_SolidCube(i*4.0, j*4.0, 0.0, i*4.0 + 3.0, j*4.0 + 3.0, 3.0);
+			CSG_BooleanOp(world, src, 1, CSG_ADD, 0);
+			CSG_Free(src);
+		}
+	}
+	for(j = 0; j < 16; j++)
+	{
+		src = CSG_SolidCube(-1.0, j*4.0 + 0.5, 0.5, 81.0, j*4.0 + 1.5, 2.5);
+		CSG_BooleanOp(world, src, 2, CSG_ADD, 0);
+		CSG_Free(src);
+	}
+	for(i = 0; i < 20; i++)
+	{
+		src = CSG_SolidCube(i*4.0 + 1.0, -1.0, 0.25, i*4.0 + 2.0, 65.0, 2.75);
+		CSG_BooleanOp(world, src, 2, CSG_ADD, 0);
+		CSG_Free(src);
+	}
+	src = CSG_SolidCube(-1.0, -1.0, 1.25, 81.0, 65.0, 1.75);
+	CSG_BooleanOp(world, src, 3, CSG_ADD, 0);
+	CSG_Free(src);
+	src = CSG_SolidCube(-1.0, -1.0, 0.75, 81.0, 65.0, 2.25);
+	CSG_BooleanOp(world, src, 3, CSG_ADD, 0);
+	CSG_Free(src);
+	return world;
+}
+
+static int Compare(poly_t *poly1, poly_t *poly2)
+{
+	// ************************************************
+	// Counts the differences between two poly lists.
+	// Vertices and surfaces are pooled, so equal ones
+	// have equal references.
+	// ************************************************
+	
+	int errors = 0;
+	
+	for(; poly1 && poly2; poly1 = poly1->next, poly2 = poly2->next)
+	{
+		if(poly1->vertcount != poly2->vertcount || poly1->surf_id != poly2->surf_id)
+		{
+			errors++;
+			continue;
+		}
+		for(int n = 0; n < poly1->vertcount; n++)
+		{
+			if(poly1->vref[n] != poly2->vref[n] || poly1->sref[n] != poly2->sref[n])
+			{
+				errors++;
+				break;
+			}
+		}
+		errors += Compare(poly1->down, poly2->down);
+	}
+	if(poly1 || poly2) errors++;
+	return errors;
+}
+
+static int Compare(hull_t *hull1, hull_t *hull2)
+{
+	// *********************************************
+	// Counts the differences between two hull lists
+	// *********************************************
+	
+	int errors = 0;
+	
+	for(; hull1 && hull2; hull1 = hull1->next, hull2 = hull2->next)
+	{
+		if(hull1->vertcount != hull2->vertcount)
+		{
+			errors++;
+			continue;
+		}
+		for(int n = 0; n < hull1->vertcount; n++)
+		{
+			if(hull1->vref[n] != hull2->vref[n])
+			{
+				errors++;
+				break;
+			}
+		}
+		errors += Compare(hull1->face, hull2->face);
+		errors += Compare(hull1->down, hull2->down);
+	}
+	if(hull1 || hull2) errors++;
+	return errors;
+}
+
+static int CheckThreads(void)
+{
+	// *****************************************************
+	// Builds the scratch world with one thread and with
+	// four, so that the threaded scans take their results
+	// from the arena, and compares the two. The caller's
+	// thread count is put back afterwards.
+	// *****************************************************
+	
+	int threads = CSG_GetThreadCount();
+	hull_t *world[2];
+	
+	CSG_SetThreadCount(1);
+	world[0] = BuildScene();
+	CSG_SetThreadCount(4);
+	world[1] = BuildScene();
+	CSG_SetThreadCount(threads);
+	
+	int errors = Compare(world[0], world[1]);
+	
+	CSG_Free(world[0]);
+	CSG_Free(world[1]);
+	return errors;
+}
+
+static int CheckChildren(hull_t *hull, bbox_t *bbox)
+{
+	// ***************************************************
+	// Compares CSG_Query with a plain scan of hull's
+	// children. The list goes in the frame arena, as in
+	// a boolean op, and enough is allocated after it to
+	// fill several chunks before it is read.
+	// ***************************************************
+	
+	int count = CSG_Query(hull, bbox, 7, NULL, 0);
+	int i, n = 0;
+	int errors = 0;
+	
+	hull_t **list = (hull_t**)CSG_AllocFrame(sizeof(hull_t*), count);
+	
+	CSG_Query(hull, bbox, 7, list, count);
+	
+	for(i = 0; i < 4*CSG_FRAME_SIZE/1000; i++)
+	{
+		memset(CSG_AllocFrame(1, 1000), 0xFF, 1000);
+	}
+	for(hull_t *h = hull->down; h; h = h->next)
+	{
+		if(CSG_Intersect(bbox, &h->bbox, 7)) continue;
+		if(n >= count || list[n] != h) errors++;
+		n++;
+	}
+	if(n != count) errors++;
+	
+	CSG_ResetFrame();
+	return errors;
+}
+
+static int CheckQuery(void)
+{
+	// ***********************************************
+	// Checks CSG_Query on all the boxes of the scratch
+	// world (more than fit on its stack), on some of
+	// them, and on the bars inside each box.
+	// ***********************************************
+	
+	hull_t *world = BuildScene();
+	bbox_t bbox = world->bbox;
+	int errors = 0;
+	
+	errors += CheckChildren(world, &bbox);
+	
+	bbox.minv = vec3(10.0, 10.0, 1.0);
+	bbox.maxv = vec3(50.0, 30.0, 2.0);
+	errors += CheckChildren(world, &bbox);
+	
+	for(hull_t *h = world->down; h; h = h->next)
+	{
+		errors += CheckChildren(h, &bbox);
+	}
+	CSG_Free(world);
+	return errors;
+}
+
+static void Benchmark(char *script)
+{
+	// ****************************************************
+	// Times CDR_Collide and CDR_CollideBatch on the world
+	// built by a modeler script.
+	// ****************************************************
+	
+	hull_t *world = CSG_World();
+	
+	CSG_InitializeModeler(world);
+	CSG_RunScript(script);
+	while(!_CSG_AddHull());
+	CDR_Initialize(world);
+	
+	printf("Collision benchmark, %s, 1000 spheres x 100 steps:\n", script);
+	
+	for(int batch = 0; batch < 2; batch++)
+	{
+		double checksum;
+		double seconds = CDR_Benchmark(1000, 100, 0.4, batch, &checksum);
+		
+		printf("%-16s %.3f s (checksum %.6f)\n",
+		       batch ? "CDR_CollideBatch" : "CDR_Collide", seconds, checksum);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	int errors, total = 0;
+	
+	CSG_Initialize();
+	
+	if(argc > 1 && strcmp(argv[1], "-benchmark") == 0)
+	{
+		static char script[] = "Scripts/CSG_default_script.txt";
+		
+		Benchmark(argc > 2 ? argv[2] : script);
+		return 0;
+	}
+	
+	total += errors = CheckFrame();
+	printf("frame arena: %i errors\n", errors);
+	
+	total += errors = CheckThreads();
+	printf("threaded scans: %i errors\n", errors);
+	
+	total += errors = CheckQuery();
+	printf("child queries: %i errors\n", errors);
+	
+	return total ? 1 : 0;
+}
@@ -7,6 +7,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "strtok_r.h"
 #include "hcsg_modeler.h"
 
@@ -127,6 +130,51 @@ static tag_t CSG_TAG_LIST[] = {
 	{"",    "",   -1}
 };
 
+// ****************************************************************************
+// === SCRIPTS ================================================================
+// ****************************************************************************
+
+struct command_t; // prototype
+
+struct instr_t
+{
+	command_t *command;
+	int        line;  // source line, counting from 1
+	char      *name;  // shape or file name, or NULL for *
+	int        count; // number of operands
+	double    *value; // operands as scalar values
+	int       *tag;   // the same operands as tags (0 if not a tag)
+	int        jump;  // LOOP: first instruction of the next line
+};
+
+struct script_t
+{
+	char      fname[256];
+	long      size; // length of the text compiled,
+	unsigned long hash; // and its FNV-1a hash
+	long      fsize; // file size and time when last checked,
+	time_t    mtime;
+	time_t    checked; // and the clock time of that check
+	int       run; // CSG_SCRIPT_RUN it was last checked in
+	int       count;
+	int       max;
+	instr_t  *code;
+	script_t *next;
+};
+
+// *********************************************************
+// Notes on SCRIPT structure:
+// 
+// Scripts are compiled the first time they are run, and
+// again only when the text changes (see CSG_CompileScript).
+// Each command becomes
+// an instruction with its operands already parsed, so
+// loops and re-runs do no text processing at all. Jumps
+// (LOOP/ENDLOOP) go to instruction indices, and take effect
+// at the end of a line, as they did when the file was read
+// a line at a time.
+// *********************************************************
+
 // ****************************************************************************
 // === COMMANDS ===============================================================
 // ****************************************************************************
@@ -172,46 +220,48 @@ enum CSG_COMMAND
 	CSG_COMMAND_DEPTH,
 	CSG_COMMAND_CSGADD,
 	CSG_COMMAND_CSGSUB,
+	CSG_COMMAND_THREADS,
 	//
 	CSG_COMMAND_LOOP,
 	CSG_COMMAND_ENDLOOP,
 	CSG_COMMAND_RETURN
 };
 
-static void CSG_ExecNOP(char *paramstr[]);
-static void CSG_ExecRUNSCRIPT(char *paramstr[]);
+static void CSG_ExecNOP(instr_t *instr);
+static void CSG_ExecRUNSCRIPT(instr_t *instr);
 //
-static void CSG_ExecPUSHCOORDS(char *paramstr[]);
-static void CSG_ExecPOPCOORDS(char *paramstr[]);
-static void CSG_ExecMATRIX(char *paramstr[]);
-static void CSG_ExecIDENTITY(char *paramstr[]);
-static void CSG_ExecBBOX(char *paramstr[]);
-static void CSG_ExecSTEPBBOX(char *paramstr[]);
-static void CSG_ExecAXIS(char *paramstr[]);
-static void CSG_ExecROTATE(char *paramstr[]);
-static void CSG_ExecROTATEAXIS(char *paramstr[]);
-static void CSG_ExecTRANSLATE(char *paramstr[]);
-static void CSG_ExecSCALE(char *paramstr[]);
-static void CSG_ExecSHEAR(char *paramstr[]);
-static void CSG_ExecPREROTATE(char *paramstr[]);
-static void CSG_ExecPREROTATEAXIS(char *paramstr[]);
-static void CSG_ExecPRETRANSLATE(char *paramstr[]);
-static void CSG_ExecPRESCALE(char *paramstr[]);
-static void CSG_ExecPRESHEAR(char *paramstr[]);
+static void CSG_ExecPUSHCOORDS(instr_t *instr);
+static void CSG_ExecPOPCOORDS(instr_t *instr);
+static void CSG_ExecMATRIX(instr_t *instr);
+static void CSG_ExecIDENTITY(instr_t *instr);
+static void CSG_ExecBBOX(instr_t *instr);
+static void CSG_ExecSTEPBBOX(instr_t *instr);
+static void CSG_ExecAXIS(instr_t *instr);
+static void CSG_ExecROTATE(instr_t *instr);
+static void CSG_ExecROTATEAXIS(instr_t *instr);
+static void CSG_ExecTRANSLATE(instr_t *instr);
+static void CSG_ExecSCALE(instr_t *instr);
+static void CSG_ExecSHEAR(instr_t *instr);
+static void CSG_ExecPREROTATE(instr_t *instr);
+static void CSG_ExecPREROTATEAXIS(instr_t *instr);
+static void CSG_ExecPRETRANSLATE(instr_t *instr);
+static void CSG_ExecPRESCALE(instr_t *instr);
+static void CSG_ExecPRESHEAR(instr_t *instr);
 //
-static void CSG_ExecSHAPE(char *paramstr[]);
-static void CSG_ExecSPIRALSTAIR1(char *paramstr[]);
-static void CSG_ExecREGULARPOLY1(char *paramstr[]);
-static void CSG_ExecFREESHAPE(char *paramstr[]);
+static void CSG_ExecSHAPE(instr_t *instr);
+static void CSG_ExecSPIRALSTAIR1(instr_t *instr);
+static void CSG_ExecREGULARPOLY1(instr_t *instr);
+static void CSG_ExecFREESHAPE(instr_t *instr);
 //
-static void CSG_ExecDEPTH(char *paramstr[]);
-static void CSG_ExecCSGADD(char *paramstr[]);
-static void CSG_ExecCSGSUB(char *paramstr[]);
+static void CSG_ExecDEPTH(instr_t *instr);
+static void CSG_ExecCSGADD(instr_t *instr);
+static void CSG_ExecCSGSUB(instr_t *instr);
+static void CSG_ExecTHREADS(instr_t *instr);
 //
-static void CSG_ExecLOOP(char *paramstr[]);
-static void CSG_ExecENDLOOP(char *paramstr[]);
+static void CSG_ExecLOOP(instr_t *instr);
+static void CSG_ExecENDLOOP(instr_t *instr);
 
-typedef void vf_t(char *paramstr[]);
+typedef void vf_t(instr_t *instr);
 struct command_t
 {
 	char  name[24];
@@ -251,6 +301,7 @@ static command_t CSG_COMMAND_LIST[] = {
 	{"depth",         2,  1, CSG_COMMAND_DEPTH,         CSG_ExecDEPTH},
 	{"csgadd",        4,  0, CSG_COMMAND_CSGADD,        CSG_ExecCSGADD},
 	{"csgsub",        4,  0, CSG_COMMAND_CSGSUB,        CSG_ExecCSGSUB},
+	{"threads",       2,  1, CSG_COMMAND_THREADS,       CSG_ExecTHREADS},
 	//
 	{"loop",          2,  1, CSG_COMMAND_LOOP,          CSG_ExecLOOP},
 	{"endloop",       1,  0, CSG_COMMAND_ENDLOOP,       CSG_ExecENDLOOP},
@@ -266,6 +317,7 @@ static command_t CSG_COMMAND_LIST[] = {
 #define CSG_MAX_RECURS_DEPTH   10
 #define CSG_MAX_COMMAND_PARAMS 4
 #define CSG_MAX_ARRAY_SIZE     200 // allows for 100-sided polygons
+#define CSG_MAX_CHECKPOINTS    8   // copies of the world kept by _CSG_AddHull
 
 static coords_t CSG_COORDS_STACK[CSG_MAX_COORDS_DEPTH];
 static int      CSG_COORDS_DEPTH;
@@ -273,17 +325,47 @@ static recurs_t CSG_RECURS_STACK[CSG_MAX_RECURS_DEPTH];
 static int      CSG_RECURS_DEPTH;
 static int      CSG_CURRENT_DEPTH;
 static shape_t *CSG_CURRENT_SHAPE;
-static FILE    *CSG_CURRENT_FILE;
+static script_t *CSG_SCRIPT_LIST;
+static int      CSG_SCRIPT_RUN;   // counts top-level CSG_RunScript calls
+static int      CSG_SCRIPT_DEPTH; // nesting of CSG_RunScript calls
+static int      CSG_JUMP; // pending jump, or -1
 static shape_t *CSG_SHAPE_LIST;
 static event_t *CSG_EVENT_LIST;
 static hull_t  *CSG_WORLD; // shadow variable
 static int      CSG_SHAPE_ID; // unique id
 static int      CSG_REVERSE_ORDER = 0; // internal flag
 
+// Hulls made by CSGADD, waiting for _CSG_AddHull. HASH
+// covers the hull and every one before it in the list.
+struct _hull_entry_t{ hull_t *hull; int depth; unsigned long hash; };
+static _hull_entry_t *_HULL_LIST  = NULL;
+static int            _HULL_COUNT = 0;
+static int            _HULL_MAX   = 0;
+static int            _HULL_NEXT  = 0; // number already added to the world
+
+struct checkpoint_t
+{
+	int     index; // _HULL_NEXT when the copy was taken
+	hull_t *world; // copy of the world
+};
+static checkpoint_t CSG_CHECKPOINT[CSG_MAX_CHECKPOINTS];
+static int          CSG_CHECKPOINT_COUNT = 0;
+static int          CSG_CHECKPOINT_STEP  = 1;
+static int          CSG_CHECKPOINT_ALL   = 0; // set by the first reload
+
 static int      CSG_ParseTag(char *str);
 static double   CSG_ParseScalarValue(char *str);
-static int      CSG_ParseScalarArray(char *str, double *array);
 static char    *CSG_ParseParamString(char **str, char markers[3]);
+static script_t *CSG_CompileScript(char *fname);
+static instr_t *CSG_CompileInstr(script_t *script, command_t *command, int line);
+static void     CSG_CompileName(instr_t *instr, char *str);
+static void     CSG_CompileArray(instr_t *instr, char *str);
+static void     CSG_FreeCode(script_t *script);
+static void     CSG_ResetModeler(void);
+static void     CSG_ClearResults(void);
+static void     CSG_Checkpoint(void);
+static unsigned long CSG_HashBytes(unsigned long hash, void *data, int size);
+static unsigned long CSG_HashHull(unsigned long hash, hull_t *hull, int depth);
 static shape_t *CSG_FindShape(char name[], int create);
 static void     CSG_FreeShape(shape_t *shape);
 static event_t *CSG_Event(int type, shape_t *shape);
@@ -301,19 +383,43 @@ void CSG_InitializeModeler(hull_t *world)
 	// *********************************************
 	// Allocates a new coordinate stack and sets the
 	// stack depth to zero. Clears all shapes and
-	// brushes.
+	// brushes, and any results cached for the last
+	// world. Compiled scripts are kept.
 	// *********************************************
 	
-	CSG_COORDS_DEPTH  = 2;
-	CSG_RECURS_DEPTH  = 0;
-	CSG_CURRENT_DEPTH = 0;
-	CSG_CURRENT_SHAPE = NULL;
-	CSG_CURRENT_FILE  = NULL;
+	CSG_ClearResults();
+	
 	CSG_SHAPE_LIST    = NULL; // dynamic pool
 	CSG_EVENT_LIST    = NULL; // dynamic pool
 	CSG_WORLD         = world;
 	CSG_SHAPE_ID      = 0;
 	
+	CSG_ResetModeler();
+	CSG_POPNAME_;
+}
+
+static void CSG_ResetModeler(void)
+{
+	CSG_PUSHNAME("ResetModeler");
+	
+	// *************************************************
+	// Resets the coordinate stack and the other state a
+	// script starts from. Shapes are left alone, since
+	// hulls in the world point to them.
+	// *************************************************
+	
+	while(CSG_EVENT_LIST)
+	{
+		event_t *next = CSG_EVENT_LIST->next;
+		CSG_FreeMem(CSG_EVENT_LIST);
+		CSG_EVENT_LIST = next;
+	}
+	CSG_COORDS_DEPTH  = 2;
+	CSG_RECURS_DEPTH  = 0;
+	CSG_CURRENT_DEPTH = 0;
+	CSG_CURRENT_SHAPE = NULL;
+	CSG_JUMP          = -1;
+	
 	// ********************************
 	// Initialize two coordinate frames
 	// ********************************
@@ -355,6 +461,27 @@ int CSG_GetMemInUse_Modeler(void)
 	{
 		mem += sizeof(event_t);
 	}
+	for(script_t *sc = CSG_SCRIPT_LIST; sc; sc = sc->next)
+	{
+		mem += sizeof(script_t);
+		mem += sizeof(instr_t) * sc->max;
+		
+		for(int i = 0; i < sc->count; i++)
+		{
+			mem += (sizeof(double) + sizeof(int)) * sc->code[i].count;
+			if(sc->code[i].name) mem += strlen(sc->code[i].name) + 1;
+		}
+	}
+	mem += sizeof(_hull_entry_t) * _HULL_MAX;
+	
+	for(int i = 0; i < _HULL_COUNT; i++)
+	{
+		mem += CSG_GetMemInUse(_HULL_LIST[i].hull); // kept for reloads
+	}
+	for(int i = 0; i < CSG_CHECKPOINT_COUNT; i++)
+	{
+		mem += CSG_GetMemInUse(CSG_CHECKPOINT[i].world);
+	}
 	CSG_POPNAME(mem);
 }
 
@@ -362,29 +489,137 @@ void CSG_RunScript(char *fname)
 {
 	CSG_PUSHNAME("RunScript");
 	
-	// ***********************************************
-	// Opens a file and parses the contents, executing
-	// commands as specified.
-	// ***********************************************
+	// ************************************************
+	// Runs a script, compiling it first if it has not
+	// been run before or has changed since it was.
+	// ************************************************
 	
-	char linebuf[4001];
-	int brk = 0;
+	if(CSG_SCRIPT_DEPTH == 0)
+	{
+		CSG_SCRIPT_RUN++; // nested runs don't look at the files again
+	}
+	script_t *script = CSG_CompileScript(fname);
+	
+	if(!script)
+	{
+		CSG_POPNAME_; // safe
+	}
+	CSG_SCRIPT_DEPTH++;
+	CSG_JUMP = -1;
+	
+	for(int pc = 0; pc < script->count;)
+	{
+		instr_t *instr = &script->code[pc++];
+		
+		if(instr->command->index == CSG_COMMAND_RETURN) break;
+		
+		instr->command->func(instr);
+		
+		if(CSG_JUMP >= 0 && (pc == script->count || script->code[pc].line != instr->line))
+		{
+			pc = CSG_JUMP;
+			CSG_JUMP = -1;
+		}
+	}
+	CSG_SCRIPT_DEPTH--;
+	CSG_POPNAME_;
+}
+
+static script_t *CSG_CompileScript(char *fname)
+{
+	CSG_PUSHNAME("CompileScript");
+	
+	// ************************************************
+	// Returns the compiled form of a script, compiling
+	// it only if it has not been compiled before or its
+	// text has changed since. Returns NULL if the file
+	// can't be opened.
+	// 
+	// A script is checked once per top-level run, so a
+	// RUNSCRIPT in a loop costs nothing more. The check
+	// compares the file's size and time first, and only
+	// reads and hashes the text if they have changed, or
+	// if the time is no older than the last check: the
+	// time only changes once a second, so it won't show
+	// an edit made in the same second as that check.
+	// ************************************************
+	
+	script_t *script;
+	struct stat st;
+	
+	for(script = CSG_SCRIPT_LIST; script; script = script->next)
+	{
+		if(!strcmp(script->fname, fname)) break;
+	}
+	if(script && script->run == CSG_SCRIPT_RUN)
+	{
+		CSG_POPNAME(script);
+	}
+	if(stat(fname, &st) != 0)
+	{
+		CSG_POPNAME(NULL);
+	}
+	if(script && script->fsize == (long)st.st_size &&
+	   script->mtime == st.st_mtime && script->mtime < script->checked)
+	{
+		script->run = CSG_SCRIPT_RUN;
+		CSG_POPNAME(script);
+	}
 	FILE *fp = fopen(fname, "r");
 	
 	if(!fp)
 	{
-		CSG_POPNAME_; // safe
+		CSG_POPNAME(NULL);
+	}
+	time_t checked = time(NULL); // before reading, so later edits count
+	unsigned long hash = 2166136261UL;
+	long size = 0;
+	int c;
+	
+	while((c = fgetc(fp)) != EOF)
+	{
+		hash = (hash ^ (unsigned char)c) * 16777619UL;
+		size++;
+	}
+	if(script && script->size == size && script->hash == hash)
+	{
+		fclose(fp);
+		script->fsize   = (long)st.st_size;
+		script->mtime   = st.st_mtime;
+		script->checked = checked;
+		script->run     = CSG_SCRIPT_RUN;
+		CSG_POPNAME(script);
+	}
+	rewind(fp);
+	
+	char linebuf[4001];
+	int brk = 0, line = 0, i;
+	
+	if(!script)
+	{
+		script = (script_t*)CSG_AllocMem(sizeof(script_t), 1);
+		strncpy(script->fname, fname, 255);
+		script->next    = CSG_SCRIPT_LIST;
+		CSG_SCRIPT_LIST = script;
 	}
-	CSG_CURRENT_FILE = fp;
+	else CSG_FreeCode(script);
+	
+	script->size    = size;
+	script->hash    = hash;
+	script->fsize   = (long)st.st_size;
+	script->mtime   = st.st_mtime;
+	script->checked = checked;
+	script->run     = CSG_SCRIPT_RUN;
 	
 	while(!brk && fgets(linebuf, 4000, fp))
 	{
 		char *s1 = linebuf;
 		
+		line++;
+		
 		while(!brk)
 		{
 			char *cmdstr = strtok_r(s1, " =\t\n\r", &s1);
-			int i;
 			
 			if(!cmdstr) break; // no more commands
 			if(cmdstr[0] == '/' &&
@@ -409,43 +644,142 @@ void CSG_RunScript(char *fname)
 				if(!strcmp(cmdstr, command->name)) break;
 				CSG_ASSERT(command->index >= 0, "unknown command");
 			}
-			// ***************
-			// Find parameters
-			// ***************
+			// ****************
+			// Parse parameters
+			// ****************
 			
-			char *paramstr[CSG_MAX_COMMAND_PARAMS];
+			instr_t *instr = CSG_CompileInstr(script, command, line);
 			
 			switch(command->format)
 			{
 				case CSG_COMMAND_FORMAT1: break;
 				case CSG_COMMAND_FORMAT2:
-					paramstr[0] = strtok_r(s1, " =:\t\n\r", &s1);
-					paramstr[1] = NULL;
+					CSG_CompileArray(instr, strtok_r(s1, " =:\t\n\r", &s1));
 					break;
 				case CSG_COMMAND_FORMAT3:
-					paramstr[0] = CSG_ParseParamString(&s1, "[]");
-					paramstr[1] = NULL;
+					CSG_CompileArray(instr, CSG_ParseParamString(&s1, "[]"));
 					break;
 				case CSG_COMMAND_FORMAT4:
-					paramstr[0] = CSG_ParseParamString(&s1, "\"\"*");
-					paramstr[1] = NULL;
+					CSG_CompileName(instr, CSG_ParseParamString(&s1, "\"\"*"));
 					break;
 				case CSG_COMMAND_FORMAT5:
-					paramstr[0] = CSG_ParseParamString(&s1, "\"\"*");
-					paramstr[1] = CSG_ParseParamString(&s1, "[]");
+					CSG_CompileName(instr, CSG_ParseParamString(&s1, "\"\"*"));
+					CSG_CompileArray(instr, CSG_ParseParamString(&s1, "[]"));
 					break;
 				default:
 					CSG_ASSERT(0, "unknown command format");
 			}
-			// ***************
-			// Execute command
-			// ***************
-			
 			if(command->index == CSG_COMMAND_RETURN) brk = 1;
-			command->func(paramstr);
 		}
 	}
 	fclose(fp);
+	
+	// *******************************************
+	// A loop restarts at the line after its LOOP
+	// *******************************************
+	
+	for(i = 0; i < script->count; i++)
+	{
+		if(script->code[i].command->index != CSG_COMMAND_LOOP) continue;
+		
+		int j = i+1;
+		
+		while(j < script->count && script->code[j].line == script->code[i].line) j++;
+		
+		script->code[i].jump = j;
+	}
+	CSG_POPNAME(script);
+}
+
+static instr_t *CSG_CompileInstr(script_t *script, command_t *command, int line)
+{
+	CSG_PUSHNAME("CompileInstr");
+	
+	if(script->count == script->max)
+	{
+		int max = script->max ? script->max*2 : 64;
+		instr_t *code = (instr_t*)CSG_AllocMem(sizeof(instr_t), max);
+		
+		if(script->code)
+		{
+			memcpy(code, script->code, sizeof(instr_t) * script->count);
+			CSG_FreeMem(script->code);
+		}
+		script->code = code;
+		script->max  = max;
+	}
+	instr_t *instr = &script->code[script->count++];
+	
+	instr->command = command;
+	instr->line    = line;
+	CSG_POPNAME(instr);
+}
+
+static void CSG_CompileName(instr_t *instr, char *str)
+{
+	CSG_PUSHNAME("CompileName");
+	
+	if(str)
+	{
+		instr->name = (char*)CSG_AllocMem(strlen(str) + 1, 1);
+		strcpy(instr->name, str);
+	}
+	CSG_POPNAME_;
+}
+
+static void CSG_CompileArray(instr_t *instr, char *str)
+{
+	CSG_PUSHNAME("CompileArray");
+	
+	// ***********************************************
+	// Parses a list of operands, keeping each as both
+	// a scalar value and a tag, since some commands
+	// (ROTATE, STEPBBOX) take a mix of the two.
+	// ***********************************************
+	
+	CSG_ASSERT(str, "parse error");
+	
+	double value[CSG_MAX_ARRAY_SIZE];
+	int    tag[CSG_MAX_ARRAY_SIZE];
+	
+	char *s1 = str;
+	char *s2 = strtok_r(s1, " ,:()[]{}\t\n\r", &s1);
+	int k = 0;
+	
+	while(s2)
+	{
+		CSG_ASSERT(k < CSG_MAX_ARRAY_SIZE, "array too big");
+		value[k] = CSG_ParseScalarValue(s2);
+		tag[k++] = CSG_ParseTag(s2);
+		s2 = strtok_r(s1, " ,:()[]{}\t\n\r", &s1);
+	}
+	instr->count = k;
+	
+	if(k > 0)
+	{
+		instr->value = (double*)CSG_AllocMem(sizeof(double), k);
+		instr->tag   = (int   *)CSG_AllocMem(sizeof(int),    k);
+		memcpy(instr->value, value, sizeof(double) * k);
+		memcpy(instr->tag,   tag,   sizeof(int)    * k);
+	}
+	CSG_POPNAME_;
+}
+
+static void CSG_FreeCode(script_t *script)
+{
+	CSG_PUSHNAME("FreeCode");
+	
+	for(int i = 0; i < script->count; i++)
+	{
+		CSG_FreeMem(script->code[i].name);
+		CSG_FreeMem(script->code[i].value);
+		CSG_FreeMem(script->code[i].tag);
+	}
+	CSG_FreeMem(script->code);
+	
+	script->code  = NULL;
+	script->count = 0;
+	script->max   = 0;
 	CSG_POPNAME_;
 }
 
@@ -501,24 +835,6 @@ static double CSG_ParseScalarValue(char *str)
 	CSG_POPNAME(atof(str));
 }
 
-static int CSG_ParseScalarArray(char *str, double *array)
-{
-	CSG_PUSHNAME("ParseScalarArray");
-	CSG_ASSERT(str, "parse error");
-	
-	char *s1 = str;
-	char *s2 = strtok_r(s1, " ,:(){}\t\n\r", &s1);
-	int k = 0;
-	
-	while(s2)
-	{
-		CSG_ASSERT(k < CSG_MAX_ARRAY_SIZE, "array too big");
-		array[k++] = CSG_ParseScalarValue(s2);
-		s2 = strtok_r(s1, " ,:(){}\t\n\r", &s1);
-	}
-	CSG_POPNAME(k);
-}
-
 static char *CSG_ParseParamString(char **str, char markers[3])
 {
 	CSG_PUSHNAME("ParseParamString");
@@ -777,13 +1093,13 @@ static hull_t *CSG_Extrude(shape_t *shape)
 	CSG_POPNAME(hull);
 }
 
-static void CSG_ExecNOP(char *paramstr[])
+static void CSG_ExecNOP(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecNOP");
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecRUNSCRIPT(char *paramstr[])
+static void CSG_ExecRUNSCRIPT(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecRUNSCRIPT");
 	
@@ -791,13 +1107,13 @@ static void CSG_ExecRUNSCRIPT(char *paramstr[])
 	// Run a new script
 	// ****************
 	
-	FILE *save = CSG_CURRENT_FILE;
-	CSG_RunScript(paramstr[0]);
-	CSG_CURRENT_FILE = save;
+	int save = CSG_JUMP;
+	CSG_RunScript(instr->name);
+	CSG_JUMP = save;
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecPUSHCOORDS(char *paramstr[])
+static void CSG_ExecPUSHCOORDS(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecPUSHCOORDS");
 	
@@ -828,7 +1144,7 @@ static void CSG_ExecPUSHCOORDS(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecPOPCOORDS(char *paramstr[])
+static void CSG_ExecPOPCOORDS(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecPOPCOORDS");
 	
@@ -843,20 +1159,20 @@ static void CSG_ExecPOPCOORDS(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecMATRIX(char *paramstr[])
+static void CSG_ExecMATRIX(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecMATRIX");
 	
 	coords_t *coords = &CSG_COORDS_STACK[CSG_COORDS_DEPTH-1];
-	double tmp[CSG_MAX_ARRAY_SIZE];	
-	int count = CSG_ParseScalarArray(paramstr[0], tmp);
+	double *tmp = instr->value;
+	int count = instr->count;
 	CSG_ASSERT(count == 16, "incorrect array size");
 	memcpy(&coords->local, tmp, sizeof(mat4));
 	CSG_Update(coords);
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecIDENTITY(char *paramstr[])
+static void CSG_ExecIDENTITY(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecIDENTITY");
 	
@@ -866,7 +1182,7 @@ static void CSG_ExecIDENTITY(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecBBOX(char *paramstr[])
+static void CSG_ExecBBOX(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecBBOX");
 	
@@ -877,8 +1193,8 @@ static void CSG_ExecBBOX(char *paramstr[])
 	// *************************************************
 	
 	coords_t *coords = &CSG_COORDS_STACK[CSG_COORDS_DEPTH-1];
-	double tmp[CSG_MAX_ARRAY_SIZE];
-	int count = CSG_ParseScalarArray(paramstr[0], tmp);
+	double *tmp = instr->value;
+	int count = instr->count;
 	CSG_ASSERT(count == 6, "incorrect array size");
 	CSG_ASSERT(tmp[0] < tmp[3], "invalid coordinates");
 	CSG_ASSERT(tmp[1] < tmp[4], "invalid coordinates");
@@ -889,24 +1205,18 @@ static void CSG_ExecBBOX(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecSTEPBBOX(char *paramstr[])
+static void CSG_ExecSTEPBBOX(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecSTEPBBOX");
 	
-	char *s1 = paramstr[0];
-	char *s2 = strtok_r(s1, " ,:[]{}\t\n\r", &s1);
-	
 	coords_t *coords = &CSG_COORDS_STACK[CSG_COORDS_DEPTH-1];
 	
-	while(s2)
+	CSG_ASSERT(!(instr->count & 1), "parse error");
+	
+	for(int i = 0; i < instr->count; i += 2)
 	{
-		int    side;
-		double delta;
-		
-		side = CSG_ParseTag(s2);
-		s2 = strtok_r(s1, " ,:[]{}\t\n\r", &s1);
-		delta = CSG_ParseScalarValue(s2);
-		s2 = strtok_r(s1, " ,:[]{}\t\n\r", &s1);
+		int    side  = instr->tag[i];
+		double delta = instr->value[i+1];
 		
 		switch(side)
 		{
@@ -923,7 +1233,7 @@ static void CSG_ExecSTEPBBOX(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecAXIS(char *paramstr[])
+static void CSG_ExecAXIS(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecAXIS");
 	
@@ -932,7 +1242,9 @@ static void CSG_ExecAXIS(char *paramstr[])
 	coords->axis.zero();
 	coords->axis.w.w = 1.0;
 	
-	switch(CSG_ParseTag(paramstr[0]))
+	CSG_ASSERT(instr->count == 1, "parse error");
+	
+	switch(instr->tag[0])
 	{
 		case CSG_TAG_X:
 			coords->axis.x.z = -1.0;
@@ -956,26 +1268,20 @@ static void CSG_ExecAXIS(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecROTATE(char *paramstr[])
+static void CSG_ExecROTATE(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecROTATE");
 	
 	coords_t *coords = &CSG_COORDS_STACK[CSG_COORDS_DEPTH-1];
 	
-	char *s1 = paramstr[0];
-	char *s2 = strtok_r(s1, " ,:[]{}\t\n\r", &s1);
-	
 	mat4 m; m.identity();
 	
-	while(s2)
+	CSG_ASSERT(!(instr->count & 1), "parse error");
+	
+	for(int i = 0; i < instr->count; i += 2)
 	{
-		int    axis;
-		double theta;
-		
-		axis = CSG_ParseTag(s2);
-		s2 = strtok_r(s1, " ,:[]{}\t\n\r", &s1);
-		theta = CSG_ParseScalarValue(s2);
-		s2 = strtok_r(s1, " ,:[]{}\t\n\r", &s1);
+		int    axis  = instr->tag[i];
+		double theta = instr->value[i+1];
 		
 		// **********************************************************
 		// NOTE: Successive rotations can introduce floating-point
@@ -1011,19 +1317,19 @@ static void CSG_ExecROTATE(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecROTATEAXIS(char *paramstr[])
+static void CSG_ExecROTATEAXIS(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecROTATEAXIS");
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecTRANSLATE(char *paramstr[])
+static void CSG_ExecTRANSLATE(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecTRANSLATE");
 	
 	coords_t *coords = &CSG_COORDS_STACK[CSG_COORDS_DEPTH-1];
-	double tmp[CSG_MAX_ARRAY_SIZE];
-	int count = CSG_ParseScalarArray(paramstr[0], tmp);
+	double *tmp = instr->value;
+	int count = instr->count;
 	CSG_ASSERT(count == 3, "incorrect array size");
 	
 	mat4 m(1.0, 0.0, 0.0, tmp[0],
@@ -1038,13 +1344,13 @@ static void CSG_ExecTRANSLATE(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecSCALE(char *paramstr[])
+static void CSG_ExecSCALE(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecSCALE");
 	
 	coords_t *coords = &CSG_COORDS_STACK[CSG_COORDS_DEPTH-1];
-	double tmp[CSG_MAX_ARRAY_SIZE];
-	int count = CSG_ParseScalarArray(paramstr[0], tmp);
+	double *tmp = instr->value;
+	int count = instr->count;
 	CSG_ASSERT(count == 3, "incorrect array size");
 	
 	mat4 m(tmp[0], 0.0,    0.0,    0.0,
@@ -1059,49 +1365,49 @@ static void CSG_ExecSCALE(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecSHEAR(char *paramstr[])
+static void CSG_ExecSHEAR(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecSHEAR");
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecPREROTATE(char *paramstr[])
+static void CSG_ExecPREROTATE(instr_t *instr)
 {
 	CSG_REVERSE_ORDER = 1;
-	CSG_ExecROTATE(paramstr);
+	CSG_ExecROTATE(instr);
 }
 
-static void CSG_ExecPREROTATEAXIS(char *paramstr[])
+static void CSG_ExecPREROTATEAXIS(instr_t *instr)
 {
 	CSG_REVERSE_ORDER = 1;
-	CSG_ExecROTATEAXIS(paramstr);
+	CSG_ExecROTATEAXIS(instr);
 }
 
-static void CSG_ExecPRETRANSLATE(char *paramstr[])
+static void CSG_ExecPRETRANSLATE(instr_t *instr)
 {
 	CSG_REVERSE_ORDER = 1;
-	CSG_ExecTRANSLATE(paramstr);
+	CSG_ExecTRANSLATE(instr);
 }
 
-static void CSG_ExecPRESCALE(char *paramstr[])
+static void CSG_ExecPRESCALE(instr_t *instr)
 {
 	CSG_REVERSE_ORDER = 1;
-	CSG_ExecSCALE(paramstr);
+	CSG_ExecSCALE(instr);
 }
 
-static void CSG_ExecPRESHEAR(char *paramstr[])
+static void CSG_ExecPRESHEAR(instr_t *instr)
 {
 	CSG_REVERSE_ORDER = 1;
-	CSG_ExecSHEAR(paramstr);
+	CSG_ExecSHEAR(instr);
 }
 
-static void CSG_ExecSHAPE(char *paramstr[])
+static void CSG_ExecSHAPE(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecSHAPE");
 	
-	shape_t *sh = CSG_FindShape(paramstr[0], 1);
-	double tmp[CSG_MAX_ARRAY_SIZE];
-	int count = CSG_ParseScalarArray(paramstr[1], tmp);
+	shape_t *sh = CSG_FindShape(instr->name, 1);
+	double *tmp = instr->value;
+	int count = instr->count;
 	sh->type = CSG_SHAPETYPE_POLYGON;
 	sh->vertcount = count/2;
 	CSG_ASSERT(sh->vertcount >= 3, "too few vertices");
@@ -1127,16 +1433,16 @@ static void CSG_ExecSHAPE(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecSPIRALSTAIR1(char *paramstr[])
+static void CSG_ExecSPIRALSTAIR1(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecSPIRALSTAIR1");
 	
 	// THETA0, THETASTEP, INNERRADIUS, OUTERPOINTS
 	// Useful for making spiral staircases
 	
-	shape_t *sh = CSG_FindShape(paramstr[0], 1);
-	double tmp[CSG_MAX_ARRAY_SIZE];
-	int count = CSG_ParseScalarArray(paramstr[1], tmp);
+	shape_t *sh = CSG_FindShape(instr->name, 1);
+	double *tmp = instr->value;
+	int count = instr->count;
 	CSG_ASSERT(count == 4, "incorrect array size");
 	CSG_ASSERT(tmp[3] == floor(tmp[3]), "integer required");
 	CSG_ASSERT(tmp[3] >= 2.0, "too few outer points");
@@ -1168,15 +1474,15 @@ static void CSG_ExecSPIRALSTAIR1(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecREGULARPOLY1(char *paramstr[])
+static void CSG_ExecREGULARPOLY1(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecREGULARPOLY1");
 	
 	// THETA0, THETASTEP, NPOINTS
 	
-	shape_t *sh = CSG_FindShape(paramstr[0], 1);
-	double tmp[CSG_MAX_ARRAY_SIZE];
-	int count = CSG_ParseScalarArray(paramstr[1], tmp);
+	shape_t *sh = CSG_FindShape(instr->name, 1);
+	double *tmp = instr->value;
+	int count = instr->count;
 	CSG_ASSERT(count == 3, "incorrect array size");
 	CSG_ASSERT(tmp[2] == floor(tmp[2]), "integer required");
 	sh->vertcount = (int)tmp[2];
@@ -1197,16 +1503,16 @@ static void CSG_ExecREGULARPOLY1(char *paramstr[])
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecFREESHAPE(char *paramstr[])
+static void CSG_ExecFREESHAPE(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecFREESHAPE");
 	
-	shape_t *sh = CSG_FindShape(paramstr[0], 0);
+	shape_t *sh = CSG_FindShape(instr->name, 0);
 	CSG_FreeShape(sh);
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecDEPTH(char *paramstr[])
+static void CSG_ExecDEPTH(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecDEPTH");
 	
@@ -1214,33 +1520,216 @@ static void CSG_ExecDEPTH(char *paramstr[])
 	// Set current depth for HCSG operations
 	// *************************************
 	
-	double val = CSG_ParseScalarValue(paramstr[0]);
+	CSG_ASSERT(instr->count == 1, "parse error");
+	
+	double val = instr->value[0];
 	
 	CSG_ASSERT(val == floor(val), "depth must be integer");
 	CSG_CURRENT_DEPTH = (int)val;
 	CSG_POPNAME_;
 }
 
-struct _hull_entry_t{ hull_t *hull; int depth; };
-static _hull_entry_t _HULL_LIST[1000];
-static int           _HULL_COUNT = 0;
+static void CSG_ExecTHREADS(instr_t *instr)
+{
+	CSG_PUSHNAME("ExecTHREADS");
+	
+	// ***********************************************
+	// Set thread count for HCSG operations (0 = one
+	// per processor). This does not change the result.
+	// ***********************************************
+	
+	CSG_ASSERT(instr->count == 1, "parse error");
+	
+	double val = instr->value[0];
+	
+	CSG_ASSERT(val == floor(val), "thread count must be integer");
+	CSG_SetThreadCount((int)val);
+	CSG_POPNAME_;
+}
 
 int _CSG_AddHull(void)
 {
-	static int count = 0;
-	if(count >= _HULL_COUNT) return 1; // finished
+	if(_HULL_NEXT >= _HULL_COUNT) return 1; // finished
+	if(_HULL_NEXT == 0 && CSG_CHECKPOINT_COUNT == 0)
+	{
+		CSG_Checkpoint(); // the empty world
+	}
 	CSG_BooleanOp(CSG_WORLD,
-		_HULL_LIST[count].hull,
-		_HULL_LIST[count].depth, CSG_ADD, 0);
-	count++;
+		_HULL_LIST[_HULL_NEXT].hull,
+		_HULL_LIST[_HULL_NEXT].depth, CSG_ADD, 0);
+	_HULL_NEXT++;
+	
+	if(CSG_CHECKPOINT_ALL && _HULL_NEXT % CSG_CHECKPOINT_STEP == 0)
+	{
+		CSG_Checkpoint();
+	}
 	return 0;
 }
 
-static void CSG_ExecCSGADD(char *paramstr[])
+static void CSG_Checkpoint(void)
+{
+	CSG_PUSHNAME("Checkpoint");
+	
+	// ****************************************************
+	// Keeps a copy of the world as it is after _HULL_NEXT
+	// hulls. When all CSG_MAX_CHECKPOINTS are used, every
+	// other one is dropped and the spacing doubles, so the
+	// copies stay spread over the whole script.
+	// ****************************************************
+	
+	if(CSG_CHECKPOINT_COUNT == CSG_MAX_CHECKPOINTS)
+	{
+		int i, n = 0;
+		
+		CSG_CHECKPOINT_STEP *= 2;
+		
+		for(i = 0; i < CSG_CHECKPOINT_COUNT; i++)
+		{
+			checkpoint_t *cp = &CSG_CHECKPOINT[i];
+			
+			if(cp->index % CSG_CHECKPOINT_STEP == 0) CSG_CHECKPOINT[n++] = *cp;
+			else CSG_Free(cp->world);
+		}
+		CSG_CHECKPOINT_COUNT = n;
+		
+		if(_HULL_NEXT % CSG_CHECKPOINT_STEP != 0)
+		{
+			CSG_POPNAME_;
+		}
+	}
+	checkpoint_t *cp = &CSG_CHECKPOINT[CSG_CHECKPOINT_COUNT++];
+	
+	cp->index = _HULL_NEXT;
+	cp->world = CSG_Alloc(NULL);
+	cp->world->depth = CSG_WORLD->depth;
+	CSG_Copy(cp->world, CSG_WORLD);
+	CSG_POPNAME_;
+}
+
+static unsigned long CSG_HashHull(unsigned long hash, hull_t *hull, int depth)
+{
+	// ************************************************
+	// FNV-1a over what a CSGADD depends on: the depth,
+	// the shape and the hull's vertices (its faces
+	// follow from them). Shapes last as long as the
+	// modeler, so the same shape keeps its pointer
+	// across reloads. Chained from the hash of the hull
+	// before.
+	// ************************************************
+	
+	vert_t *pool = CSG_GetVertPool();
+	
+	hash = CSG_HashBytes(hash, &depth, sizeof(int));
+	hash = CSG_HashBytes(hash, &hull->shape, sizeof(void*));
+	
+	for(int i = 0; i < hull->vertcount; i++)
+	{
+		hash = CSG_HashBytes(hash, &pool[hull->vref[i]], sizeof(vert_t));
+	}
+	return hash;
+}
+
+static unsigned long CSG_HashBytes(unsigned long hash, void *data, int size)
+{
+	unsigned char *bytes = (unsigned char*)data;
+	
+	for(int k = 0; k < size; k++)
+	{
+		hash = (hash ^ bytes[k]) * 16777619UL;
+	}
+	return hash;
+}
+
+static void CSG_ClearResults(void)
+{
+	CSG_PUSHNAME("ClearResults");
+	
+	// *********************************************
+	// Forgets the hull list and the world copies,
+	// for when the modeler is given a new world.
+	// *********************************************
+	
+	for(int i = 0; i < CSG_CHECKPOINT_COUNT; i++)
+	{
+		CSG_Free(CSG_CHECKPOINT[i].world);
+	}
+	CSG_CHECKPOINT_COUNT = 0;
+	CSG_CHECKPOINT_STEP  = 1;
+	
+	for(int j = 0; j < _HULL_COUNT; j++)
+	{
+		CSG_Free(_HULL_LIST[j].hull);
+	}
+	CSG_FreeMem(_HULL_LIST);
+	
+	_HULL_LIST  = NULL;
+	_HULL_COUNT = 0;
+	_HULL_MAX   = 0;
+	_HULL_NEXT  = 0;
+	CSG_POPNAME_;
+}
+
+void CSG_ReloadScript(char *fname)
+{
+	CSG_PUSHNAME("ReloadScript");
+	
+	// *****************************************************
+	// Runs a script again after it (or a script it runs)
+	// has been edited, without starting the world over.
+	// Each hull's hash covers it and every hull before it,
+	// so the hulls up to the first edited one are known to
+	// give the same world as last time. The world is wound
+	// back to the last copy taken within those, and
+	// _CSG_AddHull carries on from there as usual.
+	//
+	// Copies cost about as much as the build itself, so
+	// only the empty world is kept until the first reload.
+	// *****************************************************
+	
+	CSG_CHECKPOINT_ALL = 1;
+	
+	_hull_entry_t *list = _HULL_LIST;
+	int count = _HULL_COUNT;
+	int added = _HULL_NEXT;
+	int same  = 0;
+	
+	_HULL_LIST  = NULL;
+	_HULL_COUNT = 0;
+	_HULL_MAX   = 0;
+	
+	CSG_ResetModeler();
+	CSG_RunScript(fname);
+	
+	while(same < added && same < _HULL_COUNT && _HULL_LIST[same].hash == list[same].hash)
+	{
+		same++;
+	}
+	if(same < added)
+	{
+		while(CSG_CHECKPOINT[CSG_CHECKPOINT_COUNT-1].index > same)
+		{
+			CSG_Free(CSG_CHECKPOINT[--CSG_CHECKPOINT_COUNT].world);
+		}
+		checkpoint_t *cp = &CSG_CHECKPOINT[CSG_CHECKPOINT_COUNT-1];
+		
+		CSG_Copy(CSG_WORLD, cp->world);
+		added = cp->index;
+	}
+	_HULL_NEXT = added;
+	
+	for(int i = 0; i < count; i++)
+	{
+		CSG_Free(list[i].hull); // BooleanOp CSG_ADD clones hull
+	}
+	CSG_FreeMem(list);
+	CSG_POPNAME_;
+}
+
+static void CSG_ExecCSGADD(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecCSGADD");
 	
-	shape_t *shape = CSG_FindShape(paramstr[0], 0);
+	shape_t *shape = CSG_FindShape(instr->name, 0);
 	hull_t  *hull  = CSG_Extrude(shape);
 	
 	CSG_Event(CSG_ADD, shape);
@@ -1252,20 +1741,36 @@ static void CSG_ExecCSGADD(char *paramstr[])
 	// of hulls to add. This makes it easier to watch the b-rep
 	// updating in realtime, as we can do the hull addition in the
 	// main event loop.
-	_HULL_LIST[_HULL_COUNT].hull = hull;
+	if(_HULL_COUNT == _HULL_MAX)
+	{
+		int max = _HULL_MAX ? _HULL_MAX*2 : 256;
+		_hull_entry_t *list = (_hull_entry_t*)CSG_AllocMem(sizeof(_hull_entry_t), max);
+		
+		if(_HULL_LIST)
+		{
+			memcpy(list, _HULL_LIST, sizeof(_hull_entry_t) * _HULL_COUNT);
+			CSG_FreeMem(_HULL_LIST);
+		}
+		_HULL_LIST = list;
+		_HULL_MAX  = max;
+	}
+	unsigned long hash = _HULL_COUNT ? _HULL_LIST[_HULL_COUNT-1].hash : 2166136261UL;
+	
+	_HULL_LIST[_HULL_COUNT].hull  = hull;
 	_HULL_LIST[_HULL_COUNT].depth = CSG_CURRENT_DEPTH;
+	_HULL_LIST[_HULL_COUNT].hash  = CSG_HashHull(hash, hull, CSG_CURRENT_DEPTH);
 	_HULL_COUNT++;
 	// --RECENT CHANGE--
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecCSGSUB(char *paramstr[])
+static void CSG_ExecCSGSUB(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecCSGSUB");
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecLOOP(char *paramstr[])
+static void CSG_ExecLOOP(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecLOOP");
 	
@@ -1274,7 +1779,9 @@ static void CSG_ExecLOOP(char *paramstr[])
 	// line, otherwise the marker will be incorrectly set!
 	// ***************************************************
 	
-	double counter = CSG_ParseScalarValue(paramstr[0]);
+	CSG_ASSERT(instr->count == 1, "parse error");
+	
+	double counter = instr->value[0];
 	
 	CSG_ASSERT(CSG_RECURS_DEPTH < CSG_MAX_RECURS_DEPTH, "recursion overflow");
 	CSG_ASSERT(counter == floor(counter), "counter must be integer");
@@ -1282,11 +1789,11 @@ static void CSG_ExecLOOP(char *paramstr[])
 	
 	recurs_t *recurs = &CSG_RECURS_STACK[CSG_RECURS_DEPTH++];
 	recurs->counter  = (int)counter;
-	recurs->marker   = (int)ftell(CSG_CURRENT_FILE);
+	recurs->marker   = instr->jump;
 	CSG_POPNAME_;
 }
 
-static void CSG_ExecENDLOOP(char *paramstr[])
+static void CSG_ExecENDLOOP(instr_t *instr)
 {
 	CSG_PUSHNAME("ExecENDLOOP");
 	
@@ -1301,7 +1808,7 @@ static void CSG_ExecENDLOOP(char *paramstr[])
 	
 	if(--recurs->counter > 0)
 	{
-		fseek(CSG_CURRENT_FILE, recurs->marker, SEEK_SET);
+		CSG_JUMP = recurs->marker;
 	}
 	else
 	{
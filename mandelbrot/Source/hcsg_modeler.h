@@ -11,6 +11,7 @@
 void CSG_InitializeModeler(hull_t *world);
 int  CSG_GetMemInUse_Modeler(void);
 void CSG_RunScript(char fname[]);
+void CSG_ReloadScript(char fname[]);
 
 int _CSG_AddHull(void); // recent code
 
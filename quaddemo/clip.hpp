@@ -10,6 +10,7 @@
 namespace Clip {
 	enum Visibility { NO_CLIP, SOME_CLIP, NOT_VISIBLE };
 	Visibility	ComputeBoxVisibility(const float min[3], const float max[3]);
+	void	ComputeBoxVisibility4(const float min[3][4], const float max[3][4], Visibility result[4]);	// [axis][box]
 };
 
 
@@ -0,0 +1,534 @@
+// quadpager.cpp
+
+// Streams detail heightmap data into a quadsquare tree from a
+// memory-mapped file, a tile at a time, as the viewer moves around.
+
+// This code may be freely modified and redistributed.  I make no
+// warrantees about it; use at your own risk.  If you do incorporate
+// this code into a project, I'd appreciate a mention in the credits.
+
+
+// The heightmap file is a raw array of int16 samples, row-major, just
+// like the demdata files, but it can be much bigger than memory.  The
+// file is divided into square tiles, each one covering exactly one
+// quadsquare block at TileLevel.  The samples are additive detail, the
+// same as the data passed to AddHeightMap().
+//
+// When the viewer comes within LoadRadius of a tile, we make a detached
+// copy of the tile's original square (and its static descendants), and
+// hand it to a new thread.  The thread maps the rows of the file that
+// cover the tile, runs AddHeightMap() and StaticCullData() on the copy,
+// and exits.  Back on the main thread, Update() notices that the thread
+// is done and swaps the copy into the live tree.
+//
+// A tile is only started if the paged-in nodes, plus the pending tiles,
+// still fit in MaxNodes, guessing each tile at the size of the largest
+// one built so far.  To make room, tiles farther than EvictRadius are
+// swapped back out: a copy of the original subtree is put back, and the
+// detailed one is deleted.  If nothing is far enough away to evict,
+// loading stops until the viewer moves on.  The file mapping is only
+// held while a tile is being built, so address space use stays bounded
+// as well.
+//
+// The vertices along a tile's edges are shared with the neighboring
+// squares outside it, so whenever a tile is paged in or out, the seams
+// around it are stitched: a paged-in neighbor's heights win, and
+// otherwise the neighbor's block is rebuilt from its original subtree
+// and made to match the paged-in tiles around it.  That is why we keep
+// an untouched copy of every block we have stitched; new tiles are
+// built from it, so detail is never added twice along a seam.  The
+// corners of a tile belong to the squares above TileLevel and are never
+// changed, so all four tiles around a corner agree on it.
+
+
+#include <windows.h>
+
+#include <stdio.h>
+#include <math.h>
+#include "quadpager.hpp"
+
+
+enum {
+	TILE_UNLOADED = 0,
+	TILE_BUILDING,
+	TILE_RESIDENT,
+	TILE_FAILED,
+};
+
+
+struct quadpagetile {
+	int	State;
+	int	x, z;	// World coords of the block origin.
+
+	quadsquare*	Detail;	// Copy being built, or paged into the tree.
+	quadsquare*	Original;	// Untouched copy of the block, taken before we first changed it.
+	quadcornerdata	cd;	// Corner data for the block; Parent is NULL.
+	int	NodeCount;
+
+	// Used by the build thread.
+	HANDLE	Thread;
+	HANDLE	Mapping;
+	int	Granularity;
+	int	FirstRow, FirstColumn;
+	HeightMapInfo	hm;
+	float	ThresholdDetail;
+	bool	Failed;
+};
+
+
+static DWORD WINAPI	BuildTile(LPVOID param)
+// Thread function.  Adds the tile's heightmap data to its detached copy
+// and culls it.  Doesn't touch anything outside the tile struct, so it's
+// safe to run while the main thread updates and renders the tree.
+{
+	quadpagetile*	t = (quadpagetile*) param;
+
+	// Map the rows that cover the tile.  Views have to start on an
+	// allocation-granularity boundary.
+	unsigned __int64	start = (unsigned __int64) t->FirstRow * t->hm.RowWidth * sizeof(int16);
+	unsigned __int64	base = start - start % t->Granularity;
+	DWORD	length = DWORD(start - base) + t->hm.ZSize * t->hm.RowWidth * sizeof(int16);
+
+	char*	view = (char*) MapViewOfFile(t->Mapping, FILE_MAP_READ, DWORD(base >> 32), DWORD(base), length);
+	if (view == NULL) {
+		t->Failed = true;
+		return 1;
+	}
+
+	t->hm.Data = (int16*) (view + DWORD(start - base)) + t->FirstColumn;
+
+	t->Detail->AddHeightMap(t->cd, t->hm);
+	t->Detail->StaticCullData(t->cd, t->ThresholdDetail);
+
+	// Bring the error data up to date here, rather than on the main
+	// thread; ExchangeDescendant() relies on it.
+	if (t->Detail->Dirty) t->Detail->RecomputeErrorAndLighting(t->cd);
+
+	// Keep Update() from deleting the tile root once it's in the tree;
+	// we need to be able to find it again to evict it.
+	t->Detail->Static = true;
+	t->NodeCount = t->Detail->CountNodes();
+
+	UnmapViewOfFile(view);
+	t->hm.Data = NULL;
+
+	return 0;
+}
+
+
+quadpager::quadpager(quadsquare* root, const quadcornerdata& rootcd)
+// Constructor.  The pager feeds data into the given tree.
+{
+	Root = root;
+	RootCornerData = &rootcd;
+
+	LoadRadius = 8000;
+	EvictRadius = 16000;
+	MaxNodes = 200000;
+	MaxPending = 2;
+	ThresholdDetail = 25;
+
+	ResidentNodes = 0;
+	ResidentTiles = 0;
+
+	File = INVALID_HANDLE_VALUE;
+	Mapping = NULL;
+	Granularity = 65536;
+
+	Tile = NULL;
+	TileCountX = TileCountZ = 0;
+	Pending = 0;
+	MaxTileNodes = 0;
+}
+
+
+quadpager::~quadpager()
+// Destructor.
+{
+	Close();
+}
+
+
+bool	quadpager::Open(const char* filename, int XSize, int ZSize, int XOrigin, int ZOrigin, int Scale, int TileLevel)
+// Opens a raw int16 heightmap of XSize by ZSize samples, at (1 << Scale)
+// sample spacing, whose first sample is at (XOrigin, ZOrigin).  Each
+// tile covers one square at TileLevel, so the origin must be a multiple
+// of (2 << TileLevel).  Returns false on error.
+{
+	Close();
+
+	int	TileSize = 2 << TileLevel;
+	if (TileLevel >= RootCornerData->Level || TileSize >> Scale < 1 ||
+	    (XOrigin & (TileSize - 1)) || (ZOrigin & (TileSize - 1)))
+	{
+		printf("quadpager: bad tile parameters for %s\n", filename);
+		return false;
+	}
+
+	File = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (File == INVALID_HANDLE_VALUE) {
+		printf("quadpager: can't open %s\n", filename);
+		return false;
+	}
+
+	DWORD	SizeHigh = 0;
+	DWORD	SizeLow = GetFileSize(File, &SizeHigh);
+	unsigned __int64	FileSize = ((unsigned __int64) SizeHigh << 32) | SizeLow;
+	if (FileSize < (unsigned __int64) XSize * ZSize * sizeof(int16)) {
+		printf("quadpager: %s is too small for %d x %d samples\n", filename, XSize, ZSize);
+		Close();
+		return false;
+	}
+
+	Mapping = CreateFileMapping(File, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (Mapping == NULL) {
+		printf("quadpager: can't map %s\n", filename);
+		Close();
+		return false;
+	}
+
+	SYSTEM_INFO	si;
+	GetSystemInfo(&si);
+	Granularity = si.dwAllocationGranularity;
+
+	Map.Data = NULL;
+	Map.XOrigin = XOrigin;
+	Map.ZOrigin = ZOrigin;
+	Map.XSize = XSize;
+	Map.ZSize = ZSize;
+	Map.RowWidth = XSize;
+	Map.Scale = Scale;
+
+	this->TileLevel = TileLevel;
+	TileSamples = TileSize >> Scale;
+	TileCountX = (XSize - 1 + TileSamples - 1) / TileSamples;
+	TileCountZ = (ZSize - 1 + TileSamples - 1) / TileSamples;
+
+	Tile = new quadpagetile[TileCountX * TileCountZ];
+
+	int	i, j;
+	for (j = 0; j < TileCountZ; j++) {
+		for (i = 0; i < TileCountX; i++) {
+			quadpagetile*	t = &Tile[i + j * TileCountX];
+			t->State = TILE_UNLOADED;
+			t->x = XOrigin + i * TileSize;
+			t->z = ZOrigin + j * TileSize;
+			t->Detail = NULL;
+			t->Original = NULL;
+			t->NodeCount = 0;
+			t->Thread = NULL;
+			t->Mapping = Mapping;
+			t->Granularity = Granularity;
+			t->FirstColumn = i * TileSamples;
+			t->FirstRow = j * TileSamples;
+			t->Failed = false;
+
+			// Take one extra row & column past the far edge, so
+			// HeightMapInfo::Sample() can interpolate all the way to
+			// the shared border.  Both tiles then agree on the heights
+			// of the alias vertices along the seam.
+			t->hm.Data = NULL;
+			t->hm.XOrigin = t->x;
+			t->hm.ZOrigin = t->z;
+			t->hm.XSize = XSize - t->FirstColumn;
+			if (t->hm.XSize > TileSamples + 2) t->hm.XSize = TileSamples + 2;
+			t->hm.ZSize = ZSize - t->FirstRow;
+			if (t->hm.ZSize > TileSamples + 2) t->hm.ZSize = TileSamples + 2;
+			t->hm.RowWidth = XSize;
+			t->hm.Scale = Scale;
+		}
+	}
+
+	return true;
+}
+
+
+void	quadpager::Close()
+// Waits for pending builds and releases the file.  Tiles that are paged
+// in stay in the tree.
+{
+	if (Tile) {
+		int	count = TileCountX * TileCountZ;
+		for (int i = 0; i < count; i++) {
+			quadpagetile*	t = &Tile[i];
+			if (t->State == TILE_BUILDING) {
+				WaitForSingleObject(t->Thread, INFINITE);
+				CloseHandle(t->Thread);
+				delete t->Detail;
+			}
+			delete t->Original;
+		}
+		delete [] Tile;
+		Tile = NULL;
+	}
+	TileCountX = TileCountZ = 0;
+	Pending = 0;
+	MaxTileNodes = 0;
+	ResidentNodes = 0;
+	ResidentTiles = 0;
+
+	if (Mapping) {
+		CloseHandle(Mapping);
+		Mapping = NULL;
+	}
+	if (File != INVALID_HANDLE_VALUE) {
+		CloseHandle(File);
+		File = INVALID_HANDLE_VALUE;
+	}
+}
+
+
+float	quadpager::TileDistance(const quadpagetile* t, const float ViewerLocation[3]) const
+// Returns the horizontal distance from the viewer to the center of the tile.
+{
+	float	half = float(1 << TileLevel);
+	float	dx = t->x + half - ViewerLocation[0];
+	float	dz = t->z + half - ViewerLocation[2];
+	return sqrtf(dx * dx + dz * dz);
+}
+
+
+quadpagetile*	quadpager::Neighbor(const quadpagetile* t, int dir)
+// Returns the tile next to t in the given direction, 0-3 --> { E, N, W,
+// S }, or NULL if t is on that edge of the file.
+{
+	int	TileSize = 2 << TileLevel;
+	int	i = (t->x - Map.XOrigin) / TileSize;
+	int	j = (t->z - Map.ZOrigin) / TileSize;
+
+	switch (dir) {
+	default:
+	case 0: i++; break;
+	case 1: j--; break;
+	case 2: i--; break;
+	case 3: j++; break;
+	}
+
+	if (i < 0 || i >= TileCountX || j < 0 || j >= TileCountZ) return NULL;
+	return &Tile[i + j * TileCountX];
+}
+
+
+void	quadpager::RestoreTile(quadpagetile* t)
+// Puts a copy of the original subtree back in place of a tile that isn't
+// paged in.  Call StitchTile() once the blocks around it are settled.
+{
+	if (t->Original == NULL) {
+		// We haven't touched this block yet, so the tree still holds
+		// the original data; keep a copy before stitching it.
+		t->Original = Root->CloneDescendant(*RootCornerData, TileLevel, t->x, t->z, &t->cd);
+	} else {
+		quadsquare*	s = Root->ExchangeDescendant(*RootCornerData, TileLevel, t->x, t->z, t->Original->CloneStatic());
+		delete s;
+	}
+}
+
+
+void	quadpager::StitchTile(quadpagetile* t)
+// Makes the edges of a tile that isn't paged in match the neighbors that
+// are.  Squares created along a seam take their other edges from the
+// blocks next to them, so those must already be restored.
+{
+	for (int dir = 0; dir < 4; dir++) {
+		quadpagetile*	n = Neighbor(t, dir);
+		if (n && n->State == TILE_RESIDENT) {
+			Root->StitchDescendant(*RootCornerData, TileLevel, t->x, t->z, dir, n->Detail);
+		}
+	}
+}
+
+
+void	quadpager::StartTile(quadpagetile* t)
+// Makes a detached copy of the tile's original subtree and starts a
+// thread to build it.
+{
+	if (t->Original == NULL) {
+		t->Original = Root->CloneDescendant(*RootCornerData, TileLevel, t->x, t->z, &t->cd);
+	}
+	t->Detail = t->Original->CloneStatic();
+	t->cd.Square = t->Detail;
+	t->ThresholdDetail = ThresholdDetail;
+	t->Failed = false;
+
+	DWORD	id;
+	t->Thread = CreateThread(NULL, 0, BuildTile, t, 0, &id);
+	if (t->Thread == NULL) {
+		delete t->Detail;
+		t->Detail = NULL;
+		t->State = TILE_FAILED;
+		return;
+	}
+
+	t->State = TILE_BUILDING;
+	Pending++;
+}
+
+
+void	quadpager::FinishTile(quadpagetile* t)
+// Swaps a finished tile into the tree.  Its build thread must be done.
+{
+	CloseHandle(t->Thread);
+	t->Thread = NULL;
+	Pending--;
+
+	if (t->Failed) {
+		delete t->Detail;
+		t->Detail = NULL;
+		t->State = TILE_FAILED;
+		return;
+	}
+
+	// What was in the tree is either the original data or a stitched
+	// copy of it; either way, t->Original has it.
+	quadsquare*	s = Root->ExchangeDescendant(*RootCornerData, TileLevel, t->x, t->z, t->Detail);
+	delete s;
+
+	t->State = TILE_RESIDENT;
+	ResidentNodes += t->NodeCount;
+	ResidentTiles++;
+	if (t->NodeCount > MaxTileNodes) MaxTileNodes = t->NodeCount;
+
+	// Stitch the seams.  A paged-in neighbor keeps its edge, and the rest
+	// are rebuilt to match ours.  Past the edge of the file there's no
+	// detail (see HeightMapInfo::Sample()), so take the tree's heights.
+	int	TileSize = 2 << TileLevel;
+	int	RootSize = 2 << RootCornerData->Level;
+	for (int dir = 0; dir < 4; dir++) {
+		quadpagetile*	n = Neighbor(t, dir);
+		if (n && n->State == TILE_RESIDENT) {
+			Root->StitchDescendant(*RootCornerData, TileLevel, t->x, t->z, dir, n->Detail);
+		} else if (n) {
+			RestoreTile(n);
+			StitchTile(n);
+		} else {
+			int	nx = t->x + (dir == 0 ? TileSize : dir == 2 ? -TileSize : 0);
+			int	nz = t->z + (dir == 3 ? TileSize : dir == 1 ? -TileSize : 0);
+			if (nx < RootCornerData->xorg || nx >= RootCornerData->xorg + RootSize ||
+			    nz < RootCornerData->zorg || nz >= RootCornerData->zorg + RootSize)
+			{
+				continue;	// Outside the tree; nothing to match.
+			}
+			quadsquare*	src = Root->GetDescendant(*RootCornerData, TileLevel, nx, nz);
+			Root->StitchDescendant(*RootCornerData, TileLevel, t->x, t->z, dir, src);
+		}
+	}
+}
+
+
+void	quadpager::EvictTile(quadpagetile* t)
+// Puts a copy of the original subtree back in place of the tile's
+// detail, and unstitches the neighbors that aren't paged in.
+{
+	t->State = TILE_UNLOADED;
+	t->Detail = NULL;
+	ResidentNodes -= t->NodeCount;
+	ResidentTiles--;
+
+	RestoreTile(t);	// Deletes the detail.
+
+	int	dir;
+	for (dir = 0; dir < 4; dir++) {
+		quadpagetile*	n = Neighbor(t, dir);
+		if (n && n->State != TILE_RESIDENT) {
+			RestoreTile(n);
+		}
+	}
+
+	StitchTile(t);
+	for (dir = 0; dir < 4; dir++) {
+		quadpagetile*	n = Neighbor(t, dir);
+		if (n && n->State != TILE_RESIDENT) {
+			StitchTile(n);
+		}
+	}
+}
+
+
+bool	quadpager::EvictFarthest(const float ViewerLocation[3])
+// Evicts the paged-in tile farthest from the viewer, if it's beyond
+// EvictRadius.  Returns false if there's no such tile.
+{
+	int	count = TileCountX * TileCountZ;
+	quadpagetile*	worst = NULL;
+	float	worstd = EvictRadius;
+	for (int i = 0; i < count; i++) {
+		if (Tile[i].State != TILE_RESIDENT) continue;
+		float	d = TileDistance(&Tile[i], ViewerLocation);
+		if (d > worstd) {
+			worst = &Tile[i];
+			worstd = d;
+		}
+	}
+	if (worst == NULL) return false;
+
+	EvictTile(worst);
+	return true;
+}
+
+
+void	quadpager::Update(const float ViewerLocation[3])
+// Call once per frame, before quadsquare::Update().  Swaps finished tiles
+// into the tree, evicts distant tiles if we're over the node budget, and
+// starts building tiles the viewer is approaching if they fit in it.
+{
+	if (Tile == NULL) return;
+
+	int	count = TileCountX * TileCountZ;
+	int	i;
+
+	// Pick up finished tiles.
+	for (i = 0; i < count; i++) {
+		quadpagetile*	t = &Tile[i];
+		if (t->State == TILE_BUILDING && WaitForSingleObject(t->Thread, 0) == WAIT_OBJECT_0) {
+			FinishTile(t);
+		}
+	}
+
+	// Evict the farthest tiles until we're under budget.
+	while (ResidentNodes > MaxNodes) {
+		if (EvictFarthest(ViewerLocation) == false) break;
+	}
+
+	// Start building the nearest tiles within range.
+	while (Pending < MaxPending) {
+		quadpagetile*	best = NULL;
+		float	bestd = LoadRadius;
+		for (i = 0; i < count; i++) {
+			if (Tile[i].State != TILE_UNLOADED) continue;
+			float	d = TileDistance(&Tile[i], ViewerLocation);
+			if (d < bestd) {
+				best = &Tile[i];
+				bestd = d;
+			}
+		}
+		if (best == NULL) break;
+
+		// Make room for it and the ones already pending.  If the
+		// tiles in the way are all too close to evict, stop loading
+		// rather than go over budget.
+		int	need = (Pending + 1) * MaxTileNodes;
+		while (ResidentNodes + need > MaxNodes) {
+			if (EvictFarthest(ViewerLocation) == false) break;
+		}
+		if (ResidentNodes + need > MaxNodes) break;
+
+		StartTile(best);
+	}
+}
+
+
+void	quadpager::Flush()
+// Waits for all pending tiles to finish, and swaps them into the tree.
+{
+	if (Tile == NULL) return;
+
+	int	count = TileCountX * TileCountZ;
+
+	for (int i = 0; i < count; i++) {
+		quadpagetile*	t = &Tile[i];
+		if (t->State == TILE_BUILDING) {
+			WaitForSingleObject(t->Thread, INFINITE);
+			FinishTile(t);
+		}
+	}
+}
@@ -0,0 +1,69 @@
+// quadpager.hpp
+
+// Streams detail heightmap data into a quadsquare tree from a
+// memory-mapped file, a tile at a time, as the viewer moves around.
+
+// This code may be freely modified and redistributed.  I make no
+// warrantees about it; use at your own risk.  If you do incorporate
+// this code into a project, I'd appreciate a mention in the credits.
+
+
+#ifndef QUADPAGER_HPP
+#define QUADPAGER_HPP
+
+
+#include "quadtree.hpp"
+
+
+struct quadpagetile;
+
+
+struct quadpager {
+	// Tuning parameters; may be changed at any time.
+	float	LoadRadius;	// Tiles whose center is closer than this to the viewer get loaded...
+	int	MaxNodes;	// ...as long as paged-in nodes stay under this count.
+	float	EvictRadius;	// Tiles farther than this may be evicted to make room.
+	int	MaxPending;	// Max number of tiles being built at once.
+	float	ThresholdDetail;	// Passed to StaticCullData() for each new tile.
+
+	int	ResidentNodes;	// Count of nodes in paged-in tiles.
+	int	ResidentTiles;
+
+	quadpager(quadsquare* root, const quadcornerdata& rootcd);
+	~quadpager();
+
+	bool	Open(const char* filename, int XSize, int ZSize, int XOrigin, int ZOrigin, int Scale, int TileLevel);
+	void	Close();
+
+	void	Update(const float ViewerLocation[3]);
+	void	Flush();
+
+private:
+	quadsquare*	Root;
+	const quadcornerdata*	RootCornerData;
+
+	void*	File;
+	void*	Mapping;
+	int	Granularity;
+
+	HeightMapInfo	Map;	// Describes the whole file; Data is unused.
+	int	TileLevel;
+	int	TileSamples;	// Samples along a tile edge, not counting the shared border.
+	int	TileCountX, TileCountZ;
+	quadpagetile*	Tile;
+
+	int	Pending;
+	int	MaxTileNodes;	// Largest tile built so far; the estimate for the next one.
+
+	void	StartTile(quadpagetile* t);
+	void	FinishTile(quadpagetile* t);
+	void	EvictTile(quadpagetile* t);
+	bool	EvictFarthest(const float ViewerLocation[3]);
+	void	RestoreTile(quadpagetile* t);
+	void	StitchTile(quadpagetile* t);
+	quadpagetile*	Neighbor(const quadpagetile* t, int dir);
+	float	TileDistance(const quadpagetile* t, const float ViewerLocation[3]) const;
+};
+
+
+#endif // QUADPAGER_HPP
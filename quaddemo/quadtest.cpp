@@ -11,9 +11,11 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <xmmintrin.h>
 #include "geometry.hpp"
 #include "clip.hpp"
 #include "quadtree.hpp"
+#include "quadpager.hpp"
 
 #include <windows.h>
 #include <gl/glut.h>
@@ -34,6 +36,7 @@ void	LoadData();
 
 
 quadsquare*	root = NULL;
+quadpager*	pager = NULL;
 quadcornerdata	RootCornerData = { NULL, NULL, 0, 15, 0, 0, { { 0, 0 }, { 0, 0 }, { 0, 0 }, { 0, 0 } } };
 
 
@@ -67,10 +70,15 @@ int	main(int argc, char *argv[])
 	printf(" * 'c' toggles backface culling\n");
 	printf(" * 'p' fixes the viewpoint at a certain altitude above the terrain\n");
 	printf(" * 'm' toggles motion mode\n");
+	printf(" * 'l' swings the sun around and relights the terrain\n");
 	printf(" * 'd' runs a 1-second benchmark and displays some performance data\n");
 	printf(" * '=' increases terrain detail\n");
 	printf(" * '-' decreases terrain detail\n");
 	printf("\n");
+	printf("Usage: quadtest [<heightmap.raw> <xsize> <zsize>]\n");
+	printf("An optional heightmap of int16 detail samples at 32 meter spacing\n");
+	printf("is streamed in around the viewpoint, a tile at a time.\n");
+	printf("\n");
 	
 	int	i;
 	
@@ -125,6 +133,19 @@ int	main(int argc, char *argv[])
 	printf("max error = %g\n", root->RecomputeErrorAndLighting(RootCornerData));
 
 
+	// Set up paging for the optional big heightmap.
+	if (argc >= 4) {
+		pager = new quadpager(root, RootCornerData);
+		if (pager->Open(argv[1], atoi(argv[2]), atoi(argv[3]), 0, 0, 5, 11)) {
+			pager->Update((const float*) ViewerLoc);
+			pager->Flush();
+			printf("paged in %d tiles, %d nodes\n", pager->ResidentTiles, pager->ResidentNodes);
+		} else {
+			delete pager;
+			pager = NULL;
+		}
+	}
+
 	// Run the update function a few times before we start rendering
 	// to disable unnecessary quadsquares, so the first frame won't
 	// be overloaded with tons of triangles.
@@ -159,6 +180,7 @@ int	main(int argc, char *argv[])
 
 	glutMainLoop();
 
+	delete pager;
 	delete root;
 
 	return 0;
@@ -330,6 +352,7 @@ void	Display()
 
 	// Draw the quadtree.
 	if (root) {
+		if (pager) pager->Update((const float*) ViewerLoc);
 		root->Update(RootCornerData, (const float*) ViewerLoc, Detail);
 		TriangleCounter += root->Render(RootCornerData, Textured);
 	}
@@ -516,6 +539,18 @@ void	KeyHandler(unsigned char key, int x, int y)
 		MoveForward = !MoveForward;
 	}
 
+	// Swing the sun around the vertical axis on 'l', and relight.
+	static float	SunTheta = 0;
+	if (key == 'l') {
+		SunTheta += PI / 12;
+		float	sun[3] = { 0.1578f * cos(SunTheta), -0.9875f, 0.1578f * sin(SunTheta) };
+		quadsquare::SetSunVector(sun);
+
+		int	StartTicks = glutGet(GLUT_ELAPSED_TIME);
+		root->Relight(RootCornerData);
+		printf("Relit in %d ms\n", glutGet(GLUT_ELAPSED_TIME) - StartTicks);
+	}
+
 
 	// =/- keys adjust the detail threshold.
 	if (key == '-') {
@@ -553,7 +588,7 @@ void	KeyHandler(unsigned char key, int x, int y)
 
 		// Show the fps and tps results.
 		float	dt = (ticks - StartTicks) / 1000.0;
-		printf("Rendered %0.1f frames/sec, %d tris/frame, %d tris/sec\n", FrameCounter / dt, TrisPerFrame, int(TriangleCounter / dt));
+		printf("Rendered %0.1f frames/sec, %d tris/frame, %d tris/sec, %d clip tests/frame\n", FrameCounter / dt, TrisPerFrame, int(TriangleCounter / dt), ClipTestCount);
 	}
 }
 
@@ -618,5 +653,48 @@ Visibility	ComputeBoxVisibility(const float min[3], const float max[3])
 }
 
 
+void	ComputeBoxVisibility4(const float min[3][4], const float max[3][4], Visibility result[4])
+// Same as ComputeBoxVisibility(), for four boxes at once.  The box
+// coordinates are given structure-of-arrays style, min[axis][box].
+{
+	// Rather than checking all eight corners against each plane, just
+	// check the corner that's farthest along the plane normal, and the
+	// one that's farthest against it.  If the far one is outside, all
+	// the corners are; if the near one is outside, some are.
+	__m128	mx = _mm_loadu_ps(min[0]), my = _mm_loadu_ps(min[1]), mz = _mm_loadu_ps(min[2]);
+	__m128	Mx = _mm_loadu_ps(max[0]), My = _mm_loadu_ps(max[1]), Mz = _mm_loadu_ps(max[2]);
+	__m128	zero = _mm_setzero_ps();
+	int	OrCodes = 0, AndCodes = 0;	// bit i set for box i.
+
+	for (int j = 0; j < 6; j++) {
+		const PlaneInfo&	p = TransformedFrustumPlane[j];
+		__m128	nx = _mm_set1_ps(p.Normal.X());
+		__m128	ny = _mm_set1_ps(p.Normal.Y());
+		__m128	nz = _mm_set1_ps(p.Normal.Z());
+		__m128	d = _mm_set1_ps(p.D);
+
+		bool	px = p.Normal.X() >= 0, py = p.Normal.Y() >= 0, pz = p.Normal.Z() >= 0;
+
+		__m128	pdist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px ? Mx : mx, nx), _mm_mul_ps(py ? My : my, ny)), _mm_mul_ps(pz ? Mz : mz, nz));
+		__m128	ndist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(px ? mx : Mx, nx), _mm_mul_ps(py ? my : My, ny)), _mm_mul_ps(pz ? mz : Mz, nz));
+
+		AndCodes |= _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(pdist, d), zero));
+		OrCodes |= _mm_movemask_ps(_mm_cmplt_ps(_mm_sub_ps(ndist, d), zero));
+	}
+
+	for (int i = 0; i < 4; i++) {
+		if (AndCodes & (1 << i)) {
+			// All the points are outside one of the frustum planes.
+			result[i] = NOT_VISIBLE;
+		} else if (OrCodes & (1 << i)) {
+			result[i] = SOME_CLIP;
+		} else {
+			// The box is completely within the frustum.
+			result[i] = NO_CLIP;
+		}
+	}
+}
+
+
 }	// end namespace Clip.
 
@@ -13,7 +13,10 @@
 #include <gl/gl.h>
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
 #include "quadtree.hpp"
 #include "geometry.hpp"
 
@@ -459,6 +462,14 @@ quadsquare*	quadsquare::GetNeighbor(int dir, const quadcornerdata& cd)
 static vector	SunVector(0.0705, -0.9875, -0.1411);	// For demo lighting.  Pick some unit vector pointing roughly downward.
 
 
+void	quadsquare::SetSunVector(const float dir[3])
+// Sets the direction of the demo light; dir should be unit length.
+// Call Relight() afterwards to update the vertex lighting.
+{
+	SunVector.SetXYZ(dir[0], dir[1], dir[2]);
+}
+
+
 unsigned char	MakeLightness(float xslope, float zslope)
 // Generates an 8-bit lightness value, given a surface slope.
 {
@@ -477,6 +488,76 @@ unsigned char	MakeLightness(float xslope, float zslope)
 }
 
 
+// Lightness values are queued up here during the recursive passes and
+// then computed four at a time with SSE, instead of one at a time with
+// MakeLightness().  Nothing reads Lightness during those passes, so it's
+// fine for the results to land late.
+struct quadlightbatch {
+	enum { SIZE = 256 };
+
+	float	XSlope[SIZE];
+	float	ZSlope[SIZE];
+	unsigned char*	Dest[SIZE];
+	int	Count;
+
+	quadlightbatch() { Count = 0; }
+
+	void	Add(unsigned char* dest, float xslope, float zslope)
+	{
+		XSlope[Count] = xslope;
+		ZSlope[Count] = zslope;
+		Dest[Count] = dest;
+		Count++;
+		if (Count == SIZE) Flush();
+	}
+
+	void	Flush();
+};
+
+
+void	quadlightbatch::Flush()
+// Computes all the queued lightness values and stores them.  Same math
+// as MakeLightness().
+{
+	__m128	sx = _mm_set1_ps(SunVector.X());
+	__m128	sy = _mm_set1_ps(SunVector.Y());
+	__m128	sz = _mm_set1_ps(SunVector.Z());
+	__m128	one = _mm_set1_ps(1);
+	__m128	scale = _mm_set1_ps(300);
+	__m128	top = _mm_set1_ps(255);
+	__m128	zero = _mm_setzero_ps();
+
+	int	i;
+	for (i = 0; i + 4 <= Count; i += 4) {
+		__m128	xs = _mm_loadu_ps(&XSlope[i]);
+		__m128	zs = _mm_loadu_ps(&ZSlope[i]);
+
+		// norm = (-xs, -1, -zs) / |norm|; dot = norm * SunVector.
+		__m128	mag = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(xs, xs), _mm_mul_ps(zs, zs)), one));
+		__m128	dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(xs, sx), _mm_mul_ps(zs, sz)), sy);
+		dot = _mm_sub_ps(zero, _mm_div_ps(dot, mag));
+
+		__m128	c = _mm_sub_ps(top, _mm_mul_ps(_mm_sub_ps(one, dot), scale));
+		c = _mm_min_ps(_mm_max_ps(c, zero), top);
+
+		int	result[4];
+		_mm_storeu_si128((__m128i*) result, _mm_cvttps_epi32(c));
+
+		*Dest[i] = result[0];
+		*Dest[i+1] = result[1];
+		*Dest[i+2] = result[2];
+		*Dest[i+3] = result[3];
+	}
+
+	// Leftovers.
+	for ( ; i < Count; i++) {
+		*Dest[i] = MakeLightness(XSlope[i], ZSlope[i]);
+	}
+
+	Count = 0;
+}
+
+
 unsigned int	MakeColor(unsigned char Lightness)
 // Makes an ARGB color, given an 8-bit lightness value.
 // Just replicates the components and uses FF for alpha.
@@ -485,11 +566,222 @@ unsigned int	MakeColor(unsigned char Lightness)
 }
 
 
+// Squares above this level hand their children off to the worker threads
+// when recomputing error & lighting.  With the root at level 15, that's
+// 16 jobs doing the real work, one per level-13 subtree.
+const int	PARALLEL_MIN_LEVEL = 13;
+
+// Most worker threads to start.  The thread that asks for a recompute
+// works on the jobs too.
+const int	MAX_RECOMPUTE_THREADS = 15;
+
+
+struct quadrecomputejob {
+	quadsquare*	Square;
+	quadcornerdata	cd;
+	bool	LightingOnly;
+	float	MaxError;
+	volatile LONG*	Pending;	// Caller's count of unfinished jobs.
+	HANDLE	Owner;	// Caller's event, set when *Pending reaches 0.
+	quadrecomputejob*	Next;	// Queue link.
+
+	void	Run(quadlightbatch* lb)
+	// Recomputes (or just relights) the child subtree.
+	{
+		if (LightingOnly) {
+			Square->RelightAux(cd, lb);
+			MaxError = 0;
+		} else {
+			MaxError = Square->RecomputeAux(cd, lb);
+		}
+	}
+
+	void	Finish()
+	// Runs a queued job with a light batch of its own, then lets the
+	// caller know.
+	{
+		quadlightbatch	lb;
+		Run(&lb);
+		lb.Flush();
+
+		// The job lives on the caller's stack, which may be gone as soon
+		// as *Pending reaches 0, so Owner has to be read first.
+		HANDLE	owner = Owner;
+		if (InterlockedDecrement(Pending) == 0) SetEvent(owner);
+	}
+};
+
+
+// The worker threads are started by the first recompute that needs them,
+// and then sleep on RecomputeWake between jobs, so a recompute doesn't pay
+// for creating and closing threads.  Jobs queue more jobs for the next
+// level down; a thread waiting on its own jobs runs queued ones in the
+// meantime, so the queue can't stall with every thread waiting.
+static bool	RecomputePoolStarted = false;
+static CRITICAL_SECTION	RecomputeLock;	// Guards RecomputeQueue.
+static quadrecomputejob*	RecomputeQueue = NULL;
+static HANDLE	RecomputeWake;	// Semaphore, released once per queued job.
+static DWORD	RecomputeEventSlot;	// TLS slot for each thread's wait event.
+
+
+static quadrecomputejob*	PopRecomputeJob()
+// Takes the next job off the queue, or returns NULL if it's empty.
+{
+	EnterCriticalSection(&RecomputeLock);
+	quadrecomputejob*	j = RecomputeQueue;
+	if (j) RecomputeQueue = j->Next;
+	LeaveCriticalSection(&RecomputeLock);
+
+	return j;
+}
+
+
+static DWORD WINAPI	RecomputeThread(LPVOID param)
+// Worker thread function.  Runs queued jobs until the program exits.
+{
+	for (;;) {
+		WaitForSingleObject(RecomputeWake, INFINITE);
+
+		// NULL if a waiting thread took the job first.
+		quadrecomputejob*	j = PopRecomputeJob();
+		if (j) j->Finish();
+	}
+
+	return 0;
+}
+
+
+static void	StartRecomputePool()
+// Starts a worker for each CPU after the first.  If none will start, the
+// threads that queue jobs end up running them all themselves.
+{
+	InitializeCriticalSection(&RecomputeLock);
+	RecomputeWake = CreateSemaphore(NULL, 0, 0x7FFFFFFF, NULL);
+	RecomputeEventSlot = TlsAlloc();
+
+	SYSTEM_INFO	info;
+	GetSystemInfo(&info);
+	int	count = (int) info.dwNumberOfProcessors - 1;
+	if (count > MAX_RECOMPUTE_THREADS) count = MAX_RECOMPUTE_THREADS;
+
+	for (int i = 0; i < count; i++) {
+		DWORD	id;
+		HANDLE	h = CreateThread(NULL, 0, RecomputeThread, NULL, 0, &id);
+		if (h) CloseHandle(h);	// The thread keeps running.
+	}
+
+	RecomputePoolStarted = true;
+}
+
+
+static HANDLE	GetRecomputeEvent()
+// Returns the calling thread's wait event, creating it the first time.
+{
+	HANDLE	e = (HANDLE) TlsGetValue(RecomputeEventSlot);
+	if (e == NULL) {
+		e = CreateEvent(NULL, FALSE, FALSE, NULL);
+		TlsSetValue(RecomputeEventSlot, e);
+	}
+
+	return e;
+}
+
+
+void	quadsquare::RecomputeChildren(const quadcornerdata& cd, bool LightingOnly, quadlightbatch* lb)
+// Recomputes the child subtrees, on the worker threads if they're big
+// enough, and gathers their error and bounds into this square.  The
+// child passes only write to their own squares, and only read Y values
+// from their neighbors, so they don't step on each other.
+{
+	int	i;
+	quadrecomputejob	job[4];
+	int	count = 0;
+	bool	parallel = cd.Level > PARALLEL_MIN_LEVEL;
+
+	for (i = 0; i < 4; i++) {
+		if (Child[i] == NULL) continue;
+
+		quadrecomputejob&	j = job[count++];
+		j.Square = Child[i];
+		SetupCornerData(&j.cd, cd, i);
+		j.LightingOnly = LightingOnly && Child[i]->Dirty == false;
+		j.MaxError = 0;
+
+		if (parallel == false) {
+			// Small subtree; do it here.
+			j.Run(lb);
+		}
+	}
+
+	if (parallel && count > 0) {
+		if (RecomputePoolStarted == false) StartRecomputePool();
+
+		volatile LONG	pending = count;
+		HANDLE	owner = GetRecomputeEvent();
+
+		EnterCriticalSection(&RecomputeLock);
+		for (i = 0; i < count; i++) {
+			job[i].Pending = &pending;
+			job[i].Owner = owner;
+			job[i].Next = RecomputeQueue;
+			RecomputeQueue = &job[i];
+		}
+		LeaveCriticalSection(&RecomputeLock);
+		ReleaseSemaphore(RecomputeWake, count, NULL);
+
+		// Help with the queue until our jobs are done.  Once it's empty,
+		// any of ours that are left are running on other threads.
+		while (pending > 0) {
+			quadrecomputejob*	j = PopRecomputeJob();
+			if (j) {
+				j->Finish();
+			} else {
+				WaitForSingleObject(owner, INFINITE);
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		quadrecomputejob&	j = job[i];
+		if (j.LightingOnly == false) {
+			Error[j.cd.ChildIndex + 2] = j.MaxError;
+		}
+	}
+}
+
+
 float	quadsquare::RecomputeErrorAndLighting(const quadcornerdata& cd)
 // Recomputes the error values for this tree.  Returns the
 // max error.
 // Also updates MinY & MaxY.
 // Also computes quick & dirty vertex lighting for the demo.
+{
+	quadlightbatch	lb;
+	float	maxerror = RecomputeAux(cd, &lb);
+	lb.Flush();
+
+	return maxerror;
+}
+
+
+void	quadsquare::Relight(const quadcornerdata& cd)
+// Recomputes the vertex lighting for this tree, e.g. after the sun
+// moves.  Error data is only recomputed for squares that are Dirty;
+// everything else just gets new Lightness values.
+{
+	quadlightbatch	lb;
+	if (Dirty) {
+		RecomputeAux(cd, &lb);
+	} else {
+		RelightAux(cd, &lb);
+	}
+	lb.Flush();
+}
+
+
+float	quadsquare::RecomputeAux(const quadcornerdata& cd, quadlightbatch* lb)
+// Does the work for RecomputeErrorAndLighting().  Lightness values are
+// queued into the given batch.
 {
 	int	i;
 	
@@ -505,17 +797,6 @@ float	quadsquare::RecomputeErrorAndLighting(const quadcornerdata& cd)
 	}
 	if (e > maxerror) maxerror = e;
 
-	// Initial min/max.
-	MaxY = Vertex[0].Y;
-	MinY = Vertex[0].Y;
-
-	// Check min/max of corners.
-	for (i = 0; i < 4; i++) {
-		float	y = cd.Verts[i].Y;
-		if (y < MinY) MinY = y;
-		if (y > MaxY) MaxY = y;
-	}
-	
 	// Edge verts.
 	e = fabs(Vertex[1].Y - (cd.Verts[0].Y + cd.Verts[3].Y) * 0.5);
 	if (e > maxerror) maxerror = e;
@@ -525,74 +806,99 @@ float	quadsquare::RecomputeErrorAndLighting(const quadcornerdata& cd)
 	if (e > maxerror) maxerror = e;
 	Error[1] = e;
 
-	// Min/max of edge verts.
+	// Min/max of the center, corners, and edge verts, and the
+	// bilinear-vs-diagonal error for each quadrant, four at a time.
+	// Quadrants with a child get their error from the child below.
+	__m128	corner = _mm_set_ps(cd.Verts[3].Y, cd.Verts[2].Y, cd.Verts[1].Y, cd.Verts[0].Y);
+	__m128	edge = _mm_set_ps(Vertex[4].Y, Vertex[3].Y, Vertex[2].Y, Vertex[1].Y);
+	__m128	nextedge = _mm_shuffle_ps(edge, edge, _MM_SHUFFLE(0, 3, 2, 1));
+	__m128	center = _mm_set1_ps(Vertex[0].Y);
+
+	__m128	lo = _mm_min_ps(_mm_min_ps(corner, edge), center);
+	__m128	hi = _mm_max_ps(_mm_max_ps(corner, edge), center);
+	lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 0, 3, 2)));
+	lo = _mm_min_ps(lo, _mm_shuffle_ps(lo, lo, _MM_SHUFFLE(2, 3, 0, 1)));
+	hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 0, 3, 2)));
+	hi = _mm_max_ps(hi, _mm_shuffle_ps(hi, hi, _MM_SHUFFLE(2, 3, 0, 1)));
+	MinY = _mm_cvtss_f32(lo);
+	MaxY = _mm_cvtss_f32(hi);
+
+	__m128	diag = _mm_sub_ps(_mm_add_ps(center, corner), _mm_add_ps(edge, nextedge));
+	diag = _mm_mul_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), diag), _mm_set1_ps(0.25f));
+	int	diagerror[4];
+	_mm_storeu_si128((__m128i*) diagerror, _mm_cvttps_epi32(diag));
+
+	// Check child squares.
 	for (i = 0; i < 4; i++) {
-		float	y = Vertex[1 + i].Y;
-		if (y < MinY) MinY = y;
-		if (y > MaxY) MaxY = y;
+		if (Child[i] == NULL) {
+			// Compute difference between bilinear average at child center, and diagonal edge approximation.
+			Error[i+2] = diagerror[i];
+		}
 	}
-	
-	// Check child squares.
+	RecomputeChildren(cd, false, lb);
 	for (i = 0; i < 4; i++) {
-		quadcornerdata	q;
 		if (Child[i]) {
-			SetupCornerData(&q, cd, i);
-			Error[i+2] = Child[i]->RecomputeErrorAndLighting(q);
-
 			if (Child[i]->MinY < MinY) MinY = Child[i]->MinY;
 			if (Child[i]->MaxY > MaxY) MaxY = Child[i]->MaxY;
-		} else {
-			// Compute difference between bilinear average at child center, and diagonal edge approximation.
-			Error[i+2] = fabs((Vertex[0].Y + cd.Verts[i].Y) - (Vertex[i+1].Y + Vertex[((i+1)&3) + 1].Y)) * 0.25;
 		}
 		if (Error[i+2] > maxerror) maxerror = Error[i+2];
 	}
 
+	QueueLighting(cd, lb);
 
-	//
-	// Compute quickie demo lighting.
-	//
+	// The error, MinY/MaxY, and lighting values for this node and descendants are correct now.
+	Dirty = false;
+	
+	return maxerror;
+}
 
+
+void	quadsquare::RelightAux(const quadcornerdata& cd, quadlightbatch* lb)
+// Does the work for Relight().  Dirty children get a full recompute.
+{
+	RecomputeChildren(cd, true, lb);
+	QueueLighting(cd, lb);
+}
+
+
+void	quadsquare::QueueLighting(const quadcornerdata& cd, quadlightbatch* lb)
+// Compute quickie demo lighting for our five vertices.
+{
 	float	OneOverSize = 1.0 / (2 << cd.Level);
-	Vertex[0].Lightness = MakeLightness((Vertex[1].Y - Vertex[3].Y) * OneOverSize,
-					    (Vertex[4].Y - Vertex[2].Y) * OneOverSize);
+	lb->Add(&Vertex[0].Lightness, (Vertex[1].Y - Vertex[3].Y) * OneOverSize,
+		(Vertex[4].Y - Vertex[2].Y) * OneOverSize);
 
 	float	v;
 	quadsquare*	s = GetNeighbor(0, cd);
 	if (s) v = s->Vertex[0].Y; else v = Vertex[1].Y;
-	Vertex[1].Lightness = MakeLightness((v - Vertex[0].Y) * OneOverSize,
-				    (cd.Verts[3].Y - cd.Verts[0].Y) * OneOverSize);
+	lb->Add(&Vertex[1].Lightness, (v - Vertex[0].Y) * OneOverSize,
+		(cd.Verts[3].Y - cd.Verts[0].Y) * OneOverSize);
 	
 	s = GetNeighbor(1, cd);
 	if (s) v = s->Vertex[0].Y; else v = Vertex[2].Y;
-	Vertex[2].Lightness = MakeLightness((cd.Verts[0].Y - cd.Verts[1].Y) * OneOverSize,
-				    (Vertex[0].Y - v) * OneOverSize);
+	lb->Add(&Vertex[2].Lightness, (cd.Verts[0].Y - cd.Verts[1].Y) * OneOverSize,
+		(Vertex[0].Y - v) * OneOverSize);
 	
 	s = GetNeighbor(2, cd);
 	if (s) v = s->Vertex[0].Y; else v = Vertex[3].Y;
-	Vertex[3].Lightness = MakeLightness((Vertex[0].Y - v) * OneOverSize,
-				    (cd.Verts[2].Y - cd.Verts[1].Y) * OneOverSize);
+	lb->Add(&Vertex[3].Lightness, (Vertex[0].Y - v) * OneOverSize,
+		(cd.Verts[2].Y - cd.Verts[1].Y) * OneOverSize);
 	
 	s = GetNeighbor(3, cd);
 	if (s) v = s->Vertex[0].Y; else v = Vertex[4].Y;
-	Vertex[4].Lightness = MakeLightness((cd.Verts[3].Y - cd.Verts[2].Y) * OneOverSize,
-				    (v - Vertex[0].Y) * OneOverSize);
-	
-
-	// The error, MinY/MaxY, and lighting values for this node and descendants are correct now.
-	Dirty = false;
-	
-	return maxerror;
+	lb->Add(&Vertex[4].Lightness, (cd.Verts[3].Y - cd.Verts[2].Y) * OneOverSize,
+		(v - Vertex[0].Y) * OneOverSize);
 }
 
 
-void	quadsquare::ResetTree()
+void	quadsquare::ResetTree(bool MarkDirty)
 // Clear all enabled flags, and delete all non-static child nodes.
+// If MarkDirty is true, then error data is invalidated too.
 {
 	int	i;
 	for (i = 0; i < 4; i++) {
 		if (Child[i]) {
-			Child[i]->ResetTree();
+			Child[i]->ResetTree(MarkDirty);
 			if (Child[i]->Static == false) {
 				delete Child[i];
 				Child[i] = 0;
@@ -602,7 +908,304 @@ void	quadsquare::ResetTree()
 	EnabledFlags = 0;
 	SubEnabledCount[0] = 0;
 	SubEnabledCount[1] = 0;
-	Dirty = true;
+	if (MarkDirty) Dirty = true;
+}
+
+
+void	quadsquare::TransferEnabledState(const quadcornerdata& cd, const quadsquare* src)
+// Copies the enabled flags and edge-vertex reference counts from src,
+// which covers the same block as we do, into this subtree.  Children are
+// created where src has enabled children, so every enabled square in src
+// has a counterpart here; squares with no enabled counterpart are
+// cleared, and non-static ones deleted.  The enabled state only depends
+// on position, so the rest of the tree stays consistent with it.
+{
+	int	i;
+
+	if (src == NULL) {
+		ResetTree(false);
+		return;
+	}
+
+	EnabledFlags = src->EnabledFlags;
+	SubEnabledCount[0] = src->SubEnabledCount[0];
+	SubEnabledCount[1] = src->SubEnabledCount[1];
+
+	for (i = 0; i < 4; i++) {
+		if (src->EnabledFlags & (16 << i)) {
+			quadcornerdata	q;
+			CreateChild(i, cd);
+			SetupCornerData(&q, cd, i);
+			Child[i]->TransferEnabledState(q, src->Child[i]);
+		} else if (Child[i]) {
+			Child[i]->ResetTree(false);
+			if (Child[i]->Static == false) {
+				delete Child[i];
+				Child[i] = 0;
+			}
+		}
+	}
+}
+
+
+float	quadsquare::MaxError(const quadcornerdata& cd) const
+// Returns the largest error in this subtree, taken from the current
+// error data.  This is the value RecomputeErrorAndLighting() returns,
+// without the recursion.
+{
+	float	maxerror;
+	if (cd.ChildIndex & 1) {
+		maxerror = fabs(Vertex[0].Y - (cd.Verts[1].Y + cd.Verts[3].Y) * 0.5);
+	} else {
+		maxerror = fabs(Vertex[0].Y - (cd.Verts[0].Y + cd.Verts[2].Y) * 0.5);
+	}
+	for (int i = 0; i < 6; i++) {
+		if (Error[i] > maxerror) maxerror = Error[i];
+	}
+	return maxerror;
+}
+
+
+void	quadsquare::RefreshChildError(const quadcornerdata& cd, int index)
+// Brings the error for the indexed quadrant, and our MinY/MaxY, up to
+// date after the child there has been swapped.  Uses the error data
+// the children already have, instead of recomputing the subtree.
+{
+	int	i;
+
+	if (Child[index]) {
+		quadcornerdata	q;
+		SetupCornerData(&q, cd, index);
+		Error[index+2] = Child[index]->MaxError(q);
+	} else {
+		// Same as RecomputeAux() for an empty quadrant.
+		Error[index+2] = fabs((Vertex[0].Y + cd.Verts[index].Y) - (Vertex[index+1].Y + Vertex[((index+1)&3) + 1].Y)) * 0.25;
+	}
+
+	float	miny = Vertex[0].Y, maxy = Vertex[0].Y;
+	for (i = 0; i < 4; i++) {
+		float	y = cd.Verts[i].Y;
+		if (y < miny) miny = y;
+		if (y > maxy) maxy = y;
+		y = Vertex[i+1].Y;
+		if (y < miny) miny = y;
+		if (y > maxy) maxy = y;
+		if (Child[i]) {
+			if (Child[i]->MinY < miny) miny = Child[i]->MinY;
+			if (Child[i]->MaxY > maxy) maxy = Child[i]->MaxY;
+		}
+	}
+	MinY = miny;
+	MaxY = maxy;
+}
+
+
+quadsquare*	quadsquare::CloneStatic() const
+// Returns a deep copy of this square and its static descendants.  The
+// copy's enabled state is cleared, since it doesn't belong to a tree yet.
+{
+	quadsquare*	s = new quadsquare(*this);
+
+	s->EnabledFlags = 0;
+	s->SubEnabledCount[0] = 0;
+	s->SubEnabledCount[1] = 0;
+
+	for (int i = 0; i < 4; i++) {
+		if (Child[i] && Child[i]->Static) {
+			s->Child[i] = Child[i]->CloneStatic();
+		} else {
+			s->Child[i] = NULL;
+		}
+	}
+
+	return s;
+}
+
+
+quadsquare*	quadsquare::CloneDescendant(const quadcornerdata& cd, int Level, int x, int z, quadcornerdata* q)
+// Finds the descendant square at the given level whose block contains
+// (x,z), creating squares along the way as necessary, and returns a
+// detached copy of it and its static descendants.  Fills *q with the
+// corner data for the copy, with no parent, so the copy can be worked
+// on independently of this tree (e.g. by another thread).
+{
+	int	half = 1 << cd.Level;
+	int	ix = (x - cd.xorg) >= half ? 1 : 0;
+	int	iz = (z - cd.zorg) >= half ? 1 : 0;
+	int	index = ix ^ (iz ^ 1) + (iz << 1);
+
+	CreateChild(index, cd);
+
+	quadcornerdata	cq;
+	SetupCornerData(&cq, cd, index);
+
+	if (cq.Level > Level) {
+		return Child[index]->CloneDescendant(cq, Level, x, z, q);
+	}
+
+	*q = cq;
+	q->Parent = NULL;
+	q->Square = Child[index]->CloneStatic();
+
+	return q->Square;
+}
+
+
+quadsquare*	quadsquare::ExchangeDescendant(const quadcornerdata& cd, int Level, int x, int z, quadsquare* replacement)
+// Puts the given subtree in place of the descendant square at the given
+// level whose block contains (x,z), and returns the subtree that was
+// there before (possibly NULL).  The replacement must have been made
+// for the same block, e.g. by CloneDescendant(), and its error data must
+// be current.  The replacement takes over the enabled state of the old
+// subtree, and the error and bounds of the squares along the path are
+// updated from it, so nothing else in the tree needs to be recomputed
+// or reset.
+{
+	int	half = 1 << cd.Level;
+	int	ix = (x - cd.xorg) >= half ? 1 : 0;
+	int	iz = (z - cd.zorg) >= half ? 1 : 0;
+	int	index = ix ^ (iz ^ 1) + (iz << 1);
+	quadsquare*	old;
+
+	if (cd.Level - 1 > Level) {
+		quadcornerdata	q;
+		CreateChild(index, cd);
+		SetupCornerData(&q, cd, index);
+		old = Child[index]->ExchangeDescendant(q, Level, x, z, replacement);
+	} else {
+		old = Child[index];
+		Child[index] = replacement;
+
+		if (replacement == NULL && (EnabledFlags & (16 << index))) {
+			// The quadrant is enabled, so it needs a square to carry
+			// the enabled state; an interpolated one will do.
+			CreateChild(index, cd);
+		}
+		if (Child[index]) {
+			quadcornerdata	q;
+			SetupCornerData(&q, cd, index);
+			Child[index]->TransferEnabledState(q, old);
+		}
+
+		if (replacement && replacement->Static) {
+			// Real data below us now, so don't let Update() prune the path.
+			SetStatic(cd);
+		}
+	}
+
+	RefreshChildError(cd, index);
+
+	return old;
+}
+
+
+quadsquare*	quadsquare::GetDescendant(const quadcornerdata& cd, int Level, int x, int z)
+// Returns the descendant square at the given level whose block contains
+// (x,z), or NULL if it doesn't exist.  Doesn't create anything.
+{
+	int	half = 1 << cd.Level;
+	int	ix = (x - cd.xorg) >= half ? 1 : 0;
+	int	iz = (z - cd.zorg) >= half ? 1 : 0;
+	int	index = ix ^ (iz ^ 1) + (iz << 1);
+
+	if (Child[index] == NULL || cd.Level - 1 == Level) {
+		return Child[index];
+	}
+
+	quadcornerdata	q;
+	SetupCornerData(&q, cd, index);
+	return Child[index]->GetDescendant(q, Level, x, z);
+}
+
+
+void	quadsquare::StitchDescendant(const quadcornerdata& cd, int Level, int x, int z, int dir, const quadsquare* src)
+// Makes the heights along one edge of the descendant square at the
+// given level whose block contains (x,z) match src, the square of the
+// same level across that edge.  dir is the side of the edge, 0-3 -->
+// { E, N, W, S }.  src may be NULL, meaning the other side has no data
+// there and will interpolate the edge.  Only our side is changed; the
+// error and bounds of the squares along the path are updated.
+{
+	int	half = 1 << cd.Level;
+	int	ix = (x - cd.xorg) >= half ? 1 : 0;
+	int	iz = (z - cd.zorg) >= half ? 1 : 0;
+	int	index = ix ^ (iz ^ 1) + (iz << 1);
+
+	CreateChild(index, cd);
+
+	quadcornerdata	q;
+	SetupCornerData(&q, cd, index);
+
+	if (q.Level > Level) {
+		Child[index]->StitchDescendant(q, Level, x, z, dir, src);
+	} else {
+		quadlightbatch	lb;
+		Child[index]->StitchEdge(q, dir, src, &lb);
+		lb.Flush();
+	}
+
+	RefreshChildError(cd, index);
+}
+
+
+void	quadsquare::StitchEdge(const quadcornerdata& cd, int dir, const quadsquare* src, quadlightbatch* lb)
+// Does the work for StitchDescendant().  Copies our edge vertex from its
+// alias in src, and recurses into the children along the edge, creating
+// ours where src has static ones so every vertex on the edge has a
+// counterpart.  A child we create takes its other edge vertices from the
+// squares already on the far side of them.  Where src has nothing, the
+// edge is made straight.
+{
+	int	i;
+
+	if (src && src->Static) {
+		// Real data on the edge now, so don't let Update() prune us.
+		SetStatic(cd);
+	}
+
+	if (src) {
+		Vertex[dir + 1].Y = src->Vertex[((dir + 2) & 3) + 1].Y;
+	} else {
+		Vertex[dir + 1].Y = (cd.Verts[dir].Y + cd.Verts[(dir + 3) & 3].Y) * 0.5;
+	}
+
+	// Our children along the edge, and the ones facing them in src.
+	int	index[2] = { dir, (dir + 3) & 3 };
+	for (i = 0; i < 2; i++) {
+		int	ci = index[i];
+		const quadsquare*	c = src ? src->Child[ci ^ 1 ^ ((dir & 1) << 1)] : NULL;
+
+		bool	Created = false;
+		if (c && c->Static && Child[ci] == NULL) {
+			CreateChild(ci, cd);
+			Created = true;
+		}
+		if (Child[ci]) {
+			quadcornerdata	q;
+			SetupCornerData(&q, cd, ci);
+
+			if (Created) {
+				for (int k = 0; k < 4; k++) {
+					if (k == dir) continue;
+					quadsquare*	n = Child[ci]->GetNeighbor(k, q);
+					if (n) Child[ci]->Vertex[k + 1].Y = n->Vertex[((k + 2) & 3) + 1].Y;
+				}
+			}
+
+			Child[ci]->StitchEdge(q, dir, c, lb);
+		}
+	}
+
+	// Same as RecomputeAux(), for the vertices that may have moved.  The
+	// error for our w and n vertices is kept by the squares across those
+	// edges, and their heights haven't changed.
+	Error[0] = fabs(Vertex[1].Y - (cd.Verts[0].Y + cd.Verts[3].Y) * 0.5);
+	Error[1] = fabs(Vertex[4].Y - (cd.Verts[2].Y + cd.Verts[3].Y) * 0.5);
+	for (i = 0; i < 4; i++) {
+		RefreshChildError(cd, i);
+	}
+
+	QueueLighting(cd, lb);
 }
 
 
@@ -612,7 +1215,7 @@ void	quadsquare::StaticCullData(const quadcornerdata& cd, float ThresholdDetail)
 // edge-length to height ratio less than ThresholdDetail.
 {
 	// First, clean non-static nodes out of the tree.
-	ResetTree();
+	ResetTree(true);
 
 	// Make sure error values are up-to-date.
 	if (Dirty) RecomputeErrorAndLighting(cd);
@@ -926,6 +1529,31 @@ bool	BoxTest(float x, float z, float size, float miny, float maxy, float error,
 }
 
 
+static int	BoxTest4(float x, float z, float size, float miny, float maxy, const uint16 error[4], const float Viewer[3])
+// Does BoxTest() for the four child quadrants of the square with origin
+// (x,z) and edge length size * 2, all at once.  The children share the
+// parent's miny/maxy.  Returns a bitmask with bit i set if child i
+// passes.  Child order is the usual { ne, nw, sw, se }.
+{
+	float	half = size * 0.5;
+
+	// Child origins.
+	__m128	cx = _mm_set_ps(x + size, x, x, x + size);
+	__m128	cz = _mm_set_ps(z + size, z + size, z, z);
+	__m128	vh = _mm_set1_ps(half);
+	__m128	sign = _mm_set1_ps(-0.0f);
+
+	__m128	dx = _mm_sub_ps(_mm_andnot_ps(sign, _mm_sub_ps(_mm_add_ps(cx, vh), _mm_set1_ps(Viewer[0]))), vh);
+	__m128	dz = _mm_sub_ps(_mm_andnot_ps(sign, _mm_sub_ps(_mm_add_ps(cz, vh), _mm_set1_ps(Viewer[2]))), vh);
+	float	dy = fabs((miny + maxy) * 0.5 - Viewer[1]) - (maxy - miny) * 0.5;
+
+	__m128	d = _mm_max_ps(_mm_max_ps(dx, dz), _mm_set1_ps(dy));
+	__m128	e = _mm_mul_ps(_mm_set_ps(error[3], error[2], error[1], error[0]), _mm_set1_ps(DetailThreshold));
+
+	return _mm_movemask_ps(_mm_cmpgt_ps(e, d));
+}
+
+
 //const float	VERTICAL_SCALE = 1.0 / 8.0;
 const float	VERTICAL_SCALE = 1.0;
 
@@ -958,17 +1586,24 @@ void	quadsquare::UpdateAux(const quadcornerdata& cd, const float ViewerLocation[
 	if ((EnabledFlags & 1) == 0 && VertexTest(cd.xorg + whole, Vertex[1].Y, cd.zorg + half, Error[0], ViewerLocation) == true) EnableEdgeVertex(0, false, cd);	// East vert.
 	if ((EnabledFlags & 8) == 0 && VertexTest(cd.xorg + half, Vertex[4].Y, cd.zorg + whole, Error[1], ViewerLocation) == true) EnableEdgeVertex(3, false, cd);	// South vert.
 	if (cd.Level > 0) {
+		// Test all four child boxes at once.  Enabling a child only
+		// touches edge vertices out in the neighbors, so the results
+		// stay valid while we go through them.
+		int	pass = 0;
+		if ((EnabledFlags & 0xF0) != 0xF0) {
+			pass = BoxTest4(cd.xorg, cd.zorg, half, MinY, MaxY, &Error[2], ViewerLocation);
+		}
 		if ((EnabledFlags & 32) == 0) {
-			if (BoxTest(cd.xorg, cd.zorg, half, MinY, MaxY, Error[3], ViewerLocation) == true) EnableChild(1, cd);	// nw child.er
+			if (pass & 2) EnableChild(1, cd);	// nw child.er
 		}
 		if ((EnabledFlags & 16) == 0) {
-			if (BoxTest(cd.xorg + half, cd.zorg, half, MinY, MaxY, Error[2], ViewerLocation) == true) EnableChild(0, cd);	// ne child.
+			if (pass & 1) EnableChild(0, cd);	// ne child.
 		}
 		if ((EnabledFlags & 64) == 0) {
-			if (BoxTest(cd.xorg, cd.zorg + half, half, MinY, MaxY, Error[4], ViewerLocation) == true) EnableChild(2, cd);	// sw child.
+			if (pass & 4) EnableChild(2, cd);	// sw child.
 		}
 		if ((EnabledFlags & 128) == 0) {
-			if (BoxTest(cd.xorg + half, cd.zorg + half, half, MinY, MaxY, Error[5], ViewerLocation) == true) EnableChild(3, cd);	// se child.
+			if (pass & 8) EnableChild(3, cd);	// se child.
 		}
 		
 		// Recurse into child quadrants as necessary.
@@ -1013,11 +1648,49 @@ void	quadsquare::UpdateAux(const quadcornerdata& cd, const float ViewerLocation[
 }
 
 
-float	VertexArray[9 * 3];
-unsigned int	ColorArray[9];
-unsigned char	VertList[24];
-int	TriCount = 0;
-	
+// Vertex, color and index data for the whole frame.  RenderAux()
+// appends to these, and Render() draws everything with one call.
+// They grow as needed and are reused from frame to frame.
+static float*	VertexArray = NULL;
+static unsigned int*	ColorArray = NULL;
+static unsigned int*	IndexArray = NULL;
+static int	VertexCount = 0, VertexCapacity = 0;
+static int	IndexCount = 0, IndexCapacity = 0;
+int	ClipTestCount = 0;
+
+
+static void	ReserveArrays(int verts, int indices)
+// Makes sure there's room for the given number of additional vertices
+// and indices in the frame arrays.
+{
+	if (VertexCount + verts > VertexCapacity) {
+		int	cap = VertexCapacity ? VertexCapacity * 2 : 4096;
+		while (cap < VertexCount + verts) cap *= 2;
+
+		float*	v = new float[cap * 3];
+		unsigned int*	c = new unsigned int[cap];
+		if (VertexCount) {
+			memcpy(v, VertexArray, VertexCount * 3 * sizeof(float));
+			memcpy(c, ColorArray, VertexCount * sizeof(unsigned int));
+		}
+		delete [] VertexArray;
+		delete [] ColorArray;
+		VertexArray = v;
+		ColorArray = c;
+		VertexCapacity = cap;
+	}
+
+	if (IndexCount + indices > IndexCapacity) {
+		int	cap = IndexCapacity ? IndexCapacity * 2 : 16384;
+		while (cap < IndexCount + indices) cap *= 2;
+
+		unsigned int*	i = new unsigned int[cap];
+		if (IndexCount) memcpy(i, IndexArray, IndexCount * sizeof(unsigned int));
+		delete [] IndexArray;
+		IndexArray = i;
+		IndexCapacity = cap;
+	}
+}
 
 
 static void	InitVert(int index, float x, float y, float z)
@@ -1035,10 +1708,27 @@ int	quadsquare::Render(const quadcornerdata& cd, bool Textured)
 // Draws the heightfield represented by this tree.
 // Returns the number of triangles rendered.
 {
-	TriCount = 0;
+	VertexCount = 0;
+	IndexCount = 0;
+	ClipTestCount = 0;
+
+	// Collect all the triangles in RenderAux(), then draw them in one go.
+	float	min[3], max[3];
+	min[0] = cd.xorg;
+	min[1] = MinY * VERTICAL_SCALE;
+	min[2] = cd.zorg;
+	max[0] = cd.xorg + (2 << cd.Level);
+	max[1] = MaxY * VERTICAL_SCALE;
+	max[2] = cd.zorg + (2 << cd.Level);
+	Clip::Visibility	vis = Clip::ComputeBoxVisibility(min, max);
+	ClipTestCount++;
+
+	if (vis != Clip::NOT_VISIBLE) {
+		RenderAux(cd, Textured, vis);
+	}
+
+	if (IndexCount == 0) return 0;
 
-	// Do some initial setup, then do all the work in RenderAux().
-//	gl....();
 	glEnableClientState(GL_VERTEX_ARRAY);
 	glVertexPointer(3, GL_FLOAT, 0, VertexArray);
 
@@ -1066,7 +1756,7 @@ int	quadsquare::Render(const quadcornerdata& cd, bool Textured)
 		glEnable(GL_TEXTURE_GEN_T);
 	}
 
-	RenderAux(cd, Textured, Clip::SOME_CLIP);
+	glDrawElements(GL_TRIANGLES, IndexCount, GL_UNSIGNED_INT, IndexArray);
 
 	glDisable(GL_TEXTURE_GEN_S);
 	glDisable(GL_TEXTURE_GEN_T);
@@ -1076,81 +1766,100 @@ int	quadsquare::Render(const quadcornerdata& cd, bool Textured)
 
 	glPopMatrix();
 
-	return TriCount;
+	return IndexCount / 3;
 }
 
 
 void	quadsquare::RenderAux(const quadcornerdata& cd, bool Textured, Clip::Visibility vis)
 // Does the work of rendering this square.  Uses the enabled vertices only.
-// Recurses as necessary.
+// Recurses as necessary.  vis is the visibility of this square, which
+// the caller has already checked isn't NOT_VISIBLE.
 {
 	int	half = 1 << cd.Level;
 	int	whole = 2 << cd.Level;
 	
-	// If this square is outside the frustum, then don't render it.
-	if (vis != Clip::NO_CLIP) {
-		float	min[3], max[3];
-		min[0] = cd.xorg;
-		min[1] = MinY * VERTICAL_SCALE;
-		min[2] = cd.zorg;
-		max[0] = cd.xorg + whole;
-		max[1] = MaxY * VERTICAL_SCALE;
-		max[2] = cd.zorg + whole;
-		vis = Clip::ComputeBoxVisibility(min, max);
-		if (vis == Clip::NOT_VISIBLE) {
-			// This square is completely outside the view frustum.
-			return;
-		}
-		// else vis is either NO_CLIP or SOME_CLIP.  If it's NO_CLIP, then child
-		// squares won't have to bother with the frustum check.
-	}
-	
 	int	i;
 
+	// Set up the enabled children, and if we're partially clipped,
+	// check all their boxes against the frustum in one go.  If we're
+	// NO_CLIP, then so are they, and they don't need checking.
+	quadcornerdata	q[4];
+	Clip::Visibility	cvis[4];
 	int	flags = 0;
 	int	mask = 1;
-	quadcornerdata	q;
+	int	count = 0;
 	for (i = 0; i < 4; i++, mask <<= 1) {
+		cvis[i] = vis;
 		if (EnabledFlags & (16 << i)) {
-			SetupCornerData(&q, cd, i);
-			Child[i]->RenderAux(q, Textured, vis);
+			SetupCornerData(&q[i], cd, i);
+			count++;
 		} else {
 			flags |= mask;
 		}
 	}
 
+	if (count && vis != Clip::NO_CLIP) {
+		float	min[3][4], max[3][4];
+		for (i = 0; i < 4; i++) {
+			// Lanes for disabled children just repeat our own box.
+			const quadsquare*	s = (flags & (1 << i)) ? this : Child[i];
+			const quadcornerdata&	c = (flags & (1 << i)) ? cd : q[i];
+			int	size = 2 << c.Level;
+			min[0][i] = c.xorg;
+			min[1][i] = s->MinY * VERTICAL_SCALE;
+			min[2][i] = c.zorg;
+			max[0][i] = c.xorg + size;
+			max[1][i] = s->MaxY * VERTICAL_SCALE;
+			max[2][i] = c.zorg + size;
+		}
+		Clip::ComputeBoxVisibility4(min, max, cvis);
+		ClipTestCount += count;
+	}
+
+	for (i = 0; i < 4; i++) {
+		if ((flags & (1 << i)) == 0 && cvis[i] != Clip::NOT_VISIBLE) {
+			Child[i]->RenderAux(q[i], Textured, cvis[i]);
+		}
+	}
+
 	if (flags == 0) return;
 
 //	// xxx debug color.
 //	glColor3f(cd.Level * 10 / 255.0, ((cd.Level & 3) * 60 + ((cd.zorg >> cd.Level) & 255)) / 255.0, ((cd.Level & 7) * 30 + ((cd.xorg >> cd.Level) & 255)) / 255.0);
 	
+	ReserveArrays(9, 24);
+
 	// Init vertex data.
-	InitVert(0, cd.xorg + half, Vertex[0].Y, cd.zorg + half);
-	InitVert(1, cd.xorg + whole, Vertex[1].Y, cd.zorg + half);
-	InitVert(2, cd.xorg + whole, cd.Verts[0].Y, cd.zorg);
-	InitVert(3, cd.xorg + half, Vertex[2].Y, cd.zorg);
-	InitVert(4, cd.xorg, cd.Verts[1].Y, cd.zorg);
-	InitVert(5, cd.xorg, Vertex[3].Y, cd.zorg + half);
-	InitVert(6, cd.xorg, cd.Verts[2].Y, cd.zorg + whole);
-	InitVert(7, cd.xorg + half, Vertex[4].Y, cd.zorg + whole);
-	InitVert(8, cd.xorg + whole, cd.Verts[3].Y, cd.zorg + whole);
+	int	base = VertexCount;
+	InitVert(base + 0, cd.xorg + half, Vertex[0].Y, cd.zorg + half);
+	InitVert(base + 1, cd.xorg + whole, Vertex[1].Y, cd.zorg + half);
+	InitVert(base + 2, cd.xorg + whole, cd.Verts[0].Y, cd.zorg);
+	InitVert(base + 3, cd.xorg + half, Vertex[2].Y, cd.zorg);
+	InitVert(base + 4, cd.xorg, cd.Verts[1].Y, cd.zorg);
+	InitVert(base + 5, cd.xorg, Vertex[3].Y, cd.zorg + half);
+	InitVert(base + 6, cd.xorg, cd.Verts[2].Y, cd.zorg + whole);
+	InitVert(base + 7, cd.xorg + half, Vertex[4].Y, cd.zorg + whole);
+	InitVert(base + 8, cd.xorg + whole, cd.Verts[3].Y, cd.zorg + whole);
+	VertexCount += 9;
 
 	if (!Textured) {
-		ColorArray[0] = MakeColor(Vertex[0].Lightness);
-		ColorArray[1] = MakeColor(Vertex[1].Lightness);
-		ColorArray[2] = MakeColor(cd.Verts[0].Lightness);
-		ColorArray[3] = MakeColor(Vertex[2].Lightness);
-		ColorArray[4] = MakeColor(cd.Verts[1].Lightness);
-		ColorArray[5] = MakeColor(Vertex[3].Lightness);
-		ColorArray[6] = MakeColor(cd.Verts[2].Lightness);
-		ColorArray[7] = MakeColor(Vertex[4].Lightness);
-		ColorArray[8] = MakeColor(cd.Verts[3].Lightness);
+		unsigned int*	c = &ColorArray[base];
+		c[0] = MakeColor(Vertex[0].Lightness);
+		c[1] = MakeColor(Vertex[1].Lightness);
+		c[2] = MakeColor(cd.Verts[0].Lightness);
+		c[3] = MakeColor(Vertex[2].Lightness);
+		c[4] = MakeColor(cd.Verts[1].Lightness);
+		c[5] = MakeColor(Vertex[3].Lightness);
+		c[6] = MakeColor(cd.Verts[2].Lightness);
+		c[7] = MakeColor(Vertex[4].Lightness);
+		c[8] = MakeColor(cd.Verts[3].Lightness);
 	}
 
+	unsigned int*	VertList = &IndexArray[IndexCount];
 	int	vcount = 0;
 	
 // Local macro to make the triangle logic shorter & hopefully clearer.
-#define tri(a,b,c) ( VertList[vcount++] = a, VertList[vcount++] = b, VertList[vcount++] = c )
+#define tri(a,b,c) ( VertList[vcount++] = base + a, VertList[vcount++] = base + b, VertList[vcount++] = base + c )
 
 	// Make the list of triangles to draw.
 	if ((EnabledFlags & 1) == 0) tri(0, 8, 2);
@@ -1174,11 +1883,10 @@ void	quadsquare::RenderAux(const quadcornerdata& cd, bool Textured, Clip::Visibi
 		if (flags & 8) tri(0, 7, 8);
 	}
 
-	// Draw 'em.
-	glDrawElements(GL_TRIANGLES, vcount, GL_UNSIGNED_BYTE, VertList);
+#undef tri
 
 	// Count 'em.
-	TriCount += vcount / 3;
+	IndexCount += vcount;
 }
 
 
@@ -41,6 +41,11 @@ struct	VertInfo {
 
 
 class quadsquare;
+struct quadlightbatch;
+struct quadrecomputejob;
+
+
+extern int	ClipTestCount;	// Boxes checked against the frustum during the last Render().
 
 
 // A structure used during recursive traversal of the tree to hold
@@ -73,12 +78,21 @@ struct quadsquare {
 	void	AddHeightMap(const quadcornerdata& cd, const HeightMapInfo& hm);
 	void	StaticCullData(const quadcornerdata& cd, float ThresholdDetail);	
 	float	RecomputeErrorAndLighting(const quadcornerdata& cd);
+	void	Relight(const quadcornerdata& cd);
+	static void	SetSunVector(const float dir[3]);
 	int	CountNodes();
 	
 	void	Update(const quadcornerdata& cd, const float ViewerLocation[3], float Detail);
 	int	Render(const quadcornerdata& cd, bool Textured);
 
 	float	GetHeight(const quadcornerdata& cd, float x, float z);
+
+	// Subtree paging support.  See quadpager.cpp.
+	quadsquare*	CloneStatic() const;
+	quadsquare*	CloneDescendant(const quadcornerdata& cd, int Level, int x, int z, quadcornerdata* q);
+	quadsquare*	ExchangeDescendant(const quadcornerdata& cd, int Level, int x, int z, quadsquare* replacement);
+	quadsquare*	GetDescendant(const quadcornerdata& cd, int Level, int x, int z);
+	void	StitchDescendant(const quadcornerdata& cd, int Level, int x, int z, int dir, const quadsquare* src);
 	
 private:
 	void	EnableEdgeVertex(int index, bool IncrementCount, const quadcornerdata& cd);
@@ -86,8 +100,12 @@ private:
 	void	EnableChild(int index, const quadcornerdata& cd);
 	void	NotifyChildDisable(const quadcornerdata& cd, int index);
 
-	void	ResetTree();
+	void	ResetTree(bool MarkDirty);
+	void	TransferEnabledState(const quadcornerdata& cd, const quadsquare* src);
+	float	MaxError(const quadcornerdata& cd) const;
+	void	RefreshChildError(const quadcornerdata& cd, int index);
 	void	StaticCullAux(const quadcornerdata& cd, float ThresholdDetail, int TargetLevel);
+	void	StitchEdge(const quadcornerdata& cd, int dir, const quadsquare* src, quadlightbatch* lb);
 
 	quadsquare*	GetNeighbor(int dir, const quadcornerdata& cd);
 	void	CreateChild(int index, const quadcornerdata& cd);
@@ -96,6 +114,13 @@ private:
 	void	UpdateAux(const quadcornerdata& cd, const float ViewerLocation[3], float CenterError);
 	void	RenderAux(const quadcornerdata& cd, bool Textured, Clip::Visibility vis);
 	void	SetStatic(const quadcornerdata& cd);
+
+	float	RecomputeAux(const quadcornerdata& cd, quadlightbatch* lb);
+	void	RelightAux(const quadcornerdata& cd, quadlightbatch* lb);
+	void	RecomputeChildren(const quadcornerdata& cd, bool LightingOnly, quadlightbatch* lb);
+	void	QueueLighting(const quadcornerdata& cd, quadlightbatch* lb);
+
+	friend struct quadrecomputejob;
 };
 
 